@@ -0,0 +1,193 @@
+#include "block_codec.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+
+namespace
+{
+    /// @brief Минимальная длина повтора.
+    constexpr size_t minMatch = 4;
+    
+    /// @brief Максимальное расстояние до повтора, умещающееся в два байта.
+    constexpr size_t maxOffset = 65535;
+    
+    /// @brief Число бит хэша четырех байт в таблице поиска повторов.
+    constexpr size_t hashBits = 14;
+    
+    /// @brief Значение длины в половине управляющего байта, после которого следует продолжение в формате varint.
+    constexpr size_t lengthEscape = 15;
+    
+    /// @brief Прочитать четыре байта без требований к выравниванию.
+    /// @param[in] data - Данные.
+    /// @return Четыре байта как число.
+    uint32_t load32(const char* data)
+    {
+        uint32_t value;
+        std::memcpy(&value, data, sizeof(value));
+        return value;
+    }
+    
+    /// @brief Дописать последовательность: управляющий байт, литералы и ссылку на повтор.
+    /// @param[in,out] output - Буфер вывода.
+    /// @param[in] literals - Литералы.
+    /// @param[in] literalCount - Число литералов.
+    /// @param[in] offset - Расстояние до повтора.
+    /// @param[in] matchLength - Длина повтора, 0 - последовательность без повтора в конце блока.
+    void appendSequence(std::string& output, const char* literals, size_t literalCount, size_t offset, size_t matchLength)
+    {
+        const size_t matchCode = matchLength > 0 ? matchLength - minMatch : 0;
+        output.push_back(static_cast<char>((std::min(literalCount, lengthEscape) << 4) | std::min(matchCode, lengthEscape)));
+        if (literalCount >= lengthEscape)
+        {
+            appendVarint(output, literalCount - lengthEscape);
+        }
+        output.append(literals, literalCount);
+        
+        if (matchLength == 0)
+        {
+            return;
+        }
+        output.push_back(static_cast<char>(offset & 0xFF));
+        output.push_back(static_cast<char>(offset >> 8));
+        if (matchCode >= lengthEscape)
+        {
+            appendVarint(output, matchCode - lengthEscape);
+        }
+    }
+}
+
+
+void appendVarint(std::string& output, uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        output.push_back(static_cast<char>((value & 0x7F) | 0x80));
+        value >>= 7;
+    }
+    output.push_back(static_cast<char>(value));
+}
+
+uint64_t readVarint(const char*& input, const char* end)
+{
+    uint64_t value = 0;
+    for (size_t shift = 0; shift < 64; shift += 7)
+    {
+        if (input == end)
+        {
+            throw std::runtime_error("readVarint error: unexpected end of data");
+        }
+        const uint8_t byte = static_cast<uint8_t>(*input++);
+        value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0)
+        {
+            return value;
+        }
+    }
+    throw std::runtime_error("readVarint error: number is too long");
+}
+
+void compressBlock(const char* input, size_t size, std::string& output)
+{
+    output.clear();
+    output.reserve(size / 2);
+    
+    // Позиции последних четырехбайтовых последовательностей по их хэшу, 0 - позиции нет.
+    std::vector<uint32_t> positions(size_t(1) << hashBits, 0);
+    size_t anchor = 0;
+    size_t position = 0;
+    while (position + minMatch <= size)
+    {
+        const uint32_t sequence = load32(input + position);
+        uint32_t& slot = positions[(sequence * 2654435761u) >> (32 - hashBits)];
+        const size_t candidate = slot;
+        slot = static_cast<uint32_t>(position + 1);
+        
+        if (candidate == 0 || position + 1 - candidate > maxOffset || load32(input + candidate - 1) != sequence)
+        {
+            ++position;
+            continue;
+        }
+        
+        const size_t match = candidate - 1;
+        size_t length = minMatch;
+        while (position + length < size && input[match + length] == input[position + length])
+        {
+            ++length;
+        }
+        appendSequence(output, input + anchor, position - anchor, position - match, length);
+        position += length;
+        anchor = position;
+    }
+    
+    if (anchor < size)
+    {
+        appendSequence(output, input + anchor, size - anchor, 0, 0);
+    }
+}
+
+void decompressBlock(const char* input, size_t size, char* output, size_t outputSize)
+{
+    const char* end = input + size;
+    char* current = output;
+    char* outputEnd = output + outputSize;
+    while (input < end)
+    {
+        const uint8_t token = static_cast<uint8_t>(*input++);
+        size_t literalCount = token >> 4;
+        if (literalCount == lengthEscape)
+        {
+            literalCount += readVarint(input, end);
+        }
+        if (literalCount > static_cast<size_t>(end - input) || literalCount > static_cast<size_t>(outputEnd - current))
+        {
+            throw std::runtime_error("decompressBlock error: corrupted data");
+        }
+        std::memcpy(current, input, literalCount);
+        input += literalCount;
+        current += literalCount;
+        
+        // Последняя последовательность блока не содержит повтора.
+        if (input == end)
+        {
+            break;
+        }
+        if (end - input < 2)
+        {
+            throw std::runtime_error("decompressBlock error: corrupted data");
+        }
+        const size_t offset = static_cast<uint8_t>(input[0]) | (static_cast<size_t>(static_cast<uint8_t>(input[1])) << 8);
+        input += 2;
+        size_t length = (token & 0x0F) + minMatch;
+        if ((token & 0x0F) == lengthEscape)
+        {
+            length += readVarint(input, end);
+        }
+        if (offset == 0 || offset > static_cast<size_t>(current - output) || length > static_cast<size_t>(outputEnd - current))
+        {
+            throw std::runtime_error("decompressBlock error: corrupted data");
+        }
+        
+        // Повтор может перекрывать сам себя, тогда байты копируются по одному.
+        const char* source = current - offset;
+        if (offset >= length)
+        {
+            std::memcpy(current, source, length);
+        }
+        else
+        {
+            for (size_t i = 0; i < length; ++i)
+            {
+                current[i] = source[i];
+            }
+        }
+        current += length;
+    }
+    
+    if (current != outputEnd)
+    {
+        throw std::runtime_error("decompressBlock error: corrupted data");
+    }
+}
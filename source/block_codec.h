@@ -0,0 +1,38 @@
+#pragma once
+
+#ifndef BLOCK_CODEC_H
+#define BLOCK_CODEC_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+
+/// @brief Дописать число в формате varint: по 7 бит в байте, старший бит - признак продолжения.
+/// @param[in,out] output - Буфер вывода.
+/// @param[in] value - Число.
+void appendVarint(std::string& output, uint64_t value);
+
+/// @brief Прочитать число в формате varint.
+/// @param[in,out] input - Начало данных, сдвигается за прочитанное число.
+/// @param[in] end - Конец данных.
+/// @return Число.
+/// @throws std::exception если данные кончились или число длиннее 64 бит.
+uint64_t readVarint(const char*& input, const char* end);
+
+/// @brief Сжать блок данных быстрым байтовым кодеком семейства LZ77.
+/// @details Повторы ищутся по хэшу четырех байт в окне 64 КиБ, ссылка на повтор занимает от трех байт.
+/// @param[in] input - Данные.
+/// @param[in] size - Размер данных.
+/// @param[out] output - Сжатые данные, заменяют содержимое буфера.
+void compressBlock(const char* input, size_t size, std::string& output);
+
+/// @brief Распаковать блок, сжатый compressBlock().
+/// @param[in] input - Сжатые данные.
+/// @param[in] size - Размер сжатых данных.
+/// @param[out] output - Буфер для распакованных данных.
+/// @param[in] outputSize - Размер распакованных данных.
+/// @throws std::exception если сжатые данные повреждены.
+void decompressBlock(const char* input, size_t size, char* output, size_t outputSize);
+
+#endif // BLOCK_CODEC_H
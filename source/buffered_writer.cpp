@@ -0,0 +1,57 @@
+#include "buffered_writer.h"
+#include "trace.h"
+
+#include <stdexcept>
+
+
+const size_t BufferedWriter::defaultCapacity;
+
+
+BufferedWriter::BufferedWriter(std::ostream& output, size_t capacity)
+    : m_Output(output)
+    , m_Buffer(capacity > 0 ? capacity : 1)
+    , m_Size(0)
+{
+}
+
+BufferedWriter::~BufferedWriter()
+{
+    try
+    {
+        flush();
+    }
+    catch (const std::exception&)
+    {
+    }
+}
+
+void BufferedWriter::flush()
+{
+    flushBuffer();
+    m_Output.flush();
+    if (!m_Output.good())
+    {
+        throw std::runtime_error("BufferedWriter::flush error: failed to write output");
+    }
+}
+
+void BufferedWriter::flushBuffer()
+{
+    writeOutput(m_Buffer.data(), m_Size);
+    m_Size = 0;
+}
+
+void BufferedWriter::writeOutput(const char* data, size_t size)
+{
+    TraceScope scope("BufferedWriter::writeOutput");
+    if (size == 0)
+    {
+        return;
+    }
+    
+    m_Output.write(data, size);
+    if (!m_Output.good())
+    {
+        throw std::runtime_error("BufferedWriter::writeOutput error: failed to write output");
+    }
+}
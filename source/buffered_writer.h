@@ -0,0 +1,100 @@
+#pragma once
+
+#ifndef BUFFERED_WRITER_H
+#define BUFFERED_WRITER_H
+
+#include <cstddef>
+#include <cstring>
+#include <ostream>
+#include <string>
+#include <vector>
+
+
+/// @class BufferedWriter
+/// @brief Накапливает текст и передает его в поток вывода большими блоками.
+/// @details Добавление текста - копирование в буфер без обращения к потоку вывода, поэтому вывод
+///          большого числа коротких слов не упирается в накладные расходы операторов вывода.
+class BufferedWriter
+{
+public:
+    /// @brief Размер буфера по умолчанию.
+    static const size_t defaultCapacity = 1 << 20;
+
+public:
+    /// @brief Конструктор.
+    /// @param[in] output - Поток вывода.
+    /// @param[in] capacity - Размер буфера.
+    explicit BufferedWriter(std::ostream& output, size_t capacity = defaultCapacity);
+    
+    /// @brief Деструктор, выводит оставшийся текст без сообщения об ошибках.
+    ~BufferedWriter();
+    
+    BufferedWriter(const BufferedWriter&) = delete;
+    BufferedWriter& operator=(const BufferedWriter&) = delete;
+    
+    /// @brief Добавить текст.
+    /// @param[in] data - Указатель на текст.
+    /// @param[in] size - Размер текста.
+    /// @throws std::exception в случае ошибки вывода.
+    void write(const char* data, size_t size)
+    {
+        if (m_Buffer.size() - m_Size < size)
+        {
+            flushBuffer();
+            if (size >= m_Buffer.size())
+            {
+                writeOutput(data, size);
+                return;
+            }
+        }
+        std::memcpy(m_Buffer.data() + m_Size, data, size);
+        m_Size += size;
+    }
+    
+    /// @brief Добавить текст.
+    /// @param[in] text - Текст.
+    /// @throws std::exception в случае ошибки вывода.
+    void write(const std::string& text)
+    {
+        write(text.data(), text.size());
+    }
+    
+    /// @brief Добавить символ.
+    /// @param[in] symbol - Символ.
+    /// @throws std::exception в случае ошибки вывода.
+    void put(char symbol)
+    {
+        if (m_Size == m_Buffer.size())
+        {
+            flushBuffer();
+        }
+        m_Buffer[m_Size++] = symbol;
+    }
+    
+    /// @brief Вывести накопленный текст и сбросить поток вывода.
+    /// @throws std::exception в случае ошибки вывода.
+    void flush();
+
+private:
+    /// @brief Вывести накопленный текст.
+    /// @throws std::exception в случае ошибки вывода.
+    void flushBuffer();
+    
+    /// @brief Передать текст в поток вывода.
+    /// @param[in] data - Указатель на текст.
+    /// @param[in] size - Размер текста.
+    /// @throws std::exception в случае ошибки вывода.
+    void writeOutput(const char* data, size_t size);
+
+private:
+    /// @brief Поток вывода.
+    std::ostream& m_Output;
+    
+    /// @brief Буфер.
+    std::vector<char> m_Buffer;
+    
+    /// @brief Число байт текста в буфере.
+    size_t m_Size;
+};
+
+#endif // BUFFERED_WRITER_H
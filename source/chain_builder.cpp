@@ -1,24 +1,79 @@
 #include "chain_builder.h"
+#include "latency.h"
+#include "learn_stats.h"
+#include "parallel.h"
 #include "text_adjuster.h"
-#include "text_downloader.h"
+#include "trace.h"
 #include "word_splitter.h"
 
+#include <fcntl.h>
 #include <getopt.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
 #include <iostream>
 #include <fstream>
 #include <functional>
+#include <stdexcept>
+#include <vector>
 
 
 namespace
 {
     /// @brief Порядок цепи Маркова по умолчанию.
     const size_t defaultOrder = 0;
+    
+    /// @brief Адрес, обозначающий стандартный ввод.
+    const char* const standardInput = "-";
+    
+    /// @brief Размер блока чтения стандартного ввода.
+    const size_t inputBlockSize = 64 * 1024;
+    
+    /// @brief Интервал вывода строк хода построения в секундах.
+    const double progressInterval = 5.0;
+    
+    /// @brief Интервал между контрольными точками по умолчанию в секундах.
+    const size_t defaultCheckpointInterval = 300;
+    
+    /// @brief Заголовок файла контрольной точки.
+    const std::string checkpointHeader = "MARKOV_TEXT_CHAIN_CHECKPOINT";
+    
+    /// @brief Разобрать неотрицательное число из аргумента командной строки.
+    /// @param[in] argument - Аргумент.
+    /// @return Число.
+    /// @throws std::exception если аргумент не является неотрицательным числом.
+    size_t parseCount(const char* argument)
+    {
+        const std::string value(argument);
+        if (value.empty() || value.find_first_not_of("0123456789") != std::string::npos)
+        {
+            throw std::invalid_argument("parseCount error: not a number");
+        }
+        return std::stoull(value);
+    }
 }
 
 ChainBuilder::ChainBuilder()
     : m_Order(defaultOrder)
+    , m_Engine(MarkovTextChain::LearnEngine::Hash)
+    , m_Threads(defaultThreadCount())
+    , m_HalfLife(0)
+    , m_MaxStates(0)
+    , m_Backoff(false)
+    , m_Format(MarkovTextChain::ChainFormat::Text)
+    , m_Stats()
+    , m_Trace()
     , m_Output()
+    , m_Base()
+    , m_Append(false)
+    , m_Checkpoint()
+    , m_CheckpointInterval(defaultCheckpointInterval)
+    , m_Resume(false)
     , m_Urls()
     , m_NeedHelp(false)
     , m_ProgramName()
@@ -36,6 +91,19 @@ void ChainBuilder::init(int argc, char** argv)
     {
        {"order", required_argument, 0, 'n'},
        {"output", required_argument, 0, 'o'},
+       {"engine", required_argument, 0, 'e'},
+       {"threads", required_argument, 0, 'j'},
+       {"decay", required_argument, 0, 'd'},
+       {"max-states", required_argument, 0, 'm'},
+       {"backoff", no_argument, 0, 'b'},
+       {"format", required_argument, 0, 'f'},
+       {"stats", required_argument, 0, 's'},
+       {"trace", required_argument, 0, 'T'},
+       {"base", required_argument, 0, 'B'},
+       {"append", no_argument, 0, 'a'},
+       {"checkpoint", required_argument, 0, 'c'},
+       {"checkpoint-interval", required_argument, 0, 'C'},
+       {"resume", no_argument, 0, 'r'},
        {"help", no_argument, 0, 'h'},
        {0, 0, 0, 0 }
     };
@@ -44,7 +112,7 @@ void ChainBuilder::init(int argc, char** argv)
     opterr = 0;
     
     // Анализ ключей и их значений.
-    while ((c = getopt_long(argc, argv, "n:o:", longOptions, nullptr))!= -1)
+    while ((c = getopt_long(argc, argv, "n:o:e:j:d:m:bf:s:T:B:ac:C:r", longOptions, nullptr))!= -1)
     {
         switch (c)
         {
@@ -69,6 +137,123 @@ void ChainBuilder::init(int argc, char** argv)
             m_Output = optarg;
             break;
             
+        case 'e':
+            if (std::string(optarg) == "hash")
+            {
+                m_Engine = MarkovTextChain::LearnEngine::Hash;
+            }
+            else if (std::string(optarg) == "sort")
+            {
+                m_Engine = MarkovTextChain::LearnEngine::Sort;
+            }
+            else
+            {
+                std::cerr << "  Unsupported value for 'engine' parameter" << std::endl;
+                m_NeedHelp = true;
+            }
+            break;
+        
+        case 'j':
+            try
+            {
+                const int threads = std::stoi(optarg);
+                if (threads <= 0)
+                {
+                    throw std::exception();
+                }
+                m_Threads = threads;
+            }
+            catch (const std::exception& e)
+            {
+                std::cerr << "  Unsupported value for 'threads' parameter" << std::endl;
+                m_NeedHelp = true;
+            }
+            break;
+        
+        case 'd':
+            try
+            {
+                m_HalfLife = parseCount(optarg);
+            }
+            catch (const std::exception& e)
+            {
+                std::cerr << "  Unsupported value for 'decay' parameter" << std::endl;
+                m_NeedHelp = true;
+            }
+            break;
+        
+        case 'm':
+            try
+            {
+                m_MaxStates = parseCount(optarg);
+            }
+            catch (const std::exception& e)
+            {
+                std::cerr << "  Unsupported value for 'max-states' parameter" << std::endl;
+                m_NeedHelp = true;
+            }
+            break;
+        
+        case 'b':
+            m_Backoff = true;
+            break;
+        
+        case 'f':
+            if (std::string(optarg) == "text")
+            {
+                m_Format = MarkovTextChain::ChainFormat::Text;
+            }
+            else if (std::string(optarg) == "compact")
+            {
+                m_Format = MarkovTextChain::ChainFormat::Compact;
+            }
+            else if (std::string(optarg) == "sorted")
+            {
+                m_Format = MarkovTextChain::ChainFormat::Sorted;
+            }
+            else
+            {
+                std::cerr << "  Unsupported value for 'format' parameter" << std::endl;
+                m_NeedHelp = true;
+            }
+            break;
+        
+        case 's':
+            m_Stats = optarg;
+            break;
+        
+        case 'T':
+            m_Trace = optarg;
+            break;
+        
+        case 'B':
+            m_Base = optarg;
+            break;
+        
+        case 'a':
+            m_Append = true;
+            break;
+        
+        case 'c':
+            m_Checkpoint = optarg;
+            break;
+        
+        case 'C':
+            try
+            {
+                m_CheckpointInterval = parseCount(optarg);
+            }
+            catch (const std::exception& e)
+            {
+                std::cerr << "  Unsupported value for 'checkpoint-interval' parameter" << std::endl;
+                m_NeedHelp = true;
+            }
+            break;
+        
+        case 'r':
+            m_Resume = true;
+            break;
+        
         case 'h':
             m_NeedHelp = true;
             break;
@@ -86,6 +271,66 @@ void ChainBuilder::init(int argc, char** argv)
                 m_NeedHelp = true;
                 break;
             }
+            else if (optopt == 'e')
+            {
+                std::cerr << " Options -e and --engine require an argument" << std::endl;
+                m_NeedHelp = true;
+                break;
+            }
+            else if (optopt == 'j')
+            {
+                std::cerr << " Options -j and --threads require an argument" << std::endl;
+                m_NeedHelp = true;
+                break;
+            }
+            else if (optopt == 'd')
+            {
+                std::cerr << " Options -d and --decay require an argument" << std::endl;
+                m_NeedHelp = true;
+                break;
+            }
+            else if (optopt == 'm')
+            {
+                std::cerr << " Options -m and --max-states require an argument" << std::endl;
+                m_NeedHelp = true;
+                break;
+            }
+            else if (optopt == 'f')
+            {
+                std::cerr << " Options -f and --format require an argument" << std::endl;
+                m_NeedHelp = true;
+                break;
+            }
+            else if (optopt == 's')
+            {
+                std::cerr << " Options -s and --stats require an argument" << std::endl;
+                m_NeedHelp = true;
+                break;
+            }
+            else if (optopt == 'T')
+            {
+                std::cerr << " Options -T and --trace require an argument" << std::endl;
+                m_NeedHelp = true;
+                break;
+            }
+            else if (optopt == 'B')
+            {
+                std::cerr << " Options -B and --base require an argument" << std::endl;
+                m_NeedHelp = true;
+                break;
+            }
+            else if (optopt == 'c')
+            {
+                std::cerr << " Options -c and --checkpoint require an argument" << std::endl;
+                m_NeedHelp = true;
+                break;
+            }
+            else if (optopt == 'C')
+            {
+                std::cerr << " Options -C and --checkpoint-interval require an argument" << std::endl;
+                m_NeedHelp = true;
+                break;
+            }
             else
             {
                 std::cerr << " Unknown option " << argv[optind-1] << std::endl;
@@ -102,54 +347,263 @@ void ChainBuilder::init(int argc, char** argv)
         m_Urls.push_back(argv[i]);
     }
     
-    // Проверка наличия обязательных параметров.
-    if (m_Order == defaultOrder)
+    // Проверка наличия обязательных параметров. Порядок цепи может быть взят из базовой цепи,
+    // а базовую цепь без новых адресов можно сохранить заново, объединив дописанные приращения.
+    if (m_Order == defaultOrder && m_Base.empty())
     {
         std::cerr << "  Chain order is not set" << std::endl;
         m_NeedHelp = true;
     }
-    if (m_Urls.empty())
+    if (m_Urls.empty() && (m_Base.empty() || m_Append))
     {
         std::cerr << " No url is provided" << std::endl;
         m_NeedHelp = true;
     }
+    if (m_Append && (m_Base.empty() || !m_Output.empty() || m_Format != MarkovTextChain::ChainFormat::Text))
+    {
+        std::cerr << " Option --append requires --base and writes text, so --output and --format cannot be used with it" << std::endl;
+        m_NeedHelp = true;
+    }
+    if (m_Resume && m_Checkpoint.empty())
+    {
+        std::cerr << " Option --resume requires --checkpoint" << std::endl;
+        m_NeedHelp = true;
+    }
+    
+    // Текст std::cin при продолжении прочитать заново нельзя, а каталог точки проверяется сразу,
+    // а не после обработки первого адреса.
+    if (!m_Checkpoint.empty() && std::find(m_Urls.begin(), m_Urls.end(), standardInput) != m_Urls.end())
+    {
+        std::cerr << " Option --checkpoint cannot be used with '-', std::cin cannot be read again on resume" << std::endl;
+        m_NeedHelp = true;
+    }
+    if (!m_Checkpoint.empty())
+    {
+        const size_t slash = m_Checkpoint.find_last_of('/');
+        const std::string directory = slash == std::string::npos ? "." : m_Checkpoint.substr(0, std::max<size_t>(slash, 1));
+        if (access(directory.c_str(), W_OK | X_OK) != 0)
+        {
+            std::cerr << " Checkpoint directory '" << directory << "' is not writable: " << std::strerror(errno) << std::endl;
+            m_NeedHelp = true;
+        }
+    }
+    if ((m_HalfLife > 0 || m_MaxStates > 0 || m_Backoff) && m_Engine == MarkovTextChain::LearnEngine::Sort)
+    {
+        std::cerr << " Options --decay, --max-states and --backoff require the 'hash' engine" << std::endl;
+        m_NeedHelp = true;
+    }
 }
 
 bool ChainBuilder::run() const
 {
-    return m_NeedHelp ? !printUsage() : buildChain();
+    if (m_NeedHelp)
+    {
+        return !printUsage();
+    }
+    
+    // Задержки загрузки и сохранения цепи выводятся по сигналу SIGUSR1 во время построения и при завершении.
+    LatencyReporter reporter(std::cerr);
+    if (!m_Trace.empty())
+    {
+        Trace::enable();
+    }
+    const bool built = buildChain();
+    Latency::write(std::cerr);
+    return (m_Trace.empty() || outputTrace()) && built;
 }
 
 bool ChainBuilder::printUsage() const
 {
-    std::cout << "Usage: " << m_ProgramName << " [options] [urls]" << std::endl;
-    std::cout << "  -n, --order    Markov chain order, must be positive" << std::endl;
-    std::cout << "  -o, --output   File to output Markov chain to, std::cout will be used if not provided" << std::endl;
-    std::cout << "  -h, --help     Show this message and exit" << std::endl << std::endl;
+    std::cout << "Usage: " << m_ProgramName << " [options] [urls], '-' reads text from std::cin" << std::endl;
+    std::cout << "  -n, --order      Markov chain order, must be positive" << std::endl;
+    std::cout << "  -o, --output     File to output Markov chain to, std::cout will be used if not provided" << std::endl;
+    std::cout << "  -e, --engine     Chain build engine: 'hash' (default) or 'sort'" << std::endl;
+    std::cout << "  -j, --threads    Number of threads for the 'sort' engine, all cores are used by default" << std::endl;
+    std::cout << "  -d, --decay      Halve word counts every given number of words, dropping unseen words and states" << std::endl;
+    std::cout << "  -m, --max-states Halve word counts whenever the chain grows beyond the given number of states" << std::endl;
+    std::cout << "  -b, --backoff    Build states of all orders from 1 to the chain order for backoff to shorter contexts" << std::endl;
+    std::cout << "  -f, --format     Chain file format: 'text' (default), 'compact', a smaller binary format that loads faster," << std::endl;
+    std::cout << "                   or 'sorted', text with states sorted by key and an index for lookups without loading" << std::endl;
+    std::cout << "  -s, --stats      File to output JSON report of stage counters and timings to, '-' for std::cerr;" << std::endl;
+    std::cout << "                   progress lines with rates are printed every few seconds as well" << std::endl;
+    std::cout << "  -T, --trace      File to output Chrome Trace Event JSON of the build stages to, for Perfetto" << std::endl;
+    std::cout << "  -B, --base       Chain file to learn the urls on top of; the order is taken from it, and with no urls" << std::endl;
+    std::cout << "                   the chain is saved again with its appended deltas summed in" << std::endl;
+    std::cout << "  -a, --append     Append the states learned from the urls to the base chain file as a delta" << std::endl;
+    std::cout << "                   instead of writing the whole chain, the base chain is not loaded" << std::endl;
+    std::cout << "  -c, --checkpoint File to save the chain and the list of learned urls to after an url is learned," << std::endl;
+    std::cout << "                   at most once per checkpoint interval; removed when the chain is saved" << std::endl;
+    std::cout << "  -C, --checkpoint-interval" << std::endl;
+    std::cout << "                   Minimum number of seconds between checkpoints, 300 by default, 0 saves after every url" << std::endl;
+    std::cout << "  -r, --resume     Continue from the checkpoint if it exists, skipping the urls learned before it" << std::endl;
+    std::cout << "  -h, --help       Show this message and exit" << std::endl << std::endl;
     return true;
 }
 
 bool ChainBuilder::buildChain() const
 {
     MarkovTextChain chain(m_Order);
+    chain.setEngine(m_Engine, m_Threads);
+    chain.setDecay(m_HalfLife, m_MaxStates);
+    chain.setBackoff(m_Backoff);
     
-    TextAdjuster adjuster;
-    adjuster.setHandler(std::bind(&MarkovTextChain::addWord, std::ref(chain), std::placeholders::_1));
+    // Контрольная точка уже содержит базовую цепь.
+    std::vector<std::string> completed;
+    if (m_Resume && !loadCheckpoint(chain, completed))
+    {
+        return false;
+    }
+    if (completed.empty() && !m_Base.empty() && !loadBase(chain))
+    {
+        return false;
+    }
     
+    TextAdjuster adjuster;
     WordSplitter splitter;
-    splitter.setHandler(std::bind(&TextAdjuster::adjust, std::ref(adjuster), std::placeholders::_1));
-    
     TextDownloader downloader;
-    downloader.setHandler(std::bind(&WordSplitter::addText, std::ref(splitter), std::placeholders::_1, std::placeholders::_2));
+    
+    // Без отчета этапы связываются напрямую, с отчетом - через счетчики и замер времени каждого этапа.
+    // При трассировке текст копится блоками, и каждый этап обрабатывает блок целиком, чтобы этапы
+    // были видны на шкале времени отдельными событиями, а не миллионами событий на слова.
+    LearnStats stats(chain);
+    TextDownloader::Handler reader;
+    std::function<void()> passBlock = [] {};
+    std::string text;
+    std::vector<std::string> tokens;
+    std::vector<std::string> words;
+    if (!m_Stats.empty())
+    {
+        stats.setProgress(std::cerr, progressInterval);
+        adjuster.setHandler([&chain, &stats](std::string&& word)
+        {
+            stats.addWord();
+            stats.enter(LearnStats::Stage::Chain);
+            chain.addWord(std::move(word));
+            stats.leave();
+        });
+        splitter.setHandler([&adjuster, &stats](const std::string& token)
+        {
+            stats.addToken();
+            stats.enter(LearnStats::Stage::Adjust);
+            adjuster.adjust(token);
+            stats.leave();
+        });
+        reader = [&splitter, &stats](const char* data, size_t size)
+        {
+            stats.addBytes(size);
+            stats.enter(LearnStats::Stage::Split);
+            splitter.addText(data, size);
+            stats.leave();
+        };
+    }
+    else if (Trace::enabled())
+    {
+        adjuster.setHandler([&words](std::string&& word)
+        {
+            words.push_back(std::move(word));
+        });
+        splitter.setHandler([&tokens](const std::string& token)
+        {
+            tokens.push_back(token);
+        });
+        passBlock = [&]()
+        {
+            {
+                TraceScope scope("WordSplitter::addText");
+                splitter.addText(text.data(), text.size());
+                text.clear();
+            }
+            {
+                TraceScope scope("TextAdjuster::adjust");
+                for (const auto& token : tokens)
+                {
+                    adjuster.adjust(token);
+                }
+                tokens.clear();
+            }
+            {
+                TraceScope scope("MarkovTextChain::addWord");
+                for (auto& word : words)
+                {
+                    chain.addWord(std::move(word));
+                }
+                words.clear();
+            }
+        };
+        reader = [&text, &passBlock](const char* data, size_t size)
+        {
+            text.append(data, size);
+            if (text.size() >= inputBlockSize)
+            {
+                passBlock();
+            }
+        };
+    }
+    else
+    {
+        adjuster.setHandler(std::bind(&MarkovTextChain::addWord, std::ref(chain), std::placeholders::_1));
+        splitter.setHandler(std::bind(&TextAdjuster::adjust, std::ref(adjuster), std::placeholders::_1));
+        reader = std::bind(&WordSplitter::addText, std::ref(splitter), std::placeholders::_1, std::placeholders::_2);
+    }
+    downloader.setHandler(reader);
     
     try
     {
+        std::vector<std::string> skipped = completed;
+        auto lastCheckpoint = std::chrono::steady_clock::now();
         for (const auto& url : m_Urls)
         {
+            // Каждое вхождение адреса, обработанное до контрольной точки, пропускается один раз.
+            const auto done = std::find(skipped.begin(), skipped.end(), url);
+            if (done != skipped.end())
+            {
+                skipped.erase(done);
+                std::cerr << "Skipping '" << url << "', learned before the checkpoint" << std::endl;
+                continue;
+            }
+            
             std::cerr << "Processing '" << url << "' ... " << std::flush;
-            downloader.download(url);
+            stats.enter(LearnStats::Stage::Read);
+            if (url == standardInput)
+            {
+                readInput(reader);
+            }
+            else
+            {
+                downloader.download(url);
+            }
+            passBlock();
+            stats.enter(LearnStats::Stage::Split);
             splitter.flush();
+            stats.leave();
+            passBlock();
+            stats.enter(LearnStats::Stage::Chain);
             chain.flush();
+            stats.leave();
+            stats.leave();
+            std::cerr << "DONE" << std::endl;
+            
+            // Точка сохраняется только между адресами: текст прерванного адреса при продолжении читается заново.
+            // Неудачная точка не прерывает построение: цепь в памяти цела, а прежняя точка остается на месте.
+            completed.push_back(url);
+            if (!m_Checkpoint.empty() && std::chrono::steady_clock::now() - lastCheckpoint >= std::chrono::seconds(m_CheckpointInterval))
+            {
+                stats.enter(LearnStats::Stage::Save);
+                if (!saveCheckpoint(chain, completed))
+                {
+                    std::cerr << "  Learning continues without the checkpoint" << std::endl;
+                }
+                stats.leave();
+                lastCheckpoint = std::chrono::steady_clock::now();
+            }
+        }
+        
+        if (m_Engine == MarkovTextChain::LearnEngine::Sort)
+        {
+            std::cerr << "Counting word pairs ... " << std::flush;
+            stats.enter(LearnStats::Stage::Chain);
+            chain.commit();
+            stats.leave();
             std::cerr << "DONE" << std::endl;
         }
     }
@@ -159,11 +613,193 @@ bool ChainBuilder::buildChain() const
         return false;
     }
     
-    return outputChain(chain);
+    stats.enter(LearnStats::Stage::Save);
+    const bool saved = outputChain(chain);
+    stats.leave();
+    
+    // После сохранения цепи контрольная точка больше не нужна.
+    if (saved && !m_Checkpoint.empty())
+    {
+        std::remove(m_Checkpoint.c_str());
+    }
+    
+    return saved && (m_Stats.empty() || outputStats(stats));
+}
+
+bool ChainBuilder::loadBase(MarkovTextChain& chain) const
+{
+    std::cerr << "Loading base Markov chain from '" << m_Base << "' ... ";
+    std::ifstream input(m_Base);
+    if (!input.good())
+    {
+        std::cerr << std::endl << "  ChainBuilder::loadBase error: failed to open file '" << m_Base << "' for reading" << std::endl;
+        return false;
+    }
+    
+    try
+    {
+        if (m_Append)
+        {
+            // Признак отката в файле не записывается: как и при загрузке, цепь с откатом узнается
+            // по ключу короче порядка цепи. У такой цепи короткие ключи встречаются сразу, цепь
+            // без отката читается до конца, но потоково, без загрузки в память.
+            MarkovTextChain::StateReader reader(input);
+            if (reader.sorted())
+            {
+                // Приращение легло бы за индексом, и читатели формата Sorted его бы не увидели.
+                throw std::runtime_error("ChainBuilder::loadBase error: cannot append to a chain in the sorted format, save it as text first");
+            }
+            MarkovTextChain::Words key;
+            MarkovTextChain::Successors successors;
+            bool backoff = false;
+            while (!backoff && reader.next(key, successors))
+            {
+                backoff = key.size() < reader.order();
+            }
+            chain.setOrder(reader.order());
+            chain.setBackoff(backoff);
+        }
+        else
+        {
+            chain.load(input);
+        }
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << std::endl << "  ChainBuilder::loadBase error:\n    " << e.what() << std::endl;
+        return false;
+    }
+    
+    // Загруженная цепь задает признак отката, и новые тексты добавляются в нее так же.
+    if (m_Order != defaultOrder && chain.order() != static_cast<size_t>(m_Order))
+    {
+        std::cerr << std::endl << "  ChainBuilder::loadBase error: base chain has order " << chain.order() << ", not " << m_Order << std::endl;
+        return false;
+    }
+    if (m_Backoff && !chain.backoff())
+    {
+        std::cerr << std::endl << "  ChainBuilder::loadBase error: base chain is not a backoff chain" << std::endl;
+        return false;
+    }
+    if (chain.backoff() && m_Engine == MarkovTextChain::LearnEngine::Sort)
+    {
+        std::cerr << std::endl << "  ChainBuilder::loadBase error: backoff base chain requires the 'hash' engine" << std::endl;
+        return false;
+    }
+    
+    std::cerr << "DONE" << std::endl;
+    return true;
+}
+
+bool ChainBuilder::loadCheckpoint(MarkovTextChain& chain, std::vector<std::string>& completed) const
+{
+    // Без контрольной точки построение начинается сначала.
+    std::ifstream input(m_Checkpoint, std::ios::binary);
+    if (!input.good())
+    {
+        return true;
+    }
+    
+    std::cerr << "Resuming from checkpoint '" << m_Checkpoint << "' ... ";
+    try
+    {
+        std::string line;
+        size_t count = 0;
+        if (!std::getline(input, line) || line != checkpointHeader || !(input >> count) || !std::getline(input, line))
+        {
+            throw std::runtime_error("ChainBuilder::loadCheckpoint error: file is not a checkpoint");
+        }
+        for (size_t i = 0; i < count && std::getline(input, line); ++i)
+        {
+            completed.push_back(line);
+        }
+        if (completed.size() != count)
+        {
+            throw std::runtime_error("ChainBuilder::loadCheckpoint error: checkpoint is truncated");
+        }
+        chain.load(input);
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << std::endl << "  ChainBuilder::loadCheckpoint error:\n    " << e.what() << std::endl;
+        return false;
+    }
+    
+    if (m_Order != defaultOrder && chain.order() != static_cast<size_t>(m_Order))
+    {
+        std::cerr << std::endl << "  ChainBuilder::loadCheckpoint error: checkpoint chain has order " << chain.order() << ", not " << m_Order << std::endl;
+        return false;
+    }
+    
+    std::cerr << "DONE, " << completed.size() << " urls learned" << std::endl;
+    return true;
+}
+
+bool ChainBuilder::saveCheckpoint(MarkovTextChain& chain, const std::vector<std::string>& completed) const
+{
+    TraceScope scope("ChainBuilder::saveCheckpoint");
+    std::cerr << "Saving checkpoint to '" << m_Checkpoint << "' ... " << std::flush;
+    chain.commit();
+    
+    const std::string temporary = m_Checkpoint + ".tmp";
+    std::ofstream output(temporary, std::ios::binary);
+    if (!output.good())
+    {
+        std::cerr << std::endl << "  ChainBuilder::saveCheckpoint error: failed to open file '" << temporary << "' for writing" << std::endl;
+        return false;
+    }
+    output << checkpointHeader << '\n' << completed.size() << '\n';
+    for (const auto& url : completed)
+    {
+        output << url << '\n';
+    }
+    chain.save(output, MarkovTextChain::ChainFormat::Compact);
+    output.close();
+    if (output.fail())
+    {
+        std::remove(temporary.c_str());
+        std::cerr << std::endl << "  ChainBuilder::saveCheckpoint error: failed to write file '" << temporary << "'" << std::endl;
+        return false;
+    }
+    
+    // Данные сбрасываются на диск до переименования, иначе после сбоя питания на месте точки может оказаться пустой файл.
+    const int descriptor = open(temporary.c_str(), O_RDONLY);
+    const bool synced = descriptor >= 0 && fsync(descriptor) == 0;
+    if (descriptor >= 0)
+    {
+        close(descriptor);
+    }
+    if (!synced || std::rename(temporary.c_str(), m_Checkpoint.c_str()) != 0)
+    {
+        std::cerr << std::endl << "  ChainBuilder::saveCheckpoint error: failed to replace file '" << m_Checkpoint << "': " << std::strerror(errno) << std::endl;
+        std::remove(temporary.c_str());
+        return false;
+    }
+    std::cerr << "DONE" << std::endl;
+    return true;
+}
+
+void ChainBuilder::readInput(const TextDownloader::Handler& handler) const
+{
+    TraceScope scope("ChainBuilder::readInput");
+    std::vector<char> block(inputBlockSize);
+    while (std::cin.read(block.data(), block.size()) || std::cin.gcount() > 0)
+    {
+        handler(block.data(), static_cast<size_t>(std::cin.gcount()));
+    }
+    if (std::cin.bad())
+    {
+        throw std::runtime_error("ChainBuilder::readInput error: failed to read std::cin");
+    }
 }
 
 bool ChainBuilder::outputChain(const MarkovTextChain& chain) const
 {
+    if (m_Append)
+    {
+        return appendChain(chain);
+    }
+    
     if (!m_Output.empty())
     {
         std::cerr << "Saving Markov chain to '" << m_Output << "' ... ";
@@ -182,7 +818,7 @@ bool ChainBuilder::outputChain(const MarkovTextChain& chain) const
     
     try
     {
-        chain.save(m_Output.empty() ? std::cout : fileOutput);
+        chain.save(m_Output.empty() ? std::cout : fileOutput, m_Format);
     }
     catch (const std::exception& e)
     {
@@ -197,3 +833,97 @@ bool ChainBuilder::outputChain(const MarkovTextChain& chain) const
     
     return true;
 }
+
+bool ChainBuilder::appendChain(const MarkovTextChain& chain) const
+{
+    std::cerr << "Appending learned states to '" << m_Base << "' ... ";
+    
+    // Приращение сначала целиком записывается во временный файл, а базовая цепь при неудачной дозаписи
+    // обрезается до прежнего размера, чтобы в ней не остался сегмент без концевика.
+    const std::string temporary = m_Base + ".delta";
+    struct stat status;
+    if (stat(m_Base.c_str(), &status) != 0)
+    {
+        std::cerr << std::endl << "  ChainBuilder::appendChain error: failed to stat file '" << m_Base << "': " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    
+    try
+    {
+        std::ofstream delta(temporary, std::ios::binary);
+        if (!delta.good())
+        {
+            throw std::runtime_error("ChainBuilder::appendChain error: failed to open file '" + temporary + "' for writing");
+        }
+        chain.save(delta, m_Format);
+        delta.close();
+        if (delta.fail())
+        {
+            throw std::runtime_error("ChainBuilder::appendChain error: failed to write file '" + temporary + "'");
+        }
+        
+        std::ifstream input(temporary, std::ios::binary);
+        std::ofstream output(m_Base, std::ios::binary | std::ios::app);
+        if (!input.good() || !output.good())
+        {
+            throw std::runtime_error("ChainBuilder::appendChain error: failed to open file '" + m_Base + "' for appending");
+        }
+        output << input.rdbuf();
+        output.close();
+        
+        const int descriptor = open(m_Base.c_str(), O_RDONLY);
+        const bool synced = descriptor >= 0 && fsync(descriptor) == 0;
+        if (descriptor >= 0)
+        {
+            close(descriptor);
+        }
+        if (output.fail() || !synced)
+        {
+            const bool restored = truncate(m_Base.c_str(), status.st_size) == 0;
+            throw std::runtime_error("ChainBuilder::appendChain error: failed to append to file '" + m_Base + "'" +
+                                     (restored ? "" : ", the file could not be truncated back and may be damaged"));
+        }
+    }
+    catch (const std::exception& e)
+    {
+        std::remove(temporary.c_str());
+        std::cerr << std::endl << "  ChainBuilder::appendChain error:\n    " << e.what() << std::endl;
+        return false;
+    }
+    
+    std::remove(temporary.c_str());
+    std::cerr << "DONE" << std::endl;
+    return true;
+}
+
+bool ChainBuilder::outputStats(const LearnStats& stats) const
+{
+    if (m_Stats == standardInput)
+    {
+        stats.report(std::cerr);
+        return true;
+    }
+    
+    std::ofstream output(m_Stats);
+    if (!output.good())
+    {
+        std::cerr << "  ChainBuilder::outputStats error: failed to open file '" << m_Stats << "' for writing" << std::endl;
+        return false;
+    }
+    
+    stats.report(output);
+    return output.good();
+}
+
+bool ChainBuilder::outputTrace() const
+{
+    std::ofstream output(m_Trace);
+    if (!output.good())
+    {
+        std::cerr << "  ChainBuilder::outputTrace error: failed to open file '" << m_Trace << "' for writing" << std::endl;
+        return false;
+    }
+    
+    Trace::write(output);
+    return output.good();
+}
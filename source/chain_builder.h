@@ -4,11 +4,15 @@
 #define CHAIN_BUILDER_H
 
 #include "markov_text_chain.h"
+#include "text_downloader.h"
 
 #include <list>
 #include <string>
+#include <vector>
 
 
+class LearnStats;
+
 /// @class ChainBuilder
 /// @brief Анализирует аргументы командной строки и строит текстовую цепь Маркова.
 class ChainBuilder
@@ -38,18 +42,96 @@ private:
     /// @return true если действие выполнено успешно, false в противном случае.
     bool buildChain() const;
     
+    /// @brief Загрузить базовую цепь Маркова, к которой добавляются новые тексты.
+    /// @details При дописывании приращения из файла базовой цепи читается только порядок.
+    /// @param[in] chain - Цепь Маркова.
+    /// @return true если действие выполнено успешно, false в противном случае.
+    bool loadBase(MarkovTextChain& chain) const;
+    
+    /// @brief Загрузить контрольную точку, если она есть.
+    /// @param[in] chain - Цепь Маркова.
+    /// @param[out] completed - Адреса, обработанные до контрольной точки, пустой список - точки нет.
+    /// @return true если действие выполнено успешно, false в противном случае.
+    bool loadCheckpoint(MarkovTextChain& chain, std::vector<std::string>& completed) const;
+    
+    /// @brief Атомарно сохранить контрольную точку: цепь в компактном формате и обработанные адреса.
+    /// @details Точка пишется во временный файл, который сбрасывается на диск и переименовывается,
+    ///          поэтому прерванная запись не портит предыдущую точку.
+    /// @param[in] chain - Цепь Маркова, слова способа построения Sort подсчитываются перед сохранением.
+    /// @param[in] completed - Обработанные адреса.
+    /// @return true если действие выполнено успешно, false в противном случае.
+    bool saveCheckpoint(MarkovTextChain& chain, const std::vector<std::string>& completed) const;
+    
+    /// @brief Передать текст стандартного ввода обработчику по блокам до конца ввода.
+    /// @param[in] handler - Обработчик текста.
+    /// @throws std::exception в случае ошибки.
+    void readInput(const TextDownloader::Handler& handler) const;
+    
     /// @brief Сохранить цепь Маркова.
     /// @param[in] chain - Цепь Маркова.
     /// @return true если действие выполнено успешно, false в противном случае.
     bool outputChain(const MarkovTextChain& chain) const;
+    
+    /// @brief Дописать приращение цепи Маркова в конец файла базовой цепи.
+    /// @param[in] chain - Цепь Маркова с состояниями новых текстов.
+    /// @return true если действие выполнено успешно, false в противном случае.
+    bool appendChain(const MarkovTextChain& chain) const;
+    
+    /// @brief Вывести отчет о построении цепи Маркова.
+    /// @param[in] stats - Счетчики и время этапов построения.
+    /// @return true если действие выполнено успешно, false в противном случае.
+    bool outputStats(const LearnStats& stats) const;
+    
+    /// @brief Вывести события трассировки.
+    /// @return true если действие выполнено успешно, false в противном случае.
+    bool outputTrace() const;
 
 private:
     /// @brief Порядок цепи Маркова.
     int m_Order;
     
+    /// @brief Способ построения цепи Маркова.
+    MarkovTextChain::LearnEngine m_Engine;
+    
+    /// @brief Число потоков для построения цепи Маркова.
+    size_t m_Threads;
+    
+    /// @brief Число слов между уменьшениями вдвое чисел появлений, 0 - без уменьшения.
+    size_t m_HalfLife;
+    
+    /// @brief Максимальное число состояний цепи, 0 - без ограничения.
+    size_t m_MaxStates;
+    
+    /// @brief Признак построения цепи с откатом, содержащей состояния всех порядков.
+    bool m_Backoff;
+    
+    /// @brief Формат файла цепи Маркова.
+    MarkovTextChain::ChainFormat m_Format;
+    
+    /// @brief Файл вывода отчета о построении в формате JSON, пустая строка - без отчета.
+    std::string m_Stats;
+    
+    /// @brief Файл вывода трассировки в формате Chrome Trace Event, пустая строка - без трассировки.
+    std::string m_Trace;
+    
     /// @brief Файл вывода цепи Маркова.
     std::string m_Output;
     
+    /// @brief Файл базовой цепи Маркова, пустая строка - цепь строится с нуля.
+    std::string m_Base;
+    
+    /// @brief Признак дописывания к файлу базовой цепи приращения вместо вывода всей цепи.
+    bool m_Append;
+    
+    /// @brief Файл контрольной точки, пустая строка - без контрольных точек.
+    std::string m_Checkpoint;
+    
+    /// @brief Минимальный интервал между контрольными точками в секундах.
+    size_t m_CheckpointInterval;
+    
+    /// @brief Признак продолжения построения с контрольной точки.
+    bool m_Resume;
+    
     /// @brief Список адресов для построения цепи Маркова.
     std::list<std::string> m_Urls;
     
@@ -0,0 +1,681 @@
+#include "chain_merger.h"
+#include "latency.h"
+#include "markov_text_chain.h"
+#include "parallel.h"
+
+#include <getopt.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <queue>
+#include <stdexcept>
+#include <utility>
+
+
+namespace
+{
+    /// @brief Объем памяти для сортировки порции состояний по умолчанию, МиБ.
+    const size_t defaultMemoryMiB = 256;
+    
+    /// @brief Оценка накладных расходов памяти на строку слова.
+    const size_t wordOverhead = 48;
+    
+    /// @brief Оценка накладных расходов памяти на состояние.
+    const size_t stateOverhead = 64;
+    
+    /// @brief Имя стандартного ввода в списке входных цепей.
+    const std::string standardInput = "-";
+    
+    /// @brief Наибольшее число файлов, одновременно открытых для слияния всеми потоками.
+    const size_t maxOpenRuns = 512;
+    
+    /// @brief Состояние цепи.
+    using State = std::pair<MarkovTextChain::Words, MarkovTextChain::Successors>;
+    
+    /// @class TemporaryFile
+    /// @brief Временный файл, удаляемый вместе с объектом.
+    class TemporaryFile
+    {
+    public:
+        /// @brief Конструктор, создает пустой файл с уникальным именем.
+        /// @param[in] directory - Каталог файла.
+        /// @throws std::exception если файл не создан.
+        explicit TemporaryFile(const std::string& directory)
+            : m_Path(directory + "/markov_merge_XXXXXX")
+        {
+            const int descriptor = mkstemp(&m_Path[0]);
+            if (descriptor < 0)
+            {
+                throw std::runtime_error("TemporaryFile error: failed to create file in '" + directory + "': " + std::strerror(errno));
+            }
+            close(descriptor);
+        }
+        
+        /// @brief Деструктор, удаляет файл.
+        ~TemporaryFile()
+        {
+            unlink(m_Path.c_str());
+        }
+        
+        TemporaryFile(const TemporaryFile&) = delete;
+        TemporaryFile& operator=(const TemporaryFile&) = delete;
+        
+        /// @brief Получить имя файла.
+        /// @return Имя файла.
+        const std::string& path() const
+        {
+            return m_Path;
+        }
+    
+    private:
+        /// @brief Имя файла.
+        std::string m_Path;
+    };
+    
+    /// @brief Упорядочить слова значения по алфавиту, объединив повторы.
+    /// @param[in,out] successors - Слова значения с числом их появлений.
+    void combineSuccessors(MarkovTextChain::Successors& successors)
+    {
+        std::sort(successors.begin(), successors.end(), [](const MarkovTextChain::Successors::value_type& left,
+                                                           const MarkovTextChain::Successors::value_type& right)
+        {
+            return left.first < right.first;
+        });
+        
+        size_t last = 0;
+        for (size_t i = 1; i < successors.size(); ++i)
+        {
+            if (successors[i].first == successors[last].first)
+            {
+                successors[last].second += successors[i].second;
+            }
+            else if (++last != i)
+            {
+                successors[last] = std::move(successors[i]);
+            }
+        }
+        successors.resize(successors.empty() ? 0 : last + 1);
+    }
+    
+    /// @brief Оценить память, занимаемую состоянием.
+    /// @param[in] state - Состояние.
+    /// @return Размер в байтах.
+    size_t stateMemory(const State& state)
+    {
+        size_t size = stateOverhead;
+        for (const auto& word : state.first)
+        {
+            size += word.size() + wordOverhead;
+        }
+        for (const auto& successor : state.second)
+        {
+            size += successor.first.size() + wordOverhead;
+        }
+        return size;
+    }
+    
+    /// @brief Открыть упорядоченный файл цепи для чтения.
+    /// @param[in] path - Имя файла.
+    /// @return Поток ввода файла.
+    /// @throws std::exception если файл не открыт.
+    std::ifstream openRun(const std::string& path)
+    {
+        std::ifstream input(path);
+        if (!input.good())
+        {
+            throw std::runtime_error("openRun error: failed to open file '" + path + "' for reading: " + std::strerror(errno));
+        }
+        return input;
+    }
+    
+    /// @class RunCursor
+    /// @brief Текущее состояние упорядоченного файла цепи в пределах диапазона ключей.
+    class RunCursor
+    {
+    public:
+        /// @brief Конструктор, переходит к первому состоянию диапазона.
+        /// @param[in] path - Имя файла формата Sorted.
+        /// @param[in] lower - Нижняя граница диапазона ключей включительно, nullptr - без границы.
+        /// @param[in] upper - Верхняя граница диапазона ключей не включительно, nullptr - без границы.
+        /// @throws std::exception в случае ошибки.
+        RunCursor(const std::string& path, const MarkovTextChain::Words* lower, const MarkovTextChain::Words* upper)
+            : m_Input(openRun(path))
+            , m_Reader(m_Input)
+            , m_Upper(upper)
+            , m_State()
+            , m_Valid(false)
+        {
+            // Начать с последней записи индекса, ключ которой не больше нижней границы.
+            if (lower != nullptr)
+            {
+                m_Reader.seekState(*lower);
+            }
+            
+            do
+            {
+                advance();
+            }
+            while (m_Valid && lower != nullptr && m_State.first < *lower);
+        }
+        
+        RunCursor(const RunCursor&) = delete;
+        RunCursor& operator=(const RunCursor&) = delete;
+        
+        /// @brief Проверить, есть ли текущее состояние.
+        /// @return true если состояние есть, false если диапазон закончился.
+        bool valid() const
+        {
+            return m_Valid;
+        }
+        
+        /// @brief Получить текущее состояние.
+        /// @return Состояние.
+        State& state()
+        {
+            return m_State;
+        }
+        
+        /// @brief Перейти к следующему состоянию.
+        /// @throws std::exception если строка состояния повреждена или ключи не возрастают.
+        void advance()
+        {
+            const MarkovTextChain::Words previous = m_Valid ? std::move(m_State.first) : MarkovTextChain::Words();
+            const bool hadPrevious = m_Valid;
+            m_Valid = m_Reader.next(m_State.first, m_State.second) && (m_Upper == nullptr || m_State.first < *m_Upper);
+            if (m_Valid && hadPrevious && !(previous < m_State.first))
+            {
+                throw std::runtime_error("RunCursor error: keys of sorted chain are out of order");
+            }
+        }
+    
+    private:
+        /// @brief Поток ввода файла.
+        std::ifstream m_Input;
+        
+        /// @brief Читатель состояний.
+        MarkovTextChain::StateReader m_Reader;
+        
+        /// @brief Верхняя граница диапазона ключей, nullptr - без границы.
+        const MarkovTextChain::Words* m_Upper;
+        
+        /// @brief Текущее состояние.
+        State m_State;
+        
+        /// @brief Признак наличия текущего состояния.
+        bool m_Valid;
+    };
+    
+    /// @brief Записать порцию состояний во временный файл формата Sorted.
+    /// @param[in] states - Состояния, упорядочиваются по ключам.
+    /// @param[in] order - Порядок цепи.
+    /// @param[in] directory - Каталог временных файлов.
+    /// @return Временный файл.
+    /// @throws std::exception в случае ошибки.
+    std::unique_ptr<TemporaryFile> spillRun(std::vector<State>& states, size_t order, const std::string& directory)
+    {
+        std::sort(states.begin(), states.end(), [](const State& left, const State& right)
+        {
+            return left.first < right.first;
+        });
+        
+        // Ключ повторяется, если к цепи дописаны приращения.
+        size_t last = 0;
+        for (size_t i = 1; i < states.size(); ++i)
+        {
+            if (states[i].first == states[last].first)
+            {
+                states[last].second.insert(states[last].second.end(), states[i].second.begin(), states[i].second.end());
+            }
+            else if (++last != i)
+            {
+                states[last] = std::move(states[i]);
+            }
+        }
+        states.resize(states.empty() ? 0 : last + 1);
+        
+        std::unique_ptr<TemporaryFile> run(new TemporaryFile(directory));
+        std::ofstream output(run->path());
+        MarkovTextChain::SortedWriter writer(output);
+        writer.writeHeader(order, states.size());
+        for (auto& state : states)
+        {
+            combineSuccessors(state.second);
+            writer.write(state.first, state.second);
+        }
+        writer.finish();
+        if (!output.good())
+        {
+            throw std::runtime_error("spillRun error: failed to write file '" + run->path() + "'");
+        }
+        states.clear();
+        return run;
+    }
+    /// @brief Слить упорядоченные файлы цепи в пределах диапазона ключей, суммируя числа появлений слов.
+    /// @param[in] runs - Имена файлов формата Sorted.
+    /// @param[in] lower - Нижняя граница диапазона ключей включительно, nullptr - без границы.
+    /// @param[in] upper - Верхняя граница диапазона ключей не включительно, nullptr - без границы.
+    /// @param[in] writer - Писатель слитых состояний.
+    /// @return Число записанных состояний.
+    /// @throws std::exception в случае ошибки.
+    size_t mergeRuns(const std::vector<std::string>& runs, const MarkovTextChain::Words* lower, const MarkovTextChain::Words* upper,
+                     MarkovTextChain::SortedWriter& writer)
+    {
+        std::vector<std::unique_ptr<RunCursor>> cursors;
+        for (const auto& run : runs)
+        {
+            cursors.emplace_back(new RunCursor(run, lower, upper));
+        }
+        
+        // Куча номеров файлов по текущему ключу, наименьший ключ наверху.
+        const auto greater = [&cursors](size_t left, size_t right)
+        {
+            return cursors[right]->state().first < cursors[left]->state().first;
+        };
+        std::priority_queue<size_t, std::vector<size_t>, decltype(greater)> heap(greater);
+        for (size_t i = 0; i < cursors.size(); ++i)
+        {
+            if (cursors[i]->valid())
+            {
+                heap.push(i);
+            }
+        }
+        
+        State merged;
+        size_t states = 0;
+        while (!heap.empty())
+        {
+            const size_t first = heap.top();
+            heap.pop();
+            merged.first = cursors[first]->state().first;
+            merged.second.swap(cursors[first]->state().second);
+            std::vector<size_t> advanced(1, first);
+            while (!heap.empty() && cursors[heap.top()]->state().first == merged.first)
+            {
+                const auto& successors = cursors[heap.top()]->state().second;
+                merged.second.insert(merged.second.end(), successors.begin(), successors.end());
+                advanced.push_back(heap.top());
+                heap.pop();
+            }
+            if (advanced.size() > 1)
+            {
+                combineSuccessors(merged.second);
+            }
+            writer.write(merged.first, merged.second);
+            ++states;
+            
+            for (const auto i : advanced)
+            {
+                cursors[i]->advance();
+                if (cursors[i]->valid())
+                {
+                    heap.push(i);
+                }
+            }
+        }
+        return states;
+    }
+}
+
+ChainMerger::ChainMerger()
+    : m_Inputs()
+    , m_Output()
+    , m_TempDirectory(std::getenv("TMPDIR") != nullptr ? std::getenv("TMPDIR") : "/tmp")
+    , m_Memory(defaultMemoryMiB << 20)
+    , m_Threads(defaultThreadCount())
+    , m_NeedHelp(false)
+    , m_ProgramName()
+{
+}
+
+ChainMerger::~ChainMerger() = default;
+
+void ChainMerger::init(int argc, char** argv)
+{
+    m_ProgramName = argv[0];
+    m_ProgramName = m_ProgramName.substr(m_ProgramName.find_last_of('/') + 1);
+    
+    struct option longOptions[] =
+    {
+       {"output", required_argument, 0, 'o'},
+       {"threads", required_argument, 0, 'j'},
+       {"memory", required_argument, 0, 'm'},
+       {"directory", required_argument, 0, 'd'},
+       {"help", no_argument, 0, 'h'},
+       {0, 0, 0, 0 }
+    };
+    
+    int c = 0;
+    opterr = 0;
+    
+    // Анализ ключей и их значений.
+    while ((c = getopt_long(argc, argv, "o:j:m:d:h", longOptions, nullptr))!= -1)
+    {
+        switch (c)
+        {
+        case 'o':
+            m_Output = optarg;
+            break;
+        
+        case 'j':
+            try
+            {
+                const int threads = std::stoi(optarg);
+                if (threads <= 0)
+                {
+                    throw std::exception();
+                }
+                m_Threads = threads;
+            }
+            catch (const std::exception& e)
+            {
+                std::cerr << "  Unsupported value for 'threads' parameter" << std::endl;
+                m_NeedHelp = true;
+            }
+            break;
+        
+        case 'm':
+            try
+            {
+                const int memory = std::stoi(optarg);
+                if (memory <= 0)
+                {
+                    throw std::exception();
+                }
+                m_Memory = static_cast<size_t>(memory) << 20;
+            }
+            catch (const std::exception& e)
+            {
+                std::cerr << "  Unsupported value for 'memory' parameter" << std::endl;
+                m_NeedHelp = true;
+            }
+            break;
+        
+        case 'd':
+            m_TempDirectory = optarg;
+            break;
+        
+        case 'h':
+            m_NeedHelp = true;
+            break;
+        
+        case '?':
+            if (optopt == 'o')
+            {
+                std::cerr << " Options -o and --output require an argument" << std::endl;
+                m_NeedHelp = true;
+                break;
+            }
+            else if (optopt == 'j')
+            {
+                std::cerr << " Options -j and --threads require an argument" << std::endl;
+                m_NeedHelp = true;
+                break;
+            }
+            else if (optopt == 'm')
+            {
+                std::cerr << " Options -m and --memory require an argument" << std::endl;
+                m_NeedHelp = true;
+                break;
+            }
+            else if (optopt == 'd')
+            {
+                std::cerr << " Options -d and --directory require an argument" << std::endl;
+                m_NeedHelp = true;
+                break;
+            }
+            else
+            {
+                std::cerr << " Unknown option " << argv[optind-1] << std::endl;
+                m_NeedHelp = true;
+                break;
+            }
+            break;
+        }
+    }
+    
+    // Входные цепи перечислены после ключей.
+    m_Inputs.assign(argv + optind, argv + argc);
+    
+    // Проверка наличия обязательных параметров.
+    if (!m_NeedHelp && m_Inputs.empty())
+    {
+        std::cerr << "  At least one input chain is required" << std::endl;
+        m_NeedHelp = true;
+    }
+    if (!m_NeedHelp && std::count(m_Inputs.begin(), m_Inputs.end(), standardInput) > 1)
+    {
+        std::cerr << "  std::cin can be given as input only once" << std::endl;
+        m_NeedHelp = true;
+    }
+}
+
+bool ChainMerger::run() const
+{
+    if (m_NeedHelp)
+    {
+        return !printUsage();
+    }
+    
+    // Задержка слияния выводится по сигналу SIGUSR1 во время работы и при завершении.
+    LatencyReporter reporter(std::cerr);
+    const bool merged = mergeChains();
+    Latency::write(std::cerr);
+    return merged;
+}
+
+bool ChainMerger::printUsage() const
+{
+    std::cout << "Usage: " << m_ProgramName << " [options] <chain>..." << std::endl;
+    std::cout << "  <chain>          Chain file to merge, '-' reads std::cin" << std::endl;
+    std::cout << "  -o, --output     File to output merged chain to, std::cout will be used if not provided" << std::endl;
+    std::cout << "  -j, --threads    Number of threads merging key ranges, all cores are used by default" << std::endl;
+    std::cout << "  -m, --memory     MiB of states sorted at once for unsorted inputs, 256 by default" << std::endl;
+    std::cout << "  -d, --directory  Directory for temporary files, $TMPDIR or /tmp by default" << std::endl;
+    std::cout << "  -h, --help       Show this message and exit" << std::endl << std::endl;
+    return true;
+}
+
+bool ChainMerger::mergeChains() const
+{
+    std::ofstream fileOutput;
+    if (!m_Output.empty())
+    {
+        fileOutput.open(m_Output);
+        if (!fileOutput.good())
+        {
+            std::cerr << "  ChainMerger::mergeChains error: failed to open file '" << m_Output << "' for writing" << std::endl;
+            return false;
+        }
+    }
+    
+    const auto start = std::chrono::steady_clock::now();
+    try
+    {
+        // Слияние записывает объединенную цепь, поэтому учитывается как ее сохранение.
+        LatencyScope latency(Latency::Operation::Save);
+        merge(m_Output.empty() ? std::cout : fileOutput);
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "  ChainMerger::mergeChains error:\n    " << e.what() << std::endl;
+        return false;
+    }
+    
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cerr << "Merged " << m_Inputs.size() << " chains in " << seconds << " s" << std::endl;
+    return true;
+}
+
+void ChainMerger::merge(std::ostream& output) const
+{
+    // Упорядоченные файлы сливаются как есть, остальные входы сортируются порциями во временные файлы.
+    std::vector<std::string> runs;
+    std::vector<std::unique_ptr<TemporaryFile>> temporaryFiles;
+    std::vector<MarkovTextChain::Words> indexKeys;
+    size_t order = 0;
+    for (const auto& name : m_Inputs)
+    {
+        std::ifstream fileInput;
+        if (name != standardInput)
+        {
+            fileInput.open(name);
+            if (!fileInput.good())
+            {
+                throw std::runtime_error("ChainMerger::merge error: failed to open file '" + name + "' for reading");
+            }
+        }
+        std::istream& input = name == standardInput ? std::cin : fileInput;
+        MarkovTextChain::StateReader reader(input);
+        if (order != 0 && reader.order() != order)
+        {
+            throw std::runtime_error("ChainMerger::merge error: chain '" + name + "' has order " + std::to_string(reader.order()) +
+                                     ", expected " + std::to_string(order));
+        }
+        order = reader.order();
+        
+        if (reader.sorted() && name != standardInput)
+        {
+            runs.push_back(name);
+            for (const auto& entry : reader.index())
+            {
+                indexKeys.push_back(entry.first);
+            }
+            continue;
+        }
+        
+        std::vector<State> states;
+        size_t memory = 0;
+        State state;
+        while (reader.next(state.first, state.second))
+        {
+            memory += stateMemory(state);
+            states.push_back(std::move(state));
+            if (memory >= m_Memory)
+            {
+                temporaryFiles.push_back(spillRun(states, order, m_TempDirectory));
+                runs.push_back(temporaryFiles.back()->path());
+                memory = 0;
+            }
+        }
+        if (!states.empty())
+        {
+            temporaryFiles.push_back(spillRun(states, order, m_TempDirectory));
+            runs.push_back(temporaryFiles.back()->path());
+        }
+    }
+    
+    // Каждый поток открывает все сливаемые файлы, поэтому их число ограничено: пока файлов больше,
+    // чем приходится на поток, они сливаются группами в промежуточные файлы.
+    const size_t fanIn = std::max<size_t>(2, maxOpenRuns / m_Threads);
+    while (runs.size() > fanIn)
+    {
+        const size_t groups = (runs.size() + fanIn - 1) / fanIn;
+        std::vector<std::unique_ptr<TemporaryFile>> groupFiles(groups);
+        std::atomic<size_t> nextGroup(0);
+        runParallel(std::min(m_Threads, groups), [&](size_t)
+        {
+            for (size_t group = nextGroup++; group < groups; group = nextGroup++)
+            {
+                const auto first = runs.begin() + group * fanIn;
+                const std::vector<std::string> groupRuns(first, first + std::min(fanIn, static_cast<size_t>(runs.end() - first)));
+                groupFiles[group].reset(new TemporaryFile(m_TempDirectory));
+                
+                // Промежуточный файл не загружается, поэтому размер таблицы состояний в заголовке не нужен.
+                std::ofstream groupOutput(groupFiles[group]->path());
+                MarkovTextChain::SortedWriter writer(groupOutput);
+                writer.writeHeader(order, 0);
+                mergeRuns(groupRuns, nullptr, nullptr, writer);
+                writer.finish();
+                groupOutput.close();
+                if (groupOutput.fail())
+                {
+                    throw std::runtime_error("ChainMerger::merge error: failed to write file '" + groupFiles[group]->path() + "'");
+                }
+            }
+        });
+        
+        runs.clear();
+        for (const auto& file : groupFiles)
+        {
+            runs.push_back(file->path());
+        }
+        temporaryFiles = std::move(groupFiles);
+    }
+    
+    // Границы диапазонов ключей делят записи индексов всех файлов поровну между потоками.
+    // Записи индексов временных файлов не собираются: их ключи повторяют распределение ключей входов.
+    if (indexKeys.empty())
+    {
+        for (const auto& run : runs)
+        {
+            std::ifstream input(openRun(run));
+            MarkovTextChain::StateReader reader(input);
+            for (const auto& entry : reader.index())
+            {
+                indexKeys.push_back(entry.first);
+            }
+        }
+    }
+    std::sort(indexKeys.begin(), indexKeys.end());
+    std::vector<MarkovTextChain::Words> bounds;
+    for (size_t i = 1; i < m_Threads && !indexKeys.empty(); ++i)
+    {
+        const auto& bound = indexKeys[indexKeys.size() * i / m_Threads];
+        if (bounds.empty() || bounds.back() < bound)
+        {
+            bounds.push_back(bound);
+        }
+    }
+    const size_t ranges = bounds.size() + 1;
+    
+    // Каждый диапазон сливается в свой временный файл без заголовка.
+    std::vector<std::unique_ptr<TemporaryFile>> parts;
+    std::vector<std::ofstream> partOutputs(ranges);
+    std::vector<std::unique_ptr<MarkovTextChain::SortedWriter>> partWriters;
+    std::vector<size_t> partStates(ranges, 0);
+    for (size_t i = 0; i < ranges; ++i)
+    {
+        parts.emplace_back(new TemporaryFile(m_TempDirectory));
+        partOutputs[i].open(parts[i]->path());
+        partWriters.emplace_back(new MarkovTextChain::SortedWriter(partOutputs[i]));
+    }
+    
+    runParallel(ranges, [&](size_t range)
+    {
+        const MarkovTextChain::Words* lower = range > 0 ? &bounds[range - 1] : nullptr;
+        const MarkovTextChain::Words* upper = range < bounds.size() ? &bounds[range] : nullptr;
+        partStates[range] = mergeRuns(runs, lower, upper, *partWriters[range]);
+        partOutputs[range].close();
+        if (partOutputs[range].fail())
+        {
+            throw std::runtime_error("ChainMerger::merge error: failed to write file '" + parts[range]->path() + "'");
+        }
+    });
+    
+    // Части собираются в один файл с общим индексом.
+    size_t states = 0;
+    for (const auto count : partStates)
+    {
+        states += count;
+    }
+    MarkovTextChain::SortedWriter writer(output);
+    writer.writeHeader(order, states);
+    for (size_t i = 0; i < ranges; ++i)
+    {
+        std::ifstream part(parts[i]->path());
+        writer.append(part);
+    }
+    writer.finish();
+    if (!output.good())
+    {
+        throw std::runtime_error("ChainMerger::merge error: failed to write merged chain");
+    }
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#ifndef CHAIN_MERGER_H
+#define CHAIN_MERGER_H
+
+#include <ostream>
+#include <string>
+#include <vector>
+
+
+/// @class ChainMerger
+/// @brief Анализирует аргументы командной строки и объединяет файлы цепей Маркова, суммируя числа появлений слов.
+/// @details Входные цепи читаются потоково в порядке ключей. Файлы формата Sorted читаются как есть,
+///          состояния остальных файлов сортируются порциями ограниченного размера во временные файлы.
+///          Диапазоны ключей, выбранные по индексам, сливаются параллельно, поэтому расход памяти
+///          не зависит от размера цепей. Результат записывается в формате Sorted.
+class ChainMerger
+{
+public:
+    /// @brief Конструктор.
+    ChainMerger();
+    
+    /// @brief Деструктор.
+    ~ChainMerger();
+    
+    /// @brief Проанализировать аргументы командной строки.
+    /// @param[in] argc - Число аргументов.
+    /// @param[in] argv - Список аргументов.
+    void init(int argc, char** argv);
+    
+    /// @brief Выполнить заданное командной строкой действие.
+    /// @return true если действие выполнено успешно, false в противном случае.
+    bool run() const;
+    
+    /// @brief Объединить входные цепи.
+    /// @param[in] output - Поток вывода объединенной цепи.
+    /// @throws std::exception в случае ошибки.
+    void merge(std::ostream& output) const;
+
+private:
+    /// @brief Показать справку.
+    /// @return true если действие выполнено успешно, false в противном случае.
+    bool printUsage() const;
+    
+    /// @brief Объединить входные цепи и сохранить результат.
+    /// @return true если действие выполнено успешно, false в противном случае.
+    bool mergeChains() const;
+
+private:
+    /// @brief Имена файлов входных цепей, "-" - std::cin.
+    std::vector<std::string> m_Inputs;
+    
+    /// @brief Имя файла для вывода объединенной цепи.
+    std::string m_Output;
+    
+    /// @brief Каталог временных файлов.
+    std::string m_TempDirectory;
+    
+    /// @brief Объем памяти для сортировки порции состояний в байтах.
+    size_t m_Memory;
+    
+    /// @brief Число потоков.
+    size_t m_Threads;
+    
+    /// @brief Флаг необходимости показа справки.
+    bool m_NeedHelp;
+    
+    /// @brief Имя исполняемого файла.
+    std::string m_ProgramName;
+};
+
+#endif // CHAIN_MERGER_H
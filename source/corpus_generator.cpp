@@ -0,0 +1,126 @@
+#include "corpus_generator.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+
+namespace
+{
+    /// @brief Минимальное число слов в предложении.
+    const size_t minSentenceWords = 5;
+    
+    /// @brief Максимальное число слов в предложении.
+    const size_t maxSentenceWords = 20;
+    
+    /// @brief Запятая в среднем ставится после каждого такого числа слов.
+    const size_t commaFrequency = 8;
+    
+    /// @brief Латинскими буквами записано каждое такое по счету слово словаря.
+    const size_t latinFrequency = 4;
+    
+    /// @brief Число букв алфавита, которыми записываются номера слов.
+    const size_t letterCount = 26;
+    
+    /// @brief Число различных значений случайной позиции в распределении слов.
+    const uint64_t positionResolution = uint64_t(1) << 53;
+}
+
+CorpusGenerator::CorpusGenerator(size_t vocabulary, double skew, uint64_t seed)
+    : m_Cumulative()
+    , m_Words()
+    , m_Capitals()
+    , m_Random(seed)
+    , m_SentenceLeft(0)
+{
+    if (vocabulary == 0 || skew < 0)
+    {
+        throw std::invalid_argument("CorpusGenerator::CorpusGenerator error: inadmissible vocabulary or skew");
+    }
+    
+    m_Cumulative.reserve(vocabulary);
+    m_Words.reserve(vocabulary);
+    m_Capitals.reserve(vocabulary);
+    double total = 0.0;
+    for (size_t rank = 0; rank < vocabulary; ++rank)
+    {
+        total += 1.0 / std::pow(static_cast<double>(rank + 1), skew);
+        m_Cumulative.push_back(total);
+        m_Words.push_back(makeWord(rank, false));
+        m_Capitals.push_back(makeWord(rank, true));
+    }
+}
+
+CorpusGenerator::~CorpusGenerator() = default;
+
+void CorpusGenerator::appendWords(std::string& text, size_t words)
+{
+    for (size_t i = 0; i < words; ++i)
+    {
+        appendWord(text);
+    }
+}
+
+size_t CorpusGenerator::appendBytes(std::string& text, size_t bytes)
+{
+    const size_t target = text.size() + bytes;
+    size_t words = 0;
+    while (text.size() < target)
+    {
+        appendWord(text);
+        ++words;
+    }
+    return words;
+}
+
+void CorpusGenerator::appendWord(std::string& text)
+{
+    const double position = static_cast<double>(m_Random.uniform(positionResolution)) / positionResolution * m_Cumulative.back();
+    const size_t rank = std::min<size_t>(std::upper_bound(m_Cumulative.begin(), m_Cumulative.end(), position) - m_Cumulative.begin(),
+                                         m_Cumulative.size() - 1);
+    
+    const bool first = m_SentenceLeft == 0;
+    if (first)
+    {
+        m_SentenceLeft = minSentenceWords + m_Random.uniform(maxSentenceWords - minSentenceWords + 1);
+    }
+    
+    text += first ? m_Capitals[rank] : m_Words[rank];
+    if (--m_SentenceLeft == 0)
+    {
+        text += ".\n";
+    }
+    else
+    {
+        text += m_Random.uniform(commaFrequency) == 0 ? ", " : " ";
+    }
+}
+
+std::string CorpusGenerator::makeWord(size_t rank, bool capital)
+{
+    // Номер записывается цифрами по основанию 26, старшая цифра не нулевая.
+    const bool latin = rank % latinFrequency == latinFrequency - 1;
+    std::string word;
+    size_t value = rank + letterCount;
+    while (value > 0)
+    {
+        const unsigned letter = value % letterCount;
+        value /= letterCount;
+        const bool upper = capital && value == 0;
+        if (latin)
+        {
+            word.insert(word.begin(), static_cast<char>((upper ? 'A' : 'a') + letter));
+        }
+        else if (upper)
+        {
+            // Заглавные А-Я кодируются в UTF-8 как D0 90-AF.
+            word.insert(0, { static_cast<char>(0xD0), static_cast<char>(0x90 + letter) });
+        }
+        else
+        {
+            // Строчные а-п кодируются как D0 B0-BF, р-я - как D1 80-8F.
+            word.insert(0, { static_cast<char>(letter < 16 ? 0xD0 : 0xD1), static_cast<char>(letter < 16 ? 0xB0 + letter : 0x70 + letter) });
+        }
+    }
+    return word;
+}
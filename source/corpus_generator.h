@@ -0,0 +1,73 @@
+#pragma once
+
+#ifndef CORPUS_GENERATOR_H
+#define CORPUS_GENERATOR_H
+
+#include "random_engine.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+
+/// @class CorpusGenerator
+/// @brief Создает воспроизводимый синтетический текст для замеров производительности.
+/// @details Частоты слов подчиняются закону Ципфа: вероятность слова номер k пропорциональна 1 / k^skew.
+///          Слова словаря записаны строчными кириллическими буквами, каждое четвертое - латинскими,
+///          как в русских текстах с вкраплениями ASCII. Текст разбит на предложения с заглавной буквой
+///          в начале, точкой в конце и редкими запятыми. Текст создается частями неограниченное
+///          число раз, одинаковые параметры всегда дают одинаковый текст.
+class CorpusGenerator
+{
+public:
+    /// @brief Конструктор.
+    /// @param[in] vocabulary - Число различных слов, больше нуля.
+    /// @param[in] skew - Показатель закона Ципфа, 0 - все слова равновероятны.
+    /// @param[in] seed - Зерно генератора случайных чисел.
+    /// @throws std::exception в случае ошибки.
+    CorpusGenerator(size_t vocabulary, double skew, uint64_t seed);
+    
+    /// @brief Деструктор.
+    ~CorpusGenerator();
+    
+    /// @brief Дописать к тексту заданное число слов.
+    /// @param[in,out] text - Текст.
+    /// @param[in] words - Число слов.
+    void appendWords(std::string& text, size_t words);
+    
+    /// @brief Дописать к тексту целые слова, пока он не вырастет хотя бы на заданное число байт.
+    /// @param[in,out] text - Текст.
+    /// @param[in] bytes - Число байт.
+    /// @return Число дописанных слов.
+    size_t appendBytes(std::string& text, size_t bytes);
+
+private:
+    /// @brief Дописать к тексту следующее слово со следующим за ним разделителем.
+    /// @param[in,out] text - Текст.
+    void appendWord(std::string& text);
+    
+    /// @brief Записать номер слова буквами.
+    /// @param[in] rank - Номер слова.
+    /// @param[in] capital - Признак заглавной первой буквы.
+    /// @return Слово.
+    static std::string makeWord(size_t rank, bool capital);
+
+private:
+    /// @brief Накопленные вероятности слов по их номерам.
+    std::vector<double> m_Cumulative;
+    
+    /// @brief Слова словаря.
+    std::vector<std::string> m_Words;
+    
+    /// @brief Слова словаря с заглавной первой буквой.
+    std::vector<std::string> m_Capitals;
+    
+    /// @brief Генератор случайных чисел.
+    RandomEngine m_Random;
+    
+    /// @brief Число слов, оставшихся до конца текущего предложения.
+    size_t m_SentenceLeft;
+};
+
+#endif // CORPUS_GENERATOR_H
@@ -0,0 +1,678 @@
+#include "frozen_chain.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <iterator>
+#include <limits>
+#include <stdexcept>
+
+
+namespace
+{
+    /// @brief Максимальное число последовательностей, продвигаемых одним проходом этапов пакетной генерации.
+    const size_t maxInterleavedSteps = 32;
+}
+
+
+const FrozenChain::WordId FrozenChain::noWord = std::numeric_limits<WordId>::max();
+const FrozenChain::StateId FrozenChain::noState = std::numeric_limits<StateId>::max();
+
+
+FrozenChain::FrozenChain(size_t order, std::vector<MarkovTextChain::Word>&& words)
+    : m_Order(order)
+    , m_Words()
+    , m_WordIndex()
+    , m_Layout(MarkovTextChain::FrozenLayout::Hash)
+    , m_StateIndex()
+    , m_Keys()
+    , m_TrieLabels()
+    , m_TrieChildren()
+    , m_Offsets(1, 0)
+    , m_Successors()
+    , m_Cumulative()
+    , m_Next()
+    , m_StateCumulative()
+{
+    if (words.size() >= noWord)
+    {
+        throw std::length_error("FrozenChain::FrozenChain error: too many words");
+    }
+    
+    std::vector<uint64_t> hashes;
+    hashes.reserve(words.size());
+    for (const auto& word : words)
+    {
+        hashes.push_back(hashBytes(word.data(), word.size()));
+    }
+    m_WordIndex.build(hashes);
+    
+    // Идентификатор слова совпадает с его позицией в совершенной хэш-функции.
+    m_Words.resize(words.size());
+    for (size_t i = 0; i < words.size(); ++i)
+    {
+        m_Words[m_WordIndex.slot(hashes[i])] = std::move(words[i]);
+    }
+}
+
+FrozenChain::~FrozenChain() = default;
+
+FrozenChain::WordId FrozenChain::wordId(const MarkovTextChain::Word& word) const
+{
+    if (m_Words.empty())
+    {
+        return noWord;
+    }
+    
+    const WordId id = m_WordIndex.slot(hashBytes(word.data(), word.size()));
+    return m_Words[id] == word ? id : noWord;
+}
+
+void FrozenChain::wordIds(const MarkovTextChain::Word* words, WordId* ids, size_t count) const
+{
+    if (m_Words.empty())
+    {
+        std::fill(ids, ids + count, noWord);
+        return;
+    }
+    
+    uint64_t hashes[maxInterleavedSteps];
+    for (size_t begin = 0; begin < count; begin += maxInterleavedSteps)
+    {
+        const size_t end = std::min(count, begin + maxInterleavedSteps);
+        
+        // Смещения корзин индекса слов.
+        for (size_t i = begin; i < end; ++i)
+        {
+            hashes[i - begin] = hashBytes(words[i].data(), words[i].size());
+            m_WordIndex.prefetch(hashes[i - begin]);
+        }
+        
+        // Слова в найденных позициях, с которыми сверяются искомые слова.
+        for (size_t i = begin; i < end; ++i)
+        {
+            ids[i] = m_WordIndex.slot(hashes[i - begin]);
+            __builtin_prefetch(&m_Words[ids[i]]);
+        }
+        
+        for (size_t i = begin; i < end; ++i)
+        {
+            if (m_Words[ids[i]] != words[i])
+            {
+                ids[i] = noWord;
+            }
+        }
+    }
+}
+
+const MarkovTextChain::Word& FrozenChain::word(WordId id) const
+{
+    return m_Words[id];
+}
+
+size_t FrozenChain::wordCount() const
+{
+    return m_Words.size();
+}
+
+void FrozenChain::addState(const WordIds& key, const Successors& successors)
+{
+    if (key.size() != m_Order || successors.empty())
+    {
+        throw std::logic_error("FrozenChain::addState error: inadmissible state");
+    }
+    if (m_Successors.size() + successors.size() > std::numeric_limits<uint32_t>::max())
+    {
+        throw std::length_error("FrozenChain::addState error: too many successors");
+    }
+    
+    m_Keys.insert(m_Keys.end(), key.begin(), key.end());
+    
+    uint64_t total = 0;
+    for (const auto& successor : successors)
+    {
+        total += successor.second;
+        if (total > std::numeric_limits<uint32_t>::max())
+        {
+            throw std::length_error("FrozenChain::addState error: too many word occurrences");
+        }
+        m_Successors.push_back(successor.first);
+        m_Cumulative.push_back(total);
+    }
+    m_Offsets.push_back(m_Successors.size());
+}
+
+void FrozenChain::build(MarkovTextChain::FrozenLayout layout)
+{
+    TraceScope scope("FrozenChain::build");
+    const size_t states = m_Offsets.size() - 1;
+    m_Layout = layout;
+    const std::vector<StateId> positions = layout == MarkovTextChain::FrozenLayout::Hash ? buildHashIndex() : buildTrieIndex();
+    
+    // Переложить состояния в порядке их новых позиций.
+    std::vector<uint32_t> offsets(states + 1, 0);
+    for (size_t i = 0; i < states; ++i)
+    {
+        offsets[positions[i] + 1] = m_Offsets[i + 1] - m_Offsets[i];
+    }
+    for (size_t i = 0; i < states; ++i)
+    {
+        offsets[i + 1] += offsets[i];
+    }
+    
+    WordIds successors(m_Successors.size());
+    std::vector<uint32_t> cumulative(m_Cumulative.size());
+    for (size_t i = 0; i < states; ++i)
+    {
+        std::copy(m_Successors.begin() + m_Offsets[i], m_Successors.begin() + m_Offsets[i + 1], successors.begin() + offsets[positions[i]]);
+        std::copy(m_Cumulative.begin() + m_Offsets[i], m_Cumulative.begin() + m_Offsets[i + 1], cumulative.begin() + offsets[positions[i]]);
+    }
+    
+    if (layout == MarkovTextChain::FrozenLayout::Hash)
+    {
+        WordIds keys(m_Keys.size());
+        for (size_t i = 0; i < states; ++i)
+        {
+            std::copy(&m_Keys[i * m_Order], &m_Keys[i * m_Order] + m_Order, &keys[positions[i] * m_Order]);
+        }
+        m_Keys.swap(keys);
+    }
+    else
+    {
+        WordIds().swap(m_Keys);
+    }
+    
+    m_Offsets.swap(offsets);
+    m_Successors.swap(successors);
+    m_Cumulative.swap(cumulative);
+    
+    // Число появлений состояния - последнее накопленное число появлений его слов значения.
+    m_StateCumulative.resize(states);
+    uint64_t total = 0;
+    for (size_t i = 0; i < states; ++i)
+    {
+        total += m_Cumulative[m_Offsets[i + 1] - 1];
+        m_StateCumulative[i] = total;
+    }
+}
+
+FrozenChain::StateId FrozenChain::findState(const MarkovTextChain::Words& words) const
+{
+    if (words.empty() || words.size() > m_Order)
+    {
+        return noState;
+    }
+    
+    // Ключи состояний младших порядков цепи с откатом дополнены в начале отсутствующими словами.
+    WordIds key(m_Order - words.size(), noWord);
+    key.reserve(m_Order);
+    for (const auto& word : words)
+    {
+        const WordId id = wordId(word);
+        if (id == noWord)
+        {
+            return noState;
+        }
+        key.push_back(id);
+    }
+    
+    return findState(key.data());
+}
+
+FrozenChain::StateId FrozenChain::findBackoffState(const MarkovTextChain::Words& words) const
+{
+    // Слова до последнего неизвестного слова в окончание не входят, и ключ дополняется вместо них.
+    WordIds key(m_Order, noWord);
+    size_t position = m_Order;
+    for (auto word = words.rbegin(); word != words.rend() && position > 0; ++word)
+    {
+        const WordId id = wordId(*word);
+        if (id == noWord)
+        {
+            break;
+        }
+        key[--position] = id;
+    }
+    return position == m_Order ? noState : findBackoffState(key.data());
+}
+
+void FrozenChain::countSuccessors(const WordId* keys, const WordId* words, uint32_t* occurrences, uint32_t* totals, size_t count) const
+{
+    uint64_t hashes[maxInterleavedSteps];
+    StateId states[maxInterleavedSteps];
+    for (size_t begin = 0; begin < count; begin += maxInterleavedSteps)
+    {
+        const size_t end = std::min(count, begin + maxInterleavedSteps);
+        
+        // Спуск по дереву окончаний состоит из зависимых обращений, их загрузка заранее не запрашивается.
+        if (m_Layout == MarkovTextChain::FrozenLayout::Trie || stateCount() == 0)
+        {
+            for (size_t i = begin; i < end; ++i)
+            {
+                states[i - begin] = findBackoffState(&keys[i * m_Order]);
+            }
+        }
+        else
+        {
+            // Смещения корзин индекса состояний.
+            for (size_t i = begin; i < end; ++i)
+            {
+                hashes[i - begin] = hashBytes(&keys[i * m_Order], m_Order * sizeof(WordId));
+                m_StateIndex.prefetch(hashes[i - begin]);
+            }
+            
+            // Ключи состояний в найденных позициях и начала их списков слов значений.
+            for (size_t i = begin; i < end; ++i)
+            {
+                states[i - begin] = m_StateIndex.slot(hashes[i - begin]);
+                __builtin_prefetch(&m_Keys[states[i - begin] * m_Order]);
+                __builtin_prefetch(&m_Offsets[states[i - begin]]);
+            }
+            
+            // Ключ, не совпавший с ключом в найденной позиции, ищется заново вместе с его окончаниями.
+            for (size_t i = begin; i < end; ++i)
+            {
+                const WordId* key = &keys[i * m_Order];
+                if (!std::equal(key, key + m_Order, &m_Keys[states[i - begin] * m_Order]))
+                {
+                    states[i - begin] = findBackoffState(key);
+                }
+            }
+        }
+        
+        // Слова значений и их накопленные числа появлений.
+        for (size_t i = begin; i < end; ++i)
+        {
+            if (states[i - begin] != noState)
+            {
+                __builtin_prefetch(&m_Successors[m_Offsets[states[i - begin]]]);
+                __builtin_prefetch(&m_Cumulative[m_Offsets[states[i - begin]]]);
+            }
+        }
+        
+        for (size_t i = begin; i < end; ++i)
+        {
+            occurrences[i] = 0;
+            totals[i] = 0;
+            const StateId state = states[i - begin];
+            if (state == noState)
+            {
+                continue;
+            }
+            
+            const uint32_t first = m_Offsets[state];
+            const uint32_t last = m_Offsets[state + 1];
+            totals[i] = m_Cumulative[last - 1];
+            const auto it = std::find(m_Successors.begin() + first, m_Successors.begin() + last, words[i]);
+            if (it != m_Successors.begin() + last)
+            {
+                const uint32_t successor = it - m_Successors.begin();
+                occurrences[i] = m_Cumulative[successor] - (successor == first ? 0 : m_Cumulative[successor - 1]);
+            }
+        }
+    }
+}
+
+FrozenChain::WordId FrozenChain::generateWord(StateId state, RandomEngine& random) const
+{
+    return m_Successors[sampleSuccessor(state, random)];
+}
+
+void FrozenChain::buildLinks()
+{
+    TraceScope scope("FrozenChain::buildLinks");
+    m_Next.assign(m_Successors.size(), noState);
+    
+    // Следующее состояние - ключ текущего без первого слова, дополненный сгенерированным словом.
+    // Если такого состояния нет, в цепи с откатом берется самое длинное найденное окончание ключа.
+    WordIds nextKey(m_Order);
+    forEachState([this, &nextKey](const WordIds& key, StateId state)
+    {
+        for (uint32_t i = m_Offsets[state]; i < m_Offsets[state + 1]; ++i)
+        {
+            std::copy(key.begin() + 1, key.end(), nextKey.begin());
+            nextKey.back() = m_Successors[i];
+            m_Next[i] = findBackoffState(nextKey.data());
+        }
+    });
+}
+
+bool FrozenChain::hasLinks() const
+{
+    return !m_Next.empty() || m_Successors.empty();
+}
+
+FrozenChain::WordId FrozenChain::step(StateId& state, RandomEngine& random) const
+{
+    const uint32_t successor = sampleSuccessor(state, random);
+    state = m_Next[successor];
+    return m_Successors[successor];
+}
+
+void FrozenChain::step(StateId* states, RandomEngine* randoms, WordId* words, size_t count) const
+{
+    uint32_t successors[maxInterleavedSteps];
+    for (size_t begin = 0; begin < count; begin += maxInterleavedSteps)
+    {
+        const size_t end = std::min(count, begin + maxInterleavedSteps);
+        
+        // Начала списков слов значений.
+        for (size_t i = begin; i < end; ++i)
+        {
+            if (states[i] != noState)
+            {
+                __builtin_prefetch(&m_Offsets[states[i]]);
+            }
+        }
+        
+        // Накопленные числа появлений: последнее задает диапазон случайного числа, первое начинает поиск.
+        for (size_t i = begin; i < end; ++i)
+        {
+            if (states[i] != noState)
+            {
+                __builtin_prefetch(&m_Cumulative[m_Offsets[states[i]]]);
+                __builtin_prefetch(&m_Cumulative[m_Offsets[states[i] + 1] - 1]);
+            }
+        }
+        
+        // Выбранное слово значения и состояние, в которое оно ведет.
+        for (size_t i = begin; i < end; ++i)
+        {
+            if (states[i] != noState)
+            {
+                successors[i - begin] = sampleSuccessor(states[i], randoms[i]);
+                __builtin_prefetch(&m_Next[successors[i - begin]]);
+                __builtin_prefetch(&m_Successors[successors[i - begin]]);
+            }
+        }
+        
+        // Переход в следующее состояние. Слово понадобится вызывающему, поэтому оно тоже загружается заранее.
+        for (size_t i = begin; i < end; ++i)
+        {
+            if (states[i] == noState)
+            {
+                words[i] = noWord;
+                continue;
+            }
+            states[i] = m_Next[successors[i - begin]];
+            words[i] = m_Successors[successors[i - begin]];
+            __builtin_prefetch(&m_Words[words[i]]);
+        }
+    }
+}
+
+FrozenChain::StateId FrozenChain::randomState(RandomEngine& random) const
+{
+    if (m_StateCumulative.empty())
+    {
+        return noState;
+    }
+    
+    const uint64_t position = random.uniform(m_StateCumulative.back());
+    return std::upper_bound(m_StateCumulative.begin(), m_StateCumulative.end(), position) - m_StateCumulative.begin();
+}
+
+size_t FrozenChain::stateCount() const
+{
+    return m_Offsets.size() - 1;
+}
+
+void FrozenChain::forEachState(const std::function<void(const WordIds&, StateId)>& visitor) const
+{
+    WordIds key(m_Order);
+    
+    if (m_Layout == MarkovTextChain::FrozenLayout::Hash)
+    {
+        for (StateId state = 0; state < stateCount(); ++state)
+        {
+            std::copy(&m_Keys[state * m_Order], &m_Keys[state * m_Order] + m_Order, key.begin());
+            visitor(key, state);
+        }
+        return;
+    }
+    
+    // Листья дерева идут в порядке состояний, предки листа сдвигаются только вперед.
+    // Уровни дерева хранят слова ключа с конца.
+    std::vector<uint32_t> nodes(m_Order, 0);
+    for (StateId state = 0; state < stateCount(); ++state)
+    {
+        nodes[m_Order - 1] = state;
+        for (size_t level = m_Order - 1; level-- > 0;)
+        {
+            while (m_TrieChildren[level][nodes[level] + 1] <= nodes[level + 1])
+            {
+                ++nodes[level];
+            }
+        }
+        for (size_t level = 0; level < m_Order; ++level)
+        {
+            key[m_Order - 1 - level] = m_TrieLabels[level][nodes[level]];
+        }
+        visitor(key, state);
+    }
+}
+
+FrozenChain::Successors FrozenChain::successors(StateId state) const
+{
+    Successors result;
+    uint32_t previous = 0;
+    for (uint32_t i = m_Offsets[state]; i < m_Offsets[state + 1]; ++i)
+    {
+        result.emplace_back(m_Successors[i], m_Cumulative[i] - previous);
+        previous = m_Cumulative[i];
+    }
+    return result;
+}
+
+size_t FrozenChain::memoryUsage() const
+{
+    size_t result = sizeof(*this) + m_Words.capacity() * sizeof(MarkovTextChain::Word);
+    for (const auto& word : m_Words)
+    {
+        // Короткие строки хранятся внутри объекта строки.
+        if (word.capacity() > 15)
+        {
+            result += word.capacity() + 1;
+        }
+    }
+    
+    result += m_WordIndex.memoryUsage() + m_StateIndex.memoryUsage();
+    result += (m_Keys.capacity() + m_Successors.capacity()) * sizeof(WordId);
+    result += (m_Offsets.capacity() + m_Cumulative.capacity()) * sizeof(uint32_t);
+    result += m_Next.capacity() * sizeof(StateId);
+    result += m_StateCumulative.capacity() * sizeof(uint64_t);
+    for (const auto& labels : m_TrieLabels)
+    {
+        result += sizeof(labels) + labels.capacity() * sizeof(WordId);
+    }
+    for (const auto& children : m_TrieChildren)
+    {
+        result += sizeof(children) + children.capacity() * sizeof(uint32_t);
+    }
+    return result;
+}
+
+FrozenChain::StateId FrozenChain::findState(const WordId* key) const
+{
+    if (stateCount() == 0)
+    {
+        return noState;
+    }
+    
+    if (m_Layout == MarkovTextChain::FrozenLayout::Trie)
+    {
+        // Спуск по дереву от последнего слова ключа: на каждом уровне двоичный поиск среди дочерних узлов.
+        uint32_t first = 0;
+        uint32_t last = m_TrieLabels[0].size();
+        for (size_t level = 0; level < m_Order; ++level)
+        {
+            const WordIds& labels = m_TrieLabels[level];
+            const WordId word = key[m_Order - 1 - level];
+            const auto it = std::lower_bound(labels.begin() + first, labels.begin() + last, word);
+            if (it == labels.begin() + last || *it != word)
+            {
+                return noState;
+            }
+            
+            const uint32_t node = it - labels.begin();
+            if (level + 1 == m_Order)
+            {
+                return node;
+            }
+            first = m_TrieChildren[level][node];
+            last = m_TrieChildren[level][node + 1];
+        }
+    }
+    
+    const StateId state = m_StateIndex.slot(hashBytes(key, m_Order * sizeof(WordId)));
+    return std::equal(key, key + m_Order, &m_Keys[state * m_Order]) ? state : noState;
+}
+
+FrozenChain::StateId FrozenChain::findBackoffState(const WordId* key) const
+{
+    if (m_Layout == MarkovTextChain::FrozenLayout::Trie && stateCount() != 0)
+    {
+        // Спуск по дереву окончаний проходит состояния всех более коротких окончаний ключа:
+        // окончание длины level + 1 - состояние, если среди дочерних узлов есть узел дополнения noWord.
+        // Запоминается самое длинное из них, а его лист находится уже после спуска.
+        size_t backoffLevel = m_Order;
+        uint32_t backoffNode = 0;
+        uint32_t first = 0;
+        uint32_t last = m_TrieLabels[0].size();
+        for (size_t level = 0; level < m_Order; ++level)
+        {
+            const WordIds& labels = m_TrieLabels[level];
+            const WordId word = key[m_Order - 1 - level];
+            const auto it = std::lower_bound(labels.begin() + first, labels.begin() + last, word);
+            if (it == labels.begin() + last || *it != word)
+            {
+                break;
+            }
+            
+            const uint32_t node = it - labels.begin();
+            if (level + 1 == m_Order)
+            {
+                return node;
+            }
+            first = m_TrieChildren[level][node];
+            last = m_TrieChildren[level][node + 1];
+            if (word != noWord && m_TrieLabels[level + 1][last - 1] == noWord)
+            {
+                backoffLevel = level + 1;
+                backoffNode = last - 1;
+            }
+        }
+        if (backoffLevel == m_Order)
+        {
+            return noState;
+        }
+        
+        // Под узлом noWord лежит только цепочка узлов noWord до листа.
+        for (size_t level = backoffLevel; level + 1 < m_Order; ++level)
+        {
+            backoffNode = m_TrieChildren[level][backoffNode];
+        }
+        return backoffNode;
+    }
+    
+    StateId state = findState(key);
+    if (state != noState || m_Order == 1)
+    {
+        return state;
+    }
+    
+    // Окончания ключа - ключ, первые слова которого заменены отсутствующими.
+    WordIds suffix(key, key + m_Order);
+    for (size_t i = 0; state == noState && i + 1 < m_Order; ++i)
+    {
+        if (suffix[i] != noWord)
+        {
+            suffix[i] = noWord;
+            state = findState(suffix.data());
+        }
+    }
+    return state;
+}
+
+uint32_t FrozenChain::sampleSuccessor(StateId state, RandomEngine& random) const
+{
+    const auto first = m_Cumulative.begin() + m_Offsets[state];
+    const auto last = m_Cumulative.begin() + m_Offsets[state + 1];
+    const uint32_t position = random.uniform(*(last - 1));
+    return std::upper_bound(first, last, position) - m_Cumulative.begin();
+}
+
+std::vector<FrozenChain::StateId> FrozenChain::buildHashIndex()
+{
+    const size_t states = m_Offsets.size() - 1;
+    
+    std::vector<uint64_t> hashes;
+    hashes.reserve(states);
+    for (size_t i = 0; i < states; ++i)
+    {
+        hashes.push_back(hashBytes(&m_Keys[i * m_Order], m_Order * sizeof(WordId)));
+    }
+    m_StateIndex.build(hashes);
+    
+    // Идентификатор состояния совпадает с его позицией в совершенной хэш-функции.
+    std::vector<StateId> positions(states);
+    for (size_t i = 0; i < states; ++i)
+    {
+        positions[i] = m_StateIndex.slot(hashes[i]);
+    }
+    return positions;
+}
+
+std::vector<FrozenChain::StateId> FrozenChain::buildTrieIndex()
+{
+    const size_t states = m_Offsets.size() - 1;
+    
+    // Идентификатор состояния совпадает с номером его ключа в лексикографическом порядке слов с конца ключа.
+    std::vector<StateId> sorted(states);
+    for (size_t i = 0; i < states; ++i)
+    {
+        sorted[i] = i;
+    }
+    std::sort(sorted.begin(), sorted.end(), [this](StateId left, StateId right)
+    {
+        const WordId* leftKey = &m_Keys[left * m_Order];
+        const WordId* rightKey = &m_Keys[right * m_Order];
+        return std::lexicographical_compare(std::reverse_iterator<const WordId*>(leftKey + m_Order), std::reverse_iterator<const WordId*>(leftKey),
+                                            std::reverse_iterator<const WordId*>(rightKey + m_Order), std::reverse_iterator<const WordId*>(rightKey));
+    });
+    
+    m_TrieLabels.assign(m_Order, WordIds());
+    m_TrieChildren.assign(m_Order - 1, std::vector<uint32_t>());
+    
+    std::vector<StateId> positions(states);
+    const WordId* previous = nullptr;
+    for (size_t i = 0; i < states; ++i)
+    {
+        const WordId* key = &m_Keys[sorted[i] * m_Order];
+        positions[sorted[i]] = i;
+        
+        // Новые узлы создаются начиная с первого с конца слова, отличного от предыдущего ключа.
+        size_t level = 0;
+        while (previous != nullptr && level < m_Order && key[m_Order - 1 - level] == previous[m_Order - 1 - level])
+        {
+            ++level;
+        }
+        for (; level < m_Order; ++level)
+        {
+            if (level + 1 < m_Order)
+            {
+                m_TrieChildren[level].push_back(m_TrieLabels[level + 1].size());
+            }
+            m_TrieLabels[level].push_back(key[m_Order - 1 - level]);
+        }
+        previous = key;
+    }
+    
+    for (size_t level = 0; level + 1 < m_Order; ++level)
+    {
+        m_TrieChildren[level].push_back(m_TrieLabels[level + 1].size());
+        m_TrieChildren[level].shrink_to_fit();
+        m_TrieLabels[level].shrink_to_fit();
+    }
+    
+    return positions;
+}
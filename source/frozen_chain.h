@@ -0,0 +1,234 @@
+#pragma once
+
+#ifndef FROZEN_CHAIN_H
+#define FROZEN_CHAIN_H
+
+#include "markov_text_chain.h"
+#include "perfect_hash.h"
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+
+/// @class FrozenChain
+/// @brief Компактное неизменяемое представление текстовой цепи Маркова.
+/// @details Ключи состояний младших порядков цепи с откатом дополнены в начале словом noWord.
+///          Слова пронумерованы минимальной совершенной хэш-функцией. Состояния индексируются
+///          либо такой же функцией (каждое состояние занимает ровно одну позицию, а поиск требует
+///          ограниченного числа обращений к памяти), либо деревом окончаний ключей: слова ключа
+///          идут в нем с последнего, поэтому общие окончания ключей хранятся один раз, состояние
+///          младшего порядка лежит на пути к состояниям, ключи которых им оканчиваются, и один спуск
+///          находит самое длинное известное окончание ключа.
+class FrozenChain
+{
+public:
+    /// @brief Тип идентификатора слова.
+    using WordId = uint32_t;
+    
+    /// @brief Тип идентификатора состояния.
+    using StateId = uint32_t;
+    
+    /// @brief Тип последовательности идентификаторов слов.
+    using WordIds = std::vector<WordId>;
+    
+    /// @brief Тип списка слов значения состояния с числом их появлений.
+    using Successors = std::vector<std::pair<WordId, size_t>>;
+    
+    /// @brief Отсутствующее слово.
+    static const WordId noWord;
+    
+    /// @brief Отсутствующее состояние.
+    static const StateId noState;
+
+public:
+    /// @brief Конструктор.
+    /// @param[in] order - Порядок цепи Маркова.
+    /// @param[in] words - Все различные слова цепи.
+    /// @throws std::exception в случае ошибки.
+    FrozenChain(size_t order, std::vector<MarkovTextChain::Word>&& words);
+    
+    /// @brief Деструктор.
+    ~FrozenChain();
+    
+    /// @brief Получить идентификатор слова.
+    /// @param[in] word - Слово.
+    /// @return Идентификатор слова или noWord, если слова нет в цепи.
+    WordId wordId(const MarkovTextChain::Word& word) const;
+    
+    /// @brief Получить идентификаторы нескольких слов одновременно.
+    /// @details Для всех слов сначала запрашивается предварительная загрузка данных индекса, затем
+    ///          самих слов, поэтому промахи кэша разных слов перекрываются.
+    /// @param[in] words - Слова.
+    /// @param[out] ids - Идентификаторы слов или noWord для слов, которых нет в цепи.
+    /// @param[in] count - Число слов.
+    void wordIds(const MarkovTextChain::Word* words, WordId* ids, size_t count) const;
+    
+    /// @brief Получить слово по идентификатору.
+    /// @param[in] id - Идентификатор слова.
+    /// @return Слово.
+    const MarkovTextChain::Word& word(WordId id) const;
+    
+    /// @brief Получить число различных слов цепи.
+    /// @return Размер словаря.
+    size_t wordCount() const;
+    
+    /// @brief Добавить состояние цепи.
+    /// @param[in] key - Идентификаторы слов ключа состояния.
+    /// @param[in] successors - Слова значения состояния с числом их появлений.
+    /// @throws std::exception в случае ошибки.
+    void addState(const WordIds& key, const Successors& successors);
+    
+    /// @brief Построить индекс состояний после добавления всех состояний.
+    /// @param[in] layout - Способ индексации состояний.
+    /// @throws std::exception в случае ошибки.
+    void build(MarkovTextChain::FrozenLayout layout);
+    
+    /// @brief Найти состояние.
+    /// @param[in] words - Последовательность слов, более короткая последовательность ищется среди
+    ///                    состояний младших порядков цепи с откатом.
+    /// @return Идентификатор состояния или noState, если состояния нет в цепи.
+    StateId findState(const MarkovTextChain::Words& words) const;
+    
+    /// @brief Найти состояние самого длинного окончания последовательности слов, для которого оно есть в цепи.
+    /// @param[in] words - Последовательность слов, неизвестные слова обрывают окончание.
+    /// @return Идентификатор состояния или noState, если ни одного состояния нет в цепи.
+    StateId findBackoffState(const MarkovTextChain::Words& words) const;
+    
+    /// @brief Получить числа появлений слов после нескольких ключей одновременно.
+    /// @details Поиск выполняется поэтапно с предварительной загрузкой данных следующего этапа для всех
+    ///          ключей, как при пакетной генерации. Ключ, которого нет в цепи с откатом, заменяется самым
+    ///          длинным найденным его окончанием.
+    /// @param[in] keys - Идентификаторы слов ключей, по порядку цепи на ключ.
+    /// @param[in] words - Идентификаторы слов, следующих за ключами.
+    /// @param[out] occurrences - Числа появлений слов в значениях состояний, 0 если слова там нет.
+    /// @param[out] totals - Числа появлений состояний, 0 если состояния нет в цепи.
+    /// @param[in] count - Число ключей.
+    void countSuccessors(const WordId* keys, const WordId* words, uint32_t* occurrences, uint32_t* totals, size_t count) const;
+    
+    /// @brief Сгенерировать слово, следующее за состоянием.
+    /// @param[in] state - Идентификатор состояния.
+    /// @param[in] random - Генератор случайных чисел.
+    /// @return Идентификатор слова.
+    WordId generateWord(StateId state, RandomEngine& random) const;
+    
+    /// @brief Построить переходы: для каждого слова значения состояния - состояние, в которое оно ведет.
+    /// @details В цепи с откатом переход ведет в состояние самого длинного найденного окончания
+    ///          ключа, поэтому генерация с откатом не требует поиска состояний.
+    /// @throws std::exception в случае ошибки.
+    void buildLinks();
+    
+    /// @brief Проверить наличие переходов между состояниями.
+    /// @return true если переходы построены, false в противном случае.
+    bool hasLinks() const;
+    
+    /// @brief Сгенерировать слово и перейти в следующее состояние без поиска по ключу.
+    /// @param[in,out] state - Текущее состояние, заменяется следующим или noState, если следующего нет.
+    /// @param[in] random - Генератор случайных чисел.
+    /// @return Идентификатор слова.
+    WordId step(StateId& state, RandomEngine& random) const;
+    
+    /// @brief Сгенерировать по слову для нескольких независимых последовательностей одновременно.
+    /// @details Последовательности продвигаются поэтапно: на каждом этапе для всех последовательностей
+    ///          запрашивается предварительная загрузка данных следующего этапа, поэтому промахи кэша
+    ///          разных последовательностей перекрываются. Результат совпадает с вызовом step() для
+    ///          каждой последовательности.
+    /// @param[in,out] states - Текущие состояния, заменяются следующими, состояния noState пропускаются.
+    /// @param[in] randoms - Генераторы случайных чисел последовательностей.
+    /// @param[out] words - Идентификаторы слов или noWord для пропущенных последовательностей.
+    /// @param[in] count - Число последовательностей.
+    void step(StateId* states, RandomEngine* randoms, WordId* words, size_t count) const;
+    
+    /// @brief Выбрать случайное состояние с вероятностью, пропорциональной числу его появлений.
+    /// @param[in] random - Генератор случайных чисел.
+    /// @return Идентификатор состояния или noState, если в цепи нет состояний.
+    StateId randomState(RandomEngine& random) const;
+    
+    /// @brief Получить число состояний.
+    /// @return Число состояний.
+    size_t stateCount() const;
+    
+    /// @brief Обойти все состояния цепи.
+    /// @param[in] visitor - Обработчик, получает ключ и идентификатор состояния.
+    void forEachState(const std::function<void(const WordIds&, StateId)>& visitor) const;
+    
+    /// @brief Получить слова значения состояния.
+    /// @param[in] state - Идентификатор состояния.
+    /// @return Слова значения состояния с числом их появлений.
+    Successors successors(StateId state) const;
+    
+    /// @brief Получить объем занимаемой памяти.
+    /// @return Объем памяти в байтах.
+    size_t memoryUsage() const;
+
+private:
+    /// @brief Найти состояние.
+    /// @param[in] key - Идентификаторы слов ключа состояния.
+    /// @return Идентификатор состояния или noState, если состояния нет в цепи.
+    StateId findState(const WordId* key) const;
+    
+    /// @brief Найти состояние, а в цепи с откатом при его отсутствии - состояние самого длинного окончания ключа.
+    /// @param[in] key - Идентификаторы слов ключа состояния.
+    /// @return Идентификатор состояния или noState, если ни одного состояния нет в цепи.
+    StateId findBackoffState(const WordId* key) const;
+    
+    /// @brief Выбрать случайное слово значения состояния.
+    /// @param[in] state - Идентификатор состояния.
+    /// @param[in] random - Генератор случайных чисел.
+    /// @return Номер слова в общем списке слов значений состояний.
+    uint32_t sampleSuccessor(StateId state, RandomEngine& random) const;
+    
+    /// @brief Построить индекс состояний на основе совершенной хэш-функции.
+    /// @return Новые позиции добавленных состояний.
+    std::vector<StateId> buildHashIndex();
+    
+    /// @brief Построить дерево окончаний ключей состояний.
+    /// @return Новые позиции добавленных состояний.
+    std::vector<StateId> buildTrieIndex();
+
+private:
+    /// @brief Порядок цепи Маркова.
+    size_t m_Order;
+    
+    /// @brief Слова по их идентификаторам.
+    std::vector<MarkovTextChain::Word> m_Words;
+    
+    /// @brief Индекс слов: хэш слова -> идентификатор слова.
+    PerfectHash m_WordIndex;
+    
+    /// @brief Способ индексации состояний.
+    MarkovTextChain::FrozenLayout m_Layout;
+    
+    /// @brief Индекс состояний: хэш ключа состояния -> идентификатор состояния.
+    PerfectHash m_StateIndex;
+    
+    /// @brief Ключи состояний, по m_Order идентификаторов слов на состояние.
+    /// @details В дереве окончаний ключи не хранятся после построения.
+    WordIds m_Keys;
+    
+    /// @brief Уровни дерева окончаний: отсортированные идентификаторы слов узлов каждого уровня.
+    /// @details Уровень i содержит i-е с конца слово ключа. Узлы последнего уровня соответствуют
+    ///          состояниям. Слово noWord больше любого другого, поэтому узел дополнения ключа
+    ///          младшего порядка - всегда последний среди дочерних узлов.
+    std::vector<WordIds> m_TrieLabels;
+    
+    /// @brief Начала дочерних узлов для всех уровней, кроме последнего, с концевым элементом.
+    std::vector<std::vector<uint32_t>> m_TrieChildren;
+    
+    /// @brief Начала списков слов значений состояний, последний элемент - общий размер списков.
+    std::vector<uint32_t> m_Offsets;
+    
+    /// @brief Слова значений состояний.
+    WordIds m_Successors;
+    
+    /// @brief Накопленное в пределах состояния число появлений слов значений состояний.
+    std::vector<uint32_t> m_Cumulative;
+    
+    /// @brief Состояния, в которые ведут слова значений состояний.
+    std::vector<StateId> m_Next;
+    
+    /// @brief Накопленное по состояниям число появлений состояний для выбора случайного состояния.
+    std::vector<uint64_t> m_StateCumulative;
+};
+
+#endif // FROZEN_CHAIN_H
@@ -0,0 +1,1018 @@
+#include "generation_server.h"
+#include "latency.h"
+#include "parallel.h"
+#include "text_adjuster.h"
+#include "unix_socket.h"
+#include "word_splitter.h"
+
+#include <getopt.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+
+
+namespace
+{
+    /// @brief Число запросов, которые рабочий поток берет за один раз, по умолчанию.
+    const size_t defaultBatchSize = 16;
+    
+    /// @brief Максимальное число новых слов в одном запросе.
+    const size_t maxRequestWords = 100000;
+    
+    /// @brief Размер буфера приема данных.
+    const size_t readBufferSize = 64 * 1024;
+    
+    /// @brief Максимальное число запросов соединения без отправленного ответа, после него прием приостанавливается.
+    const uint64_t maxPendingRequests = 256;
+    
+    /// @brief Максимальный объем неотправленных ответов соединения, после него прием приостанавливается.
+    const size_t maxPendingOutput = 4 * 1024 * 1024;
+    
+    /// @brief Максимальный объем принятых и не разобранных данных соединения: одно полное сообщение.
+    const size_t maxPendingInput = maxMessageSize + messageHeaderSize;
+    
+    /// @brief Максимальное число событий за один вызов epoll_wait.
+    const int maxEvents = 64;
+    
+    /// @brief Идентификаторы источников событий epoll, соединения нумеруются начиная с firstConnection.
+    const uint64_t listenToken = 0;
+    const uint64_t stopToken = 1;
+    const uint64_t responseToken = 2;
+    const uint64_t signalToken = 3;
+    const uint64_t reloadToken = 4;
+    const uint64_t firstConnection = 16;
+    
+    /// @brief Создать событие eventfd.
+    /// @return Дескриптор события.
+    /// @throws std::exception в случае ошибки.
+    int createEvent()
+    {
+        const int descriptor = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (descriptor < 0)
+        {
+            throw std::runtime_error(std::string("GenerationServer error: failed to create event: ") + std::strerror(errno));
+        }
+        return descriptor;
+    }
+    
+    /// @brief Сбросить событие eventfd.
+    /// @param[in] descriptor - Дескриптор события.
+    void clearEvent(int descriptor)
+    {
+        uint64_t value = 0;
+        while (read(descriptor, &value, sizeof(value)) < 0 && errno == EINTR)
+        {
+        }
+    }
+    
+    /// @brief Установить событие eventfd.
+    /// @param[in] descriptor - Дескриптор события.
+    void signalEvent(int descriptor)
+    {
+        const uint64_t value = 1;
+        while (write(descriptor, &value, sizeof(value)) < 0 && errno == EINTR)
+        {
+        }
+    }
+    
+    /// @brief Добавить или изменить наблюдение epoll.
+    /// @param[in] epoll - Дескриптор epoll.
+    /// @param[in] operation - EPOLL_CTL_ADD или EPOLL_CTL_MOD.
+    /// @param[in] descriptor - Наблюдаемый дескриптор.
+    /// @param[in] events - Ожидаемые события.
+    /// @param[in] token - Идентификатор источника событий.
+    /// @throws std::exception в случае ошибки.
+    void watch(int epoll, int operation, int descriptor, uint32_t events, uint64_t token)
+    {
+        epoll_event event;
+        std::memset(&event, 0, sizeof(event));
+        event.events = events;
+        event.data.u64 = token;
+        if (epoll_ctl(epoll, operation, descriptor, &event) != 0)
+        {
+            throw std::runtime_error(std::string("GenerationServer error: failed to watch descriptor: ") + std::strerror(errno));
+        }
+    }
+}
+
+GenerationServer::Connection::Connection(int descriptor)
+    : socket(descriptor)
+    , input()
+    , output()
+    , nextRequest(0)
+    , nextResponse(0)
+    , ready()
+    , inputClosed(false)
+    , events(EPOLLIN)
+{
+}
+
+GenerationServer::GenerationServer()
+    : m_Input()
+    , m_Layout(MarkovTextChain::FrozenLayout::Hash)
+    , m_Live(false)
+    , m_SocketPath()
+    , m_Threads(defaultThreadCount())
+    , m_BatchSize(defaultBatchSize)
+    , m_NeedHelp(false)
+    , m_ProgramName()
+    , m_Chain()
+    , m_ChainMutex()
+    , m_LearnMutex()
+    , m_ChainVersion(0)
+    , m_Loader()
+    , m_Loading(false)
+    , m_StopEvent(createEvent())
+    , m_ReloadEvent(createEvent())
+    , m_ResponseEvent(createEvent())
+    , m_ListenSocket(-1)
+    , m_Epoll(-1)
+    , m_Signals(-1)
+    , m_Connections()
+    , m_NextConnection(firstConnection)
+    , m_Workers()
+    , m_QueueMutex()
+    , m_QueueCondition()
+    , m_Requests()
+    , m_Responses()
+    , m_Stopping(false)
+{
+}
+
+GenerationServer::~GenerationServer()
+{
+    close(m_StopEvent);
+    close(m_ReloadEvent);
+    close(m_ResponseEvent);
+}
+
+void GenerationServer::init(int argc, char** argv)
+{
+    m_ProgramName = argv[0];
+    m_ProgramName = m_ProgramName.substr(m_ProgramName.find_last_of('/') + 1);
+    
+    struct option longOptions[] =
+    {
+       {"input", required_argument, 0, 'i'},
+       {"layout", required_argument, 0, 'l'},
+       {"live", no_argument, 0, 'L'},
+       {"socket", required_argument, 0, 'u'},
+       {"threads", required_argument, 0, 'j'},
+       {"batch", required_argument, 0, 'b'},
+       {"help", no_argument, 0, 'h'},
+       {0, 0, 0, 0 }
+    };
+    
+    int c = 0;
+    opterr = 0;
+    
+    // Анализ ключей и их значений.
+    while ((c = getopt_long(argc, argv, "i:l:Lu:j:b:h", longOptions, nullptr))!= -1)
+    {
+        switch (c)
+        {
+        case 'i':
+            m_Input = optarg;
+            break;
+        
+        case 'l':
+            if (std::string(optarg) == "hash")
+            {
+                m_Layout = MarkovTextChain::FrozenLayout::Hash;
+            }
+            else if (std::string(optarg) == "trie")
+            {
+                m_Layout = MarkovTextChain::FrozenLayout::Trie;
+            }
+            else
+            {
+                std::cerr << "  Unsupported value for 'layout' parameter" << std::endl;
+                m_NeedHelp = true;
+            }
+            break;
+        
+        case 'L':
+            m_Live = true;
+            break;
+        
+        case 'u':
+            m_SocketPath = optarg;
+            break;
+        
+        case 'j':
+            try
+            {
+                const int threads = std::stoi(optarg);
+                if (threads <= 0)
+                {
+                    throw std::exception();
+                }
+                m_Threads = threads;
+            }
+            catch (const std::exception& e)
+            {
+                std::cerr << "  Unsupported value for 'threads' parameter" << std::endl;
+                m_NeedHelp = true;
+            }
+            break;
+        
+        case 'b':
+            try
+            {
+                const int batch = std::stoi(optarg);
+                if (batch <= 0)
+                {
+                    throw std::exception();
+                }
+                m_BatchSize = batch;
+            }
+            catch (const std::exception& e)
+            {
+                std::cerr << "  Unsupported value for 'batch' parameter" << std::endl;
+                m_NeedHelp = true;
+            }
+            break;
+        
+        case 'h':
+            m_NeedHelp = true;
+            break;
+        
+        case '?':
+            if (optopt == 'i')
+            {
+                std::cerr << " Options -i and --input require an argument" << std::endl;
+                m_NeedHelp = true;
+                break;
+            }
+            else if (optopt == 'l')
+            {
+                std::cerr << " Options -l and --layout require an argument" << std::endl;
+                m_NeedHelp = true;
+                break;
+            }
+            else if (optopt == 'u')
+            {
+                std::cerr << " Options -u and --socket require an argument" << std::endl;
+                m_NeedHelp = true;
+                break;
+            }
+            else if (optopt == 'j')
+            {
+                std::cerr << " Options -j and --threads require an argument" << std::endl;
+                m_NeedHelp = true;
+                break;
+            }
+            else if (optopt == 'b')
+            {
+                std::cerr << " Options -b and --batch require an argument" << std::endl;
+                m_NeedHelp = true;
+                break;
+            }
+            else
+            {
+                std::cerr << " Unknown option " << argv[optind-1] << std::endl;
+                m_NeedHelp = true;
+                break;
+            }
+            break;
+        }
+    }
+    
+    // Проверка наличия обязательных параметров.
+    if (m_SocketPath.empty())
+    {
+        std::cerr << "  Socket path is not set" << std::endl;
+        m_NeedHelp = true;
+    }
+    
+    if (m_NeedHelp)
+    {
+        std::cerr << std::endl;
+    }
+}
+
+bool GenerationServer::run()
+{
+    if (m_NeedHelp)
+    {
+        return !printUsage();
+    }
+    
+    std::shared_ptr<MarkovTextChain> chain = std::make_shared<MarkovTextChain>();
+    if (!loadChain(*chain))
+    {
+        return false;
+    }
+    publishChain(std::move(chain));
+    return serve();
+}
+
+void GenerationServer::stop()
+{
+    signalEvent(m_StopEvent);
+}
+
+void GenerationServer::reload()
+{
+    signalEvent(m_ReloadEvent);
+}
+
+bool GenerationServer::printUsage() const
+{
+    std::cout << "Usage: " << m_ProgramName << " [options]" << std::endl;
+    std::cout << "  -i, --input    File to load Markov chain from, std::cin will be used if not provided" << std::endl;
+    std::cout << "  -l, --layout   Index of the loaded chain states: 'hash' (default) or 'trie'" << std::endl;
+    std::cout << "  -L, --live     Keep the chain open for LEARN requests instead of freezing it" << std::endl;
+    std::cout << "  -u, --socket   Path of the Unix domain socket to listen on" << std::endl;
+    std::cout << "  -j, --threads  Number of worker threads, all cores are used by default" << std::endl;
+    std::cout << "  -b, --batch    Maximal number of requests a worker takes at once, " << defaultBatchSize << " by default" << std::endl;
+    std::cout << "  -h, --help     Show this message and exit" << std::endl;
+    std::cout << std::endl;
+    
+    return true;
+}
+
+bool GenerationServer::loadChain(MarkovTextChain& chain) const
+{
+    if (!m_Input.empty())
+    {
+        std::cerr << "Loading Markov chain from '" << m_Input << "' ... ";
+    }
+    
+    std::ifstream fileInput;
+    if (!m_Input.empty())
+    {
+        fileInput.open(m_Input);
+        if (!fileInput.good())
+        {
+            std::cerr << std::endl << "  GenerationServer::loadChain error: failed to open file '" << m_Input << "' for reading" << std::endl;
+            return false;
+        }
+    }
+    
+    try
+    {
+        chain.load(m_Input.empty() ? std::cin : fileInput);
+        if (m_Live)
+        {
+            chain.makeLive();
+        }
+        else
+        {
+            chain.freeze(m_Layout, true);
+        }
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << std::endl << "  GenerationServer::loadChain error:\n    " << e.what() << std::endl;
+        return false;
+    }
+    
+    if (!m_Input.empty())
+    {
+        std::cerr << "DONE" << std::endl;
+    }
+    
+    return true;
+}
+
+void GenerationServer::publishChain(std::shared_ptr<MarkovTextChain> chain)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_ChainMutex);
+        m_Chain = std::move(chain);
+        m_ChainVersion.fetch_add(1, std::memory_order_release);
+    }
+    
+    // Простаивающие рабочие потоки просыпаются, чтобы отпустить старую цепь.
+    {
+        std::lock_guard<std::mutex> lock(m_QueueMutex);
+    }
+    m_QueueCondition.notify_all();
+}
+
+void GenerationServer::startReload()
+{
+    if (m_Input.empty())
+    {
+        std::cerr << "  GenerationServer::startReload error: chain is read from std::cin and cannot be reloaded" << std::endl;
+        return;
+    }
+    if (m_Loading)
+    {
+        std::cerr << "  GenerationServer::startReload error: chain reload is already in progress" << std::endl;
+        return;
+    }
+    if (m_Loader.joinable())
+    {
+        m_Loader.join();
+    }
+    
+    m_Loading = true;
+    m_Loader = std::thread([this]()
+    {
+        try
+        {
+            std::shared_ptr<MarkovTextChain> chain = std::make_shared<MarkovTextChain>();
+            if (loadChain(*chain))
+            {
+                publishChain(std::move(chain));
+            }
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "  GenerationServer::startReload error:\n    " << e.what() << std::endl;
+        }
+        m_Loading = false;
+    });
+}
+
+bool GenerationServer::handleSignals()
+{
+    bool running = true;
+    signalfd_siginfo info;
+    while (read(m_Signals, &info, sizeof(info)) == sizeof(info))
+    {
+        if (info.ssi_signo == SIGHUP)
+        {
+            startReload();
+        }
+        else if (info.ssi_signo == SIGUSR1)
+        {
+            Latency::write(std::cerr);
+        }
+        else
+        {
+            running = false;
+        }
+    }
+    return running;
+}
+
+bool GenerationServer::serve()
+{
+    // Сигналы остановки принимаются через signalfd, рабочие потоки наследуют маску.
+    sigset_t signals;
+    sigset_t previousSignals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGHUP);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signals, &previousSignals);
+    
+    bool success = true;
+    try
+    {
+        m_Signals = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+        m_Epoll = epoll_create1(EPOLL_CLOEXEC);
+        if (m_Signals < 0 || m_Epoll < 0)
+        {
+            throw std::runtime_error(std::string("GenerationServer::serve error: failed to create descriptors: ") + std::strerror(errno));
+        }
+        m_ListenSocket = listenUnixSocket(m_SocketPath);
+        
+        watch(m_Epoll, EPOLL_CTL_ADD, m_ListenSocket, EPOLLIN, listenToken);
+        watch(m_Epoll, EPOLL_CTL_ADD, m_StopEvent, EPOLLIN, stopToken);
+        watch(m_Epoll, EPOLL_CTL_ADD, m_ReloadEvent, EPOLLIN, reloadToken);
+        watch(m_Epoll, EPOLL_CTL_ADD, m_ResponseEvent, EPOLLIN, responseToken);
+        watch(m_Epoll, EPOLL_CTL_ADD, m_Signals, EPOLLIN, signalToken);
+        
+        m_Stopping = false;
+        for (size_t i = 0; i < m_Threads; ++i)
+        {
+            m_Workers.emplace_back(&GenerationServer::workerLoop, this, i);
+        }
+        
+        std::cerr << "Listening on '" << m_SocketPath << "' with " << m_Threads << " worker threads" << std::endl;
+        eventLoop();
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "  GenerationServer::serve error:\n    " << e.what() << std::endl;
+        success = false;
+    }
+    
+    stopWorkers();
+    if (m_Loader.joinable())
+    {
+        m_Loader.join();
+    }
+    while (!m_Connections.empty())
+    {
+        closeConnection(m_Connections.begin()->first);
+    }
+    
+    if (m_ListenSocket >= 0)
+    {
+        close(m_ListenSocket);
+        unlink(m_SocketPath.c_str());
+        m_ListenSocket = -1;
+    }
+    if (m_Epoll >= 0)
+    {
+        close(m_Epoll);
+        m_Epoll = -1;
+    }
+    if (m_Signals >= 0)
+    {
+        close(m_Signals);
+        m_Signals = -1;
+    }
+    pthread_sigmask(SIG_SETMASK, &previousSignals, nullptr);
+    
+    if (success)
+    {
+        Latency::write(std::cerr);
+        std::cerr << "Server stopped" << std::endl;
+    }
+    return success;
+}
+
+void GenerationServer::eventLoop()
+{
+    epoll_event events[maxEvents];
+    std::vector<Request> requests;
+    bool running = true;
+    
+    while (running)
+    {
+        const int count = epoll_wait(m_Epoll, events, maxEvents, -1);
+        if (count < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (count < 0)
+        {
+            throw std::runtime_error(std::string("GenerationServer::eventLoop error: epoll_wait failed: ") + std::strerror(errno));
+        }
+        
+        for (int i = 0; i < count; ++i)
+        {
+            const uint64_t token = events[i].data.u64;
+            if (token == listenToken)
+            {
+                acceptConnections();
+            }
+            else if (token == stopToken)
+            {
+                running = false;
+            }
+            else if (token == signalToken)
+            {
+                running = handleSignals() && running;
+            }
+            else if (token == reloadToken)
+            {
+                clearEvent(m_ReloadEvent);
+                startReload();
+            }
+            else if (token == responseToken)
+            {
+                clearEvent(m_ResponseEvent);
+                collectResponses(requests);
+            }
+            else if (events[i].events & (EPOLLHUP | EPOLLERR))
+            {
+                // Клиент закрыл соединение полностью, ответы доставить уже нельзя.
+                closeConnection(token);
+            }
+            else
+            {
+                if (events[i].events & EPOLLOUT)
+                {
+                    writeConnection(token);
+                }
+                if (events[i].events & EPOLLIN)
+                {
+                    readConnection(token, requests);
+                }
+            }
+        }
+        
+        // Все запросы, разобранные за один проход, ставятся в очередь одним пакетом.
+        if (!requests.empty())
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_QueueMutex);
+                for (auto& request : requests)
+                {
+                    m_Requests.push_back(std::move(request));
+                }
+            }
+            if (requests.size() > 1)
+            {
+                m_QueueCondition.notify_all();
+            }
+            else
+            {
+                m_QueueCondition.notify_one();
+            }
+            requests.clear();
+        }
+    }
+}
+
+void GenerationServer::acceptConnections()
+{
+    while (true)
+    {
+        const int descriptor = accept4(m_ListenSocket, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (descriptor < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNABORTED)
+            {
+                return;
+            }
+            throw std::runtime_error(std::string("GenerationServer::acceptConnections error: ") + std::strerror(errno));
+        }
+        
+        const uint64_t id = m_NextConnection++;
+        m_Connections.emplace(id, Connection(descriptor));
+        watch(m_Epoll, EPOLL_CTL_ADD, descriptor, EPOLLIN, id);
+    }
+}
+
+void GenerationServer::readConnection(uint64_t id, std::vector<Request>& requests)
+{
+    auto found = m_Connections.find(id);
+    if (found == m_Connections.end())
+    {
+        return;
+    }
+    Connection& connection = found->second;
+    
+    // Принимается не больше одного полного сообщения сверх разобранного, остальное ждет в сокете.
+    char buffer[readBufferSize];
+    bool failed = false;
+    while (connection.input.size() < maxPendingInput)
+    {
+        const ssize_t result = recv(connection.socket, buffer, std::min(sizeof(buffer), maxPendingInput - connection.input.size()), 0);
+        if (result > 0)
+        {
+            connection.input.append(buffer, result);
+            continue;
+        }
+        if (result == 0)
+        {
+            // Клиент закончил запросы, но ждет ответы на уже отправленные.
+            connection.inputClosed = true;
+            break;
+        }
+        if (errno == EINTR)
+        {
+            continue;
+        }
+        failed = errno != EAGAIN && errno != EWOULDBLOCK;
+        break;
+    }
+    
+    if (failed || !parseRequests(id, connection, requests))
+    {
+        closeConnection(id);
+        return;
+    }
+    updateConnection(id);
+}
+
+bool GenerationServer::parseRequests(uint64_t id, Connection& connection, std::vector<Request>& requests)
+{
+    // Запросы сверх maxPendingRequests без ответа остаются в буфере до отправки ответов.
+    size_t offset = 0;
+    std::string payload;
+    bool valid = true;
+    try
+    {
+        while (connection.nextRequest - connection.nextResponse < maxPendingRequests && decodeMessage(connection.input, offset, payload))
+        {
+            requests.push_back(Request{id, connection.nextRequest++, std::move(payload), std::chrono::steady_clock::now()});
+        }
+    }
+    catch (const std::exception& e)
+    {
+        // Поток сообщений поврежден, дальнейший разбор соединения невозможен.
+        std::cerr << "  GenerationServer::parseRequests error: " << e.what() << std::endl;
+        valid = false;
+    }
+    connection.input.erase(0, offset);
+    return valid;
+}
+
+void GenerationServer::writeConnection(uint64_t id)
+{
+    auto found = m_Connections.find(id);
+    if (found == m_Connections.end())
+    {
+        return;
+    }
+    Connection& connection = found->second;
+    
+    size_t sent = 0;
+    while (sent < connection.output.size())
+    {
+        const ssize_t result = send(connection.socket, connection.output.data() + sent, connection.output.size() - sent, MSG_NOSIGNAL);
+        if (result > 0)
+        {
+            sent += result;
+            continue;
+        }
+        if (result < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            break;
+        }
+        closeConnection(id);
+        return;
+    }
+    connection.output.erase(0, sent);
+    updateConnection(id);
+}
+
+void GenerationServer::updateConnection(uint64_t id)
+{
+    auto found = m_Connections.find(id);
+    if (found == m_Connections.end())
+    {
+        return;
+    }
+    Connection& connection = found->second;
+    
+    // Закрытое клиентом на запись соединение закрывается после отправки ответов на все его запросы.
+    if (connection.inputClosed && connection.nextResponse == connection.nextRequest && connection.output.empty())
+    {
+        closeConnection(id);
+        return;
+    }
+    
+    // Прием приостанавливается, пока клиент не заберет ответы, а готовность к записи ожидается,
+    // только пока в буфере остаются данные.
+    uint32_t events = 0;
+    if (!connection.inputClosed && connection.nextRequest - connection.nextResponse < maxPendingRequests &&
+        connection.output.size() < maxPendingOutput && connection.input.size() < maxPendingInput)
+    {
+        events |= EPOLLIN;
+    }
+    if (!connection.output.empty())
+    {
+        events |= EPOLLOUT;
+    }
+    if (events != connection.events)
+    {
+        watch(m_Epoll, EPOLL_CTL_MOD, connection.socket, events, id);
+        connection.events = events;
+    }
+}
+
+void GenerationServer::closeConnection(uint64_t id)
+{
+    auto found = m_Connections.find(id);
+    if (found == m_Connections.end())
+    {
+        return;
+    }
+    
+    // Закрытие дескриптора удаляет его из epoll, ответы на оставшиеся запросы отбрасываются.
+    close(found->second.socket);
+    m_Connections.erase(found);
+}
+
+void GenerationServer::collectResponses(std::vector<Request>& requests)
+{
+    std::vector<Request> responses;
+    {
+        std::lock_guard<std::mutex> lock(m_QueueMutex);
+        responses.swap(m_Responses);
+    }
+    
+    std::vector<uint64_t> updated;
+    for (auto& response : responses)
+    {
+        auto found = m_Connections.find(response.connection);
+        if (found == m_Connections.end())
+        {
+            continue;
+        }
+        
+        Connection& connection = found->second;
+        connection.ready.emplace(response.sequence, std::move(response.payload));
+        for (auto next = connection.ready.begin(); next != connection.ready.end() && next->first == connection.nextResponse; next = connection.ready.erase(next))
+        {
+            connection.output += encodeMessage(next->second);
+            ++connection.nextResponse;
+        }
+        updated.push_back(response.connection);
+    }
+    
+    // Ответы освобождают место для запросов, отложенных в буфере соединения.
+    std::sort(updated.begin(), updated.end());
+    updated.erase(std::unique(updated.begin(), updated.end()), updated.end());
+    for (const auto id : updated)
+    {
+        auto found = m_Connections.find(id);
+        if (!parseRequests(id, found->second, requests))
+        {
+            closeConnection(id);
+            continue;
+        }
+        writeConnection(id);
+    }
+}
+
+void GenerationServer::workerLoop(size_t worker)
+{
+    RandomEngine random(RandomEngine::randomSeed(), worker);
+    std::vector<Request> batch;
+    std::shared_ptr<MarkovTextChain> chain;
+    uint64_t version = 0;
+    
+    while (true)
+    {
+        batch.clear();
+        {
+            std::unique_lock<std::mutex> lock(m_QueueMutex);
+            m_QueueCondition.wait(lock, [&]()
+            {
+                return m_Stopping || !m_Requests.empty() || m_ChainVersion.load(std::memory_order_acquire) != version;
+            });
+            if (m_Stopping)
+            {
+                return;
+            }
+            
+            while (!m_Requests.empty() && batch.size() < m_BatchSize)
+            {
+                batch.push_back(std::move(m_Requests.front()));
+                m_Requests.pop_front();
+            }
+        }
+        
+        // Цепь меняется только между пакетами: начатые запросы завершаются на старой цепи,
+        // а ее память освобождается вместе с последней ссылкой на нее.
+        if (m_ChainVersion.load(std::memory_order_acquire) != version)
+        {
+            std::lock_guard<std::mutex> lock(m_ChainMutex);
+            chain = m_Chain;
+            version = m_ChainVersion.load(std::memory_order_relaxed);
+        }
+        if (batch.empty())
+        {
+            continue;
+        }
+        
+        // Задержка запроса включает ожидание в очереди, как ее видит клиент без учета отправки ответа.
+        for (auto& request : batch)
+        {
+            request.payload = processRequest(*chain, request.payload, random);
+            const auto elapsed = std::chrono::steady_clock::now() - request.arrival;
+            Latency::histogram(Latency::Operation::Request).record(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+        }
+        
+        // Ответы пакета передаются циклу событий вместе, с одним пробуждением.
+        {
+            std::lock_guard<std::mutex> lock(m_QueueMutex);
+            for (auto& response : batch)
+            {
+                m_Responses.push_back(std::move(response));
+            }
+        }
+        signalEvent(m_ResponseEvent);
+    }
+}
+
+std::string GenerationServer::processRequest(MarkovTextChain& chain, const std::string& payload, RandomEngine& random)
+{
+    // Формат запроса: "<число слов> <зерно или -> <начальные слова>" или "LEARN <текст>".
+    std::istringstream stream(payload);
+    std::string countValue;
+    std::string seedValue;
+    if (!(stream >> countValue))
+    {
+        return "ERROR malformed request";
+    }
+    if (countValue == "LEARN")
+    {
+        std::string text;
+        std::getline(stream, text, '\0');
+        return learnText(chain, text);
+    }
+    if (!(stream >> seedValue))
+    {
+        return "ERROR malformed request";
+    }
+    
+    size_t count = 0;
+    uint64_t seed = 0;
+    try
+    {
+        size_t position = 0;
+        count = std::stoul(countValue, &position);
+        if (countValue[position] != '\0' || count == 0 || count > maxRequestWords)
+        {
+            throw std::exception();
+        }
+    }
+    catch (const std::exception& e)
+    {
+        return "ERROR unsupported number of words";
+    }
+    
+    const bool seeded = seedValue != "-";
+    try
+    {
+        size_t position = 0;
+        seed = seeded ? std::stoull(seedValue, &position) : 0;
+        if (seeded && seedValue[position] != '\0')
+        {
+            throw std::exception();
+        }
+    }
+    catch (const std::exception& e)
+    {
+        return "ERROR unsupported seed";
+    }
+    
+    std::string phrase;
+    std::getline(stream, phrase);
+    
+    try
+    {
+        std::string text;
+        RandomEngine seededRandom(seed);
+        if (!chain.continuePhrase(phrase, count, seeded ? seededRandom : random, text))
+        {
+            return "ERROR initial words are not found in the chain";
+        }
+        return "OK " + text;
+    }
+    catch (const std::exception& e)
+    {
+        return std::string("ERROR ") + e.what();
+    }
+}
+
+std::string GenerationServer::learnText(MarkovTextChain& chain, const std::string& text)
+{
+    if (!chain.live())
+    {
+        return "ERROR chain is not live";
+    }
+    
+    std::lock_guard<std::mutex> lock(m_LearnMutex);
+    size_t words = 0;
+    try
+    {
+        TextAdjuster adjuster;
+        adjuster.setHandler([&chain, &words](std::string&& word)
+        {
+            chain.addWord(std::move(word));
+            ++words;
+        });
+        
+        WordSplitter splitter;
+        splitter.setHandler(std::bind(&TextAdjuster::adjust, std::ref(adjuster), std::placeholders::_1));
+        splitter.addText(text.data(), text.size());
+        splitter.flush();
+        chain.flush();
+    }
+    catch (const std::exception& e)
+    {
+        chain.flush();
+        return std::string("ERROR ") + e.what();
+    }
+    
+    return "OK " + std::to_string(words);
+}
+
+void GenerationServer::stopWorkers()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_QueueMutex);
+        m_Stopping = true;
+        m_Requests.clear();
+    }
+    m_QueueCondition.notify_all();
+    
+    for (auto& worker : m_Workers)
+    {
+        worker.join();
+    }
+    m_Workers.clear();
+    
+    clearEvent(m_StopEvent);
+    clearEvent(m_ResponseEvent);
+    m_Responses.clear();
+}
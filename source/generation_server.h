@@ -0,0 +1,273 @@
+#pragma once
+
+#ifndef GENERATION_SERVER_H
+#define GENERATION_SERVER_H
+
+#include "markov_text_chain.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+
+/// @class GenerationServer
+/// @brief Загружает цепь Маркова один раз и обслуживает запросы генерации через сокет домена Unix.
+/// @details Цикл событий на epoll принимает соединения и разбирает сообщения, а пул рабочих потоков
+///          генерирует тексты пакетами. Ответы на запросы одного соединения отправляются в порядке
+///          поступления запросов. Цепь можно перезагрузить без остановки: новая цепь загружается
+///          в фоновом потоке и публикуется атомарно, рабочие потоки переходят на нее между пакетами,
+///          а старая цепь освобождается, когда ее отпускает последний использующий ее поток.
+///          Пополняемую цепь запросы LEARN дополняют новым текстом без остановки генерации.
+class GenerationServer
+{
+public:
+    /// @brief Конструктор.
+    /// @throws std::exception в случае ошибки.
+    GenerationServer();
+    
+    /// @brief Деструктор.
+    ~GenerationServer();
+    
+    /// @brief Проанализировать аргументы командной строки.
+    /// @param[in] argc - Число аргументов.
+    /// @param[in] argv - Список аргументов.
+    void init(int argc, char** argv);
+    
+    /// @brief Выполнить заданное командной строкой действие.
+    /// @details Обслуживание запросов продолжается до сигнала SIGINT или SIGTERM либо вызова stop().
+    ///          Сигнал SIGHUP перезагружает цепь из того же файла, сигнал SIGUSR1 выводит задержки.
+    /// @return true если действие выполнено успешно, false в противном случае.
+    bool run();
+    
+    /// @brief Остановить обслуживание запросов, может вызываться из любого потока.
+    void stop();
+    
+    /// @brief Перезагрузить цепь из того же файла в фоновом потоке, может вызываться из любого потока.
+    void reload();
+
+private:
+    /// @brief Запрос генерации.
+    struct Request
+    {
+        /// @brief Идентификатор соединения.
+        uint64_t connection;
+        
+        /// @brief Номер запроса в соединении.
+        uint64_t sequence;
+        
+        /// @brief Содержимое запроса или ответа.
+        std::string payload;
+        
+        /// @brief Время приема запроса.
+        std::chrono::steady_clock::time_point arrival;
+    };
+    
+    /// @brief Соединение с клиентом.
+    struct Connection
+    {
+        /// @brief Конструктор.
+        /// @param[in] descriptor - Дескриптор сокета соединения.
+        explicit Connection(int descriptor);
+        
+        /// @brief Дескриптор сокета соединения.
+        int socket;
+        
+        /// @brief Принятые, но еще не разобранные данные.
+        std::string input;
+        
+        /// @brief Закодированные ответы, ожидающие отправки.
+        std::string output;
+        
+        /// @brief Номер следующего запроса.
+        uint64_t nextRequest;
+        
+        /// @brief Номер следующего отправляемого ответа.
+        uint64_t nextResponse;
+        
+        /// @brief Готовые ответы, опередившие предыдущие ответы того же соединения.
+        std::map<uint64_t, std::string> ready;
+        
+        /// @brief Признак закрытия соединения клиентом на запись: новых запросов не будет.
+        bool inputClosed;
+        
+        /// @brief Наблюдаемые события epoll.
+        uint32_t events;
+    };
+    
+    /// @brief Показать справку.
+    /// @return true если действие выполнено успешно, false в противном случае.
+    bool printUsage() const;
+    
+    /// @brief Загрузить и заморозить цепь Маркова.
+    /// @param[out] chain - Цепь Маркова.
+    /// @return true если действие выполнено успешно, false в противном случае.
+    bool loadChain(MarkovTextChain& chain) const;
+    
+    /// @brief Сделать цепь текущей для новых пакетов запросов.
+    /// @param[in] chain - Загруженная и замороженная цепь.
+    void publishChain(std::shared_ptr<MarkovTextChain> chain);
+    
+    /// @brief Начать фоновую перезагрузку цепи, если она еще не выполняется.
+    void startReload();
+    
+    /// @brief Обработать принятые сигналы.
+    /// @return false если получен сигнал остановки, true в противном случае.
+    bool handleSignals();
+    
+    /// @brief Открыть сокет, запустить рабочие потоки и обслуживать запросы до остановки.
+    /// @return true если действие выполнено успешно, false в противном случае.
+    bool serve();
+    
+    /// @brief Цикл событий.
+    /// @throws std::exception в случае ошибки.
+    void eventLoop();
+    
+    /// @brief Принять ожидающие соединения.
+    /// @throws std::exception в случае ошибки.
+    void acceptConnections();
+    
+    /// @brief Принять данные соединения и разобрать полные запросы.
+    /// @param[in] id - Идентификатор соединения.
+    /// @param[out] requests - Разобранные запросы.
+    void readConnection(uint64_t id, std::vector<Request>& requests);
+    
+    /// @brief Разобрать полные запросы из принятых данных соединения, пока их число без ответа не достигнет предела.
+    /// @param[in] id - Идентификатор соединения.
+    /// @param[in] connection - Соединение.
+    /// @param[out] requests - Разобранные запросы.
+    /// @return true если данные разобраны, false если поток сообщений поврежден.
+    bool parseRequests(uint64_t id, Connection& connection, std::vector<Request>& requests);
+    
+    /// @brief Отправить накопленные ответы соединения.
+    /// @param[in] id - Идентификатор соединения.
+    void writeConnection(uint64_t id);
+    
+    /// @brief Обновить наблюдаемые события соединения или закрыть его, если все ответы отправлены после закрытия клиентом на запись.
+    /// @param[in] id - Идентификатор соединения.
+    void updateConnection(uint64_t id);
+    
+    /// @brief Закрыть соединение.
+    /// @param[in] id - Идентификатор соединения.
+    void closeConnection(uint64_t id);
+    
+    /// @brief Забрать готовые ответы рабочих потоков и поставить их в очередь отправки.
+    /// @param[out] requests - Запросы, разобранные из буферов соединений после освобождения места.
+    void collectResponses(std::vector<Request>& requests);
+    
+    /// @brief Рабочий поток: берет запросы пакетами и генерирует ответы.
+    /// @param[in] worker - Номер рабочего потока.
+    void workerLoop(size_t worker);
+    
+    /// @brief Обработать запрос генерации или пополнения цепи.
+    /// @param[in] chain - Цепь Маркова.
+    /// @param[in] payload - Содержимое запроса.
+    /// @param[in] random - Генератор случайных чисел рабочего потока.
+    /// @return Содержимое ответа.
+    std::string processRequest(MarkovTextChain& chain, const std::string& payload, RandomEngine& random);
+    
+    /// @brief Пополнить пополняемую цепь текстом.
+    /// @details Пополнения выполняются по одному, генерация в других потоках при этом продолжается.
+    /// @param[in] chain - Цепь Маркова.
+    /// @param[in] text - Текст.
+    /// @return Содержимое ответа.
+    std::string learnText(MarkovTextChain& chain, const std::string& text);
+    
+    /// @brief Остановить рабочие потоки и дождаться их завершения.
+    void stopWorkers();
+
+private:
+    /// @brief Имя файла с цепью Маркова.
+    std::string m_Input;
+    
+    /// @brief Способ индексации состояний загруженной цепи.
+    MarkovTextChain::FrozenLayout m_Layout;
+    
+    /// @brief Признак пополняемой цепи, принимающей запросы LEARN.
+    bool m_Live;
+    
+    /// @brief Путь к сокету.
+    std::string m_SocketPath;
+    
+    /// @brief Число рабочих потоков.
+    size_t m_Threads;
+    
+    /// @brief Максимальное число запросов, которые рабочий поток берет за один раз.
+    size_t m_BatchSize;
+    
+    /// @brief Признак необходимости показать справку.
+    bool m_NeedHelp;
+    
+    /// @brief Имя программы.
+    std::string m_ProgramName;
+    
+    /// @brief Текущая цепь Маркова только для чтения, общая для всех рабочих потоков.
+    std::shared_ptr<MarkovTextChain> m_Chain;
+    
+    /// @brief Мьютекс публикации цепи, рабочие потоки захватывают его только при смене версии.
+    std::mutex m_ChainMutex;
+    
+    /// @brief Мьютекс, обеспечивающий единственный пишущий поток пополняемой цепи.
+    std::mutex m_LearnMutex;
+    
+    /// @brief Версия текущей цепи, увеличивается при каждой публикации.
+    std::atomic<uint64_t> m_ChainVersion;
+    
+    /// @brief Поток фоновой загрузки цепи.
+    std::thread m_Loader;
+    
+    /// @brief Признак выполняющейся фоновой загрузки.
+    std::atomic<bool> m_Loading;
+    
+    /// @brief Событие остановки.
+    int m_StopEvent;
+    
+    /// @brief Событие запроса перезагрузки цепи.
+    int m_ReloadEvent;
+    
+    /// @brief Событие готовности ответов рабочих потоков.
+    int m_ResponseEvent;
+    
+    /// @brief Слушающий сокет.
+    int m_ListenSocket;
+    
+    /// @brief Дескриптор epoll.
+    int m_Epoll;
+    
+    /// @brief Дескриптор для приема сигналов остановки и перезагрузки.
+    int m_Signals;
+    
+    /// @brief Открытые соединения по идентификаторам.
+    std::unordered_map<uint64_t, Connection> m_Connections;
+    
+    /// @brief Идентификатор следующего соединения.
+    uint64_t m_NextConnection;
+    
+    /// @brief Рабочие потоки.
+    std::vector<std::thread> m_Workers;
+    
+    /// @brief Мьютекс очередей запросов и ответов.
+    std::mutex m_QueueMutex;
+    
+    /// @brief Условная переменная появления запросов или остановки.
+    std::condition_variable m_QueueCondition;
+    
+    /// @brief Очередь запросов.
+    std::deque<Request> m_Requests;
+    
+    /// @brief Готовые ответы.
+    std::vector<Request> m_Responses;
+    
+    /// @brief Признак остановки рабочих потоков.
+    bool m_Stopping;
+};
+
+#endif // GENERATION_SERVER_H
@@ -0,0 +1,162 @@
+#include "latency.h"
+
+#include <pthread.h>
+
+#include <iomanip>
+#include <sstream>
+
+
+namespace
+{
+    /// @brief Число замеряемых операций.
+    const size_t operationCount = 5;
+    
+    /// @brief Имена операций при выводе.
+    const char* const operationNames[operationCount] = { "generate_word", "generate_text", "request", "load", "save" };
+    
+    /// @brief Гистограммы операций.
+    LatencyHistogram histograms[operationCount];
+    
+    /// @brief Вывести задержку в микросекундах.
+    /// @param[in] output - Поток вывода.
+    /// @param[in] nanoseconds - Задержка в наносекундах.
+    void writeMicroseconds(std::ostream& output, uint64_t nanoseconds)
+    {
+        output << nanoseconds / 1000 << '.' << std::setw(3) << std::setfill('0') << nanoseconds % 1000 << "us";
+    }
+}
+
+
+LatencyHistogram::LatencyHistogram()
+    : m_Counts()
+    , m_Total(0)
+    , m_Max(0)
+{
+    for (auto& count : m_Counts)
+    {
+        count.store(0, std::memory_order_relaxed);
+    }
+}
+
+void LatencyHistogram::record(uint64_t nanoseconds, uint64_t count)
+{
+    m_Counts[bucketIndex(nanoseconds)].fetch_add(count, std::memory_order_relaxed);
+    m_Total.fetch_add(count, std::memory_order_relaxed);
+    
+    // Максимум обновляется редко, обычно хватает одного чтения.
+    uint64_t max = m_Max.load(std::memory_order_relaxed);
+    while (nanoseconds > max && !m_Max.compare_exchange_weak(max, nanoseconds, std::memory_order_relaxed))
+    {
+    }
+}
+
+uint64_t LatencyHistogram::count() const
+{
+    return m_Total.load(std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::percentile(double percentile) const
+{
+    // Счетчики читаются без остановки записи, поэтому сумма по корзинам может немного отличаться от общего числа.
+    const uint64_t total = count();
+    const uint64_t max = m_Max.load(std::memory_order_relaxed);
+    const double rank = percentile / 100.0 * total;
+    const uint64_t target = rank < 1.0 ? 1 : static_cast<uint64_t>(rank + 0.999999);
+    
+    uint64_t seen = 0;
+    for (size_t index = 0; index < bucketCount; ++index)
+    {
+        seen += m_Counts[index].load(std::memory_order_relaxed);
+        if (seen >= target)
+        {
+            const uint64_t limit = bucketLimit(index);
+            return limit < max ? limit : max;
+        }
+    }
+    return max;
+}
+
+uint64_t LatencyHistogram::max() const
+{
+    return m_Max.load(std::memory_order_relaxed);
+}
+
+size_t LatencyHistogram::bucketIndex(uint64_t value)
+{
+    // Значения меньше 2 * subBuckets хранятся точно, большие - с шагом, растущим вдвое с каждой степенью двойки.
+    if (value < 2 * subBuckets)
+    {
+        return static_cast<size_t>(value);
+    }
+    const size_t shift = 63 - __builtin_clzll(value) - subBucketBits;
+    return shift * subBuckets + static_cast<size_t>(value >> shift);
+}
+
+uint64_t LatencyHistogram::bucketLimit(size_t index)
+{
+    if (index < 2 * subBuckets)
+    {
+        return index;
+    }
+    const size_t shift = index / subBuckets - 1;
+    const uint64_t subBucket = index % subBuckets + subBuckets;
+    return ((subBucket + 1) << shift) - 1;
+}
+
+LatencyHistogram& Latency::histogram(Operation operation)
+{
+    return histograms[static_cast<size_t>(operation)];
+}
+
+void Latency::write(std::ostream& output)
+{
+    std::ostringstream text;
+    for (size_t operation = 0; operation < operationCount; ++operation)
+    {
+        const LatencyHistogram& current = histograms[operation];
+        if (current.count() == 0)
+        {
+            continue;
+        }
+        
+        text << "latency " << operationNames[operation] << ": count " << current.count() << ", p50 ";
+        writeMicroseconds(text, current.percentile(50.0));
+        text << ", p99 ";
+        writeMicroseconds(text, current.percentile(99.0));
+        text << ", p99.9 ";
+        writeMicroseconds(text, current.percentile(99.9));
+        text << ", max ";
+        writeMicroseconds(text, current.max());
+        text << std::endl;
+    }
+    output << text.str() << std::flush;
+}
+
+LatencyReporter::LatencyReporter(std::ostream& output)
+    : m_Output(output)
+    , m_PreviousSignals()
+    , m_Stopping(false)
+    , m_Thread()
+{
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signals, &m_PreviousSignals);
+    
+    m_Thread = std::thread([this, signals]()
+    {
+        int signal = 0;
+        while (sigwait(&signals, &signal) == 0 && !m_Stopping.load(std::memory_order_acquire))
+        {
+            Latency::write(m_Output);
+        }
+    });
+}
+
+LatencyReporter::~LatencyReporter()
+{
+    m_Stopping.store(true, std::memory_order_release);
+    pthread_kill(m_Thread.native_handle(), SIGUSR1);
+    m_Thread.join();
+    pthread_sigmask(SIG_SETMASK, &m_PreviousSignals, nullptr);
+}
@@ -0,0 +1,181 @@
+#pragma once
+
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <signal.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <thread>
+
+
+/// @class LatencyHistogram
+/// @brief Гистограмма задержек с логарифмическими корзинами, как в HdrHistogram.
+/// @details Каждая степень двойки делится на 32 корзины, поэтому погрешность перцентилей не больше 3%.
+///          Запись - одно атомарное сложение без блокировок, писать можно из любого числа потоков.
+class LatencyHistogram
+{
+public:
+    /// @brief Конструктор.
+    LatencyHistogram();
+    
+    /// @brief Учесть задержку.
+    /// @param[in] nanoseconds - Задержка в наносекундах.
+    /// @param[in] count - Число одинаковых задержек.
+    void record(uint64_t nanoseconds, uint64_t count = 1);
+    
+    /// @brief Получить число учтенных задержек.
+    /// @return Число задержек.
+    uint64_t count() const;
+    
+    /// @brief Получить перцентиль задержки.
+    /// @param[in] percentile - Перцентиль от 0 до 100.
+    /// @return Верхняя граница корзины перцентиля в наносекундах, не больше максимальной задержки.
+    uint64_t percentile(double percentile) const;
+    
+    /// @brief Получить максимальную задержку.
+    /// @return Задержка в наносекундах.
+    uint64_t max() const;
+
+private:
+    /// @brief Число бит номера корзины внутри степени двойки.
+    static const size_t subBucketBits = 5;
+    
+    /// @brief Число корзин внутри степени двойки.
+    static const size_t subBuckets = 1 << subBucketBits;
+    
+    /// @brief Число корзин, покрывающих все 64-битные значения.
+    static const size_t bucketCount = (64 - subBucketBits + 1) * subBuckets;
+    
+    /// @brief Получить номер корзины значения.
+    /// @param[in] value - Значение.
+    /// @return Номер корзины.
+    static size_t bucketIndex(uint64_t value);
+    
+    /// @brief Получить наибольшее значение корзины.
+    /// @param[in] index - Номер корзины.
+    /// @return Значение.
+    static uint64_t bucketLimit(size_t index);
+
+private:
+    /// @brief Число задержек в корзинах.
+    std::atomic<uint64_t> m_Counts[bucketCount];
+    
+    /// @brief Общее число задержек.
+    std::atomic<uint64_t> m_Total;
+    
+    /// @brief Максимальная задержка.
+    std::atomic<uint64_t> m_Max;
+};
+
+
+/// @class Latency
+/// @brief Гистограммы задержек операций процесса.
+/// @details Гистограммы записываются всегда: замер стоит двух чтений часов и одного атомарного сложения.
+class Latency
+{
+public:
+    /// @brief Замеряемая операция.
+    enum class Operation
+    {
+        /// @brief Генерация одного слова, замеряется каждое 64-е слово.
+        GenerateWord,
+        
+        /// @brief Генерация текста целиком.
+        GenerateText,
+        
+        /// @brief Запрос к серверу от приема до готовности ответа.
+        Request,
+        
+        /// @brief Загрузка цепи.
+        Load,
+        
+        /// @brief Сохранение цепи.
+        Save
+    };
+
+public:
+    /// @brief Получить гистограмму операции.
+    /// @param[in] operation - Операция.
+    /// @return Гистограмма.
+    static LatencyHistogram& histogram(Operation operation);
+    
+    /// @brief Вывести перцентили p50, p99, p99.9 и максимум задержек операций, по строке на операцию.
+    /// @details Операции без замеров не выводятся.
+    /// @param[in] output - Поток вывода.
+    static void write(std::ostream& output);
+};
+
+
+/// @class LatencyScope
+/// @brief Учитывает в гистограмме операции время от создания до уничтожения объекта.
+class LatencyScope
+{
+public:
+    /// @brief Конструктор.
+    /// @param[in] operation - Операция.
+    /// @param[in] count - Число операций, получивших эту задержку.
+    explicit LatencyScope(Latency::Operation operation, uint64_t count = 1)
+        : m_Operation(operation)
+        , m_Count(count)
+        , m_Start(std::chrono::steady_clock::now())
+    {
+    }
+    
+    /// @brief Деструктор.
+    ~LatencyScope()
+    {
+        const auto elapsed = std::chrono::steady_clock::now() - m_Start;
+        Latency::histogram(m_Operation).record(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count(), m_Count);
+    }
+    
+    LatencyScope(const LatencyScope&) = delete;
+    LatencyScope& operator=(const LatencyScope&) = delete;
+
+private:
+    /// @brief Операция.
+    Latency::Operation m_Operation;
+    
+    /// @brief Число операций.
+    uint64_t m_Count;
+    
+    /// @brief Время начала.
+    std::chrono::steady_clock::time_point m_Start;
+};
+
+
+/// @class LatencyReporter
+/// @brief Выводит гистограммы задержек по сигналу SIGUSR1, пока существует.
+/// @details Сигнал блокируется в создавшем объект потоке и в потоках, созданных после него,
+///          а принимает его отдельный поток, поэтому вывод не ограничен обработчиком сигнала.
+class LatencyReporter
+{
+public:
+    /// @brief Конструктор.
+    /// @param[in] output - Поток вывода.
+    explicit LatencyReporter(std::ostream& output);
+    
+    /// @brief Деструктор, останавливает поток приема сигнала.
+    ~LatencyReporter();
+    
+    LatencyReporter(const LatencyReporter&) = delete;
+    LatencyReporter& operator=(const LatencyReporter&) = delete;
+
+private:
+    /// @brief Поток вывода.
+    std::ostream& m_Output;
+    
+    /// @brief Маска сигналов создавшего потока до блокировки SIGUSR1.
+    sigset_t m_PreviousSignals;
+    
+    /// @brief Признак остановки потока приема сигнала.
+    std::atomic<bool> m_Stopping;
+    
+    /// @brief Поток приема сигнала.
+    std::thread m_Thread;
+};
+
+#endif // LATENCY_H
@@ -0,0 +1,115 @@
+#include "learn_stats.h"
+
+#include <iomanip>
+#include <sstream>
+
+
+namespace
+{
+    /// @brief Число байт в мегабайте.
+    const double bytesPerMegabyte = 1024.0 * 1024.0;
+    
+    /// @brief Получить скорость с защитой от деления на ноль.
+    /// @param[in] count - Число обработанных элементов.
+    /// @param[in] seconds - Время в секундах.
+    /// @return Число элементов в секунду.
+    double rate(double count, double seconds)
+    {
+        return seconds > 0.0 ? count / seconds : 0.0;
+    }
+}
+
+
+LearnStats::LearnStats(const MarkovTextChain& chain)
+    : m_Chain(chain)
+    , m_Progress(nullptr)
+    , m_ProgressInterval()
+    , m_LastProgress(Clock::now())
+    , m_Start(m_LastProgress)
+    , m_Last(m_LastProgress)
+    , m_Stages()
+    , m_Times()
+    , m_Bytes(0)
+    , m_Tokens(0)
+    , m_Words(0)
+{
+}
+
+void LearnStats::setProgress(std::ostream& output, double interval)
+{
+    m_Progress = &output;
+    m_ProgressInterval = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(interval));
+}
+
+void LearnStats::enter(Stage stage)
+{
+    account(Clock::now());
+    m_Stages.push_back(stage);
+}
+
+void LearnStats::leave()
+{
+    account(Clock::now());
+    m_Stages.pop_back();
+}
+
+void LearnStats::report(std::ostream& output) const
+{
+    const MarkovTextChain::Counters counters = m_Chain.counters();
+    const double total = std::chrono::duration<double>(m_Last - m_Start).count();
+    const double read = seconds(Stage::Read);
+    const double split = seconds(Stage::Split);
+    const double adjust = seconds(Stage::Adjust);
+    const double chain = seconds(Stage::Chain);
+    
+    std::ostringstream line;
+    line << std::fixed << std::setprecision(3)
+         << "{\"seconds\":" << total
+         << ",\"read\":{\"seconds\":" << read << ",\"bytes\":" << m_Bytes
+         << ",\"mb_per_s\":" << rate(m_Bytes / bytesPerMegabyte, read) << "}"
+         << ",\"split\":{\"seconds\":" << split << ",\"tokens\":" << m_Tokens
+         << ",\"tokens_per_s\":" << rate(m_Tokens, split) << "}"
+         << ",\"adjust\":{\"seconds\":" << adjust << ",\"kept\":" << m_Words << ",\"dropped\":" << m_Tokens - m_Words
+         << ",\"tokens_per_s\":" << rate(m_Tokens, adjust) << "}"
+         << ",\"chain\":{\"seconds\":" << chain << ",\"words\":" << counters.words
+         << ",\"states\":" << counters.states << ",\"successors\":" << counters.successors
+         << ",\"rehashes\":" << counters.rehashes << ",\"load_factor\":" << m_Chain.loadFactor()
+         << ",\"words_per_s\":" << rate(counters.words, chain) << "}"
+         << ",\"save\":{\"seconds\":" << seconds(Stage::Save) << "}"
+         << ",\"words_per_s\":" << rate(counters.words, total) << "}";
+    output << line.str() << std::endl;
+}
+
+void LearnStats::account(Clock::time_point now)
+{
+    if (!m_Stages.empty())
+    {
+        m_Times[static_cast<size_t>(m_Stages.back())] += now - m_Last;
+    }
+    m_Last = now;
+}
+
+void LearnStats::checkProgress()
+{
+    const Clock::time_point now = Clock::now();
+    if (now - m_LastProgress < m_ProgressInterval)
+    {
+        return;
+    }
+    
+    const double elapsed = std::chrono::duration<double>(now - m_Start).count();
+    const MarkovTextChain::Counters counters = m_Chain.counters();
+    std::ostringstream line;
+    line << std::fixed << std::setprecision(1)
+         << "  [" << elapsed << " s] read " << m_Bytes / bytesPerMegabyte << " MB ("
+         << rate(m_Bytes / bytesPerMegabyte, elapsed) << " MB/s), "
+         << m_Tokens << " tokens (" << rate(m_Tokens, elapsed) << "/s), "
+         << m_Words << " words kept, " << counters.states << " states ... ";
+    *m_Progress << std::endl << line.str() << std::flush;
+    m_LastProgress = now;
+}
+
+double LearnStats::seconds(Stage stage) const
+{
+    return std::chrono::duration<double>(m_Times[static_cast<size_t>(stage)]).count();
+}
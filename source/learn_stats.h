@@ -0,0 +1,143 @@
+#pragma once
+
+#ifndef LEARN_STATS_H
+#define LEARN_STATS_H
+
+#include "markov_text_chain.h"
+
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+
+/// @class LearnStats
+/// @brief Собирает счетчики и время этапов построения цепи Маркова.
+///
+/// Время этапов исключающее: время вложенного этапа не входит во время внешнего.
+class LearnStats
+{
+public:
+    /// @brief Этап построения цепи.
+    enum class Stage
+    {
+        /// @brief Чтение текста.
+        Read,
+        
+        /// @brief Разбиение текста на слова.
+        Split,
+        
+        /// @brief Приведение слов к единому виду.
+        Adjust,
+        
+        /// @brief Добавление слов в цепь.
+        Chain,
+        
+        /// @brief Сохранение цепи.
+        Save
+    };
+
+public:
+    /// @brief Конструктор.
+    /// @param[in] chain - Строящаяся цепь Маркова.
+    explicit LearnStats(const MarkovTextChain& chain);
+    
+    LearnStats(const LearnStats&) = delete;
+    LearnStats& operator=(const LearnStats&) = delete;
+    
+    /// @brief Выводить строки хода построения не чаще заданного интервала.
+    /// @param[in] output - Поток вывода.
+    /// @param[in] interval - Интервал в секундах.
+    void setProgress(std::ostream& output, double interval);
+    
+    /// @brief Начать вложенный этап.
+    /// @param[in] stage - Этап.
+    void enter(Stage stage);
+    
+    /// @brief Завершить текущий этап и вернуться к внешнему.
+    void leave();
+    
+    /// @brief Учесть прочитанные данные.
+    /// @param[in] size - Размер данных в байтах.
+    void addBytes(size_t size)
+    {
+        m_Bytes += size;
+    }
+    
+    /// @brief Учесть слово, выделенное из текста.
+    void addToken()
+    {
+        ++m_Tokens;
+    }
+    
+    /// @brief Учесть слово, переданное в цепь, и при необходимости вывести строку хода построения.
+    void addWord()
+    {
+        if ((++m_Words & progressCheckMask) == 0 && m_Progress != nullptr)
+        {
+            checkProgress();
+        }
+    }
+    
+    /// @brief Вывести отчет в формате JSON одной строкой.
+    /// @param[in] output - Поток вывода.
+    void report(std::ostream& output) const;
+
+private:
+    /// @brief Часы для замера времени.
+    using Clock = std::chrono::steady_clock;
+    
+    /// @brief Маска числа слов, при котором проверяется время вывода строки хода построения.
+    static const uint64_t progressCheckMask = 4095;
+    
+    /// @brief Число этапов.
+    static const size_t stageCount = 5;
+    
+    /// @brief Учесть время текущего этапа до заданного момента.
+    /// @param[in] now - Текущий момент.
+    void account(Clock::time_point now);
+    
+    /// @brief Вывести строку хода построения, если прошел интервал.
+    void checkProgress();
+    
+    /// @brief Получить время этапа в секундах.
+    /// @param[in] stage - Этап.
+    /// @return Время в секундах.
+    double seconds(Stage stage) const;
+
+private:
+    /// @brief Строящаяся цепь Маркова.
+    const MarkovTextChain& m_Chain;
+    
+    /// @brief Поток вывода строк хода построения, nullptr - без вывода.
+    std::ostream* m_Progress;
+    
+    /// @brief Интервал вывода строк хода построения.
+    Clock::duration m_ProgressInterval;
+    
+    /// @brief Момент вывода последней строки хода построения.
+    Clock::time_point m_LastProgress;
+    
+    /// @brief Момент создания.
+    Clock::time_point m_Start;
+    
+    /// @brief Момент последнего перехода между этапами.
+    Clock::time_point m_Last;
+    
+    /// @brief Стек вложенных этапов.
+    std::vector<Stage> m_Stages;
+    
+    /// @brief Время этапов.
+    Clock::duration m_Times[stageCount];
+    
+    /// @brief Число прочитанных байт.
+    uint64_t m_Bytes;
+    
+    /// @brief Число слов, выделенных из текста.
+    uint64_t m_Tokens;
+    
+    /// @brief Число слов, переданных в цепь.
+    uint64_t m_Words;
+};
+
+#endif // LEARN_STATS_H
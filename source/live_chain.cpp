@@ -0,0 +1,494 @@
+#include "live_chain.h"
+#include "perfect_hash.h"
+
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+#include <unordered_map>
+
+
+namespace
+{
+    /// @brief Начальное число слотов индекса.
+    const size_t initialIndexCapacity = 1024;
+    
+    /// @brief Начальная вместимость массива слов значения состояния.
+    const uint32_t initialSuccessorsCapacity = 2;
+    
+    /// @brief Вместимость массива слов значения, после которой позиция слова ищется по таблице, а не перебором.
+    const uint32_t successorsIndexThreshold = 8;
+    
+    /// @brief Максимальное число слов значения состояния, вместимость массива остается степенью двойки.
+    const uint32_t maxSuccessors = 0x80000000u;
+    
+    /// @brief Получить вместимость массива слов значения.
+    /// @param[in] size - Число слов значения.
+    /// @return Вместимость массива.
+    uint32_t successorsCapacity(uint32_t size)
+    {
+        uint32_t capacity = initialSuccessorsCapacity;
+        while (capacity < size)
+        {
+            capacity *= 2;
+        }
+        return capacity;
+    }
+    
+    /// @brief Максимальное число слов или состояний, идентификаторы занимают 32 бита.
+    const size_t maxIds = 0xFFFFFFFEu;
+    
+    /// @brief Максимальный порядок цепи, для которого ключ следующего состояния собирается на стеке.
+    const size_t maxStackOrder = 16;
+}
+
+
+const LiveChain::WordId LiveChain::noWord = 0xFFFFFFFFu;
+const LiveChain::StateId LiveChain::noState = 0xFFFFFFFFu;
+
+
+LiveChain::Successor::Successor()
+    : word(noWord)
+    , count(0)
+{
+}
+
+LiveChain::State::State()
+    : successors(nullptr)
+    , size(0)
+    , total(0)
+{
+}
+
+LiveChain::State::~State()
+{
+    delete[] successors.load(std::memory_order_relaxed);
+}
+
+LiveChain::Index::Index(size_t capacity)
+    : mask(capacity - 1)
+    , slots(new std::atomic<uint64_t>[capacity])
+{
+    for (size_t i = 0; i < capacity; ++i)
+    {
+        slots[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+LiveChain::LiveChain(size_t order)
+    : m_Order(order)
+    , m_Words()
+    , m_Keys()
+    , m_States()
+    , m_WordIndex(nullptr)
+    , m_StateIndex(nullptr)
+    , m_Indexes()
+    , m_Positions()
+    , m_Retired()
+    , m_RetiredSize(0)
+    , m_Window()
+{
+    m_Indexes.emplace_back(new Index(initialIndexCapacity));
+    m_WordIndex.store(m_Indexes.back().get(), std::memory_order_relaxed);
+    m_Indexes.emplace_back(new Index(initialIndexCapacity));
+    m_StateIndex.store(m_Indexes.back().get(), std::memory_order_relaxed);
+}
+
+LiveChain::~LiveChain() = default;
+
+void LiveChain::addWord(const MarkovTextChain::Word& word)
+{
+    const WordId id = addWordId(word);
+    if (m_Window.size() < m_Order)
+    {
+        m_Window.push_back(id);
+        return;
+    }
+    
+    addSuccessor(m_Window.data(), id, 1);
+    m_Window.erase(m_Window.begin());
+    m_Window.push_back(id);
+}
+
+void LiveChain::flush()
+{
+    m_Window.clear();
+}
+
+LiveChain::WordId LiveChain::addWordId(const MarkovTextChain::Word& word)
+{
+    const WordId found = wordId(word);
+    if (found != noWord)
+    {
+        return found;
+    }
+    
+    const size_t id = m_Words.size();
+    if (id >= maxIds)
+    {
+        throw std::length_error("LiveChain::addWordId error: too many words");
+    }
+    
+    // Слово публикуется до слота индекса, поэтому читатель, нашедший слот, видит слово.
+    m_Words.append() = word;
+    m_Words.publish();
+    insert(m_WordIndex, id, hashBytes(word.data(), word.size()), static_cast<uint32_t>(id));
+    return static_cast<WordId>(id);
+}
+
+void LiveChain::addSuccessor(const WordId* key, WordId successor, size_t count)
+{
+    StateId id = findState(key);
+    if (id == noState)
+    {
+        const size_t stateId = m_States.size();
+        if (stateId >= maxIds)
+        {
+            throw std::length_error("LiveChain::addSuccessor error: too many states");
+        }
+        
+        for (size_t i = 0; i < m_Order; ++i)
+        {
+            m_Keys.append() = key[i];
+            m_Keys.publish();
+        }
+        
+        // Новое состояние публикуется уже со словом значения, поэтому оно никогда не бывает пустым.
+        State& state = m_States.append();
+        if (count > std::numeric_limits<uint32_t>::max())
+        {
+            throw std::length_error("LiveChain::addSuccessor error: too many word occurrences");
+        }
+        appendSuccessor(static_cast<StateId>(stateId), state, successor, static_cast<uint32_t>(count));
+        m_States.publish();
+        
+        insert(m_StateIndex, stateId, hashKey(key), static_cast<uint32_t>(stateId));
+        return;
+    }
+    
+    // Сумма чисел появлений не больше 2^32 - 1, как и у замороженной цепи.
+    State& state = m_States[id];
+    const uint32_t total = state.total.load(std::memory_order_relaxed);
+    if (count > std::numeric_limits<uint32_t>::max() - total)
+    {
+        throw std::length_error("LiveChain::addSuccessor error: too many word occurrences");
+    }
+    
+    const uint32_t position = findSuccessor(id, successor);
+    if (position == state.size.load(std::memory_order_relaxed))
+    {
+        appendSuccessor(id, state, successor, static_cast<uint32_t>(count));
+        return;
+    }
+    
+    // Сумма публикуется после числа появлений: читатель, увидевший новую сумму, увидит и новое число.
+    std::atomic<uint32_t>& occurrences = state.successors.load(std::memory_order_relaxed)[position].count;
+    occurrences.store(occurrences.load(std::memory_order_relaxed) + static_cast<uint32_t>(count), std::memory_order_relaxed);
+    state.total.store(total + static_cast<uint32_t>(count), std::memory_order_release);
+}
+
+LiveChain::WordId LiveChain::wordId(const MarkovTextChain::Word& word) const
+{
+    return find(m_WordIndex, hashBytes(word.data(), word.size()), [this, &word](uint32_t id)
+    {
+        return m_Words[id] == word;
+    });
+}
+
+const MarkovTextChain::Word& LiveChain::word(WordId id) const
+{
+    return m_Words[id];
+}
+
+LiveChain::StateId LiveChain::findState(const MarkovTextChain::Words& words) const
+{
+    if (words.size() != m_Order)
+    {
+        return noState;
+    }
+    
+    WordIds key;
+    key.reserve(m_Order);
+    for (const auto& current : words)
+    {
+        const WordId id = wordId(current);
+        if (id == noWord)
+        {
+            return noState;
+        }
+        key.push_back(id);
+    }
+    
+    return findState(key.data());
+}
+
+LiveChain::WordId LiveChain::step(StateId& state, RandomEngine& random) const
+{
+    // Сумма читается до размера и массива: слова и числа появлений, вошедшие в сумму, уже опубликованы,
+    // а числа появлений только растут, поэтому случайный номер появления всегда попадает в массив.
+    const State& current = m_States[state];
+    const uint32_t total = current.total.load(std::memory_order_acquire);
+    const uint32_t size = current.size.load(std::memory_order_acquire);
+    const Successor* successors = current.successors.load(std::memory_order_acquire);
+    uint64_t occurrence = random.uniform(total);
+    uint32_t position = 0;
+    for (; position + 1 < size; ++position)
+    {
+        const uint32_t count = successors[position].count.load(std::memory_order_relaxed);
+        if (occurrence < count)
+        {
+            break;
+        }
+        occurrence -= count;
+    }
+    const WordId result = successors[position].word;
+    
+    // Следующее состояние - ключ текущего без первого слова, дополненный сгенерированным словом.
+    WordId stackKey[maxStackOrder];
+    WordIds heapKey(m_Order > maxStackOrder ? m_Order : 0);
+    WordId* key = m_Order > maxStackOrder ? heapKey.data() : stackKey;
+    for (size_t i = 1; i < m_Order; ++i)
+    {
+        key[i - 1] = m_Keys[state * m_Order + i];
+    }
+    key[m_Order - 1] = result;
+    state = findState(key);
+    return result;
+}
+
+LiveChain::StateId LiveChain::randomState(RandomEngine& random) const
+{
+    const size_t states = m_States.size();
+    return states == 0 ? noState : static_cast<StateId>(random.uniform(states));
+}
+
+size_t LiveChain::stateCount() const
+{
+    return m_States.size();
+}
+
+void LiveChain::forEachState(const std::function<void(const WordIds&, StateId)>& visitor) const
+{
+    WordIds key(m_Order);
+    const size_t states = m_States.size();
+    for (size_t state = 0; state < states; ++state)
+    {
+        for (size_t i = 0; i < m_Order; ++i)
+        {
+            key[i] = m_Keys[state * m_Order + i];
+        }
+        visitor(key, static_cast<StateId>(state));
+    }
+}
+
+LiveChain::Successors LiveChain::successors(StateId state) const
+{
+    const State& current = m_States[state];
+    const uint32_t size = current.size.load(std::memory_order_acquire);
+    const Successor* successors = current.successors.load(std::memory_order_acquire);
+    
+    Successors result;
+    result.reserve(size);
+    for (uint32_t i = 0; i < size; ++i)
+    {
+        result.emplace_back(successors[i].word, successors[i].count.load(std::memory_order_relaxed));
+    }
+    return result;
+}
+
+size_t LiveChain::memoryUsage() const
+{
+    size_t result = sizeof(*this) + m_Words.memoryUsage() + m_Keys.memoryUsage() + m_States.memoryUsage();
+    for (size_t id = 0; id < m_Words.size(); ++id)
+    {
+        const size_t capacity = m_Words[id].capacity();
+        result += capacity > 15 ? capacity + 1 : 0;
+    }
+    for (size_t state = 0; state < m_States.size(); ++state)
+    {
+        result += successorsCapacity(m_States[state].size.load(std::memory_order_relaxed)) * sizeof(Successor);
+    }
+    
+    // Узел хэш-таблицы хранит пару и указатель на следующий узел, корзина - указатель.
+    result += m_Positions.bucket_count() * sizeof(void*);
+    for (const auto& positions : m_Positions)
+    {
+        const size_t capacity = successorsCapacity(m_States[positions.first].size.load(std::memory_order_relaxed));
+        result += sizeof(positions) + sizeof(void*) + capacity * 2 * sizeof(uint32_t);
+    }
+    for (const auto& index : m_Indexes)
+    {
+        result += sizeof(Index) + (index->mask + 1) * sizeof(uint64_t);
+    }
+    result += m_RetiredSize * sizeof(Successor);
+    return result;
+}
+
+template <typename Equal>
+uint32_t LiveChain::find(const std::atomic<Index*>& index, uint64_t hash, const Equal& equal)
+{
+    const Index* current = index.load(std::memory_order_acquire);
+    const uint64_t tag = hash >> 32;
+    for (size_t position = tag & current->mask; ; position = (position + 1) & current->mask)
+    {
+        const uint64_t slot = current->slots[position].load(std::memory_order_acquire);
+        if (slot == 0)
+        {
+            return noWord;
+        }
+        const uint32_t id = static_cast<uint32_t>(slot) - 1;
+        if ((slot >> 32) == tag && equal(id))
+        {
+            return id;
+        }
+    }
+}
+
+void LiveChain::insert(std::atomic<Index*>& index, size_t count, uint64_t hash, uint32_t id)
+{
+    Index* current = index.load(std::memory_order_relaxed);
+    
+    // Индекс заполняется не более чем наполовину. Новый индекс строится целиком и публикуется
+    // одной операцией, читатели старого индекса продолжают работать с ним.
+    if ((count + 1) * 2 > current->mask + 1)
+    {
+        std::unique_ptr<Index> grown(new Index((current->mask + 1) * 2));
+        for (size_t i = 0; i <= current->mask; ++i)
+        {
+            const uint64_t slot = current->slots[i].load(std::memory_order_relaxed);
+            if (slot == 0)
+            {
+                continue;
+            }
+            // В слоте хранятся только старшие биты хэша, по ним и выбирается позиция в новом индексе.
+            size_t position = (slot >> 32) & grown->mask;
+            while (grown->slots[position].load(std::memory_order_relaxed) != 0)
+            {
+                position = (position + 1) & grown->mask;
+            }
+            grown->slots[position].store(slot, std::memory_order_relaxed);
+        }
+        current = grown.get();
+        m_Indexes.push_back(std::move(grown));
+        index.store(current, std::memory_order_release);
+    }
+    
+    const uint64_t tag = hash >> 32;
+    size_t position = tag & current->mask;
+    while (current->slots[position].load(std::memory_order_relaxed) != 0)
+    {
+        position = (position + 1) & current->mask;
+    }
+    current->slots[position].store((tag << 32) | (uint64_t(id) + 1), std::memory_order_release);
+}
+
+LiveChain::StateId LiveChain::findState(const WordId* key) const
+{
+    return find(m_StateIndex, hashKey(key), [this, key](uint32_t id)
+    {
+        for (size_t i = 0; i < m_Order; ++i)
+        {
+            if (m_Keys[id * m_Order + i] != key[i])
+            {
+                return false;
+            }
+        }
+        return true;
+    });
+}
+
+uint64_t LiveChain::hashKey(const WordId* key) const
+{
+    return hashBytes(key, m_Order * sizeof(WordId));
+}
+
+uint32_t LiveChain::findSuccessor(StateId id, WordId successor) const
+{
+    const State& state = m_States[id];
+    const uint32_t size = state.size.load(std::memory_order_relaxed);
+    const Successor* successors = state.successors.load(std::memory_order_relaxed);
+    if (successorsCapacity(size) <= successorsIndexThreshold)
+    {
+        uint32_t position = 0;
+        while (position < size && successors[position].word != successor)
+        {
+            ++position;
+        }
+        return position;
+    }
+    
+    const uint32_t* positions = m_Positions.find(id)->second.get();
+    const size_t mask = size_t(successorsCapacity(size)) * 2 - 1;
+    for (size_t slot = hashBytes(&successor, sizeof(successor)) & mask; ; slot = (slot + 1) & mask)
+    {
+        if (positions[slot] == 0)
+        {
+            return size;
+        }
+        if (successors[positions[slot] - 1].word == successor)
+        {
+            return positions[slot] - 1;
+        }
+    }
+}
+
+void LiveChain::appendSuccessor(StateId id, State& state, WordId successor, uint32_t count)
+{
+    const uint32_t size = state.size.load(std::memory_order_relaxed);
+    if (size >= maxSuccessors)
+    {
+        throw std::length_error("LiveChain::appendSuccessor error: too many successors");
+    }
+    
+    Successor* successors = state.successors.load(std::memory_order_relaxed);
+    const uint32_t capacity = successorsCapacity(size + 1);
+    const size_t mask = size_t(capacity) * 2 - 1;
+    if (successors == nullptr || capacity > successorsCapacity(size))
+    {
+        // Новый массив публикуется до увеличения размера: читатель, увидевший новый размер,
+        // увидит и новый массив, а старый массив остается доступен читателям старого размера.
+        Successor* grown = new Successor[capacity];
+        for (uint32_t i = 0; i < size; ++i)
+        {
+            grown[i].word = successors[i].word;
+            grown[i].count.store(successors[i].count.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        }
+        state.successors.store(grown, std::memory_order_release);
+        if (successors != nullptr)
+        {
+            m_Retired.emplace_back(successors);
+            m_RetiredSize += successorsCapacity(size);
+        }
+        successors = grown;
+        
+        // Таблица позиций большого массива строится заново вдвое больше его вместимости.
+        if (capacity > successorsIndexThreshold)
+        {
+            std::unique_ptr<uint32_t[]>& positions = m_Positions[id];
+            positions.reset(new uint32_t[mask + 1]());
+            for (uint32_t i = 0; i < size; ++i)
+            {
+                insertPosition(positions.get(), mask, successors, i);
+            }
+        }
+    }
+    
+    successors[size].word = successor;
+    successors[size].count.store(count, std::memory_order_relaxed);
+    if (capacity > successorsIndexThreshold)
+    {
+        insertPosition(m_Positions[id].get(), mask, successors, size);
+    }
+    state.size.store(size + 1, std::memory_order_release);
+    state.total.store(state.total.load(std::memory_order_relaxed) + count, std::memory_order_release);
+}
+
+void LiveChain::insertPosition(uint32_t* positions, size_t mask, const Successor* successors, uint32_t position)
+{
+    const WordId word = successors[position].word;
+    size_t slot = hashBytes(&word, sizeof(word)) & mask;
+    while (positions[slot] != 0)
+    {
+        slot = (slot + 1) & mask;
+    }
+    positions[slot] = position + 1;
+}
@@ -0,0 +1,380 @@
+#pragma once
+
+#ifndef LIVE_CHAIN_H
+#define LIVE_CHAIN_H
+
+#include "markov_text_chain.h"
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+
+/// @class AppendOnlyArray
+/// @brief Массив, который один поток дополняет, а другие потоки одновременно читают без блокировок.
+/// @details Элементы хранятся в блоках удваивающегося размера и никогда не перемещаются, поэтому
+///          ссылки на опубликованные элементы остаются действительными. Элемент заполняется
+///          через append() и становится видимым читателям после publish().
+template <typename T>
+class AppendOnlyArray
+{
+public:
+    /// @brief Конструктор.
+    AppendOnlyArray()
+        : m_Chunks()
+        , m_Size(0)
+    {
+        for (auto& chunk : m_Chunks)
+        {
+            chunk.store(nullptr, std::memory_order_relaxed);
+        }
+    }
+    
+    /// @brief Деструктор.
+    ~AppendOnlyArray()
+    {
+        for (auto& chunk : m_Chunks)
+        {
+            delete[] chunk.load(std::memory_order_relaxed);
+        }
+    }
+    
+    AppendOnlyArray(const AppendOnlyArray&) = delete;
+    AppendOnlyArray& operator=(const AppendOnlyArray&) = delete;
+    
+    /// @brief Получить число опубликованных элементов.
+    /// @return Число элементов.
+    size_t size() const
+    {
+        return m_Size.load(std::memory_order_acquire);
+    }
+    
+    /// @brief Получить опубликованный элемент.
+    /// @param[in] index - Номер элемента.
+    /// @return Элемент.
+    const T& operator[](size_t index) const
+    {
+        size_t offset = 0;
+        const size_t chunk = locate(index, offset);
+        return m_Chunks[chunk].load(std::memory_order_acquire)[offset];
+    }
+    
+    /// @brief Получить опубликованный элемент для изменения, вызывается только пишущим потоком.
+    /// @param[in] index - Номер элемента.
+    /// @return Элемент.
+    T& operator[](size_t index)
+    {
+        size_t offset = 0;
+        const size_t chunk = locate(index, offset);
+        return m_Chunks[chunk].load(std::memory_order_relaxed)[offset];
+    }
+    
+    /// @brief Получить место для следующего элемента, вызывается только пишущим потоком.
+    /// @return Элемент, невидимый читателям до вызова publish().
+    T& append()
+    {
+        size_t offset = 0;
+        const size_t index = m_Size.load(std::memory_order_relaxed);
+        const size_t chunk = locate(index, offset);
+        T* data = m_Chunks[chunk].load(std::memory_order_relaxed);
+        if (data == nullptr)
+        {
+            data = new T[firstChunkSize << chunk];
+            m_Chunks[chunk].store(data, std::memory_order_release);
+        }
+        return data[offset];
+    }
+    
+    /// @brief Сделать элемент, полученный через append(), видимым читателям.
+    void publish()
+    {
+        m_Size.store(m_Size.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+    
+    /// @brief Получить объем занимаемой памяти без учета памяти, принадлежащей элементам.
+    /// @return Объем памяти в байтах.
+    size_t memoryUsage() const
+    {
+        size_t result = sizeof(*this);
+        for (size_t chunk = 0; chunk < maxChunks; ++chunk)
+        {
+            if (m_Chunks[chunk].load(std::memory_order_relaxed) != nullptr)
+            {
+                result += (firstChunkSize << chunk) * sizeof(T);
+            }
+        }
+        return result;
+    }
+
+private:
+    /// @brief Найти блок элемента.
+    /// @param[in] index - Номер элемента.
+    /// @param[out] offset - Номер элемента внутри блока.
+    /// @return Номер блока.
+    static size_t locate(size_t index, size_t& offset)
+    {
+        // Блок k содержит firstChunkSize * 2^k элементов и начинается с firstChunkSize * (2^k - 1).
+        const uint64_t position = index / firstChunkSize + 1;
+        const size_t chunk = 63 - __builtin_clzll(position);
+        offset = index - firstChunkSize * ((size_t(1) << chunk) - 1);
+        return chunk;
+    }
+
+private:
+    /// @brief Размер первого блока.
+    static const size_t firstChunkSize = 1024;
+    
+    /// @brief Максимальное число блоков.
+    static const size_t maxChunks = 32;
+    
+    /// @brief Блоки элементов.
+    std::atomic<T*> m_Chunks[maxChunks];
+    
+    /// @brief Число опубликованных элементов.
+    std::atomic<size_t> m_Size;
+};
+
+
+/// @class LiveChain
+/// @brief Текстовая цепь Маркова, пополняемая одним пишущим потоком при одновременной генерации.
+/// @details Читатели не захватывают блокировок. Слова и состояния только добавляются, индексы
+///          слов и состояний - открытые хэш-таблицы, слоты которых публикуются атомарно. Каждое
+///          состояние хранит массив слов значения с числами их появлений в порядке первого появления
+///          и их сумму, поэтому память не зависит от объема текста. Слово выбирается просмотром
+///          массива по случайному номеру появления, частые слова обычно появляются первыми.
+///          Вытесненные при росте массивы и индексы освобождаются вместе с цепью, их суммарный
+///          размер не превышает размера действующих.
+class LiveChain
+{
+public:
+    /// @brief Тип идентификатора слова.
+    using WordId = uint32_t;
+    
+    /// @brief Тип идентификатора состояния.
+    using StateId = uint32_t;
+    
+    /// @brief Тип последовательности идентификаторов слов.
+    using WordIds = std::vector<WordId>;
+    
+    /// @brief Тип списка слов значения состояния с числом их появлений.
+    using Successors = std::vector<std::pair<WordId, size_t>>;
+    
+    /// @brief Отсутствующее слово.
+    static const WordId noWord;
+    
+    /// @brief Отсутствующее состояние.
+    static const StateId noState;
+
+public:
+    /// @brief Конструктор.
+    /// @param[in] order - Порядок цепи Маркова.
+    explicit LiveChain(size_t order);
+    
+    /// @brief Деструктор.
+    ~LiveChain();
+    
+    LiveChain(const LiveChain&) = delete;
+    LiveChain& operator=(const LiveChain&) = delete;
+    
+    /// @brief Добавить слово к цепи, вызывается только пишущим потоком.
+    /// @param[in] word - Новое слово.
+    /// @throws std::exception в случае ошибки.
+    void addWord(const MarkovTextChain::Word& word);
+    
+    /// @brief Подготовить цепь к обработке нового потока слов, вызывается только пишущим потоком.
+    void flush();
+    
+    /// @brief Получить идентификатор слова, добавив слово при необходимости, вызывается только пишущим потоком.
+    /// @param[in] word - Слово.
+    /// @return Идентификатор слова.
+    /// @throws std::exception в случае ошибки.
+    WordId addWordId(const MarkovTextChain::Word& word);
+    
+    /// @brief Добавить появления слова значения состояния, вызывается только пишущим потоком.
+    /// @param[in] key - Идентификаторы слов ключа состояния.
+    /// @param[in] successor - Идентификатор слова значения.
+    /// @param[in] count - Число появлений.
+    /// @throws std::exception в случае ошибки.
+    void addSuccessor(const WordId* key, WordId successor, size_t count);
+    
+    /// @brief Получить идентификатор слова.
+    /// @param[in] word - Слово.
+    /// @return Идентификатор слова или noWord, если слова нет в цепи.
+    WordId wordId(const MarkovTextChain::Word& word) const;
+    
+    /// @brief Получить слово по идентификатору.
+    /// @param[in] id - Идентификатор слова.
+    /// @return Слово.
+    const MarkovTextChain::Word& word(WordId id) const;
+    
+    /// @brief Найти состояние.
+    /// @param[in] words - Последовательность слов.
+    /// @return Идентификатор состояния или noState, если состояния нет в цепи.
+    StateId findState(const MarkovTextChain::Words& words) const;
+    
+    /// @brief Сгенерировать слово и перейти в следующее состояние.
+    /// @param[in,out] state - Текущее состояние, заменяется следующим или noState, если следующего нет.
+    /// @param[in] random - Генератор случайных чисел.
+    /// @return Идентификатор слова.
+    WordId step(StateId& state, RandomEngine& random) const;
+    
+    /// @brief Выбрать случайное состояние.
+    /// @details Состояния выбираются равновероятно: накопленные числа появлений изменялись бы
+    ///          при каждом добавленном слове.
+    /// @param[in] random - Генератор случайных чисел.
+    /// @return Идентификатор состояния или noState, если в цепи нет состояний.
+    StateId randomState(RandomEngine& random) const;
+    
+    /// @brief Получить число состояний.
+    /// @return Число состояний.
+    size_t stateCount() const;
+    
+    /// @brief Обойти все состояния цепи.
+    /// @param[in] visitor - Обработчик, получает ключ и идентификатор состояния.
+    void forEachState(const std::function<void(const WordIds&, StateId)>& visitor) const;
+    
+    /// @brief Получить слова значения состояния.
+    /// @param[in] state - Идентификатор состояния.
+    /// @return Слова значения состояния с числом их появлений в порядке первого появления.
+    Successors successors(StateId state) const;
+    
+    /// @brief Получить объем занимаемой памяти, вызывается только пишущим потоком.
+    /// @return Объем памяти в байтах.
+    size_t memoryUsage() const;
+
+private:
+    /// @brief Слово значения состояния с числом его появлений.
+    struct Successor
+    {
+        /// @brief Конструктор.
+        Successor();
+        
+        /// @brief Идентификатор слова.
+        WordId word;
+        
+        /// @brief Число появлений, увеличивается пишущим потоком.
+        std::atomic<uint32_t> count;
+    };
+    
+    /// @brief Состояние цепи.
+    struct State
+    {
+        /// @brief Конструктор.
+        State();
+        
+        /// @brief Деструктор.
+        ~State();
+        
+        /// @brief Слова значения состояния.
+        /// @details Вместимость массива - наименьшая степень двойки, не меньшая числа слов и начальной вместимости.
+        std::atomic<Successor*> successors;
+        
+        /// @brief Число опубликованных слов значения.
+        std::atomic<uint32_t> size;
+        
+        /// @brief Сумма опубликованных чисел появлений.
+        std::atomic<uint32_t> total;
+    };
+    
+    /// @brief Открытая хэш-таблица идентификаторов.
+    /// @details Слот содержит старшие 32 бита хэша ключа и идентификатор, увеличенный на единицу.
+    struct Index
+    {
+        /// @brief Конструктор.
+        /// @param[in] capacity - Число слотов, степень двойки.
+        explicit Index(size_t capacity);
+        
+        /// @brief Маска номера слота.
+        size_t mask;
+        
+        /// @brief Слоты, ноль - пустой слот.
+        std::unique_ptr<std::atomic<uint64_t>[]> slots;
+    };
+    
+    /// @brief Найти идентификатор в индексе.
+    /// @param[in] index - Индекс.
+    /// @param[in] hash - Хэш ключа.
+    /// @param[in] equal - Проверка соответствия идентификатора ключу.
+    /// @return Идентификатор или noWord, если ключа нет в индексе.
+    template <typename Equal>
+    static uint32_t find(const std::atomic<Index*>& index, uint64_t hash, const Equal& equal);
+    
+    /// @brief Добавить идентификатор в индекс, увеличивая индекс при необходимости.
+    /// @param[in,out] index - Индекс.
+    /// @param[in] count - Число идентификаторов в индексе до добавления.
+    /// @param[in] hash - Хэш ключа.
+    /// @param[in] id - Идентификатор.
+    void insert(std::atomic<Index*>& index, size_t count, uint64_t hash, uint32_t id);
+    
+    /// @brief Найти состояние.
+    /// @param[in] key - Идентификаторы слов ключа состояния.
+    /// @return Идентификатор состояния или noState, если состояния нет в цепи.
+    StateId findState(const WordId* key) const;
+    
+    /// @brief Найти позицию слова в массиве значения состояния, вызывается только пишущим потоком.
+    /// @param[in] id - Идентификатор состояния.
+    /// @param[in] successor - Идентификатор слова значения.
+    /// @return Позиция слова или число слов значения, если слова в значении нет.
+    uint32_t findSuccessor(StateId id, WordId successor) const;
+    
+    /// @brief Добавить слово в конец массива значения состояния, вызывается только пишущим потоком.
+    /// @param[in] id - Идентификатор состояния, может быть еще не опубликован.
+    /// @param[in,out] state - Состояние.
+    /// @param[in] successor - Идентификатор слова значения.
+    /// @param[in] count - Число появлений.
+    /// @throws std::exception в случае ошибки.
+    void appendSuccessor(StateId id, State& state, WordId successor, uint32_t count);
+    
+    /// @brief Вставить позицию слова в таблицу позиций значения состояния.
+    /// @param[in,out] positions - Таблица позиций, степень двойки слотов.
+    /// @param[in] mask - Маска номера слота.
+    /// @param[in] successors - Слова значения.
+    /// @param[in] position - Позиция слова.
+    static void insertPosition(uint32_t* positions, size_t mask, const Successor* successors, uint32_t position);
+    
+    /// @brief Вычислить хэш ключа состояния.
+    /// @param[in] key - Идентификаторы слов ключа состояния.
+    /// @return Хэш.
+    uint64_t hashKey(const WordId* key) const;
+
+private:
+    /// @brief Порядок цепи Маркова.
+    size_t m_Order;
+    
+    /// @brief Слова по их идентификаторам.
+    AppendOnlyArray<MarkovTextChain::Word> m_Words;
+    
+    /// @brief Ключи состояний, по m_Order идентификаторов слов на состояние.
+    AppendOnlyArray<WordId> m_Keys;
+    
+    /// @brief Состояния по их идентификаторам.
+    AppendOnlyArray<State> m_States;
+    
+    /// @brief Индекс слов.
+    std::atomic<Index*> m_WordIndex;
+    
+    /// @brief Индекс состояний.
+    std::atomic<Index*> m_StateIndex;
+    
+    /// @brief Все созданные индексы, включая вытесненные.
+    std::vector<std::unique_ptr<Index>> m_Indexes;
+    
+    /// @brief Таблицы позиций слов в массивах значений состояний, вместимость которых больше порога,
+    ///        используются только пишущим потоком.
+    /// @details Таблица вдвое больше массива значения, слот содержит позицию слова, увеличенную на единицу.
+    std::unordered_map<StateId, std::unique_ptr<uint32_t[]>> m_Positions;
+    
+    /// @brief Вытесненные массивы слов значений состояний.
+    std::vector<std::unique_ptr<Successor[]>> m_Retired;
+    
+    /// @brief Суммарная вместимость вытесненных массивов слов значений.
+    size_t m_RetiredSize;
+    
+    /// @brief Идентификаторы последней рассмотренной последовательности слов.
+    WordIds m_Window;
+};
+
+#endif // LIVE_CHAIN_H
@@ -0,0 +1,527 @@
+#include "corpus_generator.h"
+#include "markov_text_chain.h"
+#include "random_engine.h"
+#include "text_adjuster.h"
+#include "word_splitter.h"
+
+#include <getopt.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+
+// Allocation counter
+namespace
+{
+    std::atomic<uint64_t> allocationCount(0);
+}
+
+/// @brief Переопределенный оператор, считает выделения памяти.
+void* operator new(size_t size)
+{
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    void* result = std::malloc(size == 0 ? 1 : size);
+    if (result == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+    return result;
+}
+
+/// @brief Переопределенный оператор.
+void operator delete(void* pointer) noexcept
+{
+    std::free(pointer);
+}
+
+
+// Common values
+namespace
+{
+    std::string benchDataDir = "../test_data/";
+    size_t chainOrder = 2;
+    size_t repeatCount = 3;
+    size_t syntheticWords = 1000000;
+    size_t syntheticVocabulary = 50000;
+    double syntheticSkew = 1.0;
+    uint64_t syntheticSeed = 1;
+    std::string corpusFilter = "all";
+    
+    const size_t textBlockSize = 64 * 1024;
+    
+    struct Corpus
+    {
+        Corpus()
+            : name()
+            , text()
+            , rawWords()
+            , words()
+            , rawBytes(0)
+            , wordBytes(0)
+        {
+        }
+        
+        std::string name;
+        std::string text;
+        std::vector<std::string> rawWords;
+        std::vector<std::string> words;
+        size_t rawBytes;
+        size_t wordBytes;
+    };
+    
+    /// @brief Выполнить замер: лучший из нескольких запусков, подготовка в замер не входит.
+    void Measure(const std::string& benchmark, const Corpus& corpus, size_t ops, size_t bytes,
+                 const std::function<void()>& setup, const std::function<void()>& run)
+    {
+        double bestSeconds = std::numeric_limits<double>::max();
+        uint64_t bestAllocations = 0;
+        for (size_t i = 0; i < repeatCount; ++i)
+        {
+            setup();
+            const uint64_t allocations = allocationCount.load(std::memory_order_relaxed);
+            const auto start = std::chrono::steady_clock::now();
+            run();
+            const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            if (seconds < bestSeconds)
+            {
+                bestSeconds = seconds;
+                bestAllocations = allocationCount.load(std::memory_order_relaxed) - allocations;
+            }
+        }
+        
+        // Одна строка JSON на замер, чтобы результаты разных запусков можно было сравнивать построчно.
+        char line[512];
+        std::snprintf(line, sizeof(line),
+                      "{\"benchmark\":\"%s\",\"corpus\":\"%s\",\"order\":%zu,\"ops\":%zu,\"bytes\":%zu,"
+                      "\"seconds\":%.6f,\"ns_per_op\":%.2f,\"mb_per_s\":%.2f,\"allocs_per_op\":%.3f}",
+                      benchmark.c_str(), corpus.name.c_str(), chainOrder, ops, bytes, bestSeconds,
+                      ops == 0 ? 0.0 : bestSeconds * 1e9 / ops,
+                      bestSeconds > 0 ? bytes / bestSeconds / (1024 * 1024) : 0.0,
+                      ops == 0 ? 0.0 : static_cast<double>(bestAllocations) / ops);
+        std::cout << line << std::endl;
+    }
+    
+    /// @brief Разбить и нормализовать текст корпуса теми же классами, что и при построении цепи.
+    bool PrepareCorpus(Corpus& corpus)
+    {
+        TextAdjuster adjuster;
+        adjuster.setHandler([&corpus](std::string&& word)
+        {
+            corpus.wordBytes += word.size();
+            corpus.words.push_back(std::move(word));
+        });
+        
+        WordSplitter splitter;
+        splitter.setHandler([&corpus](const std::string& word)
+        {
+            corpus.rawBytes += word.size();
+            corpus.rawWords.push_back(word);
+        });
+        
+        try
+        {
+            splitter.addText(corpus.text.data(), corpus.text.size());
+            splitter.flush();
+            for (const auto& word : corpus.rawWords)
+            {
+                adjuster.adjust(word);
+            }
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "  PrepareCorpus: failed to prepare corpus '" << corpus.name << "': " << e.what() << std::endl;
+            return false;
+        }
+        return true;
+    }
+    
+    bool LoadTestDataCorpus(Corpus& corpus)
+    {
+        const std::string fileName = benchDataDir + "text_downloader_model.txt";
+        std::ifstream input(fileName, std::ifstream::in | std::ifstream::binary);
+        if (!input.good())
+        {
+            std::cerr << "  LoadTestDataCorpus: failed to open file '" << fileName << "' for reading" << std::endl;
+            return false;
+        }
+        
+        std::stringstream text;
+        text << input.rdbuf();
+        corpus.name = "test_data";
+        corpus.text = text.str();
+        return PrepareCorpus(corpus);
+    }
+    
+    bool MakeSyntheticCorpus(Corpus& corpus)
+    {
+        CorpusGenerator generator(syntheticVocabulary, syntheticSkew, syntheticSeed);
+        generator.appendWords(corpus.text, syntheticWords);
+        corpus.name = "synthetic";
+        return PrepareCorpus(corpus);
+    }
+}
+
+// Pipeline benchmarks
+namespace
+{
+    void WordSplitterBench(const Corpus& corpus)
+    {
+        size_t count = 0;
+        WordSplitter splitter;
+        splitter.setHandler([&count](const std::string&)
+        {
+            ++count;
+        });
+        
+        Measure("WordSplitter::addText", corpus, corpus.rawWords.size(), corpus.text.size(), [&count]()
+        {
+            count = 0;
+        }, [&]()
+        {
+            for (size_t offset = 0; offset < corpus.text.size(); offset += textBlockSize)
+            {
+                splitter.addText(corpus.text.data() + offset, std::min(textBlockSize, corpus.text.size() - offset));
+            }
+            splitter.flush();
+        });
+    }
+    
+    void TextAdjusterBench(const Corpus& corpus)
+    {
+        size_t count = 0;
+        TextAdjuster adjuster;
+        adjuster.setHandler([&count](std::string&&)
+        {
+            ++count;
+        });
+        
+        Measure("TextAdjuster::adjust", corpus, corpus.rawWords.size(), corpus.rawBytes, [&count]()
+        {
+            count = 0;
+        }, [&]()
+        {
+            for (const auto& word : corpus.rawWords)
+            {
+                adjuster.adjust(word);
+            }
+        });
+    }
+    
+    void AddWordBench(const Corpus& corpus, MarkovTextChain::LearnEngine engine, const std::string& benchmark)
+    {
+        // Слова передаются в цепь перемещением, поэтому копия корпуса готовится до замера.
+        std::vector<std::string> words;
+        std::unique_ptr<MarkovTextChain> chain;
+        Measure(benchmark, corpus, corpus.words.size(), corpus.wordBytes, [&]()
+        {
+            words = corpus.words;
+            chain.reset(new MarkovTextChain(chainOrder));
+            chain->setEngine(engine, 1);
+        }, [&]()
+        {
+            for (auto& word : words)
+            {
+                chain->addWord(std::move(word));
+            }
+            chain->flush();
+            if (engine == MarkovTextChain::LearnEngine::Sort)
+            {
+                chain->commit();
+            }
+        });
+    }
+    
+    void SaveLoadBench(const Corpus& corpus)
+    {
+        MarkovTextChain chain(chainOrder);
+        for (auto word : corpus.words)
+        {
+            chain.addWord(std::move(word));
+        }
+        const size_t states = chain.stateCount();
+        
+        std::ostringstream saved;
+        chain.save(saved);
+        const std::string text = saved.str();
+        
+        std::unique_ptr<std::ostringstream> output;
+        Measure("MarkovTextChain::save", corpus, states, text.size(), [&]()
+        {
+            output.reset(new std::ostringstream());
+        }, [&]()
+        {
+            chain.save(*output);
+        });
+        
+        std::unique_ptr<std::istringstream> input;
+        std::unique_ptr<MarkovTextChain> loaded;
+        Measure("MarkovTextChain::load", corpus, states, text.size(), [&]()
+        {
+            input.reset(new std::istringstream(text));
+            loaded.reset(new MarkovTextChain());
+        }, [&]()
+        {
+            loaded->load(*input);
+        });
+    }
+    
+    void GenerateWordBench(const Corpus& corpus)
+    {
+        MarkovTextChain chain(chainOrder);
+        for (auto word : corpus.words)
+        {
+            chain.addWord(std::move(word));
+        }
+        
+        // Генерация по последовательности слов: поиск состояния по ключу на каждое слово.
+        const size_t count = corpus.words.size();
+        RandomEngine random(syntheticSeed);
+        MarkovTextChain::Words words(corpus.words.begin(), corpus.words.begin() + chainOrder);
+        size_t bytes = 0;
+        Measure("MarkovTextChain::generateWord(words)", corpus, count, corpus.wordBytes, [&]()
+        {
+            random = RandomEngine(syntheticSeed);
+            words.assign(corpus.words.begin(), corpus.words.begin() + chainOrder);
+        }, [&]()
+        {
+            for (size_t i = 0; i < count; ++i)
+            {
+                // Из состояния без продолжения генерация начинается заново с начала корпуса.
+                MarkovTextChain::Word word;
+                try
+                {
+                    word = chain.generateWord(words, random);
+                }
+                catch (const std::exception& e)
+                {
+                    words.assign(corpus.words.begin(), corpus.words.begin() + chainOrder);
+                    continue;
+                }
+                words.pop_front();
+                words.push_back(std::move(word));
+            }
+        });
+        
+        // Генерация по переходам замороженной цепи без поиска по ключу.
+        chain.freeze(MarkovTextChain::FrozenLayout::Hash, true);
+        MarkovTextChain::StateId state = MarkovTextChain::noState;
+        Measure("MarkovTextChain::generateWord(state)", corpus, count, corpus.wordBytes, [&]()
+        {
+            random = RandomEngine(syntheticSeed);
+            state = chain.randomState(random);
+            bytes = 0;
+        }, [&]()
+        {
+            for (size_t i = 0; i < count; ++i)
+            {
+                if (state == MarkovTextChain::noState)
+                {
+                    state = chain.randomState(random);
+                }
+                bytes += chain.generateWord(state, random).size();
+            }
+        });
+    }
+    
+    void RunBenchmarks(const Corpus& corpus)
+    {
+        WordSplitterBench(corpus);
+        TextAdjusterBench(corpus);
+        AddWordBench(corpus, MarkovTextChain::LearnEngine::Hash, "MarkovTextChain::addWord(hash)");
+        AddWordBench(corpus, MarkovTextChain::LearnEngine::Sort, "MarkovTextChain::addWord(sort)");
+        SaveLoadBench(corpus);
+        GenerateWordBench(corpus);
+    }
+    
+    void PrintUsage(const std::string& programName)
+    {
+        std::cout << "Usage: " << programName << " [options] [test data directory]" << std::endl;
+        std::cout << "  -c, --corpus      Corpora to run on: 'test_data', 'synthetic' or 'all' (default)" << std::endl;
+        std::cout << "  -n, --order       Markov chain order, 2 by default" << std::endl;
+        std::cout << "  -w, --words       Number of words of the synthetic corpus, 1000000 by default" << std::endl;
+        std::cout << "  -v, --vocabulary  Number of distinct words of the synthetic corpus, 50000 by default" << std::endl;
+        std::cout << "  -z, --zipf        Zipf skew of the synthetic word frequencies, 1.0 by default" << std::endl;
+        std::cout << "  -s, --seed        Random seed of the synthetic corpus and generation, 1 by default" << std::endl;
+        std::cout << "  -r, --repeat      Number of runs of each benchmark, the fastest is reported, 3 by default" << std::endl;
+        std::cout << "  -h, --help        Show this message and exit" << std::endl << std::endl;
+    }
+    
+    /// @brief Разобрать положительное целое значение ключа.
+    bool ParseCount(const char* text, size_t& value)
+    {
+        try
+        {
+            size_t position = 0;
+            const unsigned long long parsed = std::stoull(text, &position);
+            if (text[position] != '\0' || parsed == 0)
+            {
+                return false;
+            }
+            value = parsed;
+            return true;
+        }
+        catch (const std::exception& e)
+        {
+            return false;
+        }
+    }
+}
+
+int main(int argc, char** argv)
+{
+    std::string programName = argv[0];
+    programName = programName.substr(programName.find_last_of('/') + 1);
+    
+    struct option longOptions[] =
+    {
+       {"corpus", required_argument, 0, 'c'},
+       {"order", required_argument, 0, 'n'},
+       {"words", required_argument, 0, 'w'},
+       {"vocabulary", required_argument, 0, 'v'},
+       {"zipf", required_argument, 0, 'z'},
+       {"seed", required_argument, 0, 's'},
+       {"repeat", required_argument, 0, 'r'},
+       {"help", no_argument, 0, 'h'},
+       {0, 0, 0, 0 }
+    };
+    
+    int c = 0;
+    opterr = 0;
+    bool needHelp = false;
+    size_t seed = syntheticSeed;
+    
+    while ((c = getopt_long(argc, argv, "c:n:w:v:z:s:r:h", longOptions, nullptr)) != -1)
+    {
+        switch (c)
+        {
+        case 'c':
+            corpusFilter = optarg;
+            if (corpusFilter != "test_data" && corpusFilter != "synthetic" && corpusFilter != "all")
+            {
+                std::cerr << "  Unsupported value for 'corpus' parameter" << std::endl;
+                needHelp = true;
+            }
+            break;
+        
+        case 'n':
+            if (!ParseCount(optarg, chainOrder))
+            {
+                std::cerr << "  Unsupported value for 'order' parameter" << std::endl;
+                needHelp = true;
+            }
+            break;
+        
+        case 'w':
+            if (!ParseCount(optarg, syntheticWords))
+            {
+                std::cerr << "  Unsupported value for 'words' parameter" << std::endl;
+                needHelp = true;
+            }
+            break;
+        
+        case 'v':
+            if (!ParseCount(optarg, syntheticVocabulary))
+            {
+                std::cerr << "  Unsupported value for 'vocabulary' parameter" << std::endl;
+                needHelp = true;
+            }
+            break;
+        
+        case 'z':
+            try
+            {
+                size_t position = 0;
+                syntheticSkew = std::stod(optarg, &position);
+                if (optarg[position] != '\0' || syntheticSkew < 0)
+                {
+                    throw std::exception();
+                }
+            }
+            catch (const std::exception& e)
+            {
+                std::cerr << "  Unsupported value for 'zipf' parameter" << std::endl;
+                needHelp = true;
+            }
+            break;
+        
+        case 's':
+            if (!ParseCount(optarg, seed))
+            {
+                std::cerr << "  Unsupported value for 'seed' parameter" << std::endl;
+                needHelp = true;
+            }
+            syntheticSeed = seed;
+            break;
+        
+        case 'r':
+            if (!ParseCount(optarg, repeatCount))
+            {
+                std::cerr << "  Unsupported value for 'repeat' parameter" << std::endl;
+                needHelp = true;
+            }
+            break;
+        
+        case 'h':
+            needHelp = true;
+            break;
+        
+        case '?':
+            std::cerr << " Unknown option or missing argument " << argv[optind-1] << std::endl;
+            needHelp = true;
+            break;
+        }
+    }
+    
+    if (optind < argc)
+    {
+        benchDataDir = argv[optind];
+    }
+    
+    if (needHelp)
+    {
+        PrintUsage(programName);
+        return EXIT_FAILURE;
+    }
+    
+    try
+    {
+        if (corpusFilter != "synthetic")
+        {
+            Corpus corpus;
+            if (!LoadTestDataCorpus(corpus))
+            {
+                return EXIT_FAILURE;
+            }
+            RunBenchmarks(corpus);
+        }
+        
+        if (corpusFilter != "test_data")
+        {
+            Corpus corpus;
+            if (!MakeSyntheticCorpus(corpus))
+            {
+                return EXIT_FAILURE;
+            }
+            RunBenchmarks(corpus);
+        }
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "  Benchmark failed: " << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+    
+    return EXIT_SUCCESS;
+}
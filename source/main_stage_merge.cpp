@@ -0,0 +1,12 @@
+#include "chain_merger.h"
+#include <cstdlib>
+
+
+int main(int argc, char** argv)
+{
+    ChainMerger merger;
+    merger.init(argc, argv);
+    bool result = merger.run();
+    
+    return result ? EXIT_SUCCESS : EXIT_FAILURE;
+}
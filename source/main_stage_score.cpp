@@ -0,0 +1,12 @@
+#include "text_scorer.h"
+#include <cstdlib>
+
+
+int main(int argc, char** argv)
+{
+    TextScorer scorer;
+    scorer.init(argc, argv);
+    bool result = scorer.run();
+    
+    return result ? EXIT_SUCCESS : EXIT_FAILURE;
+}
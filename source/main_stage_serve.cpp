@@ -0,0 +1,12 @@
+#include "generation_server.h"
+#include <cstdlib>
+
+
+int main(int argc, char** argv)
+{
+    GenerationServer server;
+    server.init(argc, argv);
+    bool result = server.run();
+    
+    return result ? EXIT_SUCCESS : EXIT_FAILURE;
+}
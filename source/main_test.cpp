@@ -1,12 +1,33 @@
+#include "buffered_writer.h"
+#include "chain_builder.h"
+#include "chain_merger.h"
+#include "generation_server.h"
+#include "latency.h"
+#include "live_chain.h"
 #include "markov_text_chain.h"
+#include "text_generator.h"
+#include "unix_socket.h"
 #include "text_adjuster.h"
 #include "text_downloader.h"
+#include "trace.h"
 #include "word_splitter.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
 #include <cstring>
 #include <fstream>
 #include <functional>
+#include <getopt.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <iostream>
+#include <limits>
+#include <map>
+#include <sstream>
+#include <thread>
 #include <vector>
 
 
@@ -51,6 +72,103 @@ namespace
 
         return true;
     }
+    
+    bool LoadAdjustedWords(std::vector<std::string>& words)
+    {
+        std::ifstream input(testDataDir + "text_adjuster_model.txt");
+        if (!input.good())
+        {
+            std::cerr << "\n  LoadAdjustedWords: failed to open file '" << testDataDir << "text_adjuster_model.txt' for reading" << std::endl;
+            return false;
+        }
+        
+        std::string word;
+        while (input >> word)
+        {
+            words.push_back(word);
+        }
+        
+        return !words.empty();
+    }
+    
+    // Короткий текст для цепей первого порядка.
+    // Состояния: a -> b (2 появления), b -> c, d (2 появления), c -> a (1 появление), d - тупик.
+    const std::vector<std::string>& ShortWords()
+    {
+        static const std::vector<std::string> words = { "a", "b", "c", "a", "b", "d" };
+        return words;
+    }
+    
+    bool SaveAdjustedChain(size_t order, const std::string& fileName)
+    {
+        std::vector<std::string> words;
+        if (!LoadAdjustedWords(words))
+        {
+            return false;
+        }
+        
+        std::ofstream output(fileName);
+        if (!output.good())
+        {
+            std::cerr << "\n  SaveAdjustedChain: failed to open file '" << fileName << "' for writing" << std::endl;
+            return false;
+        }
+        
+        try
+        {
+            MarkovTextChain chain(order);
+            for (auto word : words)
+            {
+                chain.addWord(std::move(word));
+            }
+            chain.save(output);
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "\n  SaveAdjustedChain: failed to build chain: " << e.what() << std::endl;
+            return false;
+        }
+        
+        return output.good();
+    }
+    
+    std::vector<std::string> CanonicalChainLines(const MarkovTextChain& chain)
+    {
+        std::stringstream stream;
+        chain.save(stream);
+        
+        std::vector<std::string> lines;
+        std::string line;
+        while (std::getline(stream, line))
+        {
+            // Размер таблицы состояний зависит от порядка вставки, сравниваются только состояния.
+            const size_t delimiter = line.find(" -> ");
+            if (delimiter == std::string::npos)
+            {
+                continue;
+            }
+            
+            // Слова значения состояния могут идти в любом порядке.
+            std::stringstream valueStream(line.substr(delimiter + 4));
+            std::vector<std::string> value;
+            std::string word;
+            while (valueStream >> word)
+            {
+                value.push_back(word);
+            }
+            std::sort(value.begin() + 1, value.end());
+            
+            line.resize(delimiter + 4);
+            for (const auto& valueWord : value)
+            {
+                line += valueWord + ' ';
+            }
+            lines.push_back(line);
+        }
+        
+        std::sort(lines.begin(), lines.end());
+        return lines;
+    }
 }
 
 // TextDownloader test
@@ -265,6 +383,1892 @@ namespace
     }
 }
 
+// MarkovTextChain sort engine test
+namespace
+{
+    const size_t sortEngineOrder = 3;
+    const size_t sortEngineThreads = 4;
+    
+    // Сортировка делится между потоками, начиная с 65536 пар на поток.
+    const size_t sortEngineParallelWords = 300000;
+    
+    bool CompareEngines(const std::vector<std::string>& words)
+    {
+        MarkovTextChain hashChain(sortEngineOrder);
+        MarkovTextChain sortChain(sortEngineOrder);
+        sortChain.setEngine(MarkovTextChain::LearnEngine::Sort, sortEngineThreads);
+        
+        try
+        {
+            for (const auto& word : words)
+            {
+                hashChain.addWord(std::string(word));
+                sortChain.addWord(std::string(word));
+            }
+            sortChain.commit();
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "\n  MarkovTextChainSortEngineTest: failed to build chain of " << words.size() << " words: " << e.what() << std::endl;
+            return false;
+        }
+        
+        if (CanonicalChainLines(hashChain) != CanonicalChainLines(sortChain))
+        {
+            std::cerr << "\n  MarkovTextChainSortEngineTest: chains of " << words.size() << " words built by hash and sort engines are different" << std::endl;
+            return false;
+        }
+        
+        return true;
+    }
+    
+    bool MarkovTextChainSortEngineTest()
+    {
+        std::vector<std::string> words;
+        if (!LoadAdjustedWords(words) || words.empty() || !CompareEngines(words))
+        {
+            return false;
+        }
+        
+        // Текст повторяется, пока пар не хватит для сортировки в нескольких потоках.
+        std::vector<std::string> repeated;
+        while (repeated.size() < sortEngineParallelWords)
+        {
+            repeated.insert(repeated.end(), words.begin(), words.end());
+        }
+        return CompareEngines(repeated);
+    }
+}
+
+// MarkovTextChain freeze test
+namespace
+{
+    const size_t freezeOrder = 3;
+    const size_t freezeGeneratedWords = 10000;
+    const uint64_t freezeSeed = 1;
+    
+    bool FreezeTest(MarkovTextChain::FrozenLayout layout)
+    {
+        std::vector<std::string> words;
+        if (!LoadAdjustedWords(words))
+        {
+            return false;
+        }
+        
+        MarkovTextChain chain(freezeOrder);
+        try
+        {
+            for (auto word : words)
+            {
+                chain.addWord(std::move(word));
+            }
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "\n  FreezeTest: failed to build chain: " << e.what() << std::endl;
+            return false;
+        }
+        
+        const auto lines = CanonicalChainLines(chain);
+        const size_t mapMemory = chain.memoryUsage();
+        
+        try
+        {
+            chain.freeze(layout, true);
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "\n  FreezeTest: failed to freeze chain: " << e.what() << std::endl;
+            return false;
+        }
+        
+        if (!chain.frozen() || chain.memoryUsage() >= mapMemory)
+        {
+            std::cerr << "\n  FreezeTest: frozen chain is not compact" << std::endl;
+            return false;
+        }
+        if (CanonicalChainLines(chain) != lines)
+        {
+            std::cerr << "\n  FreezeTest: frozen chain differs from the original one" << std::endl;
+            return false;
+        }
+        
+        RandomEngine random(freezeSeed);
+        
+        // Каждая последовательность слов текста, кроме последней, является состоянием цепи.
+        try
+        {
+            MarkovTextChain::Words state(words.begin(), words.begin() + freezeOrder);
+            for (size_t i = freezeOrder; i < words.size() && i < freezeGeneratedWords; ++i)
+            {
+                chain.generateWord(state, random);
+                state.pop_front();
+                state.push_back(words[i]);
+            }
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "\n  FreezeTest: failed to generate word: " << e.what() << std::endl;
+            return false;
+        }
+        
+        // Переходы между состояниями должны совпадать с поиском по ключу.
+        try
+        {
+            const MarkovTextChain::Words initialWords(words.begin(), words.begin() + freezeOrder);
+            MarkovTextChain::Words state = initialWords;
+            MarkovTextChain::StateId stateId = chain.findState(state);
+            for (size_t i = 0; i < freezeGeneratedWords; ++i)
+            {
+                state.pop_front();
+                state.push_back(chain.generateWord(stateId, random));
+                if (stateId != chain.findState(state))
+                {
+                    std::cerr << "\n  FreezeTest: state link differs from state lookup" << std::endl;
+                    return false;
+                }
+                if (stateId == MarkovTextChain::noState)
+                {
+                    state = initialWords;
+                    stateId = chain.findState(state);
+                }
+            }
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "\n  FreezeTest: failed to generate word by state link: " << e.what() << std::endl;
+            return false;
+        }
+        
+        return true;
+    }
+    
+    bool MarkovTextChainFreezeHashTest()
+    {
+        return FreezeTest(MarkovTextChain::FrozenLayout::Hash);
+    }
+    
+    bool MarkovTextChainFreezeTrieTest()
+    {
+        return FreezeTest(MarkovTextChain::FrozenLayout::Trie);
+    }
+}
+
+// MarkovTextChain live test
+namespace
+{
+    const size_t liveOrder = 2;
+    const size_t liveReaders = 2;
+    const size_t liveGeneratedWords = 50;
+    const uint64_t liveSeed = 1;
+    const uint64_t liveLargeCount = 3000000000ULL;
+    const size_t liveDistinctSuccessors = 20;
+    const size_t liveRepeats = 3;
+    const size_t liveMaxMemory = 1 << 20;
+    
+    bool MarkovTextChainLiveTest()
+    {
+        std::vector<std::string> words;
+        if (!LoadAdjustedWords(words))
+        {
+            return false;
+        }
+        
+        MarkovTextChain reference(liveOrder);
+        MarkovTextChain live(liveOrder);
+        std::atomic<bool> done(false);
+        std::atomic<bool> valid(true);
+        std::vector<std::thread> readers;
+        const std::string phrase = words[0] + ' ' + words[1];
+        try
+        {
+            for (auto word : words)
+            {
+                reference.addWord(std::move(word));
+            }
+            live.makeLive();
+            
+            // Читатели генерируют текст, пока пишущий поток пополняет цепь.
+            for (size_t i = 0; i < liveReaders; ++i)
+            {
+                readers.emplace_back([&, i]()
+                {
+                    RandomEngine random(liveSeed, i);
+                    std::string text;
+                    while (!done)
+                    {
+                        if (live.continuePhrase(phrase, liveGeneratedWords, random, text) && text.compare(0, phrase.size(), phrase) != 0)
+                        {
+                            valid = false;
+                        }
+                    }
+                });
+            }
+            
+            for (auto word : words)
+            {
+                live.addWord(std::move(word));
+            }
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "\n  MarkovTextChainLiveTest: failed to build chain: " << e.what() << std::endl;
+            valid = false;
+        }
+        
+        done = true;
+        for (auto& reader : readers)
+        {
+            reader.join();
+        }
+        
+        RandomEngine random(liveSeed);
+        std::string text;
+        if (!valid || !live.live() || !live.continuePhrase(phrase, liveGeneratedWords, random, text))
+        {
+            std::cerr << "\n  MarkovTextChainLiveTest: generation failed" << std::endl;
+            return false;
+        }
+        
+        if (CanonicalChainLines(live) != CanonicalChainLines(reference))
+        {
+            std::cerr << "\n  MarkovTextChainLiveTest: live chain differs from the hash engine chain" << std::endl;
+            return false;
+        }
+        
+        // Состояние хранит слова с числами появлений, а не каждое появление: число больше 2^31
+        // не занимает памяти, сумма больше 2^32 - 1 отвергается, а слова большого значения находятся по таблице.
+        try
+        {
+            LiveChain counted(1);
+            const LiveChain::WordId key = counted.addWordId("a");
+            const LiveChain::WordId frequent = counted.addWordId("b");
+            LiveChain::Successors expected = { { frequent, liveLargeCount + liveRepeats } };
+            counted.addSuccessor(&key, frequent, liveLargeCount);
+            for (size_t i = 0; i < liveDistinctSuccessors; ++i)
+            {
+                expected.emplace_back(counted.addWordId("w" + std::to_string(i)), liveRepeats);
+            }
+            for (size_t repeat = 0; repeat < liveRepeats; ++repeat)
+            {
+                counted.addSuccessor(&key, frequent, 1);
+                for (size_t i = 0; i < liveDistinctSuccessors; ++i)
+                {
+                    counted.addSuccessor(&key, expected[i + 1].first, 1);
+                }
+            }
+            
+            const LiveChain::StateId state = counted.findState({ "a" });
+            LiveChain::StateId next = state;
+            RandomEngine countedRandom(liveSeed);
+            if (state == LiveChain::noState || counted.successors(state) != expected || counted.memoryUsage() > liveMaxMemory ||
+                counted.step(next, countedRandom) != frequent)
+            {
+                std::cerr << "\n  MarkovTextChainLiveTest: wrong counts of successors" << std::endl;
+                return false;
+            }
+            
+            bool overflow = false;
+            try
+            {
+                counted.addSuccessor(&key, frequent, std::numeric_limits<uint32_t>::max() - liveLargeCount);
+            }
+            catch (const std::length_error&)
+            {
+                overflow = true;
+            }
+            if (!overflow || counted.successors(state) != expected)
+            {
+                std::cerr << "\n  MarkovTextChainLiveTest: overflow of occurrences is not detected" << std::endl;
+                return false;
+            }
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "\n  MarkovTextChainLiveTest: failed to count successors: " << e.what() << std::endl;
+            return false;
+        }
+        
+        return true;
+    }
+}
+
+// MarkovTextChain interleaved generation test
+namespace
+{
+    const size_t interleavedOrder = 2;
+    const size_t interleavedPhrases = 50;
+    const size_t interleavedWords = 200;
+    const uint64_t interleavedSeed = 3;
+    
+    bool MarkovTextChainInterleavedTest()
+    {
+        std::vector<std::string> words;
+        if (!LoadAdjustedWords(words) || words.size() < interleavedPhrases + interleavedOrder)
+        {
+            return false;
+        }
+        
+        // Последняя фраза отсутствует в цепи.
+        std::vector<std::string> phrases;
+        for (size_t i = 0; i + 1 < interleavedPhrases; ++i)
+        {
+            phrases.push_back(words[i] + ' ' + words[i + 1]);
+        }
+        phrases.push_back("absent phrase");
+        
+        MarkovTextChain chain(interleavedOrder);
+        std::vector<RandomEngine> randoms;
+        std::vector<std::string> texts(phrases.size());
+        std::vector<char> results(phrases.size());
+        try
+        {
+            for (auto word : words)
+            {
+                chain.addWord(std::move(word));
+            }
+            chain.freeze(MarkovTextChain::FrozenLayout::Hash, true);
+            
+            for (size_t i = 0; i < phrases.size(); ++i)
+            {
+                randoms.emplace_back(interleavedSeed, i);
+            }
+            chain.continuePhrases(phrases.data(), randoms.data(), texts.data(), results.data(), phrases.size(), interleavedWords);
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "\n  MarkovTextChainInterleavedTest: failed to generate text: " << e.what() << std::endl;
+            return false;
+        }
+        
+        for (size_t i = 0; i < phrases.size(); ++i)
+        {
+            RandomEngine random(interleavedSeed, i);
+            std::string text;
+            const bool result = chain.continuePhrase(phrases[i], interleavedWords, random, text);
+            if (result != static_cast<bool>(results[i]) || text != texts[i])
+            {
+                std::cerr << "\n  MarkovTextChainInterleavedTest: interleaved text differs for phrase " << i << std::endl;
+                return false;
+            }
+        }
+        
+        return !results.back();
+    }
+}
+
+// MarkovTextChain random start test
+namespace
+{
+    const size_t randomStartDraws = 10000;
+    const size_t randomStartWords = 50;
+    
+    bool MarkovTextChainRandomStartTest()
+    {
+        const std::vector<std::string>& words = ShortWords();
+        MarkovTextChain chain(1);
+        size_t startsAfterC = 0;
+        try
+        {
+            for (auto word : words)
+            {
+                chain.addWord(std::move(word));
+            }
+            chain.freeze(MarkovTextChain::FrozenLayout::Hash, true);
+            
+            RandomEngine random(1);
+            std::string text;
+            for (size_t i = 0; i < randomStartDraws; ++i)
+            {
+                if (!chain.continuePhrase("", 1, random, text))
+                {
+                    std::cerr << "\n  MarkovTextChainRandomStartTest: no random start state" << std::endl;
+                    return false;
+                }
+                startsAfterC += text == "a";
+            }
+            
+            // Из тупика d генерация продолжается со случайного состояния.
+            if (!chain.continuePhrase("b", randomStartWords, random, text) ||
+                static_cast<size_t>(std::count(text.begin(), text.end(), ' ')) != randomStartWords)
+            {
+                std::cerr << "\n  MarkovTextChainRandomStartTest: generation stopped at a dead end" << std::endl;
+                return false;
+            }
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "\n  MarkovTextChainRandomStartTest: failed to generate text: " << e.what() << std::endl;
+            return false;
+        }
+        
+        // Состояние c составляет 1/5 всех появлений состояний.
+        if (startsAfterC < randomStartDraws * 17 / 100 || startsAfterC > randomStartDraws * 23 / 100)
+        {
+            std::cerr << "\n  MarkovTextChainRandomStartTest: start states are not weighted by frequency" << std::endl;
+            return false;
+        }
+        
+        return true;
+    }
+}
+
+// MarkovTextChain backoff test
+namespace
+{
+    const size_t backoffOrder = 3;
+    const size_t backoffWords = 30;
+    const uint64_t backoffSeed = 5;
+    const uint64_t backoffSeeds = 20;
+    
+    bool MarkovTextChainBackoffTest()
+    {
+        std::vector<std::string> words;
+        if (!LoadAdjustedWords(words))
+        {
+            return false;
+        }
+        
+        // Цепь с откатом содержит те же состояния, что и цепи всех порядков от 1 до порядка цепи вместе.
+        MarkovTextChain backoff(backoffOrder);
+        backoff.setBackoff(true);
+        std::vector<std::string> expected;
+        std::stringstream stream;
+        try
+        {
+            for (size_t order = 1; order <= backoffOrder; ++order)
+            {
+                MarkovTextChain chain(order);
+                for (auto word : words)
+                {
+                    chain.addWord(std::move(word));
+                }
+                const std::vector<std::string> lines = CanonicalChainLines(chain);
+                expected.insert(expected.end(), lines.begin(), lines.end());
+            }
+            for (auto word : words)
+            {
+                backoff.addWord(std::move(word));
+            }
+            backoff.save(stream);
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "\n  MarkovTextChainBackoffTest: failed to build chain: " << e.what() << std::endl;
+            return false;
+        }
+        
+        std::sort(expected.begin(), expected.end());
+        if (CanonicalChainLines(backoff) != expected)
+        {
+            std::cerr << "\n  MarkovTextChainBackoffTest: backoff chain differs from chains of all orders" << std::endl;
+            return false;
+        }
+        
+        // Загруженная цепь распознается как цепь с откатом и продолжает фразы, известные только по окончанию.
+        MarkovTextChain loaded;
+        RandomEngine random(backoffSeed);
+        std::string text;
+        try
+        {
+            loaded.load(stream);
+            loaded.freeze(MarkovTextChain::FrozenLayout::Trie, true);
+            if (!loaded.backoff() || CanonicalChainLines(loaded) != expected ||
+                !loaded.continuePhrase("nosuchword nosuchword " + words[0], backoffWords, random, text))
+            {
+                std::cerr << "\n  MarkovTextChainBackoffTest: loaded chain does not back off" << std::endl;
+                return false;
+            }
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "\n  MarkovTextChainBackoffTest: failed to load chain: " << e.what() << std::endl;
+            return false;
+        }
+        
+        // Ключа [b c] в цепи нет, поэтому слово e после "a b c" достижимо только откатом к состоянию [c].
+        try
+        {
+            for (const auto layout : { MarkovTextChain::FrozenLayout::Hash, MarkovTextChain::FrozenLayout::Trie })
+            {
+                MarkovTextChain chain(2);
+                chain.setBackoff(true);
+                for (const char* word : { "a", "b", "c" })
+                {
+                    chain.addWord(word);
+                }
+                chain.flush();
+                for (const char* word : { "c", "e" })
+                {
+                    chain.addWord(word);
+                }
+                chain.freeze(layout, true);
+                for (uint64_t seed = 0; seed < backoffSeeds; ++seed)
+                {
+                    const std::string phrases[] = { "a b", "x b" };
+                    RandomEngine randoms[] = { RandomEngine(seed), RandomEngine(seed + backoffSeeds) };
+                    std::string texts[2];
+                    char results[2];
+                    chain.continuePhrases(phrases, randoms, texts, results, 2, 2);
+                    RandomEngine seeded(seed);
+                    if (!chain.continuePhrase("a b", 2, seeded, text) || text != "a b c e" ||
+                        !chain.continuePhrase("x c", 1, seeded, text) || text != "x c e" ||
+                        !results[0] || texts[0] != "a b c e" || !results[1] || texts[1] != "x b c e")
+                    {
+                        std::cerr << "\n  MarkovTextChainBackoffTest: generation does not follow a backoff link" << std::endl;
+                        return false;
+                    }
+                }
+            }
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "\n  MarkovTextChainBackoffTest: failed to generate text: " << e.what() << std::endl;
+            return false;
+        }
+        
+        return true;
+    }
+}
+
+// MarkovTextChain score test
+namespace
+{
+    const double scoreTolerance = 1e-9;
+    
+    bool CheckScore(const MarkovTextChain& chain, const std::vector<std::string>& text, size_t scored, double logProbability,
+                    size_t unknown = 0, double addK = 0.0)
+    {
+        const MarkovTextChain::Score score = chain.score(text.data(), text.size(), addK);
+        return score.words == text.size() && score.scored == scored && std::fabs(score.logProbability - logProbability) < scoreTolerance &&
+               score.unknown == unknown;
+    }
+    
+    bool MarkovTextChainScoreTest()
+    {
+        const std::vector<std::string>& words = ShortWords();
+        try
+        {
+            for (const auto layout : { MarkovTextChain::FrozenLayout::Hash, MarkovTextChain::FrozenLayout::Trie })
+            {
+                MarkovTextChain chain(1);
+                for (auto word : words)
+                {
+                    chain.addWord(std::move(word));
+                }
+                chain.freeze(layout);
+                
+                // Первое слово задает состояние, слово x неизвестно, переход d -> a отсутствует.
+                if (!CheckScore(chain, { "a", "b", "c", "a", "x" }, 3, std::log(0.5), 1) ||
+                    !CheckScore(chain, { "d", "a", "b" }, 1, 0.0) ||
+                    !CheckScore(chain, { "a" }, 0, 0.0))
+                {
+                    std::cerr << "\n  MarkovTextChainScoreTest: wrong score of a plain chain" << std::endl;
+                    return false;
+                }
+                
+                // Со сглаживанием 1 каждое из 4 слов словаря и неизвестное слово получают по появлению сверх
+                // своих, а слово после состояния d, которого нет, - вероятность 1 / 5.
+                if (!CheckScore(chain, { "a", "b", "c", "a", "x" }, 4, std::log(3.0 / 7 * 2.0 / 7 * 2.0 / 6 * 1.0 / 7), 1, 1.0) ||
+                    !CheckScore(chain, { "d", "a", "b" }, 2, std::log(1.0 / 5 * 3.0 / 7), 0, 1.0))
+                {
+                    std::cerr << "\n  MarkovTextChainScoreTest: wrong smoothed score of a plain chain" << std::endl;
+                    return false;
+                }
+            }
+            
+            // Цепь с откатом оценивает второе слово по первому, а для неизвестного ключа берет его окончание.
+            MarkovTextChain backoff(2);
+            backoff.setBackoff(true);
+            for (auto word : words)
+            {
+                backoff.addWord(std::move(word));
+            }
+            backoff.freeze();
+            if (!CheckScore(backoff, { "a", "b", "d" }, 2, std::log(0.5)) ||
+                !CheckScore(backoff, { "x", "b", "d" }, 1, std::log(0.5)))
+            {
+                std::cerr << "\n  MarkovTextChainScoreTest: wrong score of a backoff chain" << std::endl;
+                return false;
+            }
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "\n  MarkovTextChainScoreTest: failed to score text: " << e.what() << std::endl;
+            return false;
+        }
+        
+        return true;
+    }
+}
+
+// MarkovTextChain decay test
+namespace
+{
+    const size_t decayOrder = 2;
+    const size_t decayMaxStates = 1000;
+    
+    bool MarkovTextChainDecayTest()
+    {
+        std::vector<std::string> words;
+        if (!LoadAdjustedWords(words))
+        {
+            return false;
+        }
+        
+        // Уменьшение вдвое после семи переходов: x -> y и y -> x остаются с одним появлением, x -> z удаляется.
+        const std::vector<std::string> stream = { "x", "y", "x", "y", "x", "y", "x", "z" };
+        const std::vector<std::string> halved = { "x", "y", "x" };
+        MarkovTextChain decayed(1);
+        MarkovTextChain expected(1);
+        MarkovTextChain bounded(decayOrder);
+        decayed.setDecay(stream.size() - 1, 0);
+        bounded.setDecay(0, decayMaxStates);
+        try
+        {
+            for (auto word : stream)
+            {
+                decayed.addWord(std::move(word));
+            }
+            for (auto word : halved)
+            {
+                expected.addWord(std::move(word));
+            }
+            for (auto word : words)
+            {
+                bounded.addWord(std::move(word));
+                if (bounded.stateCount() > decayMaxStates)
+                {
+                    std::cerr << "\n  MarkovTextChainDecayTest: state limit is exceeded" << std::endl;
+                    return false;
+                }
+            }
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "\n  MarkovTextChainDecayTest: failed to build chain: " << e.what() << std::endl;
+            return false;
+        }
+        
+        if (CanonicalChainLines(decayed) != CanonicalChainLines(expected))
+        {
+            std::cerr << "\n  MarkovTextChainDecayTest: word counts are not halved" << std::endl;
+            return false;
+        }
+        
+        if (bounded.stateCount() == 0)
+        {
+            std::cerr << "\n  MarkovTextChainDecayTest: bounded chain is empty" << std::endl;
+            return false;
+        }
+        
+        return true;
+    }
+}
+
+// MarkovTextChain counters test
+namespace
+{
+    bool MarkovTextChainCountersTest()
+    {
+        const std::vector<std::string>& words = ShortWords();
+        try
+        {
+            for (const auto engine : { MarkovTextChain::LearnEngine::Hash, MarkovTextChain::LearnEngine::Sort })
+            {
+                MarkovTextChain chain(1);
+                chain.setEngine(engine, 1);
+                for (auto word : words)
+                {
+                    chain.addWord(std::move(word));
+                }
+                chain.commit();
+                
+                const MarkovTextChain::Counters counters = chain.counters();
+                if (counters.words != words.size() || counters.states != 3 || counters.successors != 4 ||
+                    counters.states != chain.stateCount() || chain.loadFactor() <= 0.0)
+                {
+                    std::cerr << "\n  MarkovTextChainCountersTest: wrong counters " << counters.words << ", "
+                              << counters.states << ", " << counters.successors << std::endl;
+                    return false;
+                }
+            }
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "\n  MarkovTextChainCountersTest: failed to build chain: " << e.what() << std::endl;
+            return false;
+        }
+        
+        return true;
+    }
+}
+
+// MarkovTextChain compact format test
+namespace
+{
+    const size_t compactOrder = 3;
+    const size_t compactWords = 30;
+    const uint64_t compactSeed = 7;
+    const size_t compactReaders = 4;
+    
+    bool MarkovTextChainCompactTest()
+    {
+        std::vector<std::string> words;
+        if (!LoadAdjustedWords(words))
+        {
+            return false;
+        }
+        
+        MarkovTextChain chain(compactOrder);
+        chain.setBackoff(true);
+        std::stringstream text;
+        std::stringstream compact;
+        try
+        {
+            for (auto word : words)
+            {
+                chain.addWord(std::move(word));
+            }
+            chain.save(text);
+            chain.save(compact, MarkovTextChain::ChainFormat::Compact);
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "\n  MarkovTextChainCompactTest: failed to build chain: " << e.what() << std::endl;
+            return false;
+        }
+        
+        const std::string data = compact.str();
+        if (data.size() * 4 > text.str().size())
+        {
+            std::cerr << "\n  MarkovTextChainCompactTest: compact chain is not smaller, " << data.size() << " bytes" << std::endl;
+            return false;
+        }
+        
+        try
+        {
+            // Загруженная цепь совпадает с исходной, и кодирование не зависит от представления цепи.
+            const std::vector<std::string> expected = CanonicalChainLines(chain);
+            MarkovTextChain loaded;
+            loaded.load(compact);
+            std::stringstream again;
+            loaded.save(again, MarkovTextChain::ChainFormat::Compact);
+            if (!loaded.backoff() || CanonicalChainLines(loaded) != expected || again.str() != data)
+            {
+                std::cerr << "\n  MarkovTextChainCompactTest: loaded chain differs from saved one" << std::endl;
+                return false;
+            }
+            
+            RandomEngine random(compactSeed);
+            std::string phrase;
+            loaded.freeze(MarkovTextChain::FrozenLayout::Trie, true);
+            std::stringstream frozen;
+            loaded.save(frozen, MarkovTextChain::ChainFormat::Compact);
+            if (frozen.str() != data || !loaded.continuePhrase(words[0], compactWords, random, phrase))
+            {
+                std::cerr << "\n  MarkovTextChainCompactTest: frozen chain differs from saved one" << std::endl;
+                return false;
+            }
+            
+            // Цепь, загруженная в компактном формате, пополняется так же, как загруженная из текста.
+            MarkovTextChain fromText;
+            MarkovTextChain fromCompact;
+            text.seekg(0);
+            fromText.load(text);
+            compact.clear();
+            compact.seekg(0);
+            fromCompact.load(compact);
+            for (size_t i = 0; i < compactWords; ++i)
+            {
+                fromText.addWord(std::string(words[i]));
+                fromCompact.addWord(std::string(words[i]));
+            }
+            if (CanonicalChainLines(fromCompact) != CanonicalChainLines(fromText))
+            {
+                std::cerr << "\n  MarkovTextChainCompactTest: extended chains differ" << std::endl;
+                return false;
+            }
+            
+            // Потоки, одновременно генерирующие слова по загруженной цепи и запрашивающие ее размер,
+            // переносят ее состояния в таблицу один раз. Половина потоков сначала запрашивает размер.
+            MarkovTextChain shared;
+            compact.clear();
+            compact.seekg(0);
+            shared.load(compact);
+            const MarkovTextChain::Words key(words.begin(), words.begin() + compactOrder);
+            std::atomic<size_t> generated(0);
+            std::vector<std::thread> readers;
+            for (size_t i = 0; i < compactReaders; ++i)
+            {
+                readers.emplace_back([&, i]()
+                {
+                    RandomEngine reader(compactSeed, i);
+                    const auto sizeMatches = [&shared, &expected]()
+                    {
+                        return shared.stateCount() == expected.size() && shared.memoryUsage() > 0;
+                    };
+                    try
+                    {
+                        if (i % 2 == 0 && !sizeMatches())
+                        {
+                            return;
+                        }
+                        shared.generateWord(key, reader);
+                        if (i % 2 == 1 && !sizeMatches())
+                        {
+                            return;
+                        }
+                        ++generated;
+                    }
+                    catch (const std::exception&)
+                    {
+                    }
+                });
+            }
+            for (auto& reader : readers)
+            {
+                reader.join();
+            }
+            if (generated != compactReaders || CanonicalChainLines(shared) != expected)
+            {
+                std::cerr << "\n  MarkovTextChainCompactTest: concurrent generation from a loaded chain failed" << std::endl;
+                return false;
+            }
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "\n  MarkovTextChainCompactTest: failed to load chain: " << e.what() << std::endl;
+            return false;
+        }
+        
+        // Обрезанный файл не загружается.
+        std::stringstream truncated(data.substr(0, data.size() / 2));
+        try
+        {
+            MarkovTextChain broken;
+            broken.load(truncated);
+            std::cerr << "\n  MarkovTextChainCompactTest: truncated chain was loaded" << std::endl;
+            return false;
+        }
+        catch (const std::exception&)
+        {
+        }
+        
+        return true;
+    }
+}
+
+// MarkovTextChain sorted format test
+namespace
+{
+    const size_t sortedOrder = 2;
+    
+    bool MarkovTextChainSortedTest()
+    {
+        std::vector<std::string> words;
+        if (!LoadAdjustedWords(words))
+        {
+            return false;
+        }
+        
+        // Ожидаемые значения состояний, подсчитанные непосредственно по тексту.
+        std::map<MarkovTextChain::Words, std::map<std::string, size_t>> expected;
+        for (size_t i = sortedOrder; i < words.size(); ++i)
+        {
+            ++expected[MarkovTextChain::Words(&words[i - sortedOrder], &words[i])][words[i]];
+        }
+        
+        // Файл не зависит от способа построения цепи и ее представления.
+        std::vector<std::string> files;
+        try
+        {
+            for (const auto engine : { MarkovTextChain::LearnEngine::Hash, MarkovTextChain::LearnEngine::Sort })
+            {
+                MarkovTextChain chain(sortedOrder);
+                chain.setEngine(engine, 2);
+                for (auto word : words)
+                {
+                    chain.addWord(std::move(word));
+                }
+                chain.commit();
+                std::stringstream stream;
+                chain.save(stream, MarkovTextChain::ChainFormat::Sorted);
+                files.push_back(stream.str());
+                
+                chain.freeze();
+                stream.str("");
+                chain.save(stream, MarkovTextChain::ChainFormat::Sorted);
+                files.push_back(stream.str());
+            }
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "\n  MarkovTextChainSortedTest: failed to build chain: " << e.what() << std::endl;
+            return false;
+        }
+        if (std::count(files.begin(), files.end(), files[0]) != static_cast<std::ptrdiff_t>(files.size()))
+        {
+            std::cerr << "\n  MarkovTextChainSortedTest: sorted files differ" << std::endl;
+            return false;
+        }
+        
+        try
+        {
+            std::stringstream stream(files[0]);
+            MarkovTextChain loaded;
+            loaded.load(stream);
+            if (loaded.stateCount() != expected.size())
+            {
+                std::cerr << "\n  MarkovTextChainSortedTest: loaded chain has " << loaded.stateCount() << " states" << std::endl;
+                return false;
+            }
+            
+            // Значения всех состояний, включая первое и последнее в файле, находятся поиском по файлу.
+            MarkovTextChain::Successors successors;
+            for (const auto& state : expected)
+            {
+                const MarkovTextChain::Words& key = state.first;
+                const auto& value = state.second;
+                if (!MarkovTextChain::lookup(stream, key, successors) || successors.size() != value.size() ||
+                    !std::equal(value.begin(), value.end(), successors.begin(), [](const std::pair<const std::string, size_t>& left, const std::pair<std::string, size_t>& right)
+                    {
+                        return left.first == right.first && left.second == right.second;
+                    }))
+                {
+                    std::cerr << "\n  MarkovTextChainSortedTest: wrong value of state " << key.front() << ' ' << key.back() << std::endl;
+                    return false;
+                }
+            }
+            if (MarkovTextChain::lookup(stream, { "nosuchword", "nosuchword" }, successors) ||
+                MarkovTextChain::lookup(stream, { "", "" }, successors))
+            {
+                std::cerr << "\n  MarkovTextChainSortedTest: found a state that is not in the chain" << std::endl;
+                return false;
+            }
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "\n  MarkovTextChainSortedTest: failed to search chain: " << e.what() << std::endl;
+            return false;
+        }
+        
+        return true;
+    }
+}
+
+// ChainMerger test
+namespace
+{
+    const size_t mergeOrder = 2;
+    const size_t mergeParts = 3;
+    const std::string mergePartOutput = "merge_part_output_";
+    
+    bool ChainMergerTest()
+    {
+        std::vector<std::string> words;
+        if (!LoadAdjustedWords(words))
+        {
+            return false;
+        }
+        
+        // Части текста перекрываются на порядок цепи, поэтому вместе дают все состояния текста.
+        // Упорядочена только средняя часть, остальные сортируются при слиянии.
+        std::string whole;
+        std::vector<std::string> arguments = {"stage_merge", "-m", "1", "-d", "."};
+        try
+        {
+            for (size_t part = 0; part <= mergeParts; ++part)
+            {
+                const size_t first = part < mergeParts ? std::max(words.size() * part / mergeParts, mergeOrder) - mergeOrder : 0;
+                const size_t last = part < mergeParts ? words.size() * (part + 1) / mergeParts : words.size();
+                MarkovTextChain chain(mergeOrder);
+                for (size_t i = first; i < last; ++i)
+                {
+                    chain.addWord(std::string(words[i]));
+                }
+                chain.commit();
+                
+                if (part == mergeParts)
+                {
+                    std::stringstream stream;
+                    chain.save(stream, MarkovTextChain::ChainFormat::Sorted);
+                    whole = stream.str();
+                    break;
+                }
+                arguments.push_back(mergePartOutput + std::to_string(part) + ".txt");
+                std::ofstream output(arguments.back());
+                chain.save(output, part == 1 ? MarkovTextChain::ChainFormat::Sorted : MarkovTextChain::ChainFormat::Text);
+            }
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "\n  ChainMergerTest: failed to build chains: " << e.what() << std::endl;
+            return false;
+        }
+        
+        // Результат совпадает с цепью всего текста и не зависит от числа потоков. При 256 потоках
+        // на поток приходится два открытых файла, и три файла сначала сливаются промежуточно.
+        for (const auto threads : { "1", "4", "256" })
+        {
+            std::vector<std::string> threadArguments = arguments;
+            threadArguments.insert(threadArguments.begin() + 1, { "-j", threads });
+            std::vector<char*> argv;
+            for (auto& argument : threadArguments)
+            {
+                argv.push_back(&argument[0]);
+            }
+            
+            optind = 0;
+            ChainMerger merger;
+            merger.init(argv.size(), argv.data());
+            std::stringstream merged;
+            try
+            {
+                merger.merge(merged);
+            }
+            catch (const std::exception& e)
+            {
+                std::cerr << "\n  ChainMergerTest: failed to merge chains: " << e.what() << std::endl;
+                return false;
+            }
+            if (merged.str() != whole)
+            {
+                std::cerr << "\n  ChainMergerTest: merged chain differs from chain of the whole text with " << threads << " threads" << std::endl;
+                return false;
+            }
+        }
+        
+        return true;
+    }
+}
+
+// MarkovTextChain delta test
+namespace
+{
+    const size_t deltaOrder = 2;
+    const std::string deltaChainOutput = "delta_chain_output.txt";
+    
+    bool MarkovTextChainDeltaTest()
+    {
+        std::vector<std::string> words;
+        if (!LoadAdjustedWords(words))
+        {
+            return false;
+        }
+        
+        // Цепь с дописанным приращением второй половины текста равна цепи, построенной по обеим половинам.
+        const size_t half = words.size() / 2;
+        std::string whole;
+        try
+        {
+            MarkovTextChain chain(deltaOrder);
+            MarkovTextChain delta(deltaOrder);
+            for (size_t i = 0; i < words.size(); ++i)
+            {
+                if (i == half)
+                {
+                    chain.flush();
+                    std::ofstream output(deltaChainOutput);
+                    chain.save(output);
+                }
+                chain.addWord(std::string(words[i]));
+                if (i >= half)
+                {
+                    delta.addWord(std::string(words[i]));
+                }
+            }
+            
+            std::stringstream stream;
+            chain.save(stream, MarkovTextChain::ChainFormat::Sorted);
+            whole = stream.str();
+            std::ofstream output(deltaChainOutput, std::ios::app);
+            delta.save(output);
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "\n  MarkovTextChainDeltaTest: failed to build chains: " << e.what() << std::endl;
+            return false;
+        }
+        
+        // Приращение учитывается как при загрузке, так и при слиянии файла.
+        try
+        {
+            std::ifstream input(deltaChainOutput);
+            MarkovTextChain loaded;
+            loaded.load(input);
+            std::stringstream stream;
+            loaded.save(stream, MarkovTextChain::ChainFormat::Sorted);
+            if (stream.str() != whole)
+            {
+                std::cerr << "\n  MarkovTextChainDeltaTest: loaded chain differs from chain of the whole text" << std::endl;
+                return false;
+            }
+            
+            std::vector<std::string> arguments = {"stage_merge", "-d", ".", deltaChainOutput};
+            std::vector<char*> argv;
+            for (auto& argument : arguments)
+            {
+                argv.push_back(&argument[0]);
+            }
+            optind = 0;
+            ChainMerger merger;
+            merger.init(argv.size(), argv.data());
+            stream.str("");
+            merger.merge(stream);
+            if (stream.str() != whole)
+            {
+                std::cerr << "\n  MarkovTextChainDeltaTest: merged chain differs from chain of the whole text" << std::endl;
+                return false;
+            }
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "\n  MarkovTextChainDeltaTest: failed to load chain: " << e.what() << std::endl;
+            return false;
+        }
+        
+        return true;
+    }
+}
+
+// ChainBuilder checkpoint test
+namespace
+{
+    const std::string checkpointOutput = "checkpoint_output.bin";
+    const std::string checkpointChainOutput = "checkpoint_chain_output.txt";
+    const std::string checkpointExpectedOutput = "checkpoint_expected_output.txt";
+    const std::string checkpointTextOutput = "checkpoint_text_output.txt";
+    
+    bool RunLearn(std::vector<std::string> arguments, const std::string& text)
+    {
+        std::vector<char*> argv;
+        for (auto& argument : arguments)
+        {
+            argv.push_back(&argument[0]);
+        }
+        
+        std::stringstream input(text);
+        std::streambuf* cinBuffer = std::cin.rdbuf(input.rdbuf());
+        std::streambuf* cerrBuffer = std::cerr.rdbuf(nullptr);
+        std::streambuf* coutBuffer = std::cout.rdbuf(nullptr);
+        
+        optind = 0;
+        ChainBuilder builder;
+        builder.init(static_cast<int>(argv.size()), argv.data());
+        const bool success = builder.run();
+        
+        std::cin.rdbuf(cinBuffer);
+        std::cerr.rdbuf(cerrBuffer);
+        std::cout.rdbuf(coutBuffer);
+        return success;
+    }
+    
+    bool ChainBuilderCheckpointTest()
+    {
+        std::vector<std::string> words;
+        if (!LoadAdjustedWords(words))
+        {
+            return false;
+        }
+        std::ofstream textOutput(checkpointTextOutput);
+        for (const auto& word : words)
+        {
+            textOutput << word << ' ';
+        }
+        textOutput.close();
+        char directory[PATH_MAX];
+        if (getcwd(directory, sizeof(directory)) == nullptr)
+        {
+            std::cerr << "\n  ChainBuilderCheckpointTest: failed to get current directory" << std::endl;
+            return false;
+        }
+        const std::string url = std::string("file://") + directory + '/' + checkpointTextOutput;
+        
+        // Текст std::cin при продолжении заново не прочитать, каталог точки должен существовать.
+        if (RunLearn({"stage_learn", "-n", "2", "-c", checkpointOutput, "-o", checkpointChainOutput, "-"}, "") ||
+            RunLearn({"stage_learn", "-n", "2", "-c", "nonexistent/checkpoint", "-o", checkpointChainOutput, url}, ""))
+        {
+            std::cerr << "\n  ChainBuilderCheckpointTest: invalid checkpoint options were accepted" << std::endl;
+            return false;
+        }
+        
+        // Точка не сохраняется, когда на месте временного файла каталог, но построение продолжается.
+        const std::string blockedCheckpoint = checkpointOutput + ".blocked";
+        mkdir((blockedCheckpoint + ".tmp").c_str(), 0700);
+        const bool blockedLearned = RunLearn({"stage_learn", "-n", "2", "-c", blockedCheckpoint, "-C", "0", "-o", checkpointChainOutput, url}, "");
+        rmdir((blockedCheckpoint + ".tmp").c_str());
+        if (!blockedLearned)
+        {
+            std::cerr << "\n  ChainBuilderCheckpointTest: failed checkpoint stopped learning" << std::endl;
+            return false;
+        }
+        
+        // Построение прерывается ошибкой загрузки второго адреса после контрольной точки первого.
+        std::remove(checkpointOutput.c_str());
+        if (!RunLearn({"stage_learn", "-n", "2", "-o", checkpointExpectedOutput, url}, "") ||
+            RunLearn({"stage_learn", "-n", "2", "-c", checkpointOutput, "-C", "0", "-o", checkpointChainOutput, url, "file:///nonexistent"}, ""))
+        {
+            std::cerr << "\n  ChainBuilderCheckpointTest: unexpected result of learning" << std::endl;
+            return false;
+        }
+        if (!std::ifstream(checkpointOutput).good())
+        {
+            std::cerr << "\n  ChainBuilderCheckpointTest: checkpoint was not saved" << std::endl;
+            return false;
+        }
+        
+        // При продолжении текст первого адреса не читается повторно.
+        std::remove(checkpointTextOutput.c_str());
+        if (!RunLearn({"stage_learn", "-n", "2", "-c", checkpointOutput, "-r", "-o", checkpointChainOutput, url}, ""))
+        {
+            std::cerr << "\n  ChainBuilderCheckpointTest: failed to resume learning" << std::endl;
+            return false;
+        }
+        if (std::ifstream(checkpointOutput).good())
+        {
+            std::cerr << "\n  ChainBuilderCheckpointTest: checkpoint was not removed" << std::endl;
+            return false;
+        }
+        
+        try
+        {
+            std::string files[2];
+            const std::string names[2] = { checkpointExpectedOutput, checkpointChainOutput };
+            for (size_t i = 0; i < 2; ++i)
+            {
+                std::ifstream input(names[i]);
+                MarkovTextChain chain;
+                chain.load(input);
+                std::stringstream stream;
+                chain.save(stream, MarkovTextChain::ChainFormat::Sorted);
+                files[i] = stream.str();
+            }
+            if (files[0] != files[1])
+            {
+                std::cerr << "\n  ChainBuilderCheckpointTest: resumed chain differs from chain learned at once" << std::endl;
+                return false;
+            }
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "\n  ChainBuilderCheckpointTest: failed to load chain: " << e.what() << std::endl;
+            return false;
+        }
+        
+        return true;
+    }
+}
+
+// ChainBuilder append test
+namespace
+{
+    const std::string appendExpectedOutput = "append_expected_output.txt";
+    const std::string appendChainOutput = "append_chain_output.txt";
+    const std::string appendDeltaOutput = "append_delta_output.txt";
+    const size_t appendDeltaWords = 4;
+    
+    size_t CountReadStates(const std::string& fileName, bool& sorted)
+    {
+        std::ifstream input(fileName);
+        MarkovTextChain::StateReader reader(input);
+        MarkovTextChain::Words key;
+        MarkovTextChain::Successors successors;
+        size_t states = 0;
+        while (reader.next(key, successors))
+        {
+            ++states;
+        }
+        sorted = reader.sorted();
+        return states;
+    }
+    
+    bool ChainBuilderAppendTest()
+    {
+        std::vector<std::string> words;
+        if (!LoadAdjustedWords(words))
+        {
+            return false;
+        }
+        std::string first;
+        std::string second;
+        for (size_t i = 0; i < words.size(); ++i)
+        {
+            (i < words.size() / 2 ? first : second) += words[i] + ' ';
+        }
+        
+        // Приращение к цепи с откатом строится с откатом и без флага -b.
+        if (!RunLearn({"stage_learn", "-n", "2", "-b", "-o", appendExpectedOutput, "-"}, first) ||
+            !RunLearn({"stage_learn", "-B", appendExpectedOutput, "-a", "-b", "-"}, second) ||
+            !RunLearn({"stage_learn", "-n", "2", "-b", "-o", appendChainOutput, "-"}, first) ||
+            !RunLearn({"stage_learn", "-B", appendChainOutput, "-a", "-"}, second))
+        {
+            std::cerr << "\n  ChainBuilderAppendTest: failed to append to backoff chain" << std::endl;
+            return false;
+        }
+        
+        std::ifstream expected(appendExpectedOutput);
+        std::ifstream appended(appendChainOutput);
+        const std::string expectedText((std::istreambuf_iterator<char>(expected)), std::istreambuf_iterator<char>());
+        const std::string appendedText((std::istreambuf_iterator<char>(appended)), std::istreambuf_iterator<char>());
+        if (expectedText.empty() || appendedText != expectedText)
+        {
+            std::cerr << "\n  ChainBuilderAppendTest: delta without -b differs from delta with -b" << std::endl;
+            return false;
+        }
+        
+        // Приращение с откатом к цепи без отката не дописывается.
+        if (!RunLearn({"stage_learn", "-n", "2", "-o", appendChainOutput, "-"}, first) ||
+            RunLearn({"stage_learn", "-B", appendChainOutput, "-a", "-b", "-"}, second))
+        {
+            std::cerr << "\n  ChainBuilderAppendTest: backoff delta was appended to chain without backoff" << std::endl;
+            return false;
+        }
+        
+        // К цепи формата Sorted приращение не дописывается: читатели индекса его бы не увидели.
+        std::string delta;
+        for (size_t i = 0; i < appendDeltaWords; ++i)
+        {
+            delta += words[i] + ' ';
+        }
+        if (!RunLearn({"stage_learn", "-n", "2", "-f", "sorted", "-o", appendChainOutput, "-"}, first) ||
+            RunLearn({"stage_learn", "-B", appendChainOutput, "-a", "-"}, second) ||
+            !RunLearn({"stage_learn", "-n", "2", "-o", appendDeltaOutput, "-"}, delta))
+        {
+            std::cerr << "\n  ChainBuilderAppendTest: delta was appended to sorted chain" << std::endl;
+            return false;
+        }
+        
+        // Короткое приращение, дописанное за индексом другим способом, делает файл неупорядоченным,
+        // и его состояния читаются следом за состояниями цепи.
+        try
+        {
+            bool baseSorted = false;
+            bool deltaSorted = false;
+            bool appendedSorted = false;
+            const size_t baseStates = CountReadStates(appendChainOutput, baseSorted);
+            const size_t deltaStates = CountReadStates(appendDeltaOutput, deltaSorted);
+            {
+                std::ifstream deltaInput(appendDeltaOutput);
+                std::ofstream appendOutput(appendChainOutput, std::ios::app);
+                appendOutput << deltaInput.rdbuf();
+            }
+            const size_t appendedStates = CountReadStates(appendChainOutput, appendedSorted);
+            if (!baseSorted || appendedSorted || deltaStates == 0 || appendedStates != baseStates + deltaStates)
+            {
+                std::cerr << "\n  ChainBuilderAppendTest: delta after the index of sorted chain is lost" << std::endl;
+                return false;
+            }
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "\n  ChainBuilderAppendTest: failed to read chain with delta: " << e.what() << std::endl;
+            return false;
+        }
+        
+        return true;
+    }
+}
+
+// RandomEngine test
+namespace
+{
+    const uint64_t randomSeed = 42;
+    const uint64_t randomBound = 10;
+    const size_t randomSamples = 1000000;
+    
+    bool RandomEngineTest()
+    {
+        RandomEngine first(randomSeed);
+        RandomEngine second(randomSeed);
+        RandomEngine otherStream(randomSeed, 1);
+        RandomEngine jumped(randomSeed);
+        jumped.jump();
+        
+        std::vector<size_t> histogram(randomBound, 0);
+        bool sameStream = true;
+        bool otherStreamDiffers = false;
+        bool jumpedDiffers = false;
+        for (size_t i = 0; i < randomSamples; ++i)
+        {
+            const uint64_t value = first.uniform(randomBound);
+            if (value >= randomBound)
+            {
+                std::cerr << "\n  RandomEngineTest: value is out of range" << std::endl;
+                return false;
+            }
+            ++histogram[value];
+            
+            sameStream = sameStream && value == second.uniform(randomBound);
+            otherStreamDiffers = otherStreamDiffers || value != otherStream.uniform(randomBound);
+            jumpedDiffers = jumpedDiffers || value != jumped.uniform(randomBound);
+        }
+        
+        if (!sameStream || !otherStreamDiffers || !jumpedDiffers)
+        {
+            std::cerr << "\n  RandomEngineTest: streams are not reproducible or not independent" << std::endl;
+            return false;
+        }
+        
+        // Отклонение частот от равномерного распределения заведомо меньше 5%.
+        for (const auto count : histogram)
+        {
+            if (count * randomBound * 100 < randomSamples * 95 || count * randomBound * 100 > randomSamples * 105)
+            {
+                std::cerr << "\n  RandomEngineTest: distribution is not uniform" << std::endl;
+                return false;
+            }
+        }
+        
+        return true;
+    }
+}
+
+// BufferedWriter test
+namespace
+{
+    const size_t writerCapacity = 8;
+    
+    bool BufferedWriterTest()
+    {
+        // Короткие слова накапливаются в буфере, длинное слово передается в поток вывода напрямую.
+        const std::vector<std::string> words = { "раз", "два", "a", "очень длинное слово", "b" };
+        std::ostringstream output;
+        std::string expected;
+        try
+        {
+            BufferedWriter writer(output, writerCapacity);
+            for (const auto& word : words)
+            {
+                writer.write(word);
+                writer.put(' ');
+                expected += word + ' ';
+            }
+            writer.flush();
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "\n  BufferedWriterTest: failed to write text: " << e.what() << std::endl;
+            return false;
+        }
+        
+        if (output.str() != expected)
+        {
+            std::cerr << "\n  BufferedWriterTest: written text differs from the input" << std::endl;
+            return false;
+        }
+        
+        return true;
+    }
+}
+
+// TextGenerator batch test
+namespace
+{
+    const size_t batchOrder = 2;
+    const size_t batchPhrases = 3000;
+    const std::string batchChainOutput = "batch_chain_output.txt";
+    const std::string batchPhrasesOutput = "batch_phrases_output.txt";
+    
+    bool RunBatch(const std::string& threads, const std::string& newWords, std::ostream& output)
+    {
+        std::vector<std::string> arguments = {"stage_use", "-i", batchChainOutput, "-w", newWords, "-s", "1", "-b", batchPhrasesOutput, "-t", threads};
+        std::vector<char*> argv;
+        for (auto& argument : arguments)
+        {
+            argv.push_back(&argument[0]);
+        }
+        
+        std::streambuf* coutBuffer = std::cout.rdbuf(output.rdbuf());
+        std::streambuf* cerrBuffer = std::cerr.rdbuf(nullptr);
+        
+        optind = 0;
+        TextGenerator generator;
+        generator.init(static_cast<int>(argv.size()), argv.data());
+        const bool success = generator.run();
+        
+        std::cout.rdbuf(coutBuffer);
+        std::cerr.rdbuf(cerrBuffer);
+        return success;
+    }
+    
+    bool RunBatch(const std::string& threads, std::string& output)
+    {
+        std::stringstream stream;
+        const bool success = RunBatch(threads, "5", stream);
+        output = stream.str();
+        return success;
+    }
+    
+    bool TextGeneratorBatchTest()
+    {
+        std::vector<std::string> words;
+        if (!LoadAdjustedWords(words))
+        {
+            return false;
+        }
+        
+        std::ofstream phrasesOutput(batchPhrasesOutput);
+        if (!phrasesOutput.good() || !SaveAdjustedChain(batchOrder, batchChainOutput))
+        {
+            std::cerr << "\n  TextGeneratorBatchTest: failed to prepare input files" << std::endl;
+            return false;
+        }
+        
+        for (size_t i = 0; i < batchPhrases; ++i)
+        {
+            const size_t first = (i * 7) % (words.size() - 1);
+            phrasesOutput << words[first] << ' ' << words[first + 1] << '\n';
+        }
+        phrasesOutput.close();
+        
+        // Результат пакетного режима не зависит от числа потоков.
+        std::string singleThreadOutput;
+        std::string multiThreadOutput;
+        if (!RunBatch("1", singleThreadOutput) || !RunBatch("4", multiThreadOutput))
+        {
+            std::cerr << "\n  TextGeneratorBatchTest: batch generation failed" << std::endl;
+            return false;
+        }
+        
+        if (singleThreadOutput != multiThreadOutput)
+        {
+            std::cerr << "\n  TextGeneratorBatchTest: output depends on the number of threads" << std::endl;
+            return false;
+        }
+        
+        if (static_cast<size_t>(std::count(singleThreadOutput.begin(), singleThreadOutput.end(), '\n')) != batchPhrases)
+        {
+            std::cerr << "\n  TextGeneratorBatchTest: wrong number of generated texts" << std::endl;
+            return false;
+        }
+        
+        // Ошибка вывода из потока пула, а не только при последнем сбросе буфера, завершает пакетный
+        // режим с ошибкой: вывод длиннее буфера вывода, а поток вывода не принимает данные.
+        std::ostream failingOutput(nullptr);
+        if (RunBatch("4", "500", failingOutput))
+        {
+            std::cerr << "\n  TextGeneratorBatchTest: output error is not reported" << std::endl;
+            return false;
+        }
+        
+        return true;
+    }
+}
+
+// GenerationServer test
+namespace
+{
+    const size_t serverOrder = 2;
+    const std::string serverChainOutput = "server_chain_output.txt";
+    const std::string serverSocket = "server_test.sock";
+    const size_t serverPipelinedRequests = 1000;
+    const int serverConnectAttempts = 500;
+    
+    int ConnectToServer()
+    {
+        for (int attempt = 0; attempt < serverConnectAttempts; ++attempt)
+        {
+            try
+            {
+                return connectUnixSocket(serverSocket);
+            }
+            catch (const std::exception& e)
+            {
+                usleep(10000);
+            }
+        }
+        return -1;
+    }
+    
+    bool GenerationServerTest()
+    {
+        std::vector<std::string> words;
+        if (!LoadAdjustedWords(words) || !SaveAdjustedChain(serverOrder, serverChainOutput))
+        {
+            return false;
+        }
+        
+        std::vector<std::string> arguments = {"stage_serve", "-i", serverChainOutput, "-u", serverSocket, "-j", "2", "-b", "2"};
+        std::vector<char*> argv;
+        for (auto& argument : arguments)
+        {
+            argv.push_back(&argument[0]);
+        }
+        
+        std::streambuf* cerrBuffer = std::cerr.rdbuf(nullptr);
+        optind = 0;
+        GenerationServer server;
+        server.init(static_cast<int>(argv.size()), argv.data());
+        bool served = false;
+        std::thread serverThread([&]() { served = server.run(); });
+        
+        const std::string phrase = words[0] + ' ' + words[1];
+        std::vector<std::string> requests =
+        {
+            "20 7 " + phrase,
+            "0 7 " + phrase,
+            "20 - " + phrase,
+            "20 7 " + phrase,
+            "20 7 nosuchword nosuchword",
+            "malformed"
+        };
+        
+        // Запросов больше, чем сервер разбирает без ответа, поэтому часть из них ждет в буфере соединения.
+        for (size_t i = 0; i < serverPipelinedRequests; ++i)
+        {
+            requests.push_back("5 " + std::to_string(i) + ' ' + phrase);
+        }
+        
+        std::vector<std::string> responses;
+        const int client = ConnectToServer();
+        try
+        {
+            if (client >= 0)
+            {
+                // Запросы отправляются без ожидания ответов, ответы должны прийти в том же порядке.
+                // Закрытое на запись соединение сервер закрывает только после отправки всех ответов.
+                for (const auto& request : requests)
+                {
+                    sendMessage(client, request);
+                }
+                shutdown(client, SHUT_WR);
+                std::string response;
+                while (receiveMessage(client, response))
+                {
+                    responses.push_back(response);
+                }
+            }
+        }
+        catch (const std::exception& e)
+        {
+            responses.clear();
+        }
+        
+        if (client >= 0)
+        {
+            close(client);
+        }
+        server.stop();
+        serverThread.join();
+        std::cerr.rdbuf(cerrBuffer);
+        
+        if (client < 0 || !served || responses.size() != requests.size())
+        {
+            std::cerr << "\n  GenerationServerTest: server did not answer all requests" << std::endl;
+            return false;
+        }
+        
+        if (responses[0].compare(0, 3 + phrase.size(), "OK " + phrase) != 0 || responses[0] != responses[3] ||
+            responses[2].compare(0, 3, "OK ") != 0)
+        {
+            std::cerr << "\n  GenerationServerTest: unexpected generated text" << std::endl;
+            return false;
+        }
+        
+        if (responses[1].compare(0, 6, "ERROR ") != 0 || responses[4].compare(0, 6, "ERROR ") != 0 ||
+            responses[5].compare(0, 6, "ERROR ") != 0)
+        {
+            std::cerr << "\n  GenerationServerTest: invalid requests are not rejected" << std::endl;
+            return false;
+        }
+        
+        return true;
+    }
+    
+    bool GenerationServerReloadTest()
+    {
+        std::vector<std::string> words;
+        if (!LoadAdjustedWords(words) || !SaveAdjustedChain(serverOrder, serverChainOutput))
+        {
+            return false;
+        }
+        
+        std::vector<std::string> arguments = {"stage_serve", "-i", serverChainOutput, "-u", serverSocket, "-j", "2"};
+        std::vector<char*> argv;
+        for (auto& argument : arguments)
+        {
+            argv.push_back(&argument[0]);
+        }
+        
+        std::streambuf* cerrBuffer = std::cerr.rdbuf(nullptr);
+        optind = 0;
+        GenerationServer server;
+        server.init(static_cast<int>(argv.size()), argv.data());
+        bool served = false;
+        std::thread serverThread([&]() { served = server.run(); });
+        
+        // Фраза из двух слов продолжается цепью второго порядка, но слишком коротка для цепи третьего.
+        const std::string request = "5 7 " + words[0] + ' ' + words[1];
+        std::string before;
+        std::string after;
+        const int client = ConnectToServer();
+        try
+        {
+            if (client >= 0)
+            {
+                sendMessage(client, request);
+                receiveMessage(client, before);
+                
+                if (SaveAdjustedChain(serverOrder + 1, serverChainOutput))
+                {
+                    server.reload();
+                    for (int attempt = 0; attempt < serverConnectAttempts && after.compare(0, 6, "ERROR ") != 0; ++attempt)
+                    {
+                        usleep(10000);
+                        sendMessage(client, request);
+                        receiveMessage(client, after);
+                    }
+                }
+            }
+        }
+        catch (const std::exception& e)
+        {
+            after.clear();
+        }
+        
+        if (client >= 0)
+        {
+            close(client);
+        }
+        server.stop();
+        serverThread.join();
+        std::cerr.rdbuf(cerrBuffer);
+        
+        if (client < 0 || !served || before.compare(0, 3, "OK ") != 0)
+        {
+            std::cerr << "\n  GenerationServerReloadTest: server did not answer" << std::endl;
+            return false;
+        }
+        
+        if (after.compare(0, 6, "ERROR ") != 0)
+        {
+            std::cerr << "\n  GenerationServerReloadTest: reloaded chain is not used" << std::endl;
+            return false;
+        }
+        
+        return true;
+    }
+}
+
+// LatencyHistogram test
+namespace
+{
+    bool LatencyHistogramTest()
+    {
+        // Значения 1..1000 нс и одно большое: корзины дают перцентили с погрешностью не больше 1/32.
+        LatencyHistogram histogram;
+        for (uint64_t value = 1; value <= 1000; ++value)
+        {
+            histogram.record(value);
+        }
+        histogram.record(5000000000ull);
+        
+        const auto close = [](uint64_t value, uint64_t expected)
+        {
+            return value >= expected && value <= expected + expected / 32;
+        };
+        if (histogram.count() != 1001 || !close(histogram.percentile(50.0), 501) ||
+            !close(histogram.percentile(99.0), 991) || histogram.max() != 5000000000ull ||
+            histogram.percentile(100.0) != 5000000000ull)
+        {
+            std::cerr << "\n  LatencyHistogramTest: wrong percentiles " << histogram.percentile(50.0) << ", "
+                      << histogram.percentile(99.0) << ", " << histogram.percentile(100.0) << std::endl;
+            return false;
+        }
+        
+        // Запись из нескольких потоков не теряет значений.
+        LatencyHistogram shared;
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < 4; ++i)
+        {
+            threads.emplace_back([&shared, i]
+            {
+                for (uint64_t value = 0; value < 10000; ++value)
+                {
+                    shared.record(value * (i + 1));
+                }
+            });
+        }
+        for (auto& thread : threads)
+        {
+            thread.join();
+        }
+        if (shared.count() != 40000 || shared.max() != 39996)
+        {
+            std::cerr << "\n  LatencyHistogramTest: lost concurrent records" << std::endl;
+            return false;
+        }
+        
+        return true;
+    }
+}
+
+// Trace test
+namespace
+{
+    /// @brief Выключает трассировку при выходе из области видимости, чтобы она не влияла на другие тесты.
+    struct TraceDisabler
+    {
+        ~TraceDisabler()
+        {
+            Trace::disable();
+        }
+    };
+    
+    bool TraceTest()
+    {
+        TraceDisabler disabler;
+        Trace::enable();
+        {
+            TraceScope scope("TraceTest main");
+            std::thread worker([]
+            {
+                TraceScope workerScope("TraceTest worker");
+            });
+            worker.join();
+        }
+        
+        // События разных потоков выводятся с разными номерами потоков.
+        std::ostringstream output;
+        Trace::write(output);
+        const std::string trace = output.str();
+        const size_t main = trace.find("\"name\":\"TraceTest main\"");
+        const size_t worker = trace.find("\"name\":\"TraceTest worker\"");
+        if (trace.find("{\"traceEvents\":[") != 0 || main == std::string::npos || worker == std::string::npos)
+        {
+            std::cerr << "\n  TraceTest: events are missing in the trace" << std::endl;
+            return false;
+        }
+        
+        const auto threadOf = [&trace](size_t position)
+        {
+            const size_t tid = trace.find("\"tid\":", position);
+            return trace.substr(tid, trace.find(',', tid) - tid);
+        };
+        if (threadOf(main) == threadOf(worker))
+        {
+            std::cerr << "\n  TraceTest: events of different threads share a thread" << std::endl;
+            return false;
+        }
+        
+        // После выключения события не собираются.
+        Trace::disable();
+        {
+            TraceScope scope("TraceTest disabled");
+        }
+        std::ostringstream disabledOutput;
+        Trace::write(disabledOutput);
+        if (Trace::enabled() || disabledOutput.str().find("\"name\":\"TraceTest disabled\"") != std::string::npos)
+        {
+            std::cerr << "\n  TraceTest: events are collected after tracing is disabled" << std::endl;
+            return false;
+        }
+        
+        return true;
+    }
+}
+
 #define RUN_TEST(test) \
     std::cout << "Running test " << #test << " ... " << std::flush; \
     std::cout << (test() ? "OK" : "FAIL") << std::endl << std::endl;
@@ -281,6 +2285,29 @@ int main(int argc, char** argv)
     RUN_TEST(TextAdjusterTest);
     RUN_TEST(MarkovTextChainBuildTest);
     RUN_TEST(MarkovTextChainLoadTest);
+    RUN_TEST(MarkovTextChainSortEngineTest);
+    RUN_TEST(MarkovTextChainFreezeHashTest);
+    RUN_TEST(MarkovTextChainFreezeTrieTest);
+    RUN_TEST(MarkovTextChainLiveTest);
+    RUN_TEST(MarkovTextChainInterleavedTest);
+    RUN_TEST(MarkovTextChainRandomStartTest);
+    RUN_TEST(MarkovTextChainBackoffTest);
+    RUN_TEST(MarkovTextChainScoreTest);
+    RUN_TEST(MarkovTextChainDecayTest);
+    RUN_TEST(MarkovTextChainCountersTest);
+    RUN_TEST(MarkovTextChainCompactTest);
+    RUN_TEST(MarkovTextChainSortedTest);
+    RUN_TEST(ChainMergerTest);
+    RUN_TEST(MarkovTextChainDeltaTest);
+    RUN_TEST(ChainBuilderCheckpointTest);
+    RUN_TEST(ChainBuilderAppendTest);
+    RUN_TEST(RandomEngineTest);
+    RUN_TEST(BufferedWriterTest);
+    RUN_TEST(TextGeneratorBatchTest);
+    RUN_TEST(GenerationServerTest);
+    RUN_TEST(GenerationServerReloadTest);
+    RUN_TEST(LatencyHistogramTest);
+    RUN_TEST(TraceTest);
     
     return 0;
 }
@@ -0,0 +1,420 @@
+#include "corpus_generator.h"
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+
+// Common values
+namespace
+{
+    std::string binaryDir = ".";
+    std::string workDir = ".";
+    std::string outputFile;
+    std::vector<uint64_t> corpusSizes = { 1 << 20, 10 << 20, 100 << 20 };
+    std::vector<size_t> chainOrders = { 1, 2, 3 };
+    size_t generatedWords = 10000000;
+    size_t vocabulary = 100000;
+    double skew = 1.0;
+    uint64_t seed = 1;
+    std::string engine = "hash";
+    
+    const size_t corpusBlockSize = 1 << 20;
+    const char* const nullDevice = "/dev/null";
+    
+    struct RunResult
+    {
+        double seconds;
+        long peakRssKb;
+    };
+    
+    /// @brief Запустить программу и дождаться ее завершения.
+    /// @param[in] arguments - Путь к программе и ее аргументы.
+    /// @param[in] input - Файл, подаваемый на стандартный ввод.
+    /// @param[in] log - Файл, в конец которого дописывается вывод ошибок программы.
+    /// @param[out] result - Время работы и пиковый объем резидентной памяти программы.
+    /// @return true если программа завершилась успешно, false в противном случае.
+    bool RunProgram(const std::vector<std::string>& arguments, const std::string& input, const std::string& log, RunResult& result)
+    {
+        std::vector<char*> argv;
+        for (const auto& argument : arguments)
+        {
+            argv.push_back(const_cast<char*>(argument.c_str()));
+        }
+        argv.push_back(nullptr);
+        
+        const auto start = std::chrono::steady_clock::now();
+        const pid_t pid = fork();
+        if (pid < 0)
+        {
+            std::cerr << "  RunProgram: failed to start '" << arguments[0] << "'" << std::endl;
+            return false;
+        }
+        if (pid == 0)
+        {
+            const int inputDescriptor = open(input.c_str(), O_RDONLY);
+            const int logDescriptor = open(log.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+            if (inputDescriptor < 0 || logDescriptor < 0 ||
+                dup2(inputDescriptor, STDIN_FILENO) < 0 || dup2(logDescriptor, STDERR_FILENO) < 0)
+            {
+                _exit(EXIT_FAILURE);
+            }
+            close(inputDescriptor);
+            close(logDescriptor);
+            execv(argv[0], argv.data());
+            _exit(EXIT_FAILURE);
+        }
+        
+        // Пиковый объем памяти дочернего процесса сообщает только wait4, а не общий счетчик всех потомков.
+        int status = 0;
+        struct rusage usage;
+        if (wait4(pid, &status, 0, &usage) != pid)
+        {
+            std::cerr << "  RunProgram: failed to wait for '" << arguments[0] << "'" << std::endl;
+            return false;
+        }
+        result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        result.peakRssKb = usage.ru_maxrss;
+        
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+        {
+            std::cerr << "  RunProgram: '" << arguments[0] << "' failed, see '" << log << "'" << std::endl;
+            return false;
+        }
+        return true;
+    }
+    
+    /// @brief Записать синтетический корпус блоками, не храня его в памяти целиком.
+    bool WriteCorpus(const std::string& fileName, uint64_t bytes, size_t& words)
+    {
+        std::ofstream output(fileName, std::ofstream::out | std::ofstream::binary | std::ofstream::trunc);
+        if (!output.good())
+        {
+            std::cerr << "  WriteCorpus: failed to open file '" << fileName << "' for writing" << std::endl;
+            return false;
+        }
+        
+        // Генератор создается заново для каждого размера, поэтому меньший корпус - начало большего.
+        CorpusGenerator generator(vocabulary, skew, seed);
+        std::string block;
+        uint64_t written = 0;
+        words = 0;
+        while (written < bytes)
+        {
+            block.clear();
+            words += generator.appendBytes(block, std::min<uint64_t>(corpusBlockSize, bytes - written));
+            output.write(block.data(), block.size());
+            written += block.size();
+        }
+        
+        output.close();
+        if (output.fail())
+        {
+            std::cerr << "  WriteCorpus: failed to write file '" << fileName << "'" << std::endl;
+            return false;
+        }
+        return true;
+    }
+    
+    uint64_t FileSize(const std::string& fileName)
+    {
+        struct stat info;
+        return stat(fileName.c_str(), &info) == 0 ? info.st_size : 0;
+    }
+    
+    /// @brief Разобрать размер с необязательным двоичным суффиксом K, M, G или T.
+    bool ParseSize(const std::string& text, uint64_t& value)
+    {
+        try
+        {
+            size_t position = 0;
+            value = std::stoull(text, &position);
+            const std::string suffix = text.substr(position);
+            const std::string suffixes = "KMGT";
+            if (suffix.size() > 1 || value == 0)
+            {
+                return false;
+            }
+            if (suffix.size() == 1)
+            {
+                const size_t power = suffixes.find(suffix[0]);
+                if (power == std::string::npos)
+                {
+                    return false;
+                }
+                value <<= 10 * (power + 1);
+            }
+            return true;
+        }
+        catch (const std::exception& e)
+        {
+            return false;
+        }
+    }
+    
+    /// @brief Разобрать список значений, разделенных запятыми.
+    template <typename Value>
+    bool ParseList(const std::string& text, std::vector<Value>& values)
+    {
+        values.clear();
+        size_t begin = 0;
+        while (begin <= text.size())
+        {
+            const size_t end = std::min(text.find(',', begin), text.size());
+            uint64_t value = 0;
+            if (!ParseSize(text.substr(begin, end - begin), value))
+            {
+                return false;
+            }
+            values.push_back(static_cast<Value>(value));
+            begin = end + 1;
+        }
+        return !values.empty();
+    }
+    
+    /// @brief Замерить построение цепи одного порядка и генерацию по ней.
+    bool MeasureOrder(const std::string& corpusFile, uint64_t corpusBytes, size_t corpusWords, size_t order, std::ostream& output)
+    {
+        const std::string chainFile = workDir + "/throughput_chain.txt";
+        const std::string logFile = workDir + "/throughput.log";
+        std::cerr << "Order " << order << ", " << corpusBytes << " bytes: learning ... " << std::flush;
+        RunResult learn = { 0, 0 };
+        if (!RunProgram({ binaryDir + "/stage_learn", "-n", std::to_string(order), "-e", engine, "-o", chainFile, "-" }, corpusFile, logFile, learn))
+        {
+            std::remove(chainFile.c_str());
+            return false;
+        }
+        const uint64_t chainBytes = FileSize(chainFile);
+        
+        // Генерация одного слова - почти только загрузка цепи, ее время вычитается из времени генерации.
+        std::cerr << "generating ... " << std::flush;
+        RunResult load = { 0, 0 };
+        RunResult use = { 0, 0 };
+        const std::vector<std::string> useArguments = { binaryDir + "/stage_use", "-i", chainFile, "-s", std::to_string(seed), "-o", nullDevice, "-w" };
+        std::vector<std::string> loadArguments = useArguments;
+        loadArguments.push_back("1");
+        std::vector<std::string> generateArguments = useArguments;
+        generateArguments.push_back(std::to_string(generatedWords));
+        const bool success = RunProgram(loadArguments, nullDevice, logFile, load) && RunProgram(generateArguments, nullDevice, logFile, use);
+        std::remove(chainFile.c_str());
+        if (!success)
+        {
+            return false;
+        }
+        std::cerr << "DONE" << std::endl;
+        
+        const double generateSeconds = std::max(use.seconds - load.seconds, 0.0);
+        char line[512];
+        std::snprintf(line, sizeof(line), "%llu,%zu,%zu,%.3f,%.0f,%ld,%llu,%.3f,%ld,%zu,%.3f,%.0f,%ld",
+                      static_cast<unsigned long long>(corpusBytes), corpusWords, order,
+                      learn.seconds, learn.seconds > 0 ? corpusWords / learn.seconds : 0.0, learn.peakRssKb,
+                      static_cast<unsigned long long>(chainBytes), load.seconds, load.peakRssKb,
+                      generatedWords, generateSeconds, generateSeconds > 0 ? generatedWords / generateSeconds : 0.0, use.peakRssKb);
+        output << line << std::endl;
+        return true;
+    }
+    
+    void PrintUsage(const std::string& programName)
+    {
+        std::cout << "Usage: " << programName << " [options]" << std::endl;
+        std::cout << "  -b, --bytes       Comma-separated corpus sizes with optional K, M, G or T suffix, '1M,10M,100M' by default" << std::endl;
+        std::cout << "  -n, --orders      Comma-separated Markov chain orders, '1,2,3' by default" << std::endl;
+        std::cout << "  -w, --words       Number of words to generate from each chain, 10000000 by default" << std::endl;
+        std::cout << "  -e, --engine      Chain build engine of stage_learn: 'hash' (default) or 'sort'" << std::endl;
+        std::cout << "  -v, --vocabulary  Number of distinct words of the synthetic corpus, 100000 by default" << std::endl;
+        std::cout << "  -z, --zipf        Zipf skew of the synthetic word frequencies, 1.0 by default" << std::endl;
+        std::cout << "  -s, --seed        Random seed of the synthetic corpus and generation, 1 by default" << std::endl;
+        std::cout << "  -d, --directory   Directory for the corpus and chain files, the current one by default" << std::endl;
+        std::cout << "  -o, --output      File to output CSV to, std::cout will be used if not provided" << std::endl;
+        std::cout << "  -h, --help        Show this message and exit" << std::endl << std::endl;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    std::string programName = argv[0];
+    const size_t slash = programName.find_last_of('/');
+    if (slash != std::string::npos)
+    {
+        binaryDir = programName.substr(0, slash);
+    }
+    programName = programName.substr(slash + 1);
+    
+    struct option longOptions[] =
+    {
+       {"bytes", required_argument, 0, 'b'},
+       {"orders", required_argument, 0, 'n'},
+       {"words", required_argument, 0, 'w'},
+       {"engine", required_argument, 0, 'e'},
+       {"vocabulary", required_argument, 0, 'v'},
+       {"zipf", required_argument, 0, 'z'},
+       {"seed", required_argument, 0, 's'},
+       {"directory", required_argument, 0, 'd'},
+       {"output", required_argument, 0, 'o'},
+       {"help", no_argument, 0, 'h'},
+       {0, 0, 0, 0 }
+    };
+    
+    int c = 0;
+    opterr = 0;
+    bool needHelp = false;
+    std::vector<uint64_t> values;
+    
+    while ((c = getopt_long(argc, argv, "b:n:w:e:v:z:s:d:o:h", longOptions, nullptr)) != -1)
+    {
+        switch (c)
+        {
+        case 'b':
+            if (!ParseList(optarg, corpusSizes))
+            {
+                std::cerr << "  Unsupported value for 'bytes' parameter" << std::endl;
+                needHelp = true;
+            }
+            break;
+        
+        case 'n':
+            if (!ParseList(optarg, chainOrders))
+            {
+                std::cerr << "  Unsupported value for 'orders' parameter" << std::endl;
+                needHelp = true;
+            }
+            break;
+        
+        case 'w':
+            if (!ParseList(optarg, values) || values.size() != 1)
+            {
+                std::cerr << "  Unsupported value for 'words' parameter" << std::endl;
+                needHelp = true;
+                break;
+            }
+            generatedWords = values[0];
+            break;
+        
+        case 'e':
+            engine = optarg;
+            if (engine != "hash" && engine != "sort")
+            {
+                std::cerr << "  Unsupported value for 'engine' parameter" << std::endl;
+                needHelp = true;
+            }
+            break;
+        
+        case 'v':
+            if (!ParseList(optarg, values) || values.size() != 1)
+            {
+                std::cerr << "  Unsupported value for 'vocabulary' parameter" << std::endl;
+                needHelp = true;
+                break;
+            }
+            vocabulary = values[0];
+            break;
+        
+        case 'z':
+            try
+            {
+                size_t position = 0;
+                skew = std::stod(optarg, &position);
+                if (optarg[position] != '\0' || skew < 0)
+                {
+                    throw std::exception();
+                }
+            }
+            catch (const std::exception& e)
+            {
+                std::cerr << "  Unsupported value for 'zipf' parameter" << std::endl;
+                needHelp = true;
+            }
+            break;
+        
+        case 's':
+            if (!ParseList(optarg, values) || values.size() != 1)
+            {
+                std::cerr << "  Unsupported value for 'seed' parameter" << std::endl;
+                needHelp = true;
+                break;
+            }
+            seed = values[0];
+            break;
+        
+        case 'd':
+            workDir = optarg;
+            break;
+        
+        case 'o':
+            outputFile = optarg;
+            break;
+        
+        case 'h':
+            needHelp = true;
+            break;
+        
+        case '?':
+            std::cerr << " Unknown option or missing argument " << argv[optind-1] << std::endl;
+            needHelp = true;
+            break;
+        }
+    }
+    
+    if (needHelp)
+    {
+        PrintUsage(programName);
+        return EXIT_FAILURE;
+    }
+    
+    std::ofstream fileOutput;
+    if (!outputFile.empty())
+    {
+        fileOutput.open(outputFile);
+        if (!fileOutput.good())
+        {
+            std::cerr << "  Failed to open file '" << outputFile << "' for writing" << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+    std::ostream& output = outputFile.empty() ? std::cout : fileOutput;
+    output << "corpus_bytes,corpus_words,order,learn_seconds,learn_words_per_sec,learn_peak_rss_kb,chain_bytes,"
+              "load_seconds,load_peak_rss_kb,generated_words,generate_seconds,generate_words_per_sec,use_peak_rss_kb" << std::endl;
+    
+    const std::string corpusFile = workDir + "/throughput_corpus.txt";
+    bool success = true;
+    try
+    {
+        for (const auto bytes : corpusSizes)
+        {
+            std::cerr << "Writing " << bytes << " bytes of synthetic text ... " << std::flush;
+            size_t words = 0;
+            if (!WriteCorpus(corpusFile, bytes, words))
+            {
+                success = false;
+                break;
+            }
+            std::cerr << "DONE" << std::endl;
+            
+            for (const auto order : chainOrders)
+            {
+                success = MeasureOrder(corpusFile, FileSize(corpusFile), words, order, output) && success;
+            }
+        }
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "  Throughput harness failed: " << e.what() << std::endl;
+        success = false;
+    }
+    std::remove(corpusFile.c_str());
+    
+    return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1,16 +1,32 @@
 #include "markov_text_chain.h"
+#include "block_codec.h"
+#include "frozen_chain.h"
+#include "latency.h"
+#include "live_chain.h"
+#include "parallel.h"
+#include "radix_sort.h"
+#include "trace.h"
 
-#include <cstdlib>
-#include <ctime>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <mutex>
+#include <numeric>
 #include <sstream>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 
 namespace
 {
+    /// @brief Число хранимых слов, после которого поиск слова идет по индексу, а не перебором.
+    const size_t wordsIndexThreshold = 8;
+    
     /// @class WordsKeeper
-    /// @brief Хранит слова состояния цепи Маркова, обеспечивает их случайную выдачу.
+    /// @brief Хранит слова состояния цепи Маркова с числом их появлений, обеспечивает их случайную выдачу.
     class WordsKeeper
     {
     public:
@@ -18,6 +34,7 @@ namespace
         WordsKeeper()
             : m_TotalWords()
             , m_Words()
+            , m_Index()
         {
         }
         
@@ -27,6 +44,7 @@ namespace
         {
             m_TotalWords = another.m_TotalWords;
             m_Words = std::move(another.m_Words);
+            m_Index = std::move(another.m_Index);
             another.m_TotalWords = 0;
             return *this;
         }
@@ -36,30 +54,53 @@ namespace
         
         /// @brief Добавить слово для хранения.
         /// @param[in] word - Новое слово.
-        void addWord(const MarkovTextChain::Word& word)
+        /// @param[in] count - Число появлений слова.
+        /// @return true если слово новое, false если оно уже хранилось.
+        bool addWord(const MarkovTextChain::Word& word, size_t count = 1)
         {
-            m_Words.push_back(word);
-            ++m_TotalWords;
+            m_TotalWords += count;
+            auto it = findWord(word);
+            if (it != m_Words.end())
+            {
+                it->second += count;
+                return false;
+            }
+            m_Words.emplace_back(word, count);
+            indexLast();
+            return true;
         }
         
         /// @brief Добавить слово для хранения.
         /// @param[in] word - Новое слово.
-        void addWord(MarkovTextChain::Word&& word)
+        /// @param[in] count - Число появлений слова.
+        /// @return true если слово новое, false если оно уже хранилось.
+        bool addWord(MarkovTextChain::Word&& word, size_t count = 1)
         {
-            m_Words.emplace_back(std::move(word));
-            ++m_TotalWords;
+            m_TotalWords += count;
+            auto it = findWord(word);
+            if (it != m_Words.end())
+            {
+                it->second += count;
+                return false;
+            }
+            m_Words.emplace_back(std::move(word), count);
+            indexLast();
+            return true;
         }
         
-        /// @brief Случайно выдать одно из хранимых слов.
+        /// @brief Случайно, с учетом числа появлений, выдать одно из хранимых слов.
+        /// @param[in] random - Генератор случайных чисел.
         /// @return Слово.
-        const MarkovTextChain::Word& getWord() const
+        const MarkovTextChain::Word& getWord(RandomEngine& random) const
         {
+            size_t position = random.uniform(m_TotalWords);
             auto it = m_Words.begin();
-            for (register int i = rand() % m_TotalWords; i > 0; --i)
+            while (position >= it->second)
             {
+                position -= it->second;
                 ++it;
             }
-            return *it;
+            return it->first;
         }
         
         /// @brief Сериализовать в строку.
@@ -67,27 +108,130 @@ namespace
         std::string toString() const
         {
             std::string result = std::to_string(m_TotalWords) + ' ';
-            for (const auto& word : m_Words)
+            for (const auto& entry : m_Words)
             {
-                result += word + ' ';
+                for (register size_t i = 0; i < entry.second; ++i)
+                {
+                    result += entry.first + ' ';
+                }
             }
             
             return result;
         }
     
+        /// @brief Уменьшить вдвое числа появлений хранимых слов, удаляя слова с нулевым числом.
+        void decay()
+        {
+            m_TotalWords = 0;
+            auto kept = m_Words.begin();
+            for (auto it = m_Words.begin(); it != m_Words.end(); ++it)
+            {
+                it->second /= 2;
+                if (it->second == 0)
+                {
+                    continue;
+                }
+                m_TotalWords += it->second;
+                if (kept != it)
+                {
+                    *kept = std::move(*it);
+                }
+                ++kept;
+            }
+            m_Words.erase(kept, m_Words.end());
+            
+            // Позиции слов сдвинулись, индекс строится заново.
+            m_Index.reset();
+            for (size_t i = m_Words.size() > wordsIndexThreshold ? 0 : m_Words.size(); i < m_Words.size(); ++i)
+            {
+                indexWord(i);
+            }
+        }
+        
         /// @brief Проверка на пустоту.
         /// @return true если список хранимых слов пустой, false в противном случае.
         bool empty() const
         {
             return m_Words.empty();
         }
+        
+        /// @brief Тип списка хранимых слов с числом их появлений.
+        using Entries = std::vector<std::pair<MarkovTextChain::Word, size_t>>;
+        
+        /// @brief Получить хранимые слова.
+        /// @return Список хранимых слов с числом их появлений.
+        const Entries& words() const
+        {
+            return m_Words;
+        }
+    
+    private:
+        /// @brief Найти хранимое слово.
+        /// @param[in] word - Слово.
+        /// @return Итератор на найденное слово или на конец списка.
+        Entries::iterator findWord(const MarkovTextChain::Word& word)
+        {
+            if (!m_Index)
+            {
+                auto it = m_Words.begin();
+                while (it != m_Words.end() && it->first != word)
+                {
+                    ++it;
+                }
+                return it;
+            }
+            
+            const auto range = m_Index->equal_range(std::hash<MarkovTextChain::Word>()(word));
+            for (auto it = range.first; it != range.second; ++it)
+            {
+                if (m_Words[it->second].first == word)
+                {
+                    return m_Words.begin() + it->second;
+                }
+            }
+            return m_Words.end();
+        }
+        
+        /// @brief Добавить в индекс слово с заданной позицией, создав индекс при необходимости.
+        /// @param[in] position - Позиция слова в списке.
+        void indexWord(size_t position)
+        {
+            if (!m_Index)
+            {
+                m_Index.reset(new Index());
+            }
+            m_Index->emplace(std::hash<MarkovTextChain::Word>()(m_Words[position].first), position);
+        }
+        
+        /// @brief Учесть в индексе последнее добавленное слово.
+        /// @details Небольшие списки просматриваются перебором, индекс строится при превышении порога.
+        void indexLast()
+        {
+            if (m_Index)
+            {
+                indexWord(m_Words.size() - 1);
+            }
+            else if (m_Words.size() > wordsIndexThreshold)
+            {
+                for (size_t i = 0; i < m_Words.size(); ++i)
+                {
+                    indexWord(i);
+                }
+            }
+        }
     
     private:
-        /// @brief Количество хранимых слов.
+        /// @brief Тип индекса: хэш слова и его позиция в списке.
+        using Index = std::unordered_multimap<size_t, uint32_t>;
+        
+        /// @brief Количество хранимых слов с учетом повторений.
         size_t m_TotalWords;
         
-        /// @brief Список хранимых слов.
-        std::list<MarkovTextChain::Word> m_Words;
+        /// @brief Список хранимых слов с числом их появлений.
+        Entries m_Words;
+        
+        /// @brief Индекс хранимых слов, nullptr - слов не больше порога.
+        std::unique_ptr<Index> m_Index;
     };
 
     /// @class WordsHash
@@ -114,6 +258,412 @@ namespace
             return hash;
         }
     };
+    
+    /// @brief Сериализовать состояния цепи, слова которой пронумерованы.
+    /// @param[in] chain - Цепь только для чтения или пополняемая цепь.
+    /// @param[in] delimiter - Разделитель ключа и значения состояния.
+    /// @param[in] output - Поток вывода.
+    template <typename Chain>
+    void saveStates(const Chain& chain, const std::string& delimiter, std::ostream& output)
+    {
+        // Для загрузки в хэш-таблицу без перестроений достаточно числа состояний.
+        output << chain.stateCount() << std::endl;
+        chain.forEachState([&chain, &delimiter, &output](const typename Chain::WordIds& key, typename Chain::StateId state)
+        {
+            // Ключи состояний младших порядков цепи с откатом дополнены в начале отсутствующими словами.
+            for (const auto id : key)
+            {
+                if (id != Chain::noWord)
+                {
+                    output << chain.word(id) << ' ';
+                }
+            }
+            output << delimiter << ' ';
+            
+            WordsKeeper value;
+            for (const auto& successor : chain.successors(state))
+            {
+                value.addWord(chain.word(successor.first), successor.second);
+            }
+            output << value.toString() << std::endl;
+        });
+    }
+    
+    /// @brief Число состояний между записями индекса смещений формата Sorted.
+    constexpr size_t sortedIndexInterval = 256;
+    
+    /// @brief Число байт в конце файла формата Sorted, среди которых ищется концевик индекса.
+    constexpr std::streamoff sortedFooterBytes = 256;
+    
+    /// @brief Сериализовать состояния цепи, слова которой пронумерованы, в порядке ключей.
+    /// @details Ключи сравниваются как последовательности слов, слова значений выводятся по алфавиту.
+    /// @param[in] chain - Цепь только для чтения или пополняемая цепь.
+    /// @param[in] writer - Писатель файла формата Sorted.
+    template <typename Chain>
+    void saveSortedStates(const Chain& chain, MarkovTextChain::SortedWriter& writer)
+    {
+        // Ключи младших порядков цепи с откатом дополнены в начале отсутствующими словами,
+        // которые при сравнении пропускаются.
+        std::vector<typename Chain::WordIds> keys;
+        std::vector<typename Chain::StateId> states;
+        std::vector<uint32_t> ids;
+        chain.forEachState([&chain, &keys, &states, &ids](const typename Chain::WordIds& key, typename Chain::StateId state)
+        {
+            keys.emplace_back(std::find_if(key.begin(), key.end(), [](uint32_t id) { return id != Chain::noWord; }), key.end());
+            states.push_back(state);
+            ids.insert(ids.end(), keys.back().begin(), keys.back().end());
+            for (const auto& successor : chain.successors(state))
+            {
+                ids.push_back(successor.first);
+            }
+        });
+        
+        // Место слова в алфавите позволяет сравнивать ключи без сравнения строк.
+        std::sort(ids.begin(), ids.end());
+        ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+        std::sort(ids.begin(), ids.end(), [&chain](uint32_t left, uint32_t right)
+        {
+            return chain.word(left) < chain.word(right);
+        });
+        std::vector<uint32_t> ranks(ids.empty() ? 0 : *std::max_element(ids.begin(), ids.end()) + 1);
+        for (size_t i = 0; i < ids.size(); ++i)
+        {
+            ranks[ids[i]] = i;
+        }
+        
+        std::vector<size_t> order(states.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::sort(order.begin(), order.end(), [&keys, &ranks](size_t left, size_t right)
+        {
+            return std::lexicographical_compare(keys[left].begin(), keys[left].end(), keys[right].begin(), keys[right].end(),
+                                                [&ranks](uint32_t a, uint32_t b) { return ranks[a] < ranks[b]; });
+        });
+        
+        MarkovTextChain::Words key;
+        MarkovTextChain::Successors successors;
+        for (const auto index : order)
+        {
+            key.clear();
+            for (const auto id : keys[index])
+            {
+                key.push_back(chain.word(id));
+            }
+            
+            auto ranked = chain.successors(states[index]);
+            std::sort(ranked.begin(), ranked.end(), [&ranks](const std::pair<uint32_t, size_t>& left, const std::pair<uint32_t, size_t>& right)
+            {
+                return ranks[left.first] < ranks[right.first];
+            });
+            successors.clear();
+            for (const auto& successor : ranked)
+            {
+                successors.emplace_back(chain.word(successor.first), successor.second);
+            }
+            writer.write(key, successors);
+        }
+    }
+    
+    /// @brief Число состояний в блоке компактного формата.
+    constexpr size_t compactBlockStates = 8192;
+    
+    /// @brief Распакованный блок состояний компактного формата.
+    struct CompactBlock
+    {
+        /// @brief Конструктор.
+        CompactBlock()
+            : keys()
+            , ends()
+            , successors()
+        {
+        }
+        
+        /// @brief Ключи состояний, по порядку цепи идентификаторов слов на состояние.
+        FrozenChain::WordIds keys;
+        
+        /// @brief Концы значений состояний в списке переходов.
+        std::vector<size_t> ends;
+        
+        /// @brief Переходы состояний в слова с числом их появлений.
+        FrozenChain::Successors successors;
+    };
+    
+    /// @brief Сжать блок компактного формата, если сжатие уменьшает его.
+    /// @param[in] raw - Несжатый блок.
+    /// @param[out] stored - Записываемый блок: сжатый или несжатый, если сжатие его не уменьшило.
+    void packBlock(const std::string& raw, std::string& stored)
+    {
+        compressBlock(raw.data(), raw.size(), stored);
+        if (stored.size() >= raw.size())
+        {
+            stored = raw;
+        }
+    }
+    
+    /// @brief Распаковать блок компактного формата.
+    /// @param[in] stored - Записанный блок, несжатый, если его размер равен размеру распакованного.
+    /// @param[in] size - Размер записанного блока.
+    /// @param[in,out] raw - Буфер размера распакованного блока, заполняется его данными.
+    /// @throws std::exception в случае ошибки.
+    void unpackBlock(const char* stored, size_t size, std::string& raw)
+    {
+        if (size == raw.size())
+        {
+            std::copy(stored, stored + size, raw.begin());
+            return;
+        }
+        decompressBlock(stored, size, &raw[0], raw.size());
+    }
+    
+    /// @brief Прочитать из потока число в формате varint.
+    /// @param[in] input - Поток ввода.
+    /// @return Число.
+    /// @throws std::exception в случае ошибки.
+    uint64_t readStreamVarint(std::istream& input)
+    {
+        uint64_t value = 0;
+        for (size_t shift = 0; shift < 64; shift += 7)
+        {
+            const int byte = input.get();
+            if (byte == std::char_traits<char>::eof())
+            {
+                throw std::runtime_error("MarkovTextChain::load error: input stream is not good");
+            }
+            value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+            if ((byte & 0x80) == 0)
+            {
+                return value;
+            }
+        }
+        throw std::runtime_error("MarkovTextChain::load error: corrupted compact chain");
+    }
+    
+    /// @brief Сериализовать в компактном формате состояния цепи, слова которой пронумерованы.
+    /// @details Слова нумеруются по убыванию числа ссылок на них, чтобы частые слова записывались
+    ///          одним байтом. Состояния сортируются по ключам, и ключ записывается длиной общего
+    ///          начала с предыдущим ключом блока, разностью первого отличающегося слова и остальными
+    ///          словами. Слова значения записываются разностями возрастающих номеров.
+    /// @param[in] chain - Цепь только для чтения или пополняемая цепь.
+    /// @param[in] order - Порядок цепи.
+    /// @param[in] backoff - Признак цепи с откатом.
+    /// @param[in] output - Поток вывода.
+    template <typename Chain>
+    void saveCompactStates(const Chain& chain, size_t order, bool backoff, std::ostream& output)
+    {
+        // Собрать ключи и значения состояний подряд.
+        std::vector<uint32_t> keys;
+        std::vector<size_t> offsets(1, 0);
+        std::vector<std::pair<uint32_t, uint64_t>> successors;
+        chain.forEachState([&chain, &keys, &offsets, &successors](const typename Chain::WordIds& key, typename Chain::StateId state)
+        {
+            keys.insert(keys.end(), key.begin(), key.end());
+            for (const auto& successor : chain.successors(state))
+            {
+                successors.emplace_back(successor.first, successor.second);
+            }
+            offsets.push_back(successors.size());
+        });
+        const size_t stateCount = offsets.size() - 1;
+        
+        // Пронумеровать слова по убыванию числа ссылок, номер 0 в ключах - отсутствующее слово.
+        std::vector<uint64_t> references;
+        const auto reference = [&references](uint32_t id)
+        {
+            if (id >= references.size())
+            {
+                references.resize(id + 1, 0);
+            }
+            ++references[id];
+        };
+        for (const auto id : keys)
+        {
+            if (id != Chain::noWord)
+            {
+                reference(id);
+            }
+        }
+        for (const auto& successor : successors)
+        {
+            reference(successor.first);
+        }
+        
+        std::vector<uint32_t> ranked;
+        for (uint32_t id = 0; id < references.size(); ++id)
+        {
+            if (references[id] > 0)
+            {
+                ranked.push_back(id);
+            }
+        }
+        std::sort(ranked.begin(), ranked.end(), [&chain, &references](uint32_t left, uint32_t right)
+        {
+            return references[left] != references[right] ? references[left] > references[right] : chain.word(left) < chain.word(right);
+        });
+        
+        std::vector<uint32_t> codes(references.size(), 0);
+        for (size_t i = 0; i < ranked.size(); ++i)
+        {
+            codes[ranked[i]] = i + 1;
+        }
+        for (auto& id : keys)
+        {
+            id = id != Chain::noWord ? codes[id] : 0;
+        }
+        for (auto& successor : successors)
+        {
+            successor.first = codes[successor.first] - 1;
+        }
+        
+        // Упорядочить состояния по ключам, а слова значений - по номерам.
+        std::vector<uint32_t> states(stateCount);
+        std::iota(states.begin(), states.end(), 0);
+        std::sort(states.begin(), states.end(), [&keys, order](uint32_t left, uint32_t right)
+        {
+            return std::lexicographical_compare(&keys[left * order], &keys[left * order] + order, &keys[right * order], &keys[right * order] + order);
+        });
+        for (size_t state = 0; state < stateCount; ++state)
+        {
+            std::sort(successors.begin() + offsets[state], successors.begin() + offsets[state + 1]);
+        }
+        
+        std::string words;
+        for (const auto id : ranked)
+        {
+            appendVarint(words, chain.word(id).size());
+            words += chain.word(id);
+        }
+        std::string storedWords;
+        packBlock(words, storedWords);
+        
+        // Блоки кодируются и сжимаются независимо друг от друга, поэтому параллельно.
+        const size_t blockCount = (stateCount + compactBlockStates - 1) / compactBlockStates;
+        std::vector<size_t> rawSizes(blockCount);
+        std::vector<std::string> blocks(blockCount);
+        const size_t threads = std::min(defaultThreadCount(), blockCount);
+        runParallel(threads, [&](size_t thread)
+        {
+            std::string raw;
+            std::vector<uint32_t> previous(order);
+            for (size_t block = thread; block < blockCount; block += threads)
+            {
+                raw.clear();
+                std::fill(previous.begin(), previous.end(), 0);
+                const size_t end = std::min(stateCount, (block + 1) * compactBlockStates);
+                for (size_t i = block * compactBlockStates; i < end; ++i)
+                {
+                    const uint32_t* key = &keys[states[i] * order];
+                    size_t common = 0;
+                    while (common < order && key[common] == previous[common])
+                    {
+                        ++common;
+                    }
+                    if (common == order)
+                    {
+                        throw std::logic_error("MarkovTextChain::save error: duplicate state");
+                    }
+                    appendVarint(raw, common);
+                    appendVarint(raw, key[common] - previous[common]);
+                    for (size_t j = common + 1; j < order; ++j)
+                    {
+                        appendVarint(raw, key[j]);
+                    }
+                    std::copy(key, key + order, previous.begin());
+                    
+                    const size_t first = offsets[states[i]];
+                    const size_t last = offsets[states[i] + 1];
+                    appendVarint(raw, last - first);
+                    uint32_t next = 0;
+                    for (size_t j = first; j < last; ++j)
+                    {
+                        appendVarint(raw, successors[j].first - next);
+                        appendVarint(raw, successors[j].second - 1);
+                        next = successors[j].first + 1;
+                    }
+                }
+                rawSizes[block] = raw.size();
+                packBlock(raw, blocks[block]);
+            }
+        });
+        
+        // Заголовок, словарь и каталог блоков позволяют распаковать блоки без последовательного разбора.
+        std::string header;
+        appendVarint(header, order);
+        appendVarint(header, backoff ? 1 : 0);
+        appendVarint(header, ranked.size());
+        appendVarint(header, stateCount);
+        appendVarint(header, words.size());
+        appendVarint(header, storedWords.size());
+        output << header << storedWords;
+        
+        std::string directory;
+        appendVarint(directory, blockCount);
+        for (size_t block = 0; block < blockCount; ++block)
+        {
+            appendVarint(directory, std::min(compactBlockStates, stateCount - block * compactBlockStates));
+            appendVarint(directory, rawSizes[block]);
+            appendVarint(directory, blocks[block].size());
+        }
+        output << directory;
+        for (const auto& block : blocks)
+        {
+            output << block;
+        }
+    }
+    
+    /// @brief Разобрать распакованный блок состояний компактного формата.
+    /// @param[in] data - Данные блока.
+    /// @param[in] size - Размер данных.
+    /// @param[in] states - Число состояний блока.
+    /// @param[in] order - Порядок цепи.
+    /// @param[in] ids - Идентификаторы слов цепи только для чтения по номерам слов файла.
+    /// @param[out] block - Состояния блока.
+    /// @throws std::exception в случае ошибки.
+    void decodeBlock(const char* data, size_t size, size_t states, size_t order, const FrozenChain::WordIds& ids, CompactBlock& block)
+    {
+        const char* end = data + size;
+        std::vector<uint64_t> key(order, 0);
+        block.keys.reserve(states * order);
+        block.ends.reserve(states);
+        for (size_t state = 0; state < states; ++state)
+        {
+            const size_t common = readVarint(data, end);
+            if (common >= order)
+            {
+                throw std::runtime_error("MarkovTextChain::load error: corrupted compact chain");
+            }
+            key[common] += readVarint(data, end);
+            for (size_t j = common + 1; j < order; ++j)
+            {
+                key[j] = readVarint(data, end);
+            }
+            for (const auto code : key)
+            {
+                if (code > ids.size())
+                {
+                    throw std::runtime_error("MarkovTextChain::load error: corrupted compact chain");
+                }
+                block.keys.push_back(code != 0 ? ids[code - 1] : FrozenChain::noWord);
+            }
+            
+            const size_t count = readVarint(data, end);
+            uint64_t next = 0;
+            for (size_t i = 0; i < count; ++i)
+            {
+                next += readVarint(data, end);
+                if (next >= ids.size())
+                {
+                    throw std::runtime_error("MarkovTextChain::load error: corrupted compact chain");
+                }
+                block.successors.emplace_back(ids[next], readVarint(data, end) + 1);
+                ++next;
+            }
+            block.ends.push_back(block.successors.size());
+        }
+        
+        if (data != end)
+        {
+            throw std::runtime_error("MarkovTextChain::load error: corrupted compact chain");
+        }
+    }
 }
 
 
@@ -124,25 +674,120 @@ struct MarkovTextChain::InnerChain
     /// @brief Конструктор.
     InnerChain()
         : m_Map()
+        , m_Loaded()
+        , m_UnpackOnce()
+        , m_WordIds()
+        , m_Vocabulary()
+        , m_Pairs()
+        , m_CurrentIds()
     {
     }
     
     /// @brief Таблица состояний цепи.
     std::unordered_map<MarkovTextChain::Words, WordsKeeper, WordsHash> m_Map;
+    
+    /// @brief Состояния, загруженные в компактном формате, без индекса. Пока они есть, таблица пуста
+    ///        или повторяет их, освобождают их только неконстантные методы.
+    std::unique_ptr<FrozenChain> m_Loaded;
+    
+    /// @brief Флаг однократного переноса загруженных состояний в таблицу, создается вместе с m_Loaded.
+    std::unique_ptr<std::once_flag> m_UnpackOnce;
+    
+    /// @brief Идентификаторы слов, накопленных для пакетного построения.
+    std::unordered_map<MarkovTextChain::Word, uint32_t> m_WordIds;
+    
+    /// @brief Слова, накопленные для пакетного построения, по их идентификаторам.
+    std::vector<MarkovTextChain::Word> m_Vocabulary;
+    
+    /// @brief Накопленные пары (состояние, слово) в виде идентификаторов, по order + 1 на пару.
+    std::vector<uint32_t> m_Pairs;
+    
+    /// @brief Идентификаторы последней рассмотренной последовательности слов.
+    std::vector<uint32_t> m_CurrentIds;
 };
 
 
+namespace
+{
+    /// @brief Число идентификаторов в буфере пар, по достижении которого пары переносятся в таблицу.
+    constexpr size_t maxPendingIds = 64 * 1024 * 1024;
+    
+    /// @brief Маска счетчика слов, по которой замеряется задержка генерации каждого 64-го слова.
+    constexpr uint32_t wordLatencySampleMask = 63;
+    
+    /// @brief Счетчик сгенерированных потоком слов для выбора замеряемых слов.
+    thread_local uint32_t generatedWords = 0;
+    
+    /// @brief Перенести состояния таблицы в цепь только для чтения без построения индекса.
+    /// @param[in,out] map - Таблица состояний.
+    /// @param[in] order - Порядок цепи.
+    /// @param[in] release - Освобождать таблицу по мере переноса.
+    /// @return Цепь только для чтения.
+    template <typename Map>
+    std::unique_ptr<FrozenChain> packStates(Map& map, size_t order, bool release)
+    {
+        // Собрать словарь цепи.
+        std::unordered_set<MarkovTextChain::Word> uniqueWords;
+        for (const auto& pair : map)
+        {
+            uniqueWords.insert(pair.first.begin(), pair.first.end());
+            for (const auto& entry : pair.second.words())
+            {
+                uniqueWords.insert(entry.first);
+            }
+        }
+        std::vector<MarkovTextChain::Word> words(uniqueWords.begin(), uniqueWords.end());
+        uniqueWords.clear();
+        
+        std::unique_ptr<FrozenChain> frozen(new FrozenChain(order, std::move(words)));
+        
+        FrozenChain::WordIds key;
+        FrozenChain::Successors successors;
+        for (auto it = map.begin(); it != map.end(); it = release ? map.erase(it) : std::next(it))
+        {
+            // Ключи состояний младших порядков дополняются в начале отсутствующими словами до порядка цепи.
+            key.assign(order - it->first.size(), FrozenChain::noWord);
+            for (const auto& word : it->first)
+            {
+                key.push_back(frozen->wordId(word));
+            }
+            
+            successors.clear();
+            for (const auto& entry : it->second.words())
+            {
+                successors.emplace_back(frozen->wordId(entry.first), entry.second);
+            }
+            
+            frozen->addState(key, successors);
+        }
+        return frozen;
+    }
+}
+
+
 const std::string MarkovTextChain::m_ChainHeader = "MARKOV_TEXT_CHAIN_BEGIN";
 const std::string MarkovTextChain::m_ChainTrailer = "MARKOV_TEXT_CHAIN_END";
+const std::string MarkovTextChain::m_CompactHeader = "MARKOV_TEXT_CHAIN_COMPACT";
+const std::string MarkovTextChain::m_IndexHeader = "MARKOV_TEXT_CHAIN_INDEX";
+const std::string MarkovTextChain::m_IndexTrailer = "MARKOV_TEXT_CHAIN_INDEX_END";
 const std::string MarkovTextChain::m_Delimiter = "->";
+const MarkovTextChain::StateId MarkovTextChain::noState = FrozenChain::noState;
 
     
 MarkovTextChain::MarkovTextChain(size_t chainOrder)
     : m_Order(chainOrder)
     , m_CurrentWords()
+    , m_Engine(LearnEngine::Hash)
+    , m_Threads(1)
+    , m_HalfLife(0)
+    , m_MaxStates(0)
+    , m_EpochWords(0)
+    , m_Backoff(false)
+    , m_Counters()
     , m_Chain(new InnerChain)
+    , m_Frozen()
+    , m_Live()
 {
-    srand(time(nullptr));
 }
 
 MarkovTextChain::~MarkovTextChain() = default;
@@ -157,13 +802,62 @@ size_t MarkovTextChain::order() const
     return m_Order;
 }
 
+void MarkovTextChain::setEngine(LearnEngine engine, size_t threads)
+{
+    m_Engine = engine;
+    m_Threads = threads > 0 ? threads : 1;
+}
+
+void MarkovTextChain::setDecay(size_t halfLife, size_t maxStates)
+{
+    m_HalfLife = halfLife;
+    m_MaxStates = maxStates;
+    m_EpochWords = 0;
+}
+
+void MarkovTextChain::setBackoff(bool backoff)
+{
+    m_Backoff = backoff;
+}
+
+bool MarkovTextChain::backoff() const
+{
+    return m_Backoff;
+}
+
+size_t MarkovTextChain::stateCount() const
+{
+    if (m_Frozen)
+    {
+        return m_Frozen->stateCount();
+    }
+    if (m_Live)
+    {
+        return m_Live->stateCount();
+    }
+    if (m_Chain->m_Loaded)
+    {
+        return m_Chain->m_Loaded->stateCount();
+    }
+    return m_Chain->m_Map.size();
+}
+
 void MarkovTextChain::load(std::istream& input)
 {
+    TraceScope scope("MarkovTextChain::load");
+    LatencyScope latency(Latency::Operation::Load);
+    m_Frozen.reset();
+    m_Live.reset();
+    m_Backoff = false;
+    
+    // Цепь загружается поверх содержимого таблицы.
+    releaseLoaded();
+    
     try
     {
         // Найти заголовок в потоке
         std::string buffer;
-        while (buffer != m_ChainHeader && input.good())
+        while (buffer != m_ChainHeader && buffer != m_CompactHeader && input.good())
         {
             input >> buffer;
         }
@@ -173,6 +867,15 @@ void MarkovTextChain::load(std::istream& input)
             throw std::runtime_error("MarkovTextChain::load error: input stream is not good");
         }
         
+        if (buffer == m_CompactHeader)
+        {
+            // За заголовком следует перевод строки и двоичные данные.
+            input.get();
+            loadCompact(input);
+            loadDeltas(input);
+            return;
+        }
+        
         // Считать порядок цепи.
         input >> m_Order;
         if (m_Order == 0)
@@ -189,6 +892,7 @@ void MarkovTextChain::load(std::istream& input)
         std::getline(input, buffer);
         
         parseChainStates(input);
+        loadDeltas(input);
     }
     catch (const std::exception&)
     {
@@ -197,72 +901,636 @@ void MarkovTextChain::load(std::istream& input)
     }
 }
 
-void MarkovTextChain::save(std::ostream& output) const
+void MarkovTextChain::save(std::ostream& output, ChainFormat format) const
 {
+    TraceScope scope("MarkovTextChain::save");
+    LatencyScope latency(Latency::Operation::Save);
     if (m_Order == 0)
     {
         throw std::logic_error("MarkovTextChain::save error: inadmissible chain order");
     }
+    if (!m_Chain->m_Pairs.empty())
+    {
+        throw std::logic_error("MarkovTextChain::save error: chain has uncommitted words");
+    }
+    if (format == ChainFormat::Compact)
+    {
+        saveCompact(output);
+        return;
+    }
+    if (format == ChainFormat::Sorted)
+    {
+        saveSorted(output);
+        return;
+    }
     
     output << m_ChainHeader << std::endl;
     output << m_Order << std::endl;
-    output << m_Chain->m_Map.bucket_count() << std::endl;
     
-    for (const auto& pair : m_Chain->m_Map)
+    if (m_Frozen || m_Live || m_Chain->m_Loaded)
     {
-        for (const auto& word : pair.first)
+        if (m_Frozen)
         {
-            output << word << ' ';
+            saveStates(*m_Frozen, m_Delimiter, output);
         }
-        output << m_Delimiter << ' ';
-        output << pair.second.toString() << std::endl;
-    }
-    
+        else if (m_Live)
+        {
+            saveStates(*m_Live, m_Delimiter, output);
+        }
+        else
+        {
+            saveStates(*m_Chain->m_Loaded, m_Delimiter, output);
+        }
+        
+        output << m_ChainTrailer << std::endl;
+        return;
+    }
+    
+    output << m_Chain->m_Map.bucket_count() << std::endl;
+    
+    for (const auto& pair : m_Chain->m_Map)
+    {
+        for (const auto& word : pair.first)
+        {
+            output << word << ' ';
+        }
+        output << m_Delimiter << ' ';
+        output << pair.second.toString() << std::endl;
+    }
+    
     output << m_ChainTrailer << std::endl;
 }
 
+bool MarkovTextChain::lookup(std::istream& input, const Words& key, Successors& successors)
+{
+    successors.clear();
+    input.clear();
+    input.seekg(0);
+    StateReader reader(input);
+    if (!reader.sorted())
+    {
+        throw std::runtime_error("MarkovTextChain::lookup error: chain file has no index");
+    }
+    const Words target(key.size() > reader.order() ? std::prev(key.end(), reader.order()) : key.begin(), key.end());
+    
+    // Перейти к последней записи индекса с ключом не больше искомого и просмотреть
+    // состояния от нее до искомого ключа или первого большего.
+    if (!reader.seekState(target))
+    {
+        return false;
+    }
+    Words stateKey;
+    for (size_t i = 0; i < sortedIndexInterval && reader.next(stateKey, successors); ++i)
+    {
+        if (stateKey == target)
+        {
+            return true;
+        }
+        if (target < stateKey)
+        {
+            break;
+        }
+    }
+    successors.clear();
+    return false;
+}
+
 void MarkovTextChain::addWord(Word&& word)
 {
     if (m_Order == 0)
     {
         throw std::logic_error("MarkovTextChain::addWord error: inadmissible chain order");
     }
+    if (m_Frozen)
+    {
+        throw std::logic_error("MarkovTextChain::addWord error: chain is frozen");
+    }
+    releaseLoaded();
+    
+    ++m_Counters.words;
+    if (m_Live)
+    {
+        m_Live->addWord(word);
+        return;
+    }
     
-    if (m_CurrentWords.size() < m_Order)
+    if (m_Engine == LearnEngine::Sort)
+    {
+        if (m_Backoff)
+        {
+            throw std::logic_error("MarkovTextChain::addWord error: backoff chain requires the hash engine");
+        }
+        appendWordPair(std::move(word));
+        return;
+    }
+    
+    if (m_Backoff)
+    {
+        // Слово добавляется в состояния всех окончаний последних слов, начиная с первого слова текста.
+        Words suffix;
+        for (auto it = m_CurrentWords.rbegin(); it != m_CurrentWords.rend(); ++it)
+        {
+            suffix.push_front(*it);
+            addSuccessor(suffix, word);
+        }
+        if (m_CurrentWords.size() == m_Order)
+        {
+            m_CurrentWords.pop_front();
+        }
+        m_CurrentWords.push_back(std::move(word));
+    }
+    else if (m_CurrentWords.size() < m_Order)
     {
         m_CurrentWords.push_back(std::move(word));
         return;
     }
+    else
+    {
+        addSuccessor(m_CurrentWords, word);
+        m_CurrentWords.pop_front();
+        m_CurrentWords.push_back(std::move(word));
+    }
     
-    m_Chain->m_Map[m_CurrentWords].addWord(word);
-    m_CurrentWords.pop_front();
-    m_CurrentWords.push_back(std::move(word));
+    if (m_HalfLife > 0 && ++m_EpochWords >= m_HalfLife)
+    {
+        decay();
+        m_EpochWords = 0;
+    }
+    while (m_MaxStates > 0 && m_Chain->m_Map.size() > m_MaxStates)
+    {
+        decay();
+    }
 }
 
-MarkovTextChain::Word MarkovTextChain::generateWord(const Words& words) const
+MarkovTextChain::Word MarkovTextChain::generateWord(const Words& words, RandomEngine& random) const
 {
     if (m_Order == 0)
     {
         throw std::logic_error("MarkovTextChain::generateWord error: inadmissible chain order");
     }
     
-    try
+    if (m_Frozen)
+    {
+        const FrozenChain::StateId state = findState(words);
+        if (state == FrozenChain::noState)
+        {
+            throw std::logic_error("MarkovTextChain::generateWord error: cannot generate word");
+        }
+        return m_Frozen->word(m_Frozen->generateWord(state, random));
+    }
+    
+    if (m_Live)
+    {
+        LiveChain::StateId state = m_Live->findState(words);
+        if (state == LiveChain::noState)
+        {
+            throw std::logic_error("MarkovTextChain::generateWord error: cannot generate word");
+        }
+        return m_Live->word(m_Live->step(state, random));
+    }
+    
+    // Цепь с откатом переходит к все более коротким окончаниям последовательности.
+    unpackLoaded();
+    Words suffix(words);
+    while (!suffix.empty())
+    {
+        const auto it = m_Chain->m_Map.find(suffix);
+        if (it != m_Chain->m_Map.end())
+        {
+            return it->second.getWord(random);
+        }
+        if (!m_Backoff)
+        {
+            break;
+        }
+        suffix.pop_front();
+    }
+    throw std::logic_error("MarkovTextChain::generateWord error: cannot generate word");
+}
+
+MarkovTextChain::StateId MarkovTextChain::findState(const Words& words) const
+{
+    if (m_Live)
     {
-        return m_Chain->m_Map.at(words).getWord();
+        return m_Live->findState(words);
     }
-    catch (const std::out_of_range&)
+    if (!m_Frozen)
+    {
+        throw std::logic_error("MarkovTextChain::findState error: chain is not frozen");
+    }
+    
+    // Цепь с откатом ищет состояние для самого длинного окончания последовательности.
+    return m_Backoff ? m_Frozen->findBackoffState(words) : m_Frozen->findState(words);
+}
+
+MarkovTextChain::StateId MarkovTextChain::randomState(RandomEngine& random) const
+{
+    if (m_Live)
+    {
+        return m_Live->randomState(random);
+    }
+    if (!m_Frozen)
+    {
+        throw std::logic_error("MarkovTextChain::randomState error: chain is not frozen");
+    }
+    return m_Frozen->randomState(random);
+}
+
+const MarkovTextChain::Word& MarkovTextChain::generateWord(StateId& state, RandomEngine& random) const
+{
+    if (state == noState)
     {
         throw std::logic_error("MarkovTextChain::generateWord error: cannot generate word");
     }
+    
+    // Замер каждого слова стоил бы сравнимо с генерацией слова, поэтому замеряется только каждое 64-е.
+    if ((++generatedWords & wordLatencySampleMask) == 0)
+    {
+        LatencyScope latency(Latency::Operation::GenerateWord);
+        return stepWord(state, random);
+    }
+    return stepWord(state, random);
+}
+
+const MarkovTextChain::Word& MarkovTextChain::stepWord(StateId& state, RandomEngine& random) const
+{
+    if (m_Live)
+    {
+        return m_Live->word(m_Live->step(state, random));
+    }
+    if (!m_Frozen || !m_Frozen->hasLinks())
+    {
+        throw std::logic_error("MarkovTextChain::generateWord error: chain is not frozen with links");
+    }
+    return m_Frozen->word(m_Frozen->step(state, random));
+}
+
+bool MarkovTextChain::continuePhrase(const std::string& phrase, size_t count, RandomEngine& random, std::string& text) const
+{
+    LatencyScope latency(Latency::Operation::GenerateText);
+    StateId state = startPhrase(phrase, random, text);
+    if (state == noState)
+    {
+        text.clear();
+        return false;
+    }
+    
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (state == noState)
+        {
+            state = randomState(random);
+        }
+        text += generateWord(state, random);
+        text += ' ';
+    }
+    
+    if (!text.empty())
+    {
+        text.pop_back();
+    }
+    return true;
+}
+
+void MarkovTextChain::continuePhrases(const std::string* phrases, RandomEngine* randoms, std::string* texts, char* results, size_t size, size_t count) const
+{
+    if (!m_Frozen || !m_Frozen->hasLinks())
+    {
+        for (size_t i = 0; i < size; ++i)
+        {
+            results[i] = continuePhrase(phrases[i], count, randoms[i], texts[i]);
+        }
+        return;
+    }
+    
+    // Фразы группы генерируются вместе, и каждая из них ждет всю группу.
+    LatencyScope latency(Latency::Operation::GenerateText, size);
+    std::vector<StateId> states(size);
+    for (size_t i = 0; i < size; ++i)
+    {
+        states[i] = startPhrase(phrases[i], randoms[i], texts[i]);
+        results[i] = states[i] != noState;
+    }
+    
+    std::vector<FrozenChain::WordId> words(size);
+    for (size_t step = 0; step < count; ++step)
+    {
+        for (size_t i = 0; i < size; ++i)
+        {
+            if (results[i] && states[i] == noState)
+            {
+                states[i] = m_Frozen->randomState(randoms[i]);
+            }
+        }
+        
+        m_Frozen->step(states.data(), randoms, words.data(), size);
+        for (size_t i = 0; i < size; ++i)
+        {
+            if (words[i] != FrozenChain::noWord)
+            {
+                texts[i] += m_Frozen->word(words[i]);
+                texts[i] += ' ';
+            }
+        }
+    }
+    
+    for (size_t i = 0; i < size; ++i)
+    {
+        if (!results[i])
+        {
+            texts[i].clear();
+        }
+        else if (!texts[i].empty())
+        {
+            texts[i].pop_back();
+        }
+    }
+}
+
+MarkovTextChain::Score MarkovTextChain::score(const Word* words, size_t count, double addK) const
+{
+    if (!m_Frozen)
+    {
+        throw std::logic_error("MarkovTextChain::score error: chain is not frozen");
+    }
+    
+    Score result = { count, 0, 0.0, 0 };
+    const size_t first = m_Backoff ? 1 : m_Order;
+    if (count <= first)
+    {
+        return result;
+    }
+    
+    std::vector<FrozenChain::WordId> ids(count);
+    m_Frozen->wordIds(words, ids.data(), count);
+    
+    // Ключ оцениваемого слова - предшествующие ему слова. В начале текста цепи с откатом ключ короче
+    // порядка цепи и дополняется в начале отсутствующими словами, как ключи младших порядков.
+    const size_t size = count - first;
+    std::vector<FrozenChain::WordId> keys(size * m_Order, FrozenChain::noWord);
+    for (size_t i = first; i < count; ++i)
+    {
+        const size_t length = std::min(i, m_Order);
+        std::copy(&ids[i - length], &ids[i], &keys[(i - first + 1) * m_Order - length]);
+    }
+    
+    std::vector<uint32_t> occurrences(size);
+    std::vector<uint32_t> totals(size);
+    m_Frozen->countSuccessors(keys.data(), &ids[first], occurrences.data(), totals.data(), size);
+    
+    // Неизвестное слово занимает в сглаженном распределении одно место сверх словаря.
+    const double outcomes = static_cast<double>(m_Frozen->wordCount() + 1);
+    for (size_t i = 0; i < size; ++i)
+    {
+        if (ids[first + i] == FrozenChain::noWord)
+        {
+            ++result.unknown;
+        }
+        if (occurrences[i] != 0 || addK > 0.0)
+        {
+            ++result.scored;
+            result.logProbability += std::log((occurrences[i] + addK) / (totals[i] + addK * outcomes));
+        }
+    }
+    return result;
+}
+
+MarkovTextChain::StateId MarkovTextChain::startPhrase(const std::string& phrase, RandomEngine& random, std::string& text) const
+{
+    std::istringstream phraseStream(phrase);
+    Words words;
+    Word word;
+    text.clear();
+    while (phraseStream >> word)
+    {
+        text += word + ' ';
+        words.push_back(std::move(word));
+    }
+    
+    if (words.empty())
+    {
+        return randomState(random);
+    }
+    
+    while (words.size() > m_Order)
+    {
+        words.pop_front();
+    }
+    
+    return findState(words);
 }
 
 void MarkovTextChain::flush()
 {
     m_CurrentWords.clear();
+    m_Chain->m_CurrentIds.clear();
+    if (m_Live)
+    {
+        m_Live->flush();
+    }
+}
+
+MarkovTextChain::Counters MarkovTextChain::counters() const
+{
+    return m_Counters;
+}
+
+double MarkovTextChain::loadFactor() const
+{
+    unpackLoaded();
+    return m_Chain->m_Map.load_factor();
+}
+
+void MarkovTextChain::commit()
+{
+    std::vector<uint32_t>& pairs = m_Chain->m_Pairs;
+    const std::vector<Word>& vocabulary = m_Chain->m_Vocabulary;
+    if (pairs.empty())
+    {
+        return;
+    }
+    
+    TraceScope scope("MarkovTextChain::commit");
+    const size_t width = m_Order + 1;
+    radixSortRecords(pairs, width, vocabulary.size() - 1, m_Threads);
+    
+    // После сортировки одинаковые пары и пары одного состояния идут подряд.
+    const size_t total = pairs.size();
+    size_t states = 0;
+    for (size_t i = 0; i < total; i += width)
+    {
+        if (i == 0 || !std::equal(&pairs[i], &pairs[i] + m_Order, &pairs[i - width]))
+        {
+            ++states;
+        }
+    }
+    const size_t buckets = m_Chain->m_Map.bucket_count();
+    const size_t previousStates = m_Chain->m_Map.size();
+    m_Chain->m_Map.reserve(m_Chain->m_Map.size() + states);
+    
+    size_t i = 0;
+    while (i < total)
+    {
+        Words key;
+        for (size_t j = 0; j < m_Order; ++j)
+        {
+            key.push_back(vocabulary[pairs[i + j]]);
+        }
+        WordsKeeper& value = m_Chain->m_Map[std::move(key)];
+        
+        const uint32_t* state = &pairs[i];
+        while (i < total && std::equal(state, state + m_Order, &pairs[i]))
+        {
+            const uint32_t successor = pairs[i + m_Order];
+            size_t count = 0;
+            while (i < total && std::equal(state, state + m_Order, &pairs[i]) && pairs[i + m_Order] == successor)
+            {
+                ++count;
+                i += width;
+            }
+            m_Counters.successors += value.addWord(vocabulary[successor], count) ? 1 : 0;
+        }
+    }
+    m_Counters.states += m_Chain->m_Map.size() - previousStates;
+    m_Counters.rehashes += m_Chain->m_Map.bucket_count() != buckets ? 1 : 0;
+    
+    pairs.clear();
+    pairs.shrink_to_fit();
+}
+
+void MarkovTextChain::freeze(FrozenLayout layout, bool links)
+{
+    if (m_Order == 0)
+    {
+        throw std::logic_error("MarkovTextChain::freeze error: inadmissible chain order");
+    }
+    if (m_Frozen)
+    {
+        return;
+    }
+    if (m_Live)
+    {
+        throw std::logic_error("MarkovTextChain::freeze error: chain is live");
+    }
+    commit();
+    TraceScope scope("MarkovTextChain::freeze");
+    
+    // Перенести состояния, освобождая таблицу по мере переноса. Состояния, загруженные
+    // в компактном формате, уже перенесены, и остается построить индекс.
+    auto& map = m_Chain->m_Map;
+    std::unique_ptr<FrozenChain> frozen = m_Chain->m_Loaded ? std::move(m_Chain->m_Loaded) : packStates(map, m_Order, true);
+    
+    frozen->build(layout);
+    if (links)
+    {
+        frozen->buildLinks();
+    }
+    
+    map = decltype(m_Chain->m_Map)();
+    m_Chain->m_WordIds.clear();
+    m_Chain->m_Vocabulary.clear();
+    m_CurrentWords.clear();
+    m_Frozen = std::move(frozen);
+}
+
+bool MarkovTextChain::frozen() const
+{
+    return static_cast<bool>(m_Frozen);
+}
+
+void MarkovTextChain::makeLive()
+{
+    if (m_Order == 0)
+    {
+        throw std::logic_error("MarkovTextChain::makeLive error: inadmissible chain order");
+    }
+    if (m_Frozen)
+    {
+        throw std::logic_error("MarkovTextChain::makeLive error: chain is frozen");
+    }
+    if (m_Backoff)
+    {
+        throw std::logic_error("MarkovTextChain::makeLive error: backoff chain cannot be live");
+    }
+    if (m_Live)
+    {
+        return;
+    }
+    releaseLoaded();
+    commit();
+    
+    // Перенести состояния, освобождая таблицу по мере переноса.
+    auto& map = m_Chain->m_Map;
+    std::unique_ptr<LiveChain> live(new LiveChain(m_Order));
+    LiveChain::WordIds key;
+    for (auto it = map.begin(); it != map.end(); it = map.erase(it))
+    {
+        key.clear();
+        for (const auto& word : it->first)
+        {
+            key.push_back(live->addWordId(word));
+        }
+        for (const auto& entry : it->second.words())
+        {
+            live->addSuccessor(key.data(), live->addWordId(entry.first), entry.second);
+        }
+    }
+    
+    map = decltype(m_Chain->m_Map)();
+    m_Chain->m_WordIds.clear();
+    m_Chain->m_Vocabulary.clear();
+    m_Chain->m_CurrentIds.clear();
+    m_CurrentWords.clear();
+    m_Live = std::move(live);
+}
+
+bool MarkovTextChain::live() const
+{
+    return static_cast<bool>(m_Live);
+}
+
+size_t MarkovTextChain::memoryUsage() const
+{
+    if (m_Frozen)
+    {
+        return sizeof(*this) + m_Frozen->memoryUsage();
+    }
+    if (m_Live)
+    {
+        return sizeof(*this) + m_Live->memoryUsage();
+    }
+    
+    // Таблицу может заполнять перенос загруженных состояний в другом потоке, поэтому она читается
+    // только после переноса. Загруженные состояния остаются в памяти рядом с таблицей.
+    unpackLoaded();
+    
+    // Оценка для узлов хэш-таблицы, узлов списков ключей и строк стандартной библиотеки.
+    const size_t nodeOverhead = 2 * sizeof(void*);
+    const auto stringSize = [](const Word& word)
+    {
+        return sizeof(Word) + (word.capacity() > 15 ? word.capacity() + 1 : 0);
+    };
+    
+    size_t result = sizeof(*this) + sizeof(InnerChain) + (m_Chain->m_Loaded ? m_Chain->m_Loaded->memoryUsage() : 0);
+    result += m_Chain->m_Map.bucket_count() * sizeof(void*);
+    for (const auto& pair : m_Chain->m_Map)
+    {
+        result += nodeOverhead + sizeof(pair);
+        for (const auto& word : pair.first)
+        {
+            result += nodeOverhead + stringSize(word);
+        }
+        for (const auto& entry : pair.second.words())
+        {
+            result += sizeof(size_t) + stringSize(entry.first);
+        }
+    }
+    return result;
 }
 
 void MarkovTextChain::parseChainStates(std::istream& input)
 {
+    TraceScope scope("MarkovTextChain::parseChainStates");
     std::string tmp;
     Words key;
     int totalWords = 0;
@@ -287,12 +1555,18 @@ void MarkovTextChain::parseChainStates(std::istream& input)
             }
         }
         
-        if (key.size() != m_Order)
+        if (key.empty() || key.size() > m_Order)
         {
             throw std::logic_error("MarkovTextChain::parseChainString error: chain string has wrong order");
         }
+        if (key.size() < m_Order)
+        {
+            m_Backoff = true;
+        }
         
+        // Если ключ уже есть в таблице, он не перемещается, поэтому очищается явно.
         WordsKeeper& value = m_Chain->m_Map[std::move(key)];
+        key.clear();
         
         input >> totalWords;
         // После разделителя считать слова значения таблицы состояний.
@@ -314,9 +1588,630 @@ void MarkovTextChain::parseChainStates(std::istream& input)
     throw std::runtime_error("MarkovTextChain::load error: input stream is not good");
 }
 
+void MarkovTextChain::loadDeltas(std::istream& input)
+{
+    // Между сегментами может находиться индекс формата Sorted, его строки пропускаются.
+    std::string buffer;
+    while (input >> buffer)
+    {
+        if (buffer != m_ChainHeader)
+        {
+            continue;
+        }
+        
+        size_t order = 0;
+        size_t buckets = 0;
+        if (!(input >> order >> buckets) || order != m_Order)
+        {
+            throw std::runtime_error("MarkovTextChain::load error: appended chain order does not match");
+        }
+        std::getline(input, buffer);
+        
+        // Приращение добавляется в таблицу состояний.
+        releaseLoaded();
+        parseChainStates(input);
+    }
+}
+
+void MarkovTextChain::loadCompact(std::istream& input)
+{
+    m_Order = readStreamVarint(input);
+    if (m_Order == 0)
+    {
+        throw std::runtime_error("MarkovTextChain::load error: inadmissible chain order");
+    }
+    m_Backoff = readStreamVarint(input) != 0;
+    const size_t wordCount = readStreamVarint(input);
+    const size_t stateCount = readStreamVarint(input);
+    
+    std::string raw(readStreamVarint(input), '\0');
+    std::string stored(readStreamVarint(input), '\0');
+    if (!input.read(&stored[0], stored.size()))
+    {
+        throw std::runtime_error("MarkovTextChain::load error: input stream is not good");
+    }
+    unpackBlock(stored.data(), stored.size(), raw);
+    
+    std::vector<Word> words;
+    words.reserve(wordCount);
+    const char* position = raw.data();
+    const char* end = position + raw.size();
+    for (size_t i = 0; i < wordCount; ++i)
+    {
+        const size_t size = readVarint(position, end);
+        if (size > static_cast<size_t>(end - position))
+        {
+            throw std::runtime_error("MarkovTextChain::load error: corrupted compact chain");
+        }
+        words.emplace_back(position, size);
+        position += size;
+    }
+    
+    // Идентификаторы слов цепи только для чтения задает ее совершенная хэш-функция, а не номера файла.
+    std::unique_ptr<FrozenChain> loaded(new FrozenChain(m_Order, std::vector<Word>(words)));
+    FrozenChain::WordIds ids(wordCount);
+    for (size_t i = 0; i < wordCount; ++i)
+    {
+        ids[i] = loaded->wordId(words[i]);
+    }
+    words = std::vector<Word>();
+    
+    const size_t blockCount = readStreamVarint(input);
+    std::vector<size_t> blockStates(blockCount);
+    std::vector<size_t> rawSizes(blockCount);
+    std::vector<size_t> offsets(blockCount + 1, 0);
+    for (size_t block = 0; block < blockCount; ++block)
+    {
+        blockStates[block] = readStreamVarint(input);
+        rawSizes[block] = readStreamVarint(input);
+        offsets[block + 1] = offsets[block] + readStreamVarint(input);
+    }
+    stored.assign(offsets.back(), '\0');
+    if (!input.read(&stored[0], stored.size()))
+    {
+        throw std::runtime_error("MarkovTextChain::load error: input stream is not good");
+    }
+    
+    // Блоки не зависят друг от друга и распаковываются параллельно.
+    std::vector<CompactBlock> blocks(blockCount);
+    const size_t threads = std::min(defaultThreadCount(), blockCount);
+    runParallel(threads, [&](size_t thread)
+    {
+        std::string data;
+        for (size_t block = thread; block < blockCount; block += threads)
+        {
+            data.assign(rawSizes[block], '\0');
+            unpackBlock(&stored[offsets[block]], offsets[block + 1] - offsets[block], data);
+            decodeBlock(data.data(), data.size(), blockStates[block], m_Order, ids, blocks[block]);
+        }
+    });
+    stored = std::string();
+    
+    FrozenChain::WordIds key;
+    FrozenChain::Successors successors;
+    for (auto& block : blocks)
+    {
+        size_t first = 0;
+        for (size_t state = 0; state < block.ends.size(); ++state)
+        {
+            key.assign(&block.keys[state * m_Order], &block.keys[state * m_Order] + m_Order);
+            successors.assign(block.successors.begin() + first, block.successors.begin() + block.ends[state]);
+            loaded->addState(key, successors);
+            first = block.ends[state];
+        }
+        block = CompactBlock();
+    }
+    
+    std::string trailer;
+    input >> trailer;
+    if (loaded->stateCount() != stateCount || trailer != m_ChainTrailer)
+    {
+        throw std::runtime_error("MarkovTextChain::load error: corrupted compact chain");
+    }
+    
+    m_Chain->m_Loaded = std::move(loaded);
+    m_Chain->m_UnpackOnce.reset(new std::once_flag());
+    if (!m_Chain->m_Map.empty())
+    {
+        releaseLoaded();
+    }
+}
+
+void MarkovTextChain::saveCompact(std::ostream& output) const
+{
+    output << m_CompactHeader << '\n';
+    if (m_Frozen)
+    {
+        saveCompactStates(*m_Frozen, m_Order, m_Backoff, output);
+    }
+    else if (m_Live)
+    {
+        saveCompactStates(*m_Live, m_Order, m_Backoff, output);
+    }
+    else if (m_Chain->m_Loaded)
+    {
+        saveCompactStates(*m_Chain->m_Loaded, m_Order, m_Backoff, output);
+    }
+    else
+    {
+        saveCompactStates(*packStates(m_Chain->m_Map, m_Order, false), m_Order, m_Backoff, output);
+    }
+    output << '\n' << m_ChainTrailer << std::endl;
+}
+
+void MarkovTextChain::saveSorted(std::ostream& output) const
+{
+    SortedWriter writer(output);
+    writer.writeHeader(m_Order, stateCount());
+    if (m_Frozen)
+    {
+        saveSortedStates(*m_Frozen, writer);
+    }
+    else if (m_Live)
+    {
+        saveSortedStates(*m_Live, writer);
+    }
+    else if (m_Chain->m_Loaded)
+    {
+        saveSortedStates(*m_Chain->m_Loaded, writer);
+    }
+    else
+    {
+        saveSortedStates(*packStates(m_Chain->m_Map, m_Order, false), writer);
+    }
+    writer.finish();
+}
+
+void MarkovTextChain::unpackLoaded() const
+{
+    // Флаг и загруженные состояния меняют только неконстантные методы, поэтому константные методы
+    // разных потоков переносят состояния один раз и не читают таблицу, пока перенос не закончен.
+    // Загруженные состояния остаются: константные методы могут читать их одновременно с переносом.
+    if (!m_Chain->m_UnpackOnce)
+    {
+        return;
+    }
+    std::call_once(*m_Chain->m_UnpackOnce, [this]()
+    {
+        const FrozenChain* loaded = m_Chain->m_Loaded.get();
+        if (!loaded)
+        {
+            return;
+        }
+        
+        auto& map = m_Chain->m_Map;
+        map.reserve(map.size() + loaded->stateCount());
+        loaded->forEachState([&loaded, &map](const FrozenChain::WordIds& key, FrozenChain::StateId state)
+        {
+            Words words;
+            for (const auto id : key)
+            {
+                if (id != FrozenChain::noWord)
+                {
+                    words.push_back(loaded->word(id));
+                }
+            }
+            
+            WordsKeeper& value = map[std::move(words)];
+            for (const auto& successor : loaded->successors(state))
+            {
+                value.addWord(loaded->word(successor.first), successor.second);
+            }
+        });
+    });
+}
+
+void MarkovTextChain::releaseLoaded()
+{
+    unpackLoaded();
+    m_Chain->m_Loaded.reset();
+}
+
+void MarkovTextChain::appendWordPair(Word&& word)
+{
+    auto inserted = m_Chain->m_WordIds.emplace(std::move(word), m_Chain->m_Vocabulary.size());
+    if (inserted.second)
+    {
+        m_Chain->m_Vocabulary.push_back(inserted.first->first);
+    }
+    
+    std::vector<uint32_t>& currentIds = m_Chain->m_CurrentIds;
+    const uint32_t id = inserted.first->second;
+    if (currentIds.size() < m_Order)
+    {
+        currentIds.push_back(id);
+        return;
+    }
+    
+    std::vector<uint32_t>& pairs = m_Chain->m_Pairs;
+    pairs.insert(pairs.end(), currentIds.begin(), currentIds.end());
+    pairs.push_back(id);
+    currentIds.erase(currentIds.begin());
+    currentIds.push_back(id);
+    
+    // Ограничить расход памяти на буфер пар при очень больших объемах текста.
+    if (pairs.size() >= maxPendingIds)
+    {
+        commit();
+    }
+}
+
+void MarkovTextChain::addSuccessor(const Words& key, const Word& word)
+{
+    auto& map = m_Chain->m_Map;
+    const size_t buckets = map.bucket_count();
+    const size_t states = map.size();
+    
+    // Перестроение таблицы видно только после вставки, поэтому время вставки замеряется всегда,
+    // а событие записывается, только если число корзин изменилось.
+    const uint64_t start = Trace::enabled() ? Trace::begin() : 0;
+    m_Counters.successors += map[key].addWord(word) ? 1 : 0;
+    m_Counters.states += map.size() - states;
+    if (map.bucket_count() != buckets)
+    {
+        ++m_Counters.rehashes;
+        if (Trace::enabled())
+        {
+            Trace::record("MarkovTextChain::rehash", start, Trace::now());
+        }
+    }
+}
+
+void MarkovTextChain::decay()
+{
+    TraceScope scope("MarkovTextChain::decay");
+    auto& map = m_Chain->m_Map;
+    for (auto it = map.begin(); it != map.end(); )
+    {
+        it->second.decay();
+        it = it->second.empty() ? map.erase(it) : std::next(it);
+    }
+    
+    // Вернуть память массива корзин, освободившегося после удаления состояний.
+    map.rehash(0);
+}
+
 void MarkovTextChain::reset()
 {
     m_Order = 0;
+    m_EpochWords = 0;
+    m_Backoff = false;
+    m_Counters = Counters();
     m_CurrentWords.clear();
     m_Chain->m_Map.clear();
+    m_Chain->m_Loaded.reset();
+    m_Chain->m_UnpackOnce.reset();
+    m_Chain->m_WordIds.clear();
+    m_Chain->m_Vocabulary.clear();
+    m_Chain->m_Pairs.clear();
+    m_Chain->m_CurrentIds.clear();
+    m_Frozen.reset();
+    m_Live.reset();
+}
+
+
+MarkovTextChain::StateReader::StateReader(std::istream& input)
+    : m_Input(input)
+    , m_Order(0)
+    , m_Buckets(0)
+    , m_Sorted(false)
+    , m_IndexBegin(0)
+    , m_IndexEnd(0)
+    , m_Index()
+    , m_Line()
+{
+    std::string buffer;
+    while (buffer != m_ChainHeader && buffer != m_CompactHeader && m_Input.good())
+    {
+        m_Input >> buffer;
+    }
+    if (buffer == m_CompactHeader)
+    {
+        throw std::runtime_error("MarkovTextChain::StateReader error: compact chain cannot be read state by state");
+    }
+    if (!(m_Input >> m_Order >> m_Buckets) || m_Order == 0)
+    {
+        throw std::runtime_error("MarkovTextChain::StateReader error: input is not a text chain");
+    }
+    
+    // После оператора ввода getline вернет ненужную пустую строку.
+    std::getline(m_Input, m_Line);
+    findIndex();
+}
+
+size_t MarkovTextChain::StateReader::order() const
+{
+    return m_Order;
+}
+
+size_t MarkovTextChain::StateReader::buckets() const
+{
+    return m_Buckets;
+}
+
+bool MarkovTextChain::StateReader::sorted() const
+{
+    return m_Sorted;
+}
+
+const std::vector<MarkovTextChain::StateReader::IndexEntry>& MarkovTextChain::StateReader::index()
+{
+    if (m_Sorted && m_Index.empty())
+    {
+        m_Input.clear();
+        const std::streamoff position = m_Input.tellg();
+        IndexEntry entry;
+        for (uint64_t offset = m_IndexBegin; offset < m_IndexEnd; )
+        {
+            offset = readIndexEntry(offset, entry);
+            m_Index.push_back(std::move(entry));
+        }
+        m_Input.clear();
+        m_Input.seekg(position);
+    }
+    return m_Index;
+}
+
+bool MarkovTextChain::StateReader::seekState(const Words& key)
+{
+    if (!m_Sorted)
+    {
+        return false;
+    }
+    
+    // Ищется строка индекса среди начинающихся в [low, high): строка, начало которой ближе всего
+    // к середине справа, сравнивается с ключом, и область сужается до одной из сторон от нее.
+    m_Input.clear();
+    const std::streamoff position = m_Input.tellg();
+    uint64_t low = m_IndexBegin;
+    uint64_t high = m_IndexEnd;
+    bool found = false;
+    uint64_t stateOffset = 0;
+    IndexEntry entry;
+    while (low < high)
+    {
+        const uint64_t middle = low + (high - low) / 2;
+        uint64_t lineBegin = low;
+        if (middle > low)
+        {
+            m_Input.clear();
+            m_Input.seekg(middle - 1);
+            std::getline(m_Input, m_Line);
+            lineBegin = middle + m_Line.size();
+        }
+        if (lineBegin >= high)
+        {
+            high = middle;
+            continue;
+        }
+        
+        const uint64_t lineEnd = readIndexEntry(lineBegin, entry);
+        if (key < entry.first)
+        {
+            high = lineBegin;
+        }
+        else
+        {
+            found = true;
+            stateOffset = entry.second;
+            low = lineEnd;
+        }
+    }
+    
+    m_Input.clear();
+    m_Input.seekg(found ? std::streamoff(stateOffset) : position);
+    return found;
+}
+
+void MarkovTextChain::StateReader::seek(uint64_t offset)
+{
+    m_Input.clear();
+    m_Input.seekg(offset);
+}
+
+bool MarkovTextChain::StateReader::next(Words& key, Successors& successors)
+{
+    key.clear();
+    successors.clear();
+    if (!std::getline(m_Input, m_Line))
+    {
+        return false;
+    }
+    
+    // За концевиком цепи могут следовать приращения. Индекс формата Sorted находится в конце файла,
+    // поэтому приращений за таким файлом нет.
+    while (m_Line == m_ChainTrailer)
+    {
+        if (m_Sorted)
+        {
+            return false;
+        }
+        while (std::getline(m_Input, m_Line) && m_Line != m_ChainHeader)
+        {
+            continue;
+        }
+        if (!m_Input)
+        {
+            return false;
+        }
+        
+        size_t order = 0;
+        size_t buckets = 0;
+        if (!(m_Input >> order >> buckets) || order != m_Order)
+        {
+            throw std::runtime_error("MarkovTextChain::StateReader error: appended chain order does not match");
+        }
+        std::getline(m_Input, m_Line);
+        if (!std::getline(m_Input, m_Line))
+        {
+            return false;
+        }
+    }
+    
+    // Слова строки разделены пробельными символами.
+    size_t position = 0;
+    std::string word;
+    const auto nextWord = [this, &position, &word]()
+    {
+        position = m_Line.find_first_not_of(" \t\r", position);
+        if (position == std::string::npos)
+        {
+            return false;
+        }
+        const size_t end = std::min(m_Line.find_first_of(" \t\r", position), m_Line.size());
+        word.assign(m_Line, position, end - position);
+        position = end;
+        return true;
+    };
+    
+    while (nextWord() && word != m_Delimiter)
+    {
+        key.push_back(word);
+    }
+    if (word != m_Delimiter || key.empty() || key.size() > m_Order || !nextWord())
+    {
+        throw std::runtime_error("MarkovTextChain::StateReader error: corrupted state line");
+    }
+    
+    const size_t total = std::stoull(word);
+    size_t count = 0;
+    while (nextWord())
+    {
+        if (successors.empty() || successors.back().first != word)
+        {
+            successors.emplace_back(word, 0);
+        }
+        ++successors.back().second;
+        ++count;
+    }
+    if (count != total || count == 0)
+    {
+        throw std::runtime_error("MarkovTextChain::StateReader error: corrupted state line");
+    }
+    return true;
+}
+
+void MarkovTextChain::StateReader::findIndex()
+{
+    const std::streamoff states = m_Input.tellg();
+    if (states < 0)
+    {
+        m_Input.clear();
+        return;
+    }
+    
+    // Последняя строка файла формата Sorted содержит смещение индекса. Концевик индекса в другой строке
+    // означает, что за индексом дописано приращение и файл больше не упорядочен.
+    m_Input.seekg(0, std::ios::end);
+    const std::streamoff size = m_Input.tellg();
+    const std::streamoff tail = std::min(size - states, sortedFooterBytes);
+    std::string footer(tail, '\0');
+    m_Input.seekg(size - tail);
+    m_Input.read(&footer[0], tail);
+    const size_t lastLineEnd = !footer.empty() && footer.back() == '\n' ? footer.size() - 1 : footer.size();
+    const size_t lastLine = lastLineEnd > 0 ? footer.rfind('\n', lastLineEnd - 1) : std::string::npos;
+    const size_t trailer = lastLine == std::string::npos ? 0 : lastLine + 1;
+    if (m_Input.good() && (lastLine != std::string::npos || tail == size - states) &&
+        footer.compare(trailer, m_IndexTrailer.size() + 1, m_IndexTrailer + ' ') == 0)
+    {
+        m_Input.seekg(std::stoull(footer.substr(trailer + m_IndexTrailer.size())));
+        m_Sorted = std::getline(m_Input, m_Line) && m_Line.compare(0, m_IndexHeader.size() + 1, m_IndexHeader + ' ') == 0;
+        m_IndexBegin = m_Sorted ? static_cast<uint64_t>(m_Input.tellg()) : 0;
+        m_IndexEnd = m_Sorted ? static_cast<uint64_t>(size - tail) + trailer : 0;
+        m_Sorted = m_Sorted && m_IndexBegin <= m_IndexEnd;
+    }
+    
+    m_Input.clear();
+    m_Input.seekg(states);
+}
+
+uint64_t MarkovTextChain::StateReader::readIndexEntry(uint64_t offset, IndexEntry& entry)
+{
+    m_Input.clear();
+    m_Input.seekg(offset);
+    if (!std::getline(m_Input, m_Line))
+    {
+        throw std::runtime_error("MarkovTextChain::StateReader error: corrupted index");
+    }
+    
+    std::istringstream line(m_Line);
+    entry.second = 0;
+    line >> entry.second;
+    entry.first.assign(std::istream_iterator<Word>(line), std::istream_iterator<Word>());
+    return offset + m_Line.size() + 1;
+}
+
+
+MarkovTextChain::SortedWriter::SortedWriter(std::ostream& output)
+    : m_Output(output)
+    , m_Offset(0)
+    , m_States(0)
+    , m_Index()
+    , m_Line()
+{
+}
+
+void MarkovTextChain::SortedWriter::writeHeader(size_t order, size_t buckets)
+{
+    // Смещения считаются по записанным байтам, поэтому поток вывода может не поддерживать позиционирование.
+    m_Line = m_ChainHeader + '\n' + std::to_string(order) + '\n' + std::to_string(buckets) + '\n';
+    m_Output << m_Line;
+    m_Offset += m_Line.size();
+}
+
+void MarkovTextChain::SortedWriter::write(const Words& key, const Successors& successors)
+{
+    m_Line.clear();
+    for (const auto& word : key)
+    {
+        m_Line += word + ' ';
+    }
+    if (m_States++ % sortedIndexInterval == 0)
+    {
+        m_Index.emplace_back(m_Offset, m_Line.substr(0, m_Line.size() - 1));
+    }
+    
+    // Слова значения повторяются по числу появлений, как в текстовом формате.
+    size_t total = 0;
+    for (const auto& successor : successors)
+    {
+        total += successor.second;
+    }
+    m_Line.append(m_Delimiter).append(1, ' ').append(std::to_string(total)).append(1, ' ');
+    for (const auto& successor : successors)
+    {
+        for (size_t i = 0; i < successor.second; ++i)
+        {
+            m_Line.append(successor.first).append(1, ' ');
+        }
+    }
+    m_Line += '\n';
+    m_Output << m_Line;
+    m_Offset += m_Line.size();
+}
+
+void MarkovTextChain::SortedWriter::append(std::istream& states)
+{
+    while (std::getline(states, m_Line))
+    {
+        if (m_States++ % sortedIndexInterval == 0)
+        {
+            m_Index.emplace_back(m_Offset, m_Line.substr(0, m_Line.find(' ' + m_Delimiter + ' ')));
+        }
+        m_Line += '\n';
+        m_Output << m_Line;
+        m_Offset += m_Line.size();
+    }
+}
+
+void MarkovTextChain::SortedWriter::finish()
+{
+    m_Output << m_ChainTrailer << '\n';
+    const uint64_t indexOffset = m_Offset + m_ChainTrailer.size() + 1;
+    m_Output << m_IndexHeader << ' ' << sortedIndexInterval << '\n';
+    for (const auto& entry : m_Index)
+    {
+        m_Output << entry.first << ' ' << entry.second << '\n';
+    }
+    m_Output << m_IndexTrailer << ' ' << indexOffset << std::endl;
 }
@@ -3,12 +3,19 @@
 #ifndef MARKOV_TEXT_CHAIN_H
 #define MARKOV_TEXT_CHAIN_H
 
+#include "random_engine.h"
+
+#include <cstdint>
 #include <istream>
 #include <list>
 #include <memory>
 #include <ostream>
 #include <string>
+#include <vector>
+
 
+class FrozenChain;
+class LiveChain;
 
 /// @class MarkovTextChain
 /// @brief Текстовая цепь Маркова.
@@ -21,6 +28,221 @@ public:
     /// @brief Тип последовательности слов.
     using Words = std::list<Word>;
     
+    /// @brief Тип списка слов значения состояния с числом их появлений.
+    using Successors = std::vector<std::pair<Word, size_t>>;
+    
+    /// @brief Тип идентификатора состояния цепи только для чтения.
+    using StateId = uint32_t;
+    
+    /// @brief Отсутствующее состояние.
+    static const StateId noState;
+    
+    /// @brief Способ построения цепи.
+    enum class LearnEngine
+    {
+        /// @brief Каждая пара (состояние, слово) сразу добавляется в таблицу состояний.
+        Hash,
+        
+        /// @brief Пары накапливаются в виде идентификаторов слов, сортируются и подсчитываются пакетно.
+        Sort
+    };
+    
+    /// @brief Способ индексации состояний цепи только для чтения.
+    enum class FrozenLayout
+    {
+        /// @brief Минимальная совершенная хэш-функция по ключам состояний.
+        Hash,
+        
+        /// @brief Префиксное дерево идентификаторов слов ключей состояний.
+        Trie
+    };
+    
+    /// @brief Формат файла цепи.
+    enum class ChainFormat
+    {
+        /// @brief Текст: по строке на состояние, слова значения повторены по числу их появлений.
+        Text,
+        
+        /// @brief Двоичный формат: слова пронумерованы по частоте, состояния разбиты на блоки,
+        ///        числа записаны в формате varint с разностным кодированием, блоки сжаты.
+        Compact,
+        
+        /// @brief Текст, состояния которого упорядочены по ключам, а слова значений - по алфавиту,
+        ///        с разреженным индексом смещений ключей в конце файла. Файл не зависит от порядка
+        ///        построения цепи, и значение состояния находится в нем двоичным поиском без загрузки.
+        Sorted
+    };
+    
+    /// @brief Оценка текста цепью.
+    struct Score
+    {
+        /// @brief Число слов текста.
+        size_t words;
+        
+        /// @brief Число оцененных слов: без сглаживания - слов, для которых в цепи есть и состояние,
+        ///        и переход в слово, со сглаживанием - всех слов после начального состояния.
+        size_t scored;
+        
+        /// @brief Натуральный логарифм вероятности оцененных слов.
+        double logProbability;
+        
+        /// @brief Число слов после начального состояния, которых нет в словаре цепи.
+        size_t unknown;
+    };
+    
+    /// @brief Счетчики построения цепи.
+    struct Counters
+    {
+        /// @brief Число добавленных слов.
+        uint64_t words;
+        
+        /// @brief Число созданных состояний.
+        uint64_t states;
+        
+        /// @brief Число слов, впервые добавленных в значения состояний.
+        uint64_t successors;
+        
+        /// @brief Число перестроений таблицы состояний.
+        uint64_t rehashes;
+    };
+    
+    /// @class StateReader
+    /// @brief Читает состояния текстового файла цепи по одному, не загружая цепь.
+    class StateReader
+    {
+    public:
+        /// @brief Тип записи индекса: ключ состояния и смещение его строки в файле.
+        using IndexEntry = std::pair<Words, uint64_t>;
+        
+        /// @brief Конструктор, читает заголовок файла и, если поток допускает произвольный доступ, индекс формата Sorted.
+        /// @param[in] input - Поток ввода.
+        /// @throws std::exception если поток не содержит цепь в текстовом формате.
+        explicit StateReader(std::istream& input);
+        
+        StateReader(const StateReader&) = delete;
+        StateReader& operator=(const StateReader&) = delete;
+        
+        /// @brief Получить порядок цепи.
+        /// @return Порядок цепи.
+        size_t order() const;
+        
+        /// @brief Получить размер таблицы состояний из заголовка файла.
+        /// @return Размер таблицы состояний.
+        size_t buckets() const;
+        
+        /// @brief Проверить, записан ли файл в формате Sorted с индексом.
+        /// @return true если состояния упорядочены по ключам и проиндексированы, false в противном случае.
+        bool sorted() const;
+        
+        /// @brief Получить индекс файла формата Sorted.
+        /// @details Индекс читается целиком при первом вызове, позиция чтения состояний не меняется.
+        /// @return Записи индекса по возрастанию ключей.
+        const std::vector<IndexEntry>& index();
+        
+        /// @brief Перейти к последнему проиндексированному состоянию с ключом не больше заданного.
+        /// @details Записи индекса упорядочены по ключам, поэтому поиск делит пополам область индекса
+        ///          в файле и читает только O(log n) строк индекса.
+        /// @param[in] key - Ключ.
+        /// @return true если такое состояние есть, false если позиция чтения не изменилась.
+        bool seekState(const Words& key);
+        
+        /// @brief Перейти к строке состояния с заданным смещением, например из индекса.
+        /// @param[in] offset - Смещение строки в файле.
+        void seek(uint64_t offset);
+        
+        /// @brief Прочитать следующее состояние.
+        /// @details Состояния приращений, дописанных к цепи, читаются следом за ее состояниями.
+        /// @param[out] key - Ключ состояния.
+        /// @param[out] successors - Слова значения с числом их появлений, повторы слова подряд объединяются.
+        /// @return true если состояние прочитано, false если состояния закончились.
+        /// @throws std::exception если строка состояния повреждена.
+        bool next(Words& key, Successors& successors);
+    
+    private:
+        /// @brief Найти индекс в конце файла, если он есть, и вернуться к началу состояний.
+        void findIndex();
+        
+        /// @brief Прочитать запись индекса.
+        /// @param[in] offset - Смещение строки записи в файле.
+        /// @param[out] entry - Запись индекса.
+        /// @return Смещение следующей строки.
+        uint64_t readIndexEntry(uint64_t offset, IndexEntry& entry);
+    
+    private:
+        /// @brief Поток ввода.
+        std::istream& m_Input;
+        
+        /// @brief Порядок цепи.
+        size_t m_Order;
+        
+        /// @brief Размер таблицы состояний из заголовка.
+        size_t m_Buckets;
+        
+        /// @brief Признак файла формата Sorted.
+        bool m_Sorted;
+        
+        /// @brief Смещение первой записи индекса файла формата Sorted.
+        uint64_t m_IndexBegin;
+        
+        /// @brief Смещение концевика индекса файла формата Sorted.
+        uint64_t m_IndexEnd;
+        
+        /// @brief Индекс файла формата Sorted, читается при первом обращении.
+        std::vector<IndexEntry> m_Index;
+        
+        /// @brief Буфер строки.
+        std::string m_Line;
+    };
+    
+    /// @class SortedWriter
+    /// @brief Записывает упорядоченные по ключам состояния в формате Sorted, не загружая цепь.
+    class SortedWriter
+    {
+    public:
+        /// @brief Конструктор.
+        /// @param[in] output - Поток вывода, позиционирование в нем не требуется.
+        explicit SortedWriter(std::ostream& output);
+        
+        SortedWriter(const SortedWriter&) = delete;
+        SortedWriter& operator=(const SortedWriter&) = delete;
+        
+        /// @brief Записать заголовок файла.
+        /// @param[in] order - Порядок цепи.
+        /// @param[in] buckets - Размер таблицы состояний для загрузки цепи.
+        void writeHeader(size_t order, size_t buckets);
+        
+        /// @brief Записать состояние.
+        /// @details Ключи состояний должны возрастать, слова значения - идти по алфавиту без повторов.
+        /// @param[in] key - Ключ состояния.
+        /// @param[in] successors - Слова значения с числом их появлений.
+        void write(const Words& key, const Successors& successors);
+        
+        /// @brief Дописать строки состояний, записанные другим писателем без заголовка в отдельный поток.
+        /// @details Так части файла, записанные параллельно, собираются в один файл, индекс которого
+        ///          не зависит от границ частей.
+        /// @param[in] states - Поток ввода записанных состояний.
+        void append(std::istream& states);
+        
+        /// @brief Записать концевик и индекс.
+        void finish();
+    
+    private:
+        /// @brief Поток вывода.
+        std::ostream& m_Output;
+        
+        /// @brief Число записанных байт.
+        uint64_t m_Offset;
+        
+        /// @brief Число записанных состояний.
+        uint64_t m_States;
+        
+        /// @brief Записи индекса: смещение строки состояния и слова ключа через пробел.
+        std::vector<std::pair<uint64_t, std::string>> m_Index;
+        
+        /// @brief Буфер строки.
+        std::string m_Line;
+    };
+
 public:
     /// @brief Конструктор.
     /// @param[in] chainOrder - Порядок цепи Маркова.
@@ -37,15 +259,68 @@ public:
     /// @return Порядок цепи Маркова.
     size_t order() const;
     
+    /// @brief Задать способ построения цепи.
+    /// @param[in] engine - Способ построения.
+    /// @param[in] threads - Число потоков для пакетной сортировки.
+    void setEngine(LearnEngine engine, size_t threads = 1);
+    
+    /// @brief Задать затухание чисел появлений слов для обработки неограниченного потока текста.
+    /// @details Действует для способа построения Hash. Числа появлений уменьшаются вдвое каждые
+    ///          halfLife добавленных слов, а также каждый раз, когда число состояний превышает
+    ///          maxStates. Слова значений и состояния с нулевым числом появлений удаляются.
+    /// @param[in] halfLife - Число слов между уменьшениями, 0 - без периодического уменьшения.
+    /// @param[in] maxStates - Максимальное число состояний, 0 - без ограничения.
+    void setDecay(size_t halfLife, size_t maxStates);
+    
+    /// @brief Строить цепь с откатом, содержащую состояния всех порядков от 1 до порядка цепи.
+    /// @details Действует для способа построения Hash. Если состояние для последних слов не найдено,
+    ///          генерация использует состояние для самого длинного найденного их окончания. В файле
+    ///          цепи ключи таких состояний короче порядка цепи, по ним цепь с откатом и распознается.
+    /// @param[in] backoff - Признак цепи с откатом.
+    void setBackoff(bool backoff);
+    
+    /// @brief Проверить, является ли цепь цепью с откатом.
+    /// @return true если цепь содержит состояния всех порядков, false в противном случае.
+    bool backoff() const;
+    
+    /// @brief Получить число состояний цепи.
+    /// @return Число состояний.
+    size_t stateCount() const;
+    
+    /// @brief Получить счетчики построения цепи.
+    /// @return Счетчики с момента создания или загрузки цепи.
+    Counters counters() const;
+    
+    /// @brief Получить коэффициент заполнения таблицы состояний строящейся цепи.
+    /// @return Среднее число состояний на корзину хэш-таблицы.
+    double loadFactor() const;
+    
     /// @brief Заполнить цепь из потока.
+    /// @details Формат определяется по заголовку. Блоки компактного формата распаковываются параллельно
+    ///          сразу в представление только для чтения, и следующий за загрузкой вызов freeze() только
+    ///          строит индекс. Таблица состояний заполняется из него при первом обращении к ней.
+    ///          За цепью в потоке могут следовать дописанные к ней приращения - цепи того же порядка
+    ///          в текстовом формате, их числа появлений слов складываются с числами цепи.
     /// @param[in] input - Поток ввода.
     /// @throws std::exception в случае ошибки.
     void load(std::istream& input);
     
     /// @brief Сохранить цепь в поток.
     /// @param[in] output - Поток вывода.
+    /// @param[in] format - Формат файла цепи.
+    /// @throws std::exception в случае ошибки.
+    void save(std::ostream& output, ChainFormat format = ChainFormat::Text) const;
+    
+    /// @brief Найти значение состояния в файле цепи формата Sorted без загрузки цепи.
+    /// @details Индекс в конце файла указывает смещение каждого 256-го состояния. Запись индекса
+    ///          ищется делением пополам прямо в файле, затем читается не больше 256 строк состояний.
+    ///          Ключ длиннее порядка цепи сокращается до последних слов.
+    /// @param[in] input - Поток ввода файла цепи с произвольным доступом.
+    /// @param[in] key - Ключ состояния.
+    /// @param[out] successors - Слова значения по алфавиту с числом их появлений.
+    /// @return true если состояние найдено, false в противном случае.
     /// @throws std::exception в случае ошибки.
-    void save(std::ostream& output) const;
+    static bool lookup(std::istream& input, const Words& key, Successors& successors);
     
     /// @brief Добавить слово к цепи.
     /// @param[in] word - Новое слово.
@@ -54,19 +329,172 @@ public:
     
     /// @brief Сгенерировать слово, соответствующее заданной последовательности слов.
     /// @param[in] words - Последовательности слов.
+    /// @param[in] random - Генератор случайных чисел вызывающего потока.
+    /// @return Слово.
+    /// @throws std::exception в случае ошибки.
+    Word generateWord(const Words& words, RandomEngine& random) const;
+    
+    /// @brief Найти состояние цепи только для чтения или пополняемой цепи.
+    /// @details Цепь с откатом находит состояние для самого длинного окончания последовательности.
+    /// @param[in] words - Последовательность слов.
+    /// @return Идентификатор состояния или noState, если состояния нет в цепи.
+    /// @throws std::exception в случае ошибки.
+    StateId findState(const Words& words) const;
+    
+    /// @brief Выбрать случайное состояние цепи только для чтения или пополняемой цепи.
+    /// @details Состояние цепи только для чтения выбирается с вероятностью, пропорциональной числу его
+    ///          появлений, за O(log n). Состояния пополняемой цепи выбираются равновероятно.
+    /// @param[in] random - Генератор случайных чисел вызывающего потока.
+    /// @return Идентификатор состояния или noState, если в цепи нет состояний.
+    /// @throws std::exception в случае ошибки.
+    StateId randomState(RandomEngine& random) const;
+    
+    /// @brief Сгенерировать слово и перейти в следующее состояние.
+    /// @details Для цепи, замороженной с переходами, не требует хэширования и сравнения ключей.
+    ///          Пополняемая цепь находит следующее состояние по ключу.
+    /// @param[in,out] state - Текущее состояние, заменяется следующим или noState, если следующего нет.
+    /// @param[in] random - Генератор случайных чисел вызывающего потока.
     /// @return Слово.
     /// @throws std::exception в случае ошибки.
-    Word generateWord(const Words& words) const;
+    const Word& generateWord(StateId& state, RandomEngine& random) const;
+    
+    /// @brief Продолжить фразу словами цепи только для чтения или пополняемой цепи.
+    /// @details Начальное состояние задают последние слова фразы, фраза без слов начинается со
+    ///          случайного состояния. Из состояния без продолжения генерация переходит в случайное состояние.
+    /// @param[in] phrase - Начальная фраза, слова разделены пробельными символами.
+    /// @param[in] count - Число новых слов.
+    /// @param[in] random - Генератор случайных чисел вызывающего потока.
+    /// @param[out] text - Слова фразы и продолжения, разделенные пробелами.
+    /// @return true если начальное состояние найдено, false в противном случае.
+    /// @throws std::exception в случае ошибки.
+    bool continuePhrase(const std::string& phrase, size_t count, RandomEngine& random, std::string& text) const;
+    
+    /// @brief Продолжить несколько фраз одновременно, чередуя генерацию их слов.
+    /// @details Цепь, замороженная с переходами, генерирует слова всех фраз поэтапно с предварительной
+    ///          загрузкой данных, что скрывает задержки памяти на цепях больше кэша процессора.
+    ///          Результат совпадает с вызовом continuePhrase() для каждой фразы с ее генератором.
+    /// @param[in] phrases - Начальные фразы.
+    /// @param[in] randoms - Генераторы случайных чисел фраз.
+    /// @param[out] texts - Слова фраз и продолжений или пустые строки для фраз без начального состояния.
+    /// @param[out] results - Признаки того, что начальное состояние фразы найдено.
+    /// @param[in] size - Число фраз.
+    /// @param[in] count - Число новых слов каждой фразы.
+    /// @throws std::exception в случае ошибки.
+    void continuePhrases(const std::string* phrases, RandomEngine* randoms, std::string* texts, char* results, size_t size, size_t count) const;
+    
+    /// @brief Оценить текст цепью только для чтения.
+    /// @details Вероятность слова - доля его появлений в значении состояния, заданного предыдущими
+    ///          словами, то есть вероятность того, что генерация из этого состояния создаст это слово.
+    ///          Первые слова текста задают начальное состояние и не оцениваются, цепь с откатом оценивает
+    ///          все слова, кроме первого. Без сглаживания слова без состояния или перехода в цепи
+    ///          не оцениваются. Сглаживание прибавляет addK к числам появлений всех слов словаря и
+    ///          неизвестного слова в каждом состоянии, тогда вероятность слова (c + addK) / (n + addK * (V + 1)),
+    ///          где c - число появлений слова в значении, n - всех слов значения, V - размер словаря,
+    ///          а слово без состояния получает вероятность 1 / (V + 1). Состояния всех слов ищутся
+    ///          одновременно с предварительной загрузкой данных.
+    /// @param[in] words - Слова текста.
+    /// @param[in] count - Число слов.
+    /// @param[in] addK - Добавка к числам появлений, 0 - без сглаживания.
+    /// @return Оценка текста.
+    /// @throws std::exception в случае ошибки.
+    Score score(const Word* words, size_t count, double addK = 0.0) const;
     
     /// @brief Подготовить цепь к обработке нового потока слов.
     void flush();
     
+    /// @brief Перенести накопленные пары слов в таблицу состояний.
+    /// @throws std::exception в случае ошибки.
+    void commit();
+    
+    /// @brief Перевести цепь в компактное представление только для чтения.
+    /// @details После этого в цепь нельзя добавлять слова.
+    /// @param[in] layout - Способ индексации состояний.
+    /// @param[in] links - Построить переходы между состояниями для генерации без поиска по ключу.
+    /// @throws std::exception в случае ошибки.
+    void freeze(FrozenLayout layout = FrozenLayout::Hash, bool links = false);
+    
+    /// @brief Проверить, переведена ли цепь в представление только для чтения.
+    /// @return true если цепь только для чтения, false в противном случае.
+    bool frozen() const;
+    
+    /// @brief Перевести цепь в пополняемое представление.
+    /// @details После этого один поток может добавлять слова через addWord() и flush(), пока другие
+    ///          потоки без блокировок вызывают findState(), generateWord() и continuePhrase().
+    ///          Сохранение и оценка памяти выполняются в добавляющем слова потоке.
+    /// @throws std::exception в случае ошибки.
+    void makeLive();
+    
+    /// @brief Проверить, переведена ли цепь в пополняемое представление.
+    /// @return true если цепь пополняемая, false в противном случае.
+    bool live() const;
+    
+    /// @brief Оценить объем памяти, занимаемой цепью.
+    /// @return Объем памяти в байтах.
+    size_t memoryUsage() const;
+
 private:
     /// @brief Разобрать из потока состояния цепи Маркова.
     /// @param[in] input - Поток ввода.
     /// @throws std::exception в случае ошибки.
     void parseChainStates(std::istream& input);
     
+    /// @brief Добавить к цепи приращения, следующие за ней в потоке до его конца.
+    /// @param[in] input - Поток ввода.
+    /// @throws std::exception в случае ошибки.
+    void loadDeltas(std::istream& input);
+    
+    /// @brief Загрузить из потока состояния цепи в компактном формате, следующие за заголовком.
+    /// @param[in] input - Поток ввода.
+    /// @throws std::exception в случае ошибки.
+    void loadCompact(std::istream& input);
+    
+    /// @brief Сохранить цепь в компактном формате.
+    /// @param[in] output - Поток вывода.
+    /// @throws std::exception в случае ошибки.
+    void saveCompact(std::ostream& output) const;
+    
+    /// @brief Сохранить цепь в формате Sorted.
+    /// @param[in] output - Поток вывода.
+    /// @throws std::exception в случае ошибки.
+    void saveSorted(std::ostream& output) const;
+    
+    /// @brief Перенести в таблицу состояний состояния, загруженные в компактном формате.
+    /// @details Вызывается и из константных методов: загруженные состояния и таблица - два
+    ///          представления одного содержимого цепи, и перенос его не меняет. Перенос выполняется
+    ///          через std::call_once, а загруженные состояния после него остаются, поэтому константные
+    ///          методы могут одновременно читать их и, после переноса, таблицу.
+    void unpackLoaded() const;
+    
+    /// @brief Перенести в таблицу состояний загруженные состояния и освободить их перед изменением таблицы.
+    void releaseLoaded();
+    
+    /// @brief Добавить слово к цепи через накопление пар идентификаторов слов.
+    /// @param[in] word - Новое слово.
+    void appendWordPair(Word&& word);
+    
+    /// @brief Найти начальное состояние продолжения фразы.
+    /// @param[in] phrase - Начальная фраза, фраза без слов начинается со случайного состояния.
+    /// @param[in] random - Генератор случайных чисел вызывающего потока.
+    /// @param[out] text - Слова фразы, разделенные пробелами, с пробелом в конце.
+    /// @return Идентификатор состояния или noState, если состояния нет в цепи.
+    /// @throws std::exception в случае ошибки.
+    StateId startPhrase(const std::string& phrase, RandomEngine& random, std::string& text) const;
+    
+    /// @brief Сгенерировать слово и перейти в следующее состояние без замера задержки.
+    /// @param[in,out] state - Текущее состояние, заменяется следующим или noState, если следующего нет.
+    /// @param[in] random - Генератор случайных чисел вызывающего потока.
+    /// @return Слово.
+    /// @throws std::exception в случае ошибки.
+    const Word& stepWord(StateId& state, RandomEngine& random) const;
+    
+    /// @brief Добавить слово в значение состояния таблицы состояний, обновив счетчики.
+    /// @param[in] key - Ключ состояния.
+    /// @param[in] word - Слово.
+    void addSuccessor(const Words& key, const Word& word);
+    
+    /// @brief Уменьшить вдвое числа появлений слов и удалить слова и состояния, которые больше не встречаются.
+    void decay();
+    
     /// @brief Сбросить состояние цепи.
     void reset();
 
@@ -77,18 +505,54 @@ private:
     /// @brief Последняя рассмотренная последовательность слов.
     Words m_CurrentWords;
     
+    /// @brief Способ построения цепи.
+    LearnEngine m_Engine;
+    
+    /// @brief Число потоков для пакетной сортировки.
+    size_t m_Threads;
+    
+    /// @brief Число слов между уменьшениями чисел появлений, 0 - без периодического уменьшения.
+    size_t m_HalfLife;
+    
+    /// @brief Максимальное число состояний, 0 - без ограничения.
+    size_t m_MaxStates;
+    
+    /// @brief Число слов, добавленных после последнего уменьшения чисел появлений.
+    size_t m_EpochWords;
+    
+    /// @brief Признак цепи с откатом.
+    bool m_Backoff;
+    
+    /// @brief Счетчики построения цепи.
+    Counters m_Counters;
+    
     /// @brief Тип внутренней цепи.
     struct InnerChain;
     
     /// @brief Указатель на внутреннюю цепь.
     std::unique_ptr<InnerChain> m_Chain;
     
+    /// @brief Указатель на представление цепи только для чтения.
+    std::unique_ptr<FrozenChain> m_Frozen;
+    
+    /// @brief Указатель на пополняемое представление цепи.
+    std::unique_ptr<LiveChain> m_Live;
+    
     /// @brief Заголовок для сериализации цепи.
     static const std::string m_ChainHeader;
     
     /// @brief Концевик для сериализации цепи.
     static const std::string m_ChainTrailer;
     
+    /// @brief Заголовок для сериализации цепи в компактном формате.
+    static const std::string m_CompactHeader;
+    
+    /// @brief Заголовок индекса смещений состояний в файле формата Sorted.
+    static const std::string m_IndexHeader;
+    
+    /// @brief Концевик индекса смещений состояний, за ним следует смещение заголовка индекса.
+    static const std::string m_IndexTrailer;
+    
     /// @brief Разделитель для сериализации цепи.
     static const std::string m_Delimiter;
 };
@@ -0,0 +1,60 @@
+#include "parallel.h"
+
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+size_t defaultThreadCount()
+{
+    const size_t threads = std::thread::hardware_concurrency();
+    return threads > 0 ? threads : 1;
+}
+
+void runParallel(size_t threads, const std::function<void(size_t)>& task)
+{
+    if (threads <= 1)
+    {
+        task(0);
+        return;
+    }
+    
+    std::exception_ptr error;
+    std::mutex errorMutex;
+    
+    auto guardedTask = [&](size_t thread)
+    {
+        try
+        {
+            task(thread);
+        }
+        catch (...)
+        {
+            std::lock_guard<std::mutex> lock(errorMutex);
+            if (!error)
+            {
+                error = std::current_exception();
+            }
+        }
+    };
+    
+    std::vector<std::thread> workers;
+    workers.reserve(threads - 1);
+    for (size_t i = 1; i < threads; ++i)
+    {
+        workers.emplace_back(guardedTask, i);
+    }
+    
+    guardedTask(0);
+    
+    for (auto& worker : workers)
+    {
+        worker.join();
+    }
+    
+    if (error)
+    {
+        std::rethrow_exception(error);
+    }
+}
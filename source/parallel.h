@@ -0,0 +1,20 @@
+#pragma once
+
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <cstddef>
+#include <functional>
+
+
+/// @brief Получить число потоков, используемое по умолчанию.
+/// @return Число аппаратных потоков, но не меньше одного.
+size_t defaultThreadCount();
+
+/// @brief Выполнить задачу одновременно в нескольких потоках.
+/// @param[in] threads - Число потоков, текущий поток тоже участвует в работе.
+/// @param[in] task - Задача, получает номер потока от 0 до threads - 1.
+/// @throws std::exception первое исключение, выброшенное задачей.
+void runParallel(size_t threads, const std::function<void(size_t)>& task);
+
+#endif // PARALLEL_H
@@ -0,0 +1,206 @@
+#include "perfect_hash.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+
+namespace
+{
+    /// @brief Среднее число ключей в корзине.
+    constexpr size_t keysPerBucket = 4;
+    
+    /// @brief Признак прямой позиции в смещении корзины.
+    constexpr uint32_t directSlotFlag = 0x80000000u;
+    
+    /// @brief Максимальное зерно хэширования.
+    constexpr uint32_t maxSeed = directSlotFlag - 1;
+    
+    /// @brief Перемешать биты 64-битного числа (финализатор MurmurHash3).
+    /// @param[in] value - Исходное число.
+    /// @return Перемешанное число.
+    uint64_t mix(uint64_t value)
+    {
+        value ^= value >> 33;
+        value *= 0xff51afd7ed558ccdull;
+        value ^= value >> 33;
+        value *= 0xc4ceb9fe1a85ec53ull;
+        value ^= value >> 33;
+        return value;
+    }
+    
+    /// @brief Вычислить корзину ключа.
+    /// @param[in] hash - Хэш ключа.
+    /// @param[in] buckets - Число корзин.
+    /// @return Номер корзины.
+    size_t bucketOf(uint64_t hash, size_t buckets)
+    {
+        return static_cast<size_t>(hash >> 32) % buckets;
+    }
+    
+    /// @brief Вычислить позицию ключа для зерна хэширования.
+    /// @param[in] hash - Хэш ключа.
+    /// @param[in] seed - Зерно хэширования.
+    /// @param[in] size - Число позиций.
+    /// @return Позиция.
+    size_t slotOf(uint64_t hash, uint32_t seed, size_t size)
+    {
+        return static_cast<size_t>(mix(hash ^ (seed * 0x9e3779b97f4a7c15ull)) % size);
+    }
+}
+
+uint64_t hashBytes(const void* data, size_t size)
+{
+    // FNV-1a с финальным перемешиванием бит.
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ull;
+    }
+    return mix(hash ^ size);
+}
+
+PerfectHash::PerfectHash()
+    : m_Size(0)
+    , m_Displacements()
+{
+}
+
+PerfectHash::~PerfectHash() = default;
+
+void PerfectHash::build(const std::vector<uint64_t>& hashes)
+{
+    m_Size = hashes.size();
+    m_Displacements.clear();
+    if (m_Size == 0)
+    {
+        return;
+    }
+    if (m_Size >= directSlotFlag)
+    {
+        throw std::length_error("PerfectHash::build error: too many keys");
+    }
+    
+    // Разложить ключи по корзинам.
+    const size_t buckets = (m_Size + keysPerBucket - 1) / keysPerBucket;
+    std::vector<size_t> bucketBegin(buckets + 1, 0);
+    for (const auto hash : hashes)
+    {
+        ++bucketBegin[bucketOf(hash, buckets) + 1];
+    }
+    for (size_t i = 0; i < buckets; ++i)
+    {
+        bucketBegin[i + 1] += bucketBegin[i];
+    }
+    std::vector<uint64_t> bucketKeys(m_Size);
+    {
+        std::vector<size_t> position(bucketBegin.begin(), bucketBegin.end() - 1);
+        for (const auto hash : hashes)
+        {
+            bucketKeys[position[bucketOf(hash, buckets)]++] = hash;
+        }
+    }
+    
+    // Корзины размещаются от больших к меньшим, пока свободных позиций много.
+    std::vector<uint32_t> order(buckets);
+    for (size_t i = 0; i < buckets; ++i)
+    {
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&bucketBegin](uint32_t left, uint32_t right)
+    {
+        return bucketBegin[left + 1] - bucketBegin[left] > bucketBegin[right + 1] - bucketBegin[right];
+    });
+    
+    m_Displacements.assign(buckets, 0);
+    std::vector<char> taken(m_Size, 0);
+    std::vector<size_t> slots;
+    size_t freeSlot = 0;
+    
+    for (const auto bucket : order)
+    {
+        const uint64_t* first = &bucketKeys[bucketBegin[bucket]];
+        const size_t size = bucketBegin[bucket + 1] - bucketBegin[bucket];
+        if (size == 0)
+        {
+            break;
+        }
+        
+        // Ключу из корзины размера 1 достаточно любой свободной позиции.
+        if (size == 1)
+        {
+            while (taken[freeSlot])
+            {
+                ++freeSlot;
+            }
+            taken[freeSlot] = 1;
+            m_Displacements[bucket] = directSlotFlag | freeSlot;
+            continue;
+        }
+        
+        for (size_t i = 1; i < size; ++i)
+        {
+            if (std::find(first, first + i, first[i]) != first + i)
+            {
+                throw std::invalid_argument("PerfectHash::build error: duplicate key hashes");
+            }
+        }
+        
+        // Подобрать зерно, при котором все ключи корзины попадают в разные свободные позиции.
+        uint32_t seed = 1;
+        for (; seed <= maxSeed; ++seed)
+        {
+            slots.clear();
+            bool placed = true;
+            for (size_t i = 0; i < size && placed; ++i)
+            {
+                const size_t slot = slotOf(first[i], seed, m_Size);
+                placed = !taken[slot] && std::find(slots.begin(), slots.end(), slot) == slots.end();
+                slots.push_back(slot);
+            }
+            if (placed)
+            {
+                break;
+            }
+        }
+        if (seed > maxSeed)
+        {
+            throw std::runtime_error("PerfectHash::build error: failed to place keys");
+        }
+        
+        for (const auto slot : slots)
+        {
+            taken[slot] = 1;
+        }
+        m_Displacements[bucket] = seed;
+    }
+}
+
+size_t PerfectHash::size() const
+{
+    return m_Size;
+}
+
+size_t PerfectHash::slot(uint64_t hash) const
+{
+    const uint32_t displacement = m_Displacements[bucketOf(hash, m_Displacements.size())];
+    if (displacement & directSlotFlag)
+    {
+        return displacement & ~directSlotFlag;
+    }
+    return slotOf(hash, displacement, m_Size);
+}
+
+void PerfectHash::prefetch(uint64_t hash) const
+{
+    if (!m_Displacements.empty())
+    {
+        __builtin_prefetch(&m_Displacements[bucketOf(hash, m_Displacements.size())]);
+    }
+}
+
+size_t PerfectHash::memoryUsage() const
+{
+    return sizeof(*this) + m_Displacements.capacity() * sizeof(uint32_t);
+}
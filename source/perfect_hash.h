@@ -0,0 +1,62 @@
+#pragma once
+
+#ifndef PERFECT_HASH_H
+#define PERFECT_HASH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+
+/// @brief Вычислить 64-битный хэш последовательности байт.
+/// @param[in] data - Указатель на данные.
+/// @param[in] size - Размер данных.
+/// @return Хэш.
+uint64_t hashBytes(const void* data, size_t size);
+
+
+/// @class PerfectHash
+/// @brief Минимальная совершенная хэш-функция (схема CHD: хэширование с корзинами и смещениями).
+/// @details Отображает n заранее известных 64-битных хэшей ключей взаимно однозначно в [0, n).
+///          Для ключа вне исходного набора возвращается произвольная позиция, поэтому
+///          вызывающая сторона должна сверять ключ в найденной позиции.
+class PerfectHash
+{
+public:
+    /// @brief Конструктор.
+    PerfectHash();
+    
+    /// @brief Деструктор.
+    ~PerfectHash();
+    
+    /// @brief Построить функцию по набору хэшей ключей.
+    /// @param[in] hashes - Хэши ключей, все различные.
+    /// @throws std::exception в случае ошибки.
+    void build(const std::vector<uint64_t>& hashes);
+    
+    /// @brief Получить число ключей.
+    /// @return Число ключей.
+    size_t size() const;
+    
+    /// @brief Получить позицию ключа.
+    /// @param[in] hash - Хэш ключа.
+    /// @return Позиция в [0, size()), size() должен быть больше нуля.
+    size_t slot(uint64_t hash) const;
+    
+    /// @brief Запросить предварительную загрузку данных, нужных для получения позиции ключа.
+    /// @param[in] hash - Хэш ключа.
+    void prefetch(uint64_t hash) const;
+    
+    /// @brief Получить объем занимаемой памяти.
+    /// @return Объем памяти в байтах.
+    size_t memoryUsage() const;
+
+private:
+    /// @brief Число ключей.
+    size_t m_Size;
+    
+    /// @brief Смещения корзин: зерно хэширования или прямая позиция для корзин из одного ключа.
+    std::vector<uint32_t> m_Displacements;
+};
+
+#endif // PERFECT_HASH_H
@@ -0,0 +1,109 @@
+#include "radix_sort.h"
+#include "parallel.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <array>
+
+
+namespace
+{
+    /// @brief Число бит в разряде сортировки.
+    constexpr size_t digitBits = 8;
+    
+    /// @brief Число значений разряда сортировки.
+    constexpr size_t digitValues = 1 << digitBits;
+    
+    /// @brief Минимальное число записей на поток, меньшие объемы сортируются в одном потоке.
+    constexpr size_t minRecordsPerThread = 1 << 16;
+    
+    /// @brief Гистограмма значений разряда.
+    using Histogram = std::array<size_t, digitValues>;
+}
+
+void radixSortRecords(std::vector<uint32_t>& records, size_t width, uint32_t maxValue, size_t threads)
+{
+    if (width == 0)
+    {
+        return;
+    }
+    
+    const size_t count = records.size() / width;
+    threads = std::max<size_t>(1, std::min(threads, count / minRecordsPerThread));
+    
+    // Число значимых разрядов определяется максимальным значением.
+    size_t digits = 1;
+    while (digits * digitBits < 32 && (maxValue >> (digits * digitBits)) != 0)
+    {
+        ++digits;
+    }
+    
+    std::vector<uint32_t> buffer(records.size());
+    std::vector<Histogram> histograms(threads);
+    
+    // Устойчивая сортировка по разрядам, начиная с младшего разряда последнего числа записи.
+    for (size_t column = width; column-- > 0;)
+    {
+        for (size_t digit = 0; digit < digits; ++digit)
+        {
+            const size_t shift = digit * digitBits;
+            
+            runParallel(threads, [&](size_t thread)
+            {
+                TraceScope scope("radixSortRecords histogram");
+                Histogram& histogram = histograms[thread];
+                histogram.fill(0);
+                const size_t first = count * thread / threads;
+                const size_t last = count * (thread + 1) / threads;
+                for (size_t i = first; i < last; ++i)
+                {
+                    ++histogram[(records[i * width + column] >> shift) & (digitValues - 1)];
+                }
+            });
+            
+            // Проход не нужен, если все записи попадают в одну корзину.
+            bool trivial = false;
+            for (size_t value = 0; value < digitValues && !trivial; ++value)
+            {
+                size_t total = 0;
+                for (const auto& histogram : histograms)
+                {
+                    total += histogram[value];
+                }
+                trivial = total == count;
+            }
+            if (trivial)
+            {
+                continue;
+            }
+            
+            // Гистограммы превращаются в позиции записи для каждого потока.
+            size_t position = 0;
+            for (size_t value = 0; value < digitValues; ++value)
+            {
+                for (auto& histogram : histograms)
+                {
+                    const size_t size = histogram[value];
+                    histogram[value] = position;
+                    position += size;
+                }
+            }
+            
+            runParallel(threads, [&](size_t thread)
+            {
+                TraceScope scope("radixSortRecords scatter");
+                Histogram& offsets = histograms[thread];
+                const size_t first = count * thread / threads;
+                const size_t last = count * (thread + 1) / threads;
+                for (size_t i = first; i < last; ++i)
+                {
+                    const uint32_t* record = &records[i * width];
+                    const size_t target = offsets[(record[column] >> shift) & (digitValues - 1)]++;
+                    std::copy(record, record + width, &buffer[target * width]);
+                }
+            });
+            
+            records.swap(buffer);
+        }
+    }
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#ifndef RADIX_SORT_H
+#define RADIX_SORT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+
+/// @brief Отсортировать лексикографически записи фиксированной длины поразрядной сортировкой.
+/// @param[in,out] records - Записи, уложенные подряд по width чисел.
+/// @param[in] width - Число чисел в одной записи.
+/// @param[in] maxValue - Максимальное значение числа в записях.
+/// @param[in] threads - Число потоков для сортировки.
+void radixSortRecords(std::vector<uint32_t>& records, size_t width, uint32_t maxValue, size_t threads);
+
+#endif // RADIX_SORT_H
@@ -0,0 +1,20 @@
+#include "random_engine.h"
+
+#include <chrono>
+#include <random>
+
+
+uint64_t RandomEngine::randomSeed()
+{
+    uint64_t seed = std::chrono::high_resolution_clock::now().time_since_epoch().count();
+    try
+    {
+        std::random_device device;
+        seed ^= (static_cast<uint64_t>(device()) << 32) | device();
+    }
+    catch (const std::exception&)
+    {
+        // Без аппаратного источника достаточно текущего времени.
+    }
+    return splitMix(seed);
+}
@@ -0,0 +1,124 @@
+#pragma once
+
+#ifndef RANDOM_ENGINE_H
+#define RANDOM_ENGINE_H
+
+#include <cstdint>
+
+
+/// @class RandomEngine
+/// @brief Быстрый генератор псевдослучайных чисел xoshiro256**.
+/// @details Экземпляр не разделяется между потоками: каждый поток создает свой генератор
+///          с собственным номером потока чисел. Методы определены в заголовке,
+///          так как вызываются на каждое сгенерированное слово.
+class RandomEngine
+{
+public:
+    /// @brief Конструктор.
+    /// @param[in] seed - Зерно генератора.
+    /// @param[in] stream - Номер независимого потока чисел для того же зерна.
+    explicit RandomEngine(uint64_t seed = 0, uint64_t stream = 0)
+        : m_State()
+    {
+        // Состояние заполняется генератором splitmix64, как рекомендуют авторы xoshiro.
+        uint64_t value = seed ^ splitMix(stream + 0x6a09e667f3bcc909ull);
+        for (auto& word : m_State)
+        {
+            value += 0x9e3779b97f4a7c15ull;
+            word = splitMix(value);
+        }
+    }
+    
+    /// @brief Получить следующее число.
+    /// @return Равномерно распределенное 64-битное число.
+    uint64_t next()
+    {
+        const uint64_t result = rotate(m_State[1] * 5, 7) * 9;
+        const uint64_t shifted = m_State[1] << 17;
+        
+        m_State[2] ^= m_State[0];
+        m_State[3] ^= m_State[1];
+        m_State[1] ^= m_State[2];
+        m_State[0] ^= m_State[3];
+        m_State[2] ^= shifted;
+        m_State[3] = rotate(m_State[3], 45);
+        
+        return result;
+    }
+    
+    /// @brief Получить число из диапазона без смещения распределения.
+    /// @param[in] bound - Верхняя граница диапазона, больше нуля.
+    /// @return Равномерно распределенное число из [0, bound).
+    uint64_t uniform(uint64_t bound)
+    {
+        // Отбросить значения из неполного последнего отрезка длины bound.
+        const uint64_t threshold = (0 - bound) % bound;
+        uint64_t value = next();
+        while (value < threshold)
+        {
+            value = next();
+        }
+        return value % bound;
+    }
+    
+    /// @brief Сдвинуть генератор на 2^128 чисел вперед.
+    /// @details Последовательные сдвиги одного генератора дают непересекающиеся потоки чисел.
+    void jump()
+    {
+        static const uint64_t polynomial[] =
+        {
+            0x180ec6d33cfd0abaull, 0xd5a61266f0c9392cull, 0xa9582618e03fc9aaull, 0x39abdc4529b1661cull
+        };
+        
+        uint64_t state[4] = { 0, 0, 0, 0 };
+        for (const auto word : polynomial)
+        {
+            for (int bit = 0; bit < 64; ++bit)
+            {
+                if (word & (uint64_t(1) << bit))
+                {
+                    for (int i = 0; i < 4; ++i)
+                    {
+                        state[i] ^= m_State[i];
+                    }
+                }
+                next();
+            }
+        }
+        
+        for (int i = 0; i < 4; ++i)
+        {
+            m_State[i] = state[i];
+        }
+    }
+    
+    /// @brief Получить непредсказуемое зерно.
+    /// @return Зерно на основе аппаратного источника случайности и текущего времени.
+    static uint64_t randomSeed();
+
+private:
+    /// @brief Циклический сдвиг влево.
+    /// @param[in] value - Число.
+    /// @param[in] shift - Величина сдвига.
+    /// @return Результат сдвига.
+    static uint64_t rotate(uint64_t value, int shift)
+    {
+        return (value << shift) | (value >> (64 - shift));
+    }
+    
+    /// @brief Перемешать биты числа (splitmix64).
+    /// @param[in] value - Число.
+    /// @return Перемешанное число.
+    static uint64_t splitMix(uint64_t value)
+    {
+        value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ull;
+        value = (value ^ (value >> 27)) * 0x94d049bb133111ebull;
+        return value ^ (value >> 31);
+    }
+
+private:
+    /// @brief Состояние генератора.
+    uint64_t m_State[4];
+};
+
+#endif // RANDOM_ENGINE_H
@@ -1,4 +1,5 @@
 #include "text_downloader.h"
+#include "trace.h"
 
 #include <errno.h>
 
@@ -38,6 +39,7 @@ void TextDownloader::download(const std::string& url) const
         throw std::logic_error("TextDownloader::download error: no handler is set");
     }
     
+    TraceScope scope("TextDownloader::download");
     auto pipe = openPipe(url);
     std::vector<char> buffer(bufferSize, '\0');
     
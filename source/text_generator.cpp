@@ -1,9 +1,18 @@
 #include "text_generator.h"
+#include "buffered_writer.h"
+#include "latency.h"
+#include "parallel.h"
+#include "trace.h"
 
 #include <getopt.h>
 
+#include <algorithm>
+#include <condition_variable>
 #include <iostream>
 #include <fstream>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
 
 
 namespace
@@ -13,11 +22,21 @@ namespace
     
     /// @brief Число слов в строке при выводе.
     const int wordsPerLine = 10;
+    
+    /// @brief Число фраз, слова которых поток генерирует вперемежку, скрывая задержки памяти.
+    const size_t interleavedPhrases = 16;
 }
 
 TextGenerator::TextGenerator()
     : m_NumberOfNewWords(defaultNumber)
     , m_Input()
+    , m_Layout(MarkovTextChain::FrozenLayout::Hash)
+    , m_Seed(RandomEngine::randomSeed())
+    , m_Output()
+    , m_Batch()
+    , m_Threads(defaultThreadCount())
+    , m_Trace()
+    , m_Query(false)
     , m_InitialWords()
     , m_NeedHelp(false)
     , m_ProgramName()
@@ -35,6 +54,13 @@ void TextGenerator::init(int argc, char** argv)
     {
        {"words", required_argument, 0, 'w'},
        {"input", required_argument, 0, 'i'},
+       {"layout", required_argument, 0, 'l'},
+       {"seed", required_argument, 0, 's'},
+       {"output", required_argument, 0, 'o'},
+       {"batch", required_argument, 0, 'b'},
+       {"threads", required_argument, 0, 't'},
+       {"trace", required_argument, 0, 'T'},
+       {"query", no_argument, 0, 'q'},
        {"help", no_argument, 0, 'h'},
        {0, 0, 0, 0 }
     };
@@ -43,7 +69,7 @@ void TextGenerator::init(int argc, char** argv)
     opterr = 0;
     
     // Анализ ключей и их значений.
-    while ((c = getopt_long(argc, argv, "w:i:", longOptions, nullptr))!= -1)
+    while ((c = getopt_long(argc, argv, "w:i:l:s:o:b:t:T:q", longOptions, nullptr))!= -1)
     {
         switch (c)
         {
@@ -68,6 +94,72 @@ void TextGenerator::init(int argc, char** argv)
             m_Input = optarg;
             break;
             
+        case 'l':
+            if (std::string(optarg) == "hash")
+            {
+                m_Layout = MarkovTextChain::FrozenLayout::Hash;
+            }
+            else if (std::string(optarg) == "trie")
+            {
+                m_Layout = MarkovTextChain::FrozenLayout::Trie;
+            }
+            else
+            {
+                std::cerr << "  Unsupported value for 'layout' parameter" << std::endl;
+                m_NeedHelp = true;
+            }
+            break;
+        
+        case 's':
+            try
+            {
+                size_t position = 0;
+                m_Seed = std::stoull(optarg, &position);
+                if (optarg[position] != '\0')
+                {
+                    throw std::exception();
+                }
+            }
+            catch (const std::exception& e)
+            {
+                std::cerr << "  Unsupported value for 'seed' parameter" << std::endl;
+                m_NeedHelp = true;
+            }
+            break;
+        
+        case 'o':
+            m_Output = optarg;
+            break;
+        
+        case 'b':
+            m_Batch = optarg;
+            break;
+        
+        case 't':
+            try
+            {
+                const int threads = std::stoi(optarg);
+                if (threads <= 0)
+                {
+                    throw std::exception();
+                }
+                m_Threads = threads;
+            }
+            catch (const std::exception& e)
+            {
+                std::cerr << "  Unsupported value for 'threads' parameter" << std::endl;
+                m_NeedHelp = true;
+            }
+            break;
+        
+        case 'T':
+            m_Trace = optarg;
+            break;
+        
+        case 'q':
+            m_Query = true;
+            break;
+        
         case 'h':
             m_NeedHelp = true;
             break;
@@ -85,6 +177,42 @@ void TextGenerator::init(int argc, char** argv)
                 m_NeedHelp = true;
                 break;
             }
+            else if (optopt == 'l')
+            {
+                std::cerr << " Options -l and --layout require an argument" << std::endl;
+                m_NeedHelp = true;
+                break;
+            }
+            else if (optopt == 's')
+            {
+                std::cerr << " Options -s and --seed require an argument" << std::endl;
+                m_NeedHelp = true;
+                break;
+            }
+            else if (optopt == 'o')
+            {
+                std::cerr << " Options -o and --output require an argument" << std::endl;
+                m_NeedHelp = true;
+                break;
+            }
+            else if (optopt == 'b')
+            {
+                std::cerr << " Options -b and --batch require an argument" << std::endl;
+                m_NeedHelp = true;
+                break;
+            }
+            else if (optopt == 't')
+            {
+                std::cerr << " Options -t and --threads require an argument" << std::endl;
+                m_NeedHelp = true;
+                break;
+            }
+            else if (optopt == 'T')
+            {
+                std::cerr << " Options -T and --trace require an argument" << std::endl;
+                m_NeedHelp = true;
+                break;
+            }
             else
             {
                 std::cerr << " Unknown option " << argv[optind-1] << std::endl;
@@ -102,28 +230,58 @@ void TextGenerator::init(int argc, char** argv)
     }
     
     // Проверка наличия обязательных параметров.
-    if (m_NumberOfNewWords == defaultNumber)
+    if (m_Query)
     {
-        std::cerr << "  Number of new words to generate is not set" << std::endl;
-        m_NeedHelp = true;
+        if (m_Input.empty() || m_InitialWords.empty())
+        {
+            std::cerr << "  Option --query requires a chain file and the words of a state" << std::endl;
+            m_NeedHelp = true;
+        }
     }
-    if (m_InitialWords.empty())
+    else if (m_NumberOfNewWords == defaultNumber)
     {
-        std::cerr << " No initial words are provided" << std::endl;
+        std::cerr << "  Number of new words to generate is not set" << std::endl;
         m_NeedHelp = true;
     }
 }
 
 bool TextGenerator::run()
 {
-    return m_NeedHelp ? !printUsage() : generateText();
+    if (m_NeedHelp)
+    {
+        return !printUsage();
+    }
+    
+    if (m_Query)
+    {
+        return queryChain();
+    }
+    
+    // Задержки выводятся по сигналу SIGUSR1 во время работы и при завершении.
+    LatencyReporter reporter(std::cerr);
+    if (!m_Trace.empty())
+    {
+        Trace::enable();
+    }
+    const bool generated = m_Batch.empty() ? generateText() : generateBatch();
+    Latency::write(std::cerr);
+    return (m_Trace.empty() || outputTrace()) && generated;
 }
 
 bool TextGenerator::printUsage() const
 {
     std::cout << "Usage: " << m_ProgramName << " [options] [initial words]" << std::endl;
+    std::cout << "       " << m_ProgramName << " [options] -b <file with initial phrases>" << std::endl;
+    std::cout << "       " << m_ProgramName << " -q -i <sorted chain file> <state words>" << std::endl;
     std::cout << "  -w, --words    Number of new words to generate, must be positive" << std::endl;
     std::cout << "  -i, --input    File to load Markov chain from, std::cin will be used if not provided" << std::endl;
+    std::cout << "  -l, --layout   Loaded chain state index: 'hash' (default) or 'trie'" << std::endl;
+    std::cout << "  -s, --seed     Random generator seed for reproducible output, random by default" << std::endl;
+    std::cout << "  -o, --output   File to output text to, std::cout will be used if not provided" << std::endl;
+    std::cout << "  -b, --batch    File with initial phrases, one per line, to generate one text line for each of them" << std::endl;
+    std::cout << "  -t, --threads  Number of threads for batch mode, all cores are used by default" << std::endl;
+    std::cout << "  -T, --trace    File to output Chrome Trace Event JSON of loading and generation to, for Perfetto" << std::endl;
+    std::cout << "  -q, --query    Print words following the state with their counts, searching a 'sorted' chain file without loading it" << std::endl;
     std::cout << "  -h, --help     Show this message and exit" << std::endl << std::endl;
     return true;
 }
@@ -137,23 +295,43 @@ bool TextGenerator::generateText()
         return false;
     }
     
+    std::ofstream fileOutput;
+    if (!openOutput(fileOutput))
+    {
+        return false;
+    }
+    BufferedWriter output(m_Output.empty() ? std::cout : fileOutput);
+    
     // Проверить, достаточно ли начальных слов.
-    if (!checkInitialWords(chain.order()))
+    if (!m_InitialWords.empty() && !checkInitialWords(chain, output))
     {
         return false;
     }
     
-    // Попытаться сгенерировать требуемое число слов.
+    // Сгенерировать требуемое число слов, переходя между состояниями без поиска по ключу. Без начальных
+    // слов и в состояниях без продолжения генерация начинается со случайного состояния.
+    // Слова не копируются: в буфер вывода попадают ссылки на слова, хранимые цепью.
     try
     {
+        TraceScope scope("TextGenerator::generateText");
+        LatencyScope latency(Latency::Operation::GenerateText);
+        RandomEngine random(m_Seed);
+        MarkovTextChain::StateId state = m_InitialWords.empty() ? chain.randomState(random) : chain.findState(m_InitialWords);
+        if (state == MarkovTextChain::noState)
+        {
+            throw std::logic_error("no chain state for the initial words");
+        }
         for (register int i = 1; i <= m_NumberOfNewWords; ++i)
         {
-            MarkovTextChain::Word newWord = chain.generateWord(m_InitialWords);
-            std::cout << newWord << (i % wordsPerLine == 0 ? '\n' : ' ');
-            
-            m_InitialWords.pop_front();
-            m_InitialWords.push_back(std::move(newWord));
+            if (state == MarkovTextChain::noState)
+            {
+                state = chain.randomState(random);
+            }
+            output.write(chain.generateWord(state, random));
+            output.put(i % wordsPerLine == 0 ? '\n' : ' ');
         }
+        output.put('\n');
+        output.flush();
     }
     catch (const std::exception& e)
     {
@@ -161,12 +339,167 @@ bool TextGenerator::generateText()
         return false;
     }
     
-    std::cout << std::endl;
     return true;
 }
 
+bool TextGenerator::generateBatch()
+{
+    std::ifstream batchInput(m_Batch);
+    if (!batchInput.good())
+    {
+        std::cerr << "  TextGenerator::generateBatch error: failed to open file '" << m_Batch << "' for reading" << std::endl;
+        return false;
+    }
+    
+    // Загрузить цепь Маркова, одну на все потоки.
+    MarkovTextChain chain;
+    if (!loadChain(chain))
+    {
+        return false;
+    }
+    
+    std::ofstream fileOutput;
+    if (!openOutput(fileOutput))
+    {
+        return false;
+    }
+    BufferedWriter output(m_Output.empty() ? std::cout : fileOutput);
+    
+    // Потоки пула по очереди берут из файла порции фраз, генерируют их без блокировки и выводят
+    // порции в порядке взятия: поток ждет вывода предыдущих порций, поэтому в памяти не больше
+    // одной порции на поток и ни один поток не простаивает в конце блока.
+    std::mutex mutex;
+    std::condition_variable written;
+    size_t nextChunk = 0;
+    size_t writtenChunks = 0;
+    size_t processed = 0;
+    bool failed = false;
+    bool success = true;
+    
+    // Ошибка вывода в любом потоке останавливает остальные и завершает пакетный режим.
+    try
+    {
+        runParallel(m_Threads, [&](size_t)
+        {
+            TraceScope scope("TextGenerator::generateBatch worker");
+            std::vector<std::string> phrases(interleavedPhrases);
+            std::vector<RandomEngine> randoms(interleavedPhrases);
+            std::vector<std::string> texts(interleavedPhrases);
+            std::vector<char> results(interleavedPhrases);
+            try
+            {
+                while (true)
+                {
+                    size_t chunk = 0;
+                    size_t first = 0;
+                    size_t size = 0;
+                    {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        while (!failed && size < interleavedPhrases && std::getline(batchInput, phrases[size]))
+                        {
+                            ++size;
+                        }
+                        if (size == 0)
+                        {
+                            return;
+                        }
+                        chunk = nextChunk++;
+                        first = processed;
+                        processed += size;
+                    }
+                    
+                    // Поток случайных чисел определяется номером фразы, а не потока, поэтому
+                    // результат не зависит от числа потоков.
+                    for (size_t i = 0; i < size; ++i)
+                    {
+                        randoms[i] = RandomEngine(m_Seed, first + i);
+                    }
+                    chain.continuePhrases(phrases.data(), randoms.data(), texts.data(), results.data(), size, m_NumberOfNewWords);
+                    
+                    std::unique_lock<std::mutex> lock(mutex);
+                    written.wait(lock, [&]()
+                    {
+                        return writtenChunks == chunk || failed;
+                    });
+                    if (failed)
+                    {
+                        return;
+                    }
+                    for (size_t i = 0; i < size; ++i)
+                    {
+                        if (!results[i])
+                        {
+                            std::cerr << "  TextGenerator::generateBatch error: cannot generate text for line " << first + i + 1 << std::endl;
+                            success = false;
+                        }
+                        output.write(texts[i]);
+                        output.put('\n');
+                    }
+                    ++writtenChunks;
+                    written.notify_all();
+                }
+            }
+            catch (...)
+            {
+                // Потоки, ждущие вывода порций этого потока, завершаются без вывода.
+                std::lock_guard<std::mutex> lock(mutex);
+                failed = true;
+                written.notify_all();
+                throw;
+            }
+        });
+        
+        output.flush();
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "  TextGenerator::generateBatch error:\n    " << e.what() << std::endl;
+        return false;
+    }
+    return success;
+}
+
+bool TextGenerator::queryChain() const
+{
+    std::ifstream input(m_Input);
+    if (!input.good())
+    {
+        std::cerr << "  TextGenerator::queryChain error: failed to open file '" << m_Input << "' for reading" << std::endl;
+        return false;
+    }
+    
+    MarkovTextChain::Successors successors;
+    try
+    {
+        if (!MarkovTextChain::lookup(input, m_InitialWords, successors))
+        {
+            std::cerr << "  No state for the given words in the chain" << std::endl;
+            return false;
+        }
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "  TextGenerator::queryChain error:\n    " << e.what() << std::endl;
+        return false;
+    }
+    
+    std::ofstream fileOutput;
+    if (!openOutput(fileOutput))
+    {
+        return false;
+    }
+    std::ostream& output = m_Output.empty() ? std::cout : fileOutput;
+    for (const auto& successor : successors)
+    {
+        output << successor.first << ' ' << successor.second << '\n';
+    }
+    output.flush();
+    return output.good();
+}
+
 bool TextGenerator::loadChain(MarkovTextChain& chain) const
 {
+    TraceScope scope("TextGenerator::loadChain");
     if (!m_Input.empty())
     {
         std::cerr << "Loading Markov chain from '" << m_Input << "' ... ";
@@ -186,6 +519,7 @@ bool TextGenerator::loadChain(MarkovTextChain& chain) const
     try
     {
         chain.load(m_Input.empty() ? std::cin : fileInput);
+        chain.freeze(m_Layout, true);
     }
     catch (const std::exception& e)
     {
@@ -201,9 +535,26 @@ bool TextGenerator::loadChain(MarkovTextChain& chain) const
     return true;
 }
 
-bool TextGenerator::checkInitialWords(size_t chainOrder)
+bool TextGenerator::openOutput(std::ofstream& fileOutput) const
 {
-    if (m_InitialWords.size() < chainOrder)
+    if (m_Output.empty())
+    {
+        return true;
+    }
+    
+    fileOutput.open(m_Output);
+    if (!fileOutput.good())
+    {
+        std::cerr << "  TextGenerator::openOutput error: failed to open file '" << m_Output << "' for writing" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool TextGenerator::checkInitialWords(const MarkovTextChain& chain, BufferedWriter& output)
+{
+    const size_t chainOrder = chain.order();
+    if (m_InitialWords.size() < (chain.backoff() ? 1 : chainOrder))
     {
         std::cerr << "  Provided chain order is " << chainOrder << ", number of initial words is too small" << std::endl;
         return false;
@@ -212,9 +563,10 @@ bool TextGenerator::checkInitialWords(size_t chainOrder)
     int counter = 1;
     for (const auto& initialWord : m_InitialWords)
     {
-        std::cout << initialWord << (counter++ % wordsPerLine == 0 ? '\n' : ' ');
+        output.write(initialWord);
+        output.put(counter++ % wordsPerLine == 0 ? '\n' : ' ');
     }
-    std::cout <<  std::endl;
+    output.put('\n');
     
     while (m_InitialWords.size() > chainOrder)
     {
@@ -223,3 +575,16 @@ bool TextGenerator::checkInitialWords(size_t chainOrder)
     
     return true;
 }
+
+bool TextGenerator::outputTrace() const
+{
+    std::ofstream output(m_Trace);
+    if (!output.good())
+    {
+        std::cerr << "  TextGenerator::outputTrace error: failed to open file '" << m_Trace << "' for writing" << std::endl;
+        return false;
+    }
+    
+    Trace::write(output);
+    return output.good();
+}
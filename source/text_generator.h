@@ -5,10 +5,14 @@
 
 #include "markov_text_chain.h"
 
+#include <fstream>
 #include <list>
 #include <string>
 
 
+class BufferedWriter;
+
+
 /// @class TextGenerator
 /// @brief Анализирует аргументы командной строки и создает текст на основе цепи Маркова.
 class TextGenerator
@@ -38,15 +42,33 @@ private:
     /// @return true если действие выполнено успешно, false в противном случае.
     bool generateText();
     
+    /// @brief Создать по тексту для каждой начальной фразы из файла, используя несколько потоков.
+    /// @return true если все тексты созданы успешно, false в противном случае.
+    bool generateBatch();
+    
+    /// @brief Вывести слова значения состояния, заданного начальными словами, из файла цепи без ее загрузки.
+    /// @return true если состояние найдено и выведено, false в противном случае.
+    bool queryChain() const;
+    
     /// @brief Загрузить цепь Маркова.
     /// @param[in] chain - Цепь Маркова.
     /// @return true если действие выполнено успешно, false в противном случае.
     bool loadChain(MarkovTextChain& chain) const;
     
-    /// @brief Проверить, достаточно ли начальных слов.
-    /// @param[in] chainOrder - порядок цепи Маркова.
+    /// @brief Открыть файл вывода, если он задан.
+    /// @param[out] fileOutput - Поток вывода в файл.
+    /// @return true если действие выполнено успешно, false в противном случае.
+    bool openOutput(std::ofstream& fileOutput) const;
+    
+    /// @brief Проверить, достаточно ли начальных слов, и вывести их.
+    /// @param[in] chain - Цепь Маркова, цепи с откатом достаточно одного начального слова.
+    /// @param[in] output - Буфер вывода.
     /// @return true если начальных слов достаточно, false в противном случае.
-    bool checkInitialWords(size_t chainOrder);
+    bool checkInitialWords(const MarkovTextChain& chain, BufferedWriter& output);
+    
+    /// @brief Вывести события трассировки.
+    /// @return true если действие выполнено успешно, false в противном случае.
+    bool outputTrace() const;
 
 private:
     /// @brief Число слов, которое надо создать.
@@ -55,6 +77,27 @@ private:
     /// @brief Имя файла для ввода цепи Маркова.
     std::string m_Input;
     
+    /// @brief Способ индексации состояний загруженной цепи Маркова.
+    MarkovTextChain::FrozenLayout m_Layout;
+    
+    /// @brief Зерно генератора случайных чисел.
+    uint64_t m_Seed;
+    
+    /// @brief Имя файла для вывода текста.
+    std::string m_Output;
+    
+    /// @brief Имя файла начальных фраз для пакетного режима.
+    std::string m_Batch;
+    
+    /// @brief Число потоков пакетного режима.
+    size_t m_Threads;
+    
+    /// @brief Файл вывода трассировки в формате Chrome Trace Event, пустая строка - без трассировки.
+    std::string m_Trace;
+    
+    /// @brief Признак поиска значения состояния в файле цепи вместо генерации текста.
+    bool m_Query;
+    
     /// @brief Список начальных слов.
     MarkovTextChain::Words m_InitialWords;
     
@@ -0,0 +1,390 @@
+#include "text_scorer.h"
+#include "buffered_writer.h"
+#include "parallel.h"
+#include "text_adjuster.h"
+#include "word_splitter.h"
+
+#include <getopt.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <vector>
+
+
+namespace
+{
+    /// @brief Число документов, оцениваемых за один проход, на поток.
+    const size_t blockPerThread = 1024;
+    
+    /// @brief Число документов, которые поток берет за один раз.
+    const size_t documentsPerClaim = 16;
+    
+    /// @brief Добавка к числам появлений слов для сглаживания по умолчанию.
+    const double defaultAddK = 0.01;
+    
+    /// @brief Размер буфера форматирования строки оценки.
+    const size_t scoreLineSize = 128;
+    
+    /// @brief Вычислить перплексию.
+    /// @param[in] logProbability - Натуральный логарифм вероятности оцененных слов.
+    /// @param[in] scored - Число оцененных слов.
+    /// @return Перплексия или бесконечность, если оцененных слов нет.
+    double perplexity(double logProbability, size_t scored)
+    {
+        return scored == 0 ? std::numeric_limits<double>::infinity() : std::exp(-logProbability / scored);
+    }
+}
+
+TextScorer::TextScorer()
+    : m_Input()
+    , m_Layout(MarkovTextChain::FrozenLayout::Hash)
+    , m_Documents()
+    , m_Output()
+    , m_Threads(defaultThreadCount())
+    , m_AddK(defaultAddK)
+    , m_NeedHelp(false)
+    , m_ProgramName()
+{
+}
+
+TextScorer::~TextScorer() = default;
+
+void TextScorer::init(int argc, char** argv)
+{
+    m_ProgramName = argv[0];
+    m_ProgramName = m_ProgramName.substr(m_ProgramName.find_last_of('/') + 1);
+    
+    struct option longOptions[] =
+    {
+       {"input", required_argument, 0, 'i'},
+       {"layout", required_argument, 0, 'l'},
+       {"documents", required_argument, 0, 'd'},
+       {"output", required_argument, 0, 'o'},
+       {"threads", required_argument, 0, 't'},
+       {"add-k", required_argument, 0, 'k'},
+       {"help", no_argument, 0, 'h'},
+       {0, 0, 0, 0 }
+    };
+    
+    int c = 0;
+    opterr = 0;
+    
+    // Анализ ключей и их значений.
+    while ((c = getopt_long(argc, argv, "i:l:d:o:t:k:h", longOptions, nullptr))!= -1)
+    {
+        switch (c)
+        {
+        case 'i':
+            m_Input = optarg;
+            break;
+        
+        case 'l':
+            if (std::string(optarg) == "hash")
+            {
+                m_Layout = MarkovTextChain::FrozenLayout::Hash;
+            }
+            else if (std::string(optarg) == "trie")
+            {
+                m_Layout = MarkovTextChain::FrozenLayout::Trie;
+            }
+            else
+            {
+                std::cerr << "  Unsupported value for 'layout' parameter" << std::endl;
+                m_NeedHelp = true;
+            }
+            break;
+        
+        case 'd':
+            m_Documents = optarg;
+            break;
+        
+        case 'o':
+            m_Output = optarg;
+            break;
+        
+        case 't':
+            try
+            {
+                const int threads = std::stoi(optarg);
+                if (threads <= 0)
+                {
+                    throw std::exception();
+                }
+                m_Threads = threads;
+            }
+            catch (const std::exception& e)
+            {
+                std::cerr << "  Unsupported value for 'threads' parameter" << std::endl;
+                m_NeedHelp = true;
+            }
+            break;
+        
+        case 'k':
+            try
+            {
+                size_t position = 0;
+                const double addK = std::stod(optarg, &position);
+                if (optarg[position] != '\0' || !(addK >= 0.0))
+                {
+                    throw std::exception();
+                }
+                m_AddK = addK;
+            }
+            catch (const std::exception& e)
+            {
+                std::cerr << "  Unsupported value for 'add-k' parameter" << std::endl;
+                m_NeedHelp = true;
+            }
+            break;
+        
+        case 'h':
+            m_NeedHelp = true;
+            break;
+        
+        case '?':
+            if (optopt == 'i')
+            {
+                std::cerr << " Options -i and --input require an argument" << std::endl;
+                m_NeedHelp = true;
+                break;
+            }
+            else if (optopt == 'l')
+            {
+                std::cerr << " Options -l and --layout require an argument" << std::endl;
+                m_NeedHelp = true;
+                break;
+            }
+            else if (optopt == 'd')
+            {
+                std::cerr << " Options -d and --documents require an argument" << std::endl;
+                m_NeedHelp = true;
+                break;
+            }
+            else if (optopt == 'o')
+            {
+                std::cerr << " Options -o and --output require an argument" << std::endl;
+                m_NeedHelp = true;
+                break;
+            }
+            else if (optopt == 't')
+            {
+                std::cerr << " Options -t and --threads require an argument" << std::endl;
+                m_NeedHelp = true;
+                break;
+            }
+            else if (optopt == 'k')
+            {
+                std::cerr << " Options -k and --add-k require an argument" << std::endl;
+                m_NeedHelp = true;
+                break;
+            }
+            else
+            {
+                std::cerr << " Unknown option " << argv[optind-1] << std::endl;
+                m_NeedHelp = true;
+                break;
+            }
+            break;
+        }
+    }
+    
+    // Проверка наличия обязательных параметров.
+    if (!m_NeedHelp && m_Input.empty() && m_Documents.empty())
+    {
+        std::cerr << "  Markov chain and documents cannot both be read from std::cin" << std::endl;
+        m_NeedHelp = true;
+    }
+}
+
+bool TextScorer::run() const
+{
+    return m_NeedHelp ? !printUsage() : scoreDocuments();
+}
+
+bool TextScorer::printUsage() const
+{
+    std::cout << "Usage: " << m_ProgramName << " [options]" << std::endl;
+    std::cout << "  -i, --input      File to load Markov chain from, std::cin will be used if not provided" << std::endl;
+    std::cout << "  -l, --layout     Loaded chain state index: 'hash' (default) or 'trie'" << std::endl;
+    std::cout << "  -d, --documents  File with documents to score, one per line, std::cin will be used if not provided" << std::endl;
+    std::cout << "  -o, --output     File to output scores to, std::cout will be used if not provided" << std::endl;
+    std::cout << "  -t, --threads    Number of threads, all cores are used by default" << std::endl;
+    std::cout << "  -k, --add-k      Count added to every word of the vocabulary and to unknown words in every state," << std::endl;
+    std::cout << "                   so that every word is scored, " << defaultAddK << " by default; 0 skips words unseen after their state" << std::endl;
+    std::cout << "  -h, --help       Show this message and exit" << std::endl << std::endl;
+    return true;
+}
+
+bool TextScorer::scoreDocuments() const
+{
+    std::ifstream fileDocuments;
+    if (!m_Documents.empty())
+    {
+        fileDocuments.open(m_Documents);
+        if (!fileDocuments.good())
+        {
+            std::cerr << "  TextScorer::scoreDocuments error: failed to open file '" << m_Documents << "' for reading" << std::endl;
+            return false;
+        }
+    }
+    std::istream& documentInput = m_Documents.empty() ? std::cin : fileDocuments;
+    
+    // Загрузить цепь Маркова, одну на все потоки.
+    MarkovTextChain chain;
+    if (!loadChain(chain))
+    {
+        return false;
+    }
+    
+    std::ofstream fileOutput;
+    if (!m_Output.empty())
+    {
+        fileOutput.open(m_Output);
+        if (!fileOutput.good())
+        {
+            std::cerr << "  TextScorer::scoreDocuments error: failed to open file '" << m_Output << "' for writing" << std::endl;
+            return false;
+        }
+    }
+    BufferedWriter output(m_Output.empty() ? std::cout : fileOutput);
+    
+    // Документы обрабатываются блоками: блок оценивается всеми потоками, затем выводится в исходном порядке.
+    const size_t blockSize = blockPerThread * m_Threads;
+    std::vector<std::string> documents;
+    std::vector<MarkovTextChain::Score> scores(blockSize);
+    std::vector<std::string> errors(blockSize);
+    size_t processed = 0;
+    size_t totalWords = 0;
+    size_t totalScored = 0;
+    size_t totalUnknown = 0;
+    double totalLogProbability = 0.0;
+    bool success = true;
+    const auto start = std::chrono::steady_clock::now();
+    
+    // Ошибка вывода возможна при выводе любого блока, а не только при последнем сбросе буфера.
+    try
+    {
+        while (documentInput.good())
+        {
+            documents.clear();
+            std::string document;
+            while (documents.size() < blockSize && std::getline(documentInput, document))
+            {
+                documents.push_back(std::move(document));
+            }
+        
+            std::atomic<size_t> next(0);
+            runParallel(m_Threads, [&](size_t)
+            {
+                // Документ разбивается на слова так же, как текст при построении цепи.
+                std::vector<MarkovTextChain::Word> words;
+                TextAdjuster adjuster;
+                adjuster.setHandler([&words](std::string&& word)
+                {
+                    words.push_back(std::move(word));
+                });
+                WordSplitter splitter;
+                splitter.setHandler(std::bind(&TextAdjuster::adjust, std::ref(adjuster), std::placeholders::_1));
+            
+                for (size_t first = next.fetch_add(documentsPerClaim); first < documents.size(); first = next.fetch_add(documentsPerClaim))
+                {
+                    const size_t last = std::min(documents.size(), first + documentsPerClaim);
+                    for (size_t i = first; i < last; ++i)
+                    {
+                        words.clear();
+                        errors[i].clear();
+                        try
+                        {
+                            splitter.addText(documents[i].data(), documents[i].size());
+                            splitter.flush();
+                            scores[i] = chain.score(words.data(), words.size(), m_AddK);
+                        }
+                        catch (const std::exception& e)
+                        {
+                            // Разбиение прерывается на уже выделенном слове, поэтому в буфере ничего не остается.
+                            scores[i] = MarkovTextChain::Score { 0, 0, 0.0, 0 };
+                            errors[i] = e.what();
+                        }
+                    }
+                }
+            });
+        
+            char line[scoreLineSize];
+            for (size_t i = 0; i < documents.size(); ++i)
+            {
+                if (!errors[i].empty())
+                {
+                    std::cerr << "  TextScorer::scoreDocuments error: cannot score line " << processed + i + 1 << ":\n    " << errors[i] << std::endl;
+                    success = false;
+                }
+            
+                const MarkovTextChain::Score& score = scores[i];
+                const int size = std::snprintf(line, sizeof(line), "%.6f\t%.6f\t%zu\t%zu\t%zu\n",
+                                               score.logProbability, perplexity(score.logProbability, score.scored), score.scored, score.words,
+                                               score.unknown);
+                output.write(line, std::min<size_t>(size, sizeof(line) - 1));
+                totalWords += score.words;
+                totalScored += score.scored;
+                totalUnknown += score.unknown;
+                totalLogProbability += score.logProbability;
+            }
+            processed += documents.size();
+        }
+        
+        output.flush();
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "  TextScorer::scoreDocuments error:\n    " << e.what() << std::endl;
+        return false;
+    }
+    
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cerr << "Scored " << processed << " documents, " << totalScored << " of " << totalWords << " words with "
+              << totalUnknown << " unknown, in " << seconds << " s: "
+              << (seconds > 0 ? processed / seconds : 0) << " documents/s, perplexity " << perplexity(totalLogProbability, totalScored) << std::endl;
+    return success;
+}
+
+bool TextScorer::loadChain(MarkovTextChain& chain) const
+{
+    if (!m_Input.empty())
+    {
+        std::cerr << "Loading Markov chain from '" << m_Input << "' ... ";
+    }
+    
+    std::ifstream fileInput;
+    if (!m_Input.empty())
+    {
+        fileInput.open(m_Input);
+        if (!fileInput.good())
+        {
+            std::cerr << std::endl << "  TextScorer::loadChain error: failed to open file '" << m_Input << "' for reading" << std::endl;
+            return false;
+        }
+    }
+    
+    try
+    {
+        chain.load(m_Input.empty() ? std::cin : fileInput);
+        chain.freeze(m_Layout);
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << std::endl << "  TextScorer::loadChain error:\n    " << e.what() << std::endl;
+        return false;
+    }
+    
+    if (!m_Input.empty())
+    {
+        std::cerr << "DONE" << std::endl << std::endl;
+    }
+    
+    return true;
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#ifndef TEXT_SCORER_H
+#define TEXT_SCORER_H
+
+#include "markov_text_chain.h"
+
+#include <string>
+
+
+/// @class TextScorer
+/// @brief Анализирует аргументы командной строки и оценивает тексты цепью Маркова.
+class TextScorer
+{
+public:
+    /// @brief Конструктор.
+    TextScorer();
+    
+    /// @brief Деструктор.
+    ~TextScorer();
+    
+    /// @brief Проанализировать аргументы командной строки.
+    /// @param[in] argc - Число аргументов.
+    /// @param[in] argv - Список аргументов.
+    void init(int argc, char** argv);
+    
+    /// @brief Выполнить заданное командной строкой действие.
+    /// @return true если действие выполнено успешно, false в противном случае.
+    bool run() const;
+
+private:
+    /// @brief Показать справку.
+    /// @return true если действие выполнено успешно, false в противном случае.
+    bool printUsage() const;
+    
+    /// @brief Оценить каждый документ цепью Маркова, используя несколько потоков.
+    /// @return true если все документы оценены успешно, false в противном случае.
+    bool scoreDocuments() const;
+    
+    /// @brief Загрузить цепь Маркова.
+    /// @param[in] chain - Цепь Маркова.
+    /// @return true если действие выполнено успешно, false в противном случае.
+    bool loadChain(MarkovTextChain& chain) const;
+
+private:
+    /// @brief Имя файла для ввода цепи Маркова.
+    std::string m_Input;
+    
+    /// @brief Способ индексации состояний загруженной цепи Маркова.
+    MarkovTextChain::FrozenLayout m_Layout;
+    
+    /// @brief Имя файла документов.
+    std::string m_Documents;
+    
+    /// @brief Имя файла для вывода оценок.
+    std::string m_Output;
+    
+    /// @brief Число потоков.
+    size_t m_Threads;
+    
+    /// @brief Добавка к числам появлений слов для сглаживания, 0 - без сглаживания.
+    double m_AddK;
+    
+    /// @brief Флаг необходимости показа справки.
+    bool m_NeedHelp;
+    
+    /// @brief Имя исполняемого файла.
+    std::string m_ProgramName;
+};
+
+#endif // TEXT_SCORER_H
@@ -0,0 +1,189 @@
+#include "trace.h"
+
+#include <chrono>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <vector>
+
+
+namespace
+{
+    /// @brief Число событий в кольцевом буфере потока.
+    const size_t bufferCapacity = 1 << 16;
+    
+    /// @brief Событие трассировки.
+    struct Event
+    {
+        /// @brief Имя события.
+        const char* name;
+        
+        /// @brief Время начала в наносекундах.
+        uint64_t start;
+        
+        /// @brief Длительность в наносекундах.
+        uint64_t duration;
+    };
+    
+    /// @brief Кольцевой буфер событий одного потока.
+    struct Buffer
+    {
+        /// @brief Конструктор.
+        /// @param[in] thread - Номер потока в трассировке.
+        explicit Buffer(size_t thread)
+            : id(thread)
+            , events(bufferCapacity)
+            , count(0)
+        {
+        }
+        
+        /// @brief Номер потока в трассировке.
+        size_t id;
+        
+        /// @brief События, запись идет по кругу.
+        std::vector<Event> events;
+        
+        /// @brief Число записанных событий, включая затертые.
+        size_t count;
+    };
+    
+    /// @brief Момент включения трассировки.
+    std::chrono::steady_clock::time_point traceStart;
+    
+    /// @brief Защита списка буферов.
+    std::mutex buffersMutex;
+    
+    /// @brief Буферы всех потоков, писавших события. Буферы живут дольше потоков,
+    ///        чтобы события завершившихся потоков попали в вывод.
+    std::vector<std::unique_ptr<Buffer>> buffers;
+    
+    /// @brief Буферы завершившихся потоков. Новый поток продолжает буфер завершившегося,
+    ///        поэтому потоки, создаваемые на каждую параллельную задачу, не плодят буферы.
+    std::vector<Buffer*> freeBuffers;
+    
+    /// @class ThreadBuffer
+    /// @brief Буфер текущего потока, при завершении потока возвращается в список свободных.
+    class ThreadBuffer
+    {
+    public:
+        /// @brief Конструктор.
+        ThreadBuffer()
+            : m_Buffer(nullptr)
+        {
+        }
+        
+        /// @brief Деструктор.
+        ~ThreadBuffer()
+        {
+            if (m_Buffer != nullptr)
+            {
+                std::lock_guard<std::mutex> lock(buffersMutex);
+                freeBuffers.push_back(m_Buffer);
+            }
+        }
+        
+        ThreadBuffer(const ThreadBuffer&) = delete;
+        ThreadBuffer& operator=(const ThreadBuffer&) = delete;
+        
+        /// @brief Получить буфер, при первом обращении взять свободный или создать новый.
+        /// @return Буфер текущего потока.
+        Buffer& get()
+        {
+            if (m_Buffer == nullptr)
+            {
+                std::lock_guard<std::mutex> lock(buffersMutex);
+                if (freeBuffers.empty())
+                {
+                    buffers.emplace_back(new Buffer(buffers.size()));
+                    m_Buffer = buffers.back().get();
+                }
+                else
+                {
+                    m_Buffer = freeBuffers.back();
+                    freeBuffers.pop_back();
+                }
+            }
+            return *m_Buffer;
+        }
+    
+    private:
+        /// @brief Буфер потока.
+        Buffer* m_Buffer;
+    };
+    
+    /// @brief Буфер текущего потока.
+    thread_local ThreadBuffer threadBuffer;
+    
+    /// @brief Вывести время в микросекундах, как требует формат.
+    /// @param[in] output - Поток вывода.
+    /// @param[in] nanoseconds - Время в наносекундах.
+    void writeMicroseconds(std::ostream& output, uint64_t nanoseconds)
+    {
+        output << nanoseconds / 1000 << '.' << std::setw(3) << std::setfill('0') << nanoseconds % 1000;
+    }
+}
+
+
+std::atomic<bool> Trace::m_Enabled(false);
+
+void Trace::enable()
+{
+    traceStart = std::chrono::steady_clock::now();
+    m_Enabled.store(true, std::memory_order_relaxed);
+}
+
+void Trace::disable()
+{
+    m_Enabled.store(false, std::memory_order_relaxed);
+}
+
+uint64_t Trace::now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - traceStart).count();
+}
+
+uint64_t Trace::begin()
+{
+    threadBuffer.get();
+    return now();
+}
+
+void Trace::record(const char* name, uint64_t start, uint64_t end)
+{
+    Buffer& buffer = threadBuffer.get();
+    Event& event = buffer.events[buffer.count++ % bufferCapacity];
+    event.name = name;
+    event.start = start;
+    event.duration = end - start;
+}
+
+void Trace::write(std::ostream& output)
+{
+    std::lock_guard<std::mutex> lock(buffersMutex);
+    
+    // Законченные события (ph = X) вместо пар начала и конца: затирание старых событий
+    // в кольцевом буфере не оставляет событий без пары.
+    std::ostringstream text;
+    text << "{\"traceEvents\":[";
+    bool first = true;
+    for (const auto& buffer : buffers)
+    {
+        text << (first ? "\n" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer->id
+             << ",\"args\":{\"name\":\"thread " << buffer->id << "\"}}";
+        first = false;
+        
+        const size_t begin = buffer->count > bufferCapacity ? buffer->count - bufferCapacity : 0;
+        for (size_t i = begin; i < buffer->count; ++i)
+        {
+            const Event& event = buffer->events[i % bufferCapacity];
+            text << ",\n{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer->id << ",\"ts\":";
+            writeMicroseconds(text, event.start);
+            text << ",\"dur\":";
+            writeMicroseconds(text, event.duration);
+            text << "}";
+        }
+    }
+    text << "\n],\"displayTimeUnit\":\"ms\"}\n";
+    output << text.str();
+}
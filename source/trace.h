@@ -0,0 +1,92 @@
+#pragma once
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+
+
+/// @class Trace
+/// @brief Собирает события трассировки и выводит их в формате Chrome Trace Event.
+/// @details Каждый поток пишет события в свой кольцевой буфер без блокировок, при переполнении
+///          старые события затираются. Пока трассировка не включена, событие стоит одного
+///          чтения флага. Вывод можно открыть в Perfetto или chrome://tracing.
+class Trace
+{
+public:
+    /// @brief Включить сбор событий, время событий отсчитывается от момента включения.
+    static void enable();
+    
+    /// @brief Выключить сбор событий, собранные события остаются в буферах до вывода.
+    static void disable();
+    
+    /// @brief Проверить, включен ли сбор событий.
+    /// @return true если сбор включен, false в противном случае.
+    static bool enabled()
+    {
+        return m_Enabled.load(std::memory_order_relaxed);
+    }
+    
+    /// @brief Получить текущее время трассировки.
+    /// @return Время в наносекундах от включения.
+    static uint64_t now();
+    
+    /// @brief Начать событие: закрепить за текущим потоком буфер, если его еще нет, и получить время.
+    /// @details Буфер закрепляется до начала первого события потока, поэтому поток может получить
+    ///          только буфер потока, все события которого уже закончились.
+    /// @return Время начала в наносекундах от включения.
+    static uint64_t begin();
+    
+    /// @brief Записать законченное событие в буфер текущего потока.
+    /// @param[in] name - Имя события, строка должна существовать до вывода.
+    /// @param[in] start - Время начала в наносекундах.
+    /// @param[in] end - Время окончания в наносекундах.
+    static void record(const char* name, uint64_t start, uint64_t end);
+    
+    /// @brief Вывести собранные события всех потоков.
+    /// @details Вызывается, когда потоки, писавшие события, завершили работу.
+    /// @param[in] output - Поток вывода.
+    static void write(std::ostream& output);
+
+private:
+    /// @brief Флаг сбора событий.
+    static std::atomic<bool> m_Enabled;
+};
+
+
+/// @class TraceScope
+/// @brief Записывает событие трассировки, длящееся от создания до уничтожения объекта.
+class TraceScope
+{
+public:
+    /// @brief Конструктор.
+    /// @param[in] name - Имя события, строковый литерал.
+    explicit TraceScope(const char* name)
+        : m_Name(Trace::enabled() ? name : nullptr)
+        , m_Start(m_Name != nullptr ? Trace::begin() : 0)
+    {
+    }
+    
+    /// @brief Деструктор.
+    ~TraceScope()
+    {
+        if (m_Name != nullptr)
+        {
+            Trace::record(m_Name, m_Start, Trace::now());
+        }
+    }
+    
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+private:
+    /// @brief Имя события, nullptr - трассировка выключена.
+    const char* m_Name;
+    
+    /// @brief Время начала.
+    uint64_t m_Start;
+};
+
+#endif // TRACE_H
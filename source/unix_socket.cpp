@@ -0,0 +1,210 @@
+#include "unix_socket.h"
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+
+namespace
+{
+    /// @brief Заполнить адрес сокета домена Unix.
+    /// @param[in] path - Путь к сокету.
+    /// @return Адрес сокета.
+    /// @throws std::exception если путь пустой или слишком длинный.
+    sockaddr_un makeAddress(const std::string& path)
+    {
+        sockaddr_un address;
+        std::memset(&address, 0, sizeof(address));
+        if (path.empty() || path.size() >= sizeof(address.sun_path))
+        {
+            throw std::invalid_argument("makeAddress error: unsupported socket path '" + path + "'");
+        }
+        address.sun_family = AF_UNIX;
+        std::memcpy(address.sun_path, path.c_str(), path.size());
+        return address;
+    }
+    
+    /// @brief Дополнить сообщение об ошибке описанием errno.
+    /// @param[in] message - Сообщение об ошибке.
+    /// @return Сообщение с описанием последней системной ошибки.
+    std::string systemError(const std::string& message)
+    {
+        return message + ": " + std::strerror(errno);
+    }
+    
+    /// @brief Разобрать префикс длины сообщения.
+    /// @param[in] header - Префикс длины.
+    /// @return Длина сообщения.
+    /// @throws std::exception если длина сообщения превышает допустимую.
+    uint32_t decodeLength(const char* header)
+    {
+        uint32_t length = 0;
+        for (size_t i = 0; i < messageHeaderSize; ++i)
+        {
+            length = (length << 8) | static_cast<unsigned char>(header[i]);
+        }
+        if (length > maxMessageSize)
+        {
+            throw std::length_error("decodeLength error: message is too long");
+        }
+        return length;
+    }
+    
+    /// @brief Принять заданное число байт из блокирующего сокета.
+    /// @param[in] socket - Дескриптор сокета.
+    /// @param[out] data - Буфер для данных.
+    /// @param[in] size - Число байт.
+    /// @return Число принятых байт, меньше size только при закрытии соединения.
+    /// @throws std::exception в случае ошибки.
+    size_t receiveExact(int socket, char* data, size_t size)
+    {
+        size_t received = 0;
+        while (received < size)
+        {
+            const ssize_t result = recv(socket, data + received, size - received, 0);
+            if (result < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (result < 0)
+            {
+                throw std::runtime_error(systemError("receiveMessage error: failed to receive data"));
+            }
+            if (result == 0)
+            {
+                break;
+            }
+            received += result;
+        }
+        return received;
+    }
+}
+
+int listenUnixSocket(const std::string& path)
+{
+    const sockaddr_un address = makeAddress(path);
+    
+    // Удаляется только сокет, обычный файл с тем же именем остается нетронутым.
+    struct stat status;
+    if (lstat(path.c_str(), &status) == 0 && S_ISSOCK(status.st_mode))
+    {
+        unlink(path.c_str());
+    }
+    
+    const int descriptor = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (descriptor < 0)
+    {
+        throw std::runtime_error(systemError("listenUnixSocket error: failed to create socket"));
+    }
+    
+    if (bind(descriptor, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0 ||
+        listen(descriptor, SOMAXCONN) != 0)
+    {
+        const std::string error = systemError("listenUnixSocket error: failed to listen on '" + path + "'");
+        close(descriptor);
+        throw std::runtime_error(error);
+    }
+    
+    return descriptor;
+}
+
+int connectUnixSocket(const std::string& path)
+{
+    const sockaddr_un address = makeAddress(path);
+    
+    const int descriptor = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (descriptor < 0)
+    {
+        throw std::runtime_error(systemError("connectUnixSocket error: failed to create socket"));
+    }
+    
+    if (connect(descriptor, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0)
+    {
+        const std::string error = systemError("connectUnixSocket error: failed to connect to '" + path + "'");
+        close(descriptor);
+        throw std::runtime_error(error);
+    }
+    
+    return descriptor;
+}
+
+std::string encodeMessage(const std::string& payload)
+{
+    if (payload.size() > maxMessageSize)
+    {
+        throw std::length_error("encodeMessage error: message is too long");
+    }
+    
+    const uint32_t length = static_cast<uint32_t>(payload.size());
+    std::string message(messageHeaderSize, '\0');
+    for (size_t i = 0; i < messageHeaderSize; ++i)
+    {
+        message[i] = static_cast<char>(length >> (8 * (messageHeaderSize - 1 - i)));
+    }
+    message += payload;
+    return message;
+}
+
+bool decodeMessage(const std::string& buffer, size_t& offset, std::string& payload)
+{
+    if (buffer.size() - offset < messageHeaderSize)
+    {
+        return false;
+    }
+    
+    const uint32_t length = decodeLength(buffer.data() + offset);
+    if (buffer.size() - offset - messageHeaderSize < length)
+    {
+        return false;
+    }
+    
+    payload.assign(buffer, offset + messageHeaderSize, length);
+    offset += messageHeaderSize + length;
+    return true;
+}
+
+void sendMessage(int socket, const std::string& payload)
+{
+    const std::string message = encodeMessage(payload);
+    size_t sent = 0;
+    while (sent < message.size())
+    {
+        const ssize_t result = send(socket, message.data() + sent, message.size() - sent, MSG_NOSIGNAL);
+        if (result < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (result < 0)
+        {
+            throw std::runtime_error(systemError("sendMessage error: failed to send data"));
+        }
+        sent += result;
+    }
+}
+
+bool receiveMessage(int socket, std::string& payload)
+{
+    char header[messageHeaderSize];
+    const size_t received = receiveExact(socket, header, messageHeaderSize);
+    if (received == 0)
+    {
+        return false;
+    }
+    if (received < messageHeaderSize)
+    {
+        throw std::runtime_error("receiveMessage error: connection closed inside message");
+    }
+    
+    const uint32_t length = decodeLength(header);
+    payload.assign(length, '\0');
+    if (length > 0 && receiveExact(socket, &payload[0], length) < length)
+    {
+        throw std::runtime_error("receiveMessage error: connection closed inside message");
+    }
+    return true;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#ifndef UNIX_SOCKET_H
+#define UNIX_SOCKET_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+
+/// @brief Максимальный размер сообщения без префикса длины.
+const uint32_t maxMessageSize = 1024 * 1024;
+
+/// @brief Размер префикса длины сообщения.
+const size_t messageHeaderSize = 4;
+
+/// @brief Создать неблокирующий слушающий сокет домена Unix.
+/// @details Оставшийся от предыдущего запуска сокет с тем же путем удаляется.
+/// @param[in] path - Путь к сокету.
+/// @return Дескриптор сокета.
+/// @throws std::exception в случае ошибки.
+int listenUnixSocket(const std::string& path);
+
+/// @brief Подключиться к сокету домена Unix.
+/// @param[in] path - Путь к сокету.
+/// @return Дескриптор блокирующего сокета.
+/// @throws std::exception в случае ошибки.
+int connectUnixSocket(const std::string& path);
+
+/// @brief Закодировать сообщение: длина в 4 байтах в сетевом порядке, затем содержимое.
+/// @param[in] payload - Содержимое сообщения.
+/// @return Закодированное сообщение.
+/// @throws std::exception в случае ошибки.
+std::string encodeMessage(const std::string& payload);
+
+/// @brief Извлечь очередное полное сообщение из буфера.
+/// @param[in] buffer - Принятые данные.
+/// @param[in,out] offset - Начало очередного сообщения, сдвигается за извлеченное сообщение.
+/// @param[out] payload - Содержимое сообщения.
+/// @return true если сообщение извлечено, false если оно принято не полностью.
+/// @throws std::exception если длина сообщения превышает допустимую.
+bool decodeMessage(const std::string& buffer, size_t& offset, std::string& payload);
+
+/// @brief Отправить сообщение через блокирующий сокет.
+/// @param[in] socket - Дескриптор сокета.
+/// @param[in] payload - Содержимое сообщения.
+/// @throws std::exception в случае ошибки.
+void sendMessage(int socket, const std::string& payload);
+
+/// @brief Принять сообщение из блокирующего сокета.
+/// @param[in] socket - Дескриптор сокета.
+/// @param[out] payload - Содержимое сообщения.
+/// @return true если сообщение принято, false если соединение закрыто до начала сообщения.
+/// @throws std::exception в случае ошибки.
+bool receiveMessage(int socket, std::string& payload);
+
+#endif // UNIX_SOCKET_H
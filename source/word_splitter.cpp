@@ -1,9 +1,21 @@
 #include "word_splitter.h"
 
 #include <algorithm>
-#include <iostream>
+#include <cctype>
+#include <stdexcept>
 
 
+namespace
+{
+    /// @brief Проверить, является ли символ разделителем слов.
+    /// @param[in] symbol - Символ.
+    /// @return true если символ - пробельный, false в противном случае.
+    bool isSpace(char symbol)
+    {
+        return std::isspace(static_cast<unsigned char>(symbol)) != 0;
+    }
+}
+
 WordSplitter::WordSplitter()
     : m_Handler()
     , m_Buffer()
@@ -24,38 +36,34 @@ void WordSplitter::addText(const char* text, size_t size)
         throw std::logic_error("WordSplitter::addText error: no handler is set");
     }
     
-    // Количество слов в новой порции текста.
-    const unsigned newWords = std::count(text, text + size, ' ');
-    m_Buffer.write(text, size);
-    
-    // Выделить все слова и передать их дальше.
-    for (register unsigned i = 0; i < newWords; ++i)
+    // Выделить все слова и передать их дальше. Внутри буфера остается только незаконченное
+    // последнее слово, поэтому память не растет при обработке неограниченного потока текста.
+    const char* const end = text + size;
+    while (text != end)
     {
-        std::string word;
-        m_Buffer >> word;
-        if (!word.empty())
+        const char* const wordEnd = std::find_if(text, end, isSpace);
+        m_Buffer.append(text, wordEnd);
+        if (wordEnd == end)
         {
+            break;
+        }
+        
+        if (!m_Buffer.empty())
+        {
+            std::string word;
+            word.swap(m_Buffer);
             m_Handler(std::move(word));
         }
+        text = std::find_if_not(wordEnd, end, isSpace);
     }
-    
-    // Сбросить флаги буфера для следующего цикла записи/чтения
-    m_Buffer.clear();
 }
 
 void WordSplitter::flush()
 {
-    while (true)
+    if (!m_Buffer.empty())
     {
         std::string word;
-        m_Buffer >> word;
-        if (!word.empty())
-        {
-            m_Handler(std::move(word));
-        }
-        else
-        {
-            break;
-        }
+        word.swap(m_Buffer);
+        m_Handler(std::move(word));
     }
 }
@@ -4,7 +4,7 @@
 #define WORD_SPLITTER_H
 
 #include <functional>
-#include <sstream>
+#include <string>
 
 
 /// @class WordSplitter
@@ -39,8 +39,8 @@ private:
     /// @brief Обработчик выделенных слов.
     Handler m_Handler;
     
-    /// @brief Внутренний буфер.
-    std::stringstream m_Buffer;
+    /// @brief Начало слова, продолжение которого еще не получено.
+    std::string m_Buffer;
 };
 
 #endif // WORD_SPLITTER_H